@@ -0,0 +1,125 @@
+// Benchmark of image_u8_gaussian_blur and image_u8_gaussian_sharpen:
+// times the SIMD kernels the library was built with (SSE2 or AVX2)
+// against the plain C code, and counts the output pixels on which
+// they disagree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/image_u8.h"
+#include "common/getopt.h"
+#include "common/time_util.h"
+
+typedef void (*filter_t)(image_u8_t*, double, int);
+
+static const char *simd_name()
+{
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "none";
+#endif
+}
+
+// average time (ms) of one call, on a fresh copy of im each time.
+static double time_filter(filter_t filter, const image_u8_t *im, double sigma, int ksz, int iters)
+{
+    image_u8_t *work = image_u8_copy(im);
+    int64_t usecs = 0;
+
+    for (int i = 0; i < iters; i++) {
+        memcpy(work->buf, im->buf, im->height * im->stride);
+
+        int64_t utime0 = utime_now();
+        filter(work, sigma, ksz);
+        usecs += utime_now() - utime0;
+    }
+
+    image_u8_destroy(work);
+    return usecs / 1000.0 / iters;
+}
+
+static int mismatch(filter_t a, filter_t b, const image_u8_t *im, double sigma, int ksz)
+{
+    image_u8_t *ima = image_u8_copy(im);
+    image_u8_t *imb = image_u8_copy(im);
+
+    a(ima, sigma, ksz);
+    b(imb, sigma, ksz);
+
+    int n = 0;
+    for (int y = 0; y < im->height; y++)
+        for (int x = 0; x < im->width; x++)
+            n += ima->buf[y*ima->stride + x] != imb->buf[y*imb->stride + x];
+
+    image_u8_destroy(ima);
+    image_u8_destroy(imb);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_int(getopt, 'W', "width", "1280", "Image width");
+    getopt_add_int(getopt, 'H', "height", "720", "Image height");
+    getopt_add_int(getopt, 'i', "iters", "100", "Repetitions per measurement");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int width = getopt_get_int(getopt, "width");
+    int height = getopt_get_int(getopt, "height");
+    int iters = getopt_get_int(getopt, "iters");
+
+    // a smooth gradient with noise, roughly like a camera image.
+    image_u8_t *im = image_u8_create(width, height);
+    srand(0);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            im->buf[y*im->stride + x] = (x + y + rand() % 32) & 0xff;
+
+    printf("%dx%d, simd: %s\n", width, height, simd_name());
+    printf("%8s %6s %4s %12s %12s %9s %10s\n", "filter", "sigma", "ksz",
+           "scalar (ms)", "simd (ms)", "speedup", "mismatch");
+
+    struct {
+        const char *name;
+        filter_t scalar, simd;
+    } filters[] = {
+        { "blur", image_u8_gaussian_blur_scalar, image_u8_gaussian_blur },
+        { "sharpen", image_u8_gaussian_sharpen_scalar, image_u8_gaussian_sharpen },
+    };
+
+    // the kernel sizes quad_sigma = 0.8 and 1.5 give in the detector
+    double sigmas[] = { 0.8, 1.5 };
+
+    for (int i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        for (int j = 0; j < sizeof(sigmas) / sizeof(double); j++) {
+            double sigma = sigmas[j];
+            int ksz = 4 * sigma;
+            if ((ksz & 1) == 0)
+                ksz++;
+
+            int n = mismatch(filters[i].scalar, filters[i].simd, im, sigma, ksz);
+
+            double tscalar = time_filter(filters[i].scalar, im, sigma, ksz, iters);
+            double tsimd = time_filter(filters[i].simd, im, sigma, ksz, iters);
+
+            printf("%8s %6.1f %4d %12.4f %12.4f %8.2fx %10d\n", filters[i].name, sigma, ksz,
+                   tscalar, tsimd, tscalar / tsimd, n);
+        }
+    }
+
+    image_u8_destroy(im);
+    getopt_destroy(getopt);
+
+    return 0;
+}
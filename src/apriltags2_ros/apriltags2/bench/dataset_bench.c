@@ -0,0 +1,486 @@
+// Speed and accuracy regression harness: runs the detector on a set of
+// captured images (PNM or JPEG files, or directories of them) under
+// every combination of the given settings, and writes the detections
+// and stage timings of each image, and aggregates of each setting, as
+// JSON. bench/dataset_compare.py compares two such files, e.g. of two
+// builds.
+//
+// Each setting option takes a comma-separated list of values, e.g.
+// --decimate 1,2 --threads 1,4 runs four configurations. Settings not
+// given keep the detector's defaults.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "apriltag.h"
+#include "tag36h11.h"
+#include "tag36h10.h"
+#include "tag25h9.h"
+#include "tag25h7.h"
+#include "tag16h5.h"
+#include "common/getopt.h"
+#include "common/image_u8.h"
+#include "common/image_u8_mmap.h"
+#include "common/pjpeg.h"
+#include "common/string_util.h"
+#include "common/time_util.h"
+#include "common/zarray.h"
+
+#define PARAM_FIELD(fn, field)                                          \
+    static void set_##fn(apriltag_detector_t *td, double v) { td->field = v; } \
+    static double get_##fn(const apriltag_detector_t *td) { return td->field; }
+
+PARAM_FIELD(decimate, quad_decimate)
+PARAM_FIELD(sigma, quad_sigma)
+PARAM_FIELD(threads, nthreads)
+PARAM_FIELD(refine_edges, refine_edges)
+PARAM_FIELD(refine_decode, refine_decode)
+PARAM_FIELD(refine_pose, refine_pose)
+PARAM_FIELD(min_cluster_pixels, qtp.min_cluster_pixels)
+PARAM_FIELD(max_nmaxima, qtp.max_nmaxima)
+PARAM_FIELD(critical_rad, qtp.critical_rad)
+PARAM_FIELD(max_line_fit_mse, qtp.max_line_fit_mse)
+PARAM_FIELD(min_white_black_diff, qtp.min_white_black_diff)
+PARAM_FIELD(deglitch, qtp.deglitch)
+
+// A detector setting, and the values to run it with (none: the
+// detector's default).
+struct param
+{
+    const char *name;
+    const char *help;
+    void (*set)(apriltag_detector_t *td, double v);
+    double (*get)(const apriltag_detector_t *td);
+
+    zarray_t *values; // double
+};
+
+#define PARAM(name, fn, help) { name, help, set_##fn, get_##fn, NULL }
+
+static struct param params[] = {
+    PARAM("decimate", decimate, "quad_decimate"),
+    PARAM("sigma", sigma, "quad_sigma"),
+    PARAM("threads", threads, "nthreads"),
+    PARAM("refine-edges", refine_edges, "refine_edges"),
+    PARAM("refine-decode", refine_decode, "refine_decode"),
+    PARAM("refine-pose", refine_pose, "refine_pose"),
+    PARAM("min-cluster-pixels", min_cluster_pixels, "qtp.min_cluster_pixels"),
+    PARAM("max-nmaxima", max_nmaxima, "qtp.max_nmaxima"),
+    PARAM("critical-rad", critical_rad, "qtp.critical_rad"),
+    PARAM("max-line-fit-mse", max_line_fit_mse, "qtp.max_line_fit_mse"),
+    PARAM("min-white-black-diff", min_white_black_diff, "qtp.min_white_black_diff"),
+    PARAM("deglitch", deglitch, "qtp.deglitch"),
+};
+
+#define NPARAMS ((int) (sizeof(params) / sizeof(params[0])))
+
+struct image
+{
+    char *path;
+    image_u8_t *im;
+    int mapped; // release with image_u8_unmap
+};
+
+static int has_suffix(const char *path, const char *suffix)
+{
+    size_t n = strlen(path), m = strlen(suffix);
+    return n >= m && !strcasecmp(path + n - m, suffix);
+}
+
+static int is_jpeg(const char *path)
+{
+    return has_suffix(path, ".jpg") || has_suffix(path, ".jpeg");
+}
+
+static int is_pnm(const char *path)
+{
+    return has_suffix(path, ".pnm") || has_suffix(path, ".pgm") || has_suffix(path, ".ppm");
+}
+
+// binary PGMs are mapped rather than read.
+static image_u8_t *load_image(const char *path, int *mapped)
+{
+    *mapped = 0;
+
+    if (is_jpeg(path)) {
+        int err = 0;
+        return pjpeg_create_u8_from_file(path, 0, &err);
+    }
+
+    image_u8_t *im = image_u8_map_pnm(path);
+    if (im != NULL) {
+        *mapped = 1;
+        return im;
+    }
+
+    return image_u8_create_from_pnm(path);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// add the images at path (a file, or the PNM and JPEG files of a
+// directory, in name order) to images.
+static void add_images(zarray_t *images, const char *path)
+{
+    zarray_t *paths = zarray_create(sizeof(char*));
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        struct dirent *ent;
+        while (dir != NULL && (ent = readdir(dir)) != NULL) {
+            if (is_jpeg(ent->d_name) || is_pnm(ent->d_name)) {
+                char *p = str_concat(path, "/", ent->d_name);
+                zarray_add(paths, &p);
+            }
+        }
+        if (dir != NULL)
+            closedir(dir);
+        zarray_sort(paths, compare_strings);
+    } else {
+        char *p = strdup(path);
+        zarray_add(paths, &p);
+    }
+
+    for (int i = 0; i < zarray_size(paths); i++) {
+        struct image img;
+        zarray_get(paths, i, &img.path);
+
+        img.im = load_image(img.path, &img.mapped);
+        if (img.im == NULL) {
+            fprintf(stderr, "couldn't load %s\n", img.path);
+            free(img.path);
+            continue;
+        }
+
+        zarray_add(images, &img);
+    }
+
+    zarray_destroy(paths);
+}
+
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static int64_t median(int64_t *v, int n)
+{
+    qsort(v, n, sizeof(int64_t), compare_int64);
+    return v[n / 2];
+}
+
+// sorted per-image times: the value below which a fraction p lies.
+static double percentile(const double *sorted, int n, double p)
+{
+    int i = p * n;
+    return sorted[i < n ? i : n - 1];
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// run all images with the current settings of td, writing one element
+// of the "runs" array.
+static void run_config(FILE *f, apriltag_detector_t *td, zarray_t *images, int repeat)
+{
+    int nimages = zarray_size(images);
+    double *image_ms = calloc(nimages, sizeof(double));
+    double stage_ms[APRILTAG_STAGE_COUNT] = { 0 };
+    int64_t *samples = calloc(repeat, sizeof(int64_t));
+    int64_t (*stage_ns)[APRILTAG_STAGE_COUNT] = calloc(repeat, sizeof(*stage_ns));
+    uint64_t npixels = 0;
+    int ndetections = 0;
+
+    fprintf(f, "    {\n      \"config\": {");
+    for (int i = 0; i < NPARAMS; i++)
+        fprintf(f, "%s\"%s\": %g", i ? ", " : "", params[i].help, params[i].get(td));
+    fprintf(f, "},\n      \"images\": [\n");
+
+    for (int i = 0; i < nimages; i++) {
+        struct image *img;
+        zarray_get_volatile(images, i, &img);
+
+        // the detections of the first repetition are reported, the
+        // median of the times of all of them.
+        zarray_t *detections = NULL;
+        for (int r = 0; r < repeat; r++) {
+            zarray_t *d = apriltag_detector_detect(td, img->im);
+            for (int s = 0; s < APRILTAG_STAGE_COUNT; s++)
+                stage_ns[r][s] = td->ctx->stage_ns[s];
+
+            if (detections == NULL)
+                detections = d;
+            else
+                apriltag_detections_destroy(d);
+        }
+
+        fprintf(f, "        {\"path\": ");
+        json_string(f, img->path);
+        fprintf(f, ", \"width\": %d, \"height\": %d,\n", img->im->width, img->im->height);
+
+        fprintf(f, "         \"stages_ms\": {");
+        int first = 1;
+        for (int s = 0; s < APRILTAG_STAGE_COUNT; s++) {
+            for (int r = 0; r < repeat; r++)
+                samples[r] = stage_ns[r][s];
+            double ms = median(samples, repeat) / 1.0e6;
+            if (ms == 0)
+                continue;
+
+            fprintf(f, "%s\"%s\": %.6f", first ? "" : ", ", apriltag_stage_name(s), ms);
+            first = 0;
+
+            if (s == APRILTAG_STAGE_TOTAL)
+                image_ms[i] = ms;
+            stage_ms[s] += ms;
+        }
+        fprintf(f, "},\n");
+
+        fprintf(f, "         \"detections\": [");
+        for (int j = 0; j < zarray_size(detections); j++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, j, &det);
+
+            fprintf(f, "%s\n           {\"family\": \"%s\", \"id\": %d, \"hamming\": %d, "
+                    "\"decision_margin\": %.4f, \"c\": [%.4f, %.4f], \"p\": [", j ? "," : "",
+                    det->family->name, det->id, det->hamming, det->decision_margin,
+                    det->c[0], det->c[1]);
+            for (int k = 0; k < 4; k++)
+                fprintf(f, "%s[%.4f, %.4f]", k ? ", " : "", det->p[k][0], det->p[k][1]);
+            fprintf(f, "]}");
+        }
+        fprintf(f, "]}%s\n", i + 1 < nimages ? "," : "");
+
+        npixels += (uint64_t) img->im->width * img->im->height;
+        ndetections += zarray_size(detections);
+        apriltag_detections_destroy(detections);
+    }
+
+    double total_ms = 0;
+    for (int i = 0; i < nimages; i++)
+        total_ms += image_ms[i];
+    qsort(image_ms, nimages, sizeof(double), compare_double);
+
+    fprintf(f, "      ],\n      \"aggregate\": {\"nimages\": %d, \"ndetections\": %d, "
+            "\"total_ms\": %.6f, \"mean_ms\": %.6f, \"p50_ms\": %.6f, \"p90_ms\": %.6f, "
+            "\"max_ms\": %.6f, \"images_per_second\": %.3f, \"megapixels_per_second\": %.3f,\n",
+            nimages, ndetections, total_ms, total_ms / nimages,
+            percentile(image_ms, nimages, 0.5), percentile(image_ms, nimages, 0.9),
+            image_ms[nimages - 1], nimages / (total_ms / 1000), npixels / (total_ms * 1000));
+
+    fprintf(f, "        \"mean_stages_ms\": {");
+    int first = 1;
+    for (int s = 0; s < APRILTAG_STAGE_COUNT; s++) {
+        if (stage_ms[s] == 0)
+            continue;
+        fprintf(f, "%s\"%s\": %.6f", first ? "" : ", ", apriltag_stage_name(s), stage_ms[s] / nimages);
+        first = 0;
+    }
+    fprintf(f, "}}\n    }");
+
+    fprintf(stderr, "%8.3f ms/image  %6d detections  [", total_ms / nimages, ndetections);
+    for (int i = 0; i < NPARAMS; i++) {
+        if (params[i].values != NULL)
+            fprintf(stderr, " %s=%g", params[i].name, params[i].get(td));
+    }
+    fprintf(stderr, " ]\n");
+
+    free(image_ms);
+    free(samples);
+    free(stage_ns);
+}
+
+static apriltag_family_t *family_create(const char *name)
+{
+    if (!strcmp(name, "tag36h11"))
+        return tag36h11_create();
+    if (!strcmp(name, "tag36h10"))
+        return tag36h10_create();
+    if (!strcmp(name, "tag25h9"))
+        return tag25h9_create();
+    if (!strcmp(name, "tag25h7"))
+        return tag25h7_create();
+    if (!strcmp(name, "tag16h5"))
+        return tag16h5_create();
+    return NULL;
+}
+
+static void family_destroy(apriltag_family_t *tf)
+{
+    if (!strcmp(tf->name, "tag36h11"))
+        tag36h11_destroy(tf);
+    else if (!strcmp(tf->name, "tag36h10"))
+        tag36h10_destroy(tf);
+    else if (!strcmp(tf->name, "tag25h9"))
+        tag25h9_destroy(tf);
+    else if (!strcmp(tf->name, "tag25h7"))
+        tag25h7_destroy(tf);
+    else if (!strcmp(tf->name, "tag16h5"))
+        tag16h5_destroy(tf);
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(getopt, 'o', "output", "-", "Write the JSON results to this file (- for stdout)");
+    getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag families (comma-separated)");
+    getopt_add_int(getopt, '\0', "hamming", "2", "Detect tags with up to this many bit errors");
+    getopt_add_int(getopt, 'r', "repeat", "3", "Detections per image and setting (the median time is reported)");
+    getopt_add_spacer(getopt, "Settings (comma-separated values; all combinations are run):");
+    for (int i = 0; i < NPARAMS; i++)
+        getopt_add_string(getopt, '\0', params[i].name, "", params[i].help);
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help") ||
+        zarray_size(getopt_get_extra_args(getopt)) == 0) {
+        printf("Usage: %s [options] <images or directories>\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int repeat = getopt_get_int(getopt, "repeat");
+    if (repeat < 1)
+        repeat = 1;
+
+    apriltag_detector_t *td = apriltag_detector_create();
+
+    zarray_t *families = str_split(getopt_get_string(getopt, "family"), ",");
+    for (int i = 0; i < zarray_size(families); i++) {
+        char *name;
+        zarray_get(families, i, &name);
+
+        apriltag_family_t *tf = family_create(name);
+        if (tf == NULL) {
+            printf("Unrecognized tag family %s\n", name);
+            exit(-1);
+        }
+        apriltag_detector_add_family_bits(td, tf, getopt_get_int(getopt, "hamming"));
+    }
+    str_split_destroy(families);
+
+    for (int i = 0; i < NPARAMS; i++) {
+        const char *s = getopt_get_string(getopt, params[i].name);
+        if (s == NULL || s[0] == 0)
+            continue;
+
+        params[i].values = zarray_create(sizeof(double));
+        zarray_t *tokens = str_split(s, ",");
+        for (int j = 0; j < zarray_size(tokens); j++) {
+            char *tok;
+            zarray_get(tokens, j, &tok);
+            double v = strtod(tok, NULL);
+            zarray_add(params[i].values, &v);
+        }
+        str_split_destroy(tokens);
+    }
+
+    zarray_t *images = zarray_create(sizeof(struct image));
+    const zarray_t *args = getopt_get_extra_args(getopt);
+    for (int i = 0; i < zarray_size(args); i++) {
+        char *arg;
+        zarray_get((zarray_t*) args, i, &arg);
+        add_images(images, arg);
+    }
+
+    if (zarray_size(images) == 0) {
+        fprintf(stderr, "no images\n");
+        exit(-1);
+    }
+
+    const char *output = getopt_get_string(getopt, "output");
+    FILE *f = strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (f == NULL) {
+        perror(output);
+        exit(-1);
+    }
+
+    fprintf(f, "{\n  \"version\": 1,\n  \"repeat\": %d,\n  \"runs\": [\n", repeat);
+
+    // odometer over the value lists of the varied settings.
+    int idx[NPARAMS];
+    memset(idx, 0, sizeof(idx));
+
+    for (int nruns = 0; ; nruns++) {
+        for (int i = 0; i < NPARAMS; i++) {
+            if (params[i].values != NULL) {
+                double v;
+                zarray_get(params[i].values, idx[i], &v);
+                params[i].set(td, v);
+            }
+        }
+
+        if (nruns > 0)
+            fprintf(f, ",\n");
+        run_config(f, td, images, repeat);
+
+        int i = NPARAMS - 1;
+        for (; i >= 0; i--) {
+            if (params[i].values == NULL)
+                continue;
+            if (++idx[i] < zarray_size(params[i].values))
+                break;
+            idx[i] = 0;
+        }
+        if (i < 0)
+            break;
+    }
+
+    fprintf(f, "\n  ]\n}\n");
+    if (f != stdout)
+        fclose(f);
+
+    for (int i = 0; i < zarray_size(images); i++) {
+        struct image *img;
+        zarray_get_volatile(images, i, &img);
+        free(img->path);
+        if (img->mapped)
+            image_u8_unmap(img->im);
+        else
+            image_u8_destroy(img->im);
+    }
+    zarray_destroy(images);
+
+    for (int i = 0; i < NPARAMS; i++) {
+        if (params[i].values != NULL)
+            zarray_destroy(params[i].values);
+    }
+
+    zarray_t *tfs = zarray_copy(td->tag_families);
+    apriltag_detector_destroy(td);
+    for (int i = 0; i < zarray_size(tfs); i++) {
+        apriltag_family_t *tf;
+        zarray_get(tfs, i, &tf);
+        family_destroy(tf);
+    }
+    zarray_destroy(tfs);
+    getopt_destroy(getopt);
+
+    return 0;
+}
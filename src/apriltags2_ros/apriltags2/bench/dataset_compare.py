@@ -0,0 +1,116 @@
+#!/usr/bin/env python
+"""Compare two result files of apriltags2_dataset_bench (e.g. of a
+baseline build and a modified one): the change in speed of each
+setting and stage, and every detection that appeared, disappeared or
+moved. Exits with status 1 if any detection changed."""
+
+from __future__ import print_function
+
+import argparse
+import json
+import math
+import sys
+
+
+def config_key(run):
+    return tuple(sorted(run['config'].items()))
+
+
+def config_name(run, keys):
+    return ' '.join('%s=%g' % (k, run['config'][k]) for k in keys)
+
+
+def delta(a, b):
+    if a == 0:
+        return '      -'
+    return '%+6.1f%%' % (100.0 * (b - a) / a)
+
+
+def corner_distance(da, db):
+    return max(math.hypot(pa[0] - pb[0], pa[1] - pb[1]) for pa, pb in zip(da['p'], db['p']))
+
+
+def compare_detections(ia, ib, tolerance):
+    """Returns a list of human-readable changes between the detections
+    of one image in two runs."""
+    da = dict(((d['family'], d['id']), d) for d in ia['detections'])
+    db = dict(((d['family'], d['id']), d) for d in ib['detections'])
+
+    changes = []
+    for key in sorted(set(da) - set(db)):
+        changes.append('lost %s %d' % key)
+    for key in sorted(set(db) - set(da)):
+        changes.append('new %s %d' % key)
+    for key in sorted(set(da) & set(db)):
+        dist = corner_distance(da[key], db[key])
+        if dist > tolerance:
+            changes.append('moved %s %d by %.3f px' % (key[0], key[1], dist))
+    return changes
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('baseline')
+    parser.add_argument('candidate')
+    parser.add_argument('--tolerance', type=float, default=0.01,
+                        help='corner movement (pixels) reported as a change')
+    parser.add_argument('--max-changes', type=int, default=20,
+                        help='how many detection changes to list per setting')
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        a = json.load(f)
+    with open(args.candidate) as f:
+        b = json.load(f)
+
+    runs_b = dict((config_key(r), r) for r in b['runs'])
+
+    # name each setting by the values that differ between settings.
+    keys = sorted(k for k in a['runs'][0]['config']
+                  if len(set(r['config'][k] for r in a['runs'])) > 1)
+    if not keys:
+        keys = sorted(a['runs'][0]['config'])
+
+    nchanged = 0
+
+    for ra in a['runs']:
+        rb = runs_b.get(config_key(ra))
+        print(config_name(ra, keys))
+        if rb is None:
+            print('  not in %s\n' % args.candidate)
+            continue
+
+        ga, gb = ra['aggregate'], rb['aggregate']
+        print('  %-28s %12s %12s %8s' % ('(ms per image)', 'baseline', 'candidate', 'change'))
+        for key in ('mean_ms', 'p50_ms', 'p90_ms', 'max_ms'):
+            print('  %-28s %12.3f %12.3f %8s' % (key[:-3], ga[key], gb[key], delta(ga[key], gb[key])))
+
+        sa, sb = ga['mean_stages_ms'], gb['mean_stages_ms']
+        for stage in sa:
+            if stage in sb and stage != 'total':
+                print('  %-28s %12.3f %12.3f %8s' % (stage, sa[stage], sb[stage], delta(sa[stage], sb[stage])))
+
+        images_b = dict((i['path'], i) for i in rb['images'])
+        changes = []
+        for ia in ra['images']:
+            ib = images_b.get(ia['path'])
+            if ib is None:
+                changes.append('%s: not in %s' % (ia['path'], args.candidate))
+                continue
+            for c in compare_detections(ia, ib, args.tolerance):
+                changes.append('%s: %s' % (ia['path'], c))
+
+        print('  detections: %d -> %d, %d changes' % (ga['ndetections'], gb['ndetections'], len(changes)))
+        for c in changes[:args.max_changes]:
+            print('    ' + c)
+        if len(changes) > args.max_changes:
+            print('    ...')
+        print()
+
+        nchanged += len(changes)
+
+    return 1 if nchanged > 0 else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
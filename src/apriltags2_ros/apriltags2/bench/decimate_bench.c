@@ -0,0 +1,92 @@
+// Benchmark of image_u8_decimate: times the SIMD kernels the library
+// was built with (NEON, SSE2 or AVX2) against the plain C code, and
+// counts the output pixels on which they disagree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/image_u8.h"
+#include "common/getopt.h"
+#include "common/time_util.h"
+
+static const char *simd_name()
+{
+#if defined(__ARM_NEON__)
+    return "neon";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "none";
+#endif
+}
+
+// average time (ms) of one call.
+static double time_decimate(image_u8_t *(*decimate)(image_u8_t*, float), image_u8_t *im,
+                            float factor, int iters)
+{
+    int64_t utime0 = utime_now();
+
+    for (int i = 0; i < iters; i++)
+        image_u8_destroy(decimate(im, factor));
+
+    return (utime_now() - utime0) / 1000.0 / iters;
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_int(getopt, 'W', "width", "1280", "Image width");
+    getopt_add_int(getopt, 'H', "height", "720", "Image height");
+    getopt_add_int(getopt, 'i', "iters", "200", "Repetitions per measurement");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int width = getopt_get_int(getopt, "width");
+    int height = getopt_get_int(getopt, "height");
+    int iters = getopt_get_int(getopt, "iters");
+
+    // a smooth gradient with noise, roughly like a camera image.
+    image_u8_t *im = image_u8_create(width, height);
+    srand(0);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            im->buf[y*im->stride + x] = (x + y + rand() % 32) & 0xff;
+
+    printf("%dx%d, simd: %s\n", width, height, simd_name());
+    printf("%8s %12s %12s %9s %10s\n", "factor", "scalar (ms)", "simd (ms)", "speedup", "mismatch");
+
+    float factors[] = { 1.5, 2, 3, 4 };
+    for (int i = 0; i < sizeof(factors) / sizeof(float); i++) {
+        float f = factors[i];
+
+        image_u8_t *a = image_u8_decimate_scalar(im, f);
+        image_u8_t *b = image_u8_decimate(im, f);
+
+        int mismatch = 0;
+        for (int y = 0; y < a->height; y++)
+            for (int x = 0; x < a->width; x++)
+                mismatch += a->buf[y*a->stride + x] != b->buf[y*b->stride + x];
+
+        image_u8_destroy(a);
+        image_u8_destroy(b);
+
+        double tscalar = time_decimate(image_u8_decimate_scalar, im, f, iters);
+        double tsimd = time_decimate(image_u8_decimate, im, f, iters);
+
+        printf("%8.1f %12.4f %12.4f %8.2fx %10d\n", f, tscalar, tsimd, tscalar / tsimd, mismatch);
+    }
+
+    image_u8_destroy(im);
+    getopt_destroy(getopt);
+
+    return 0;
+}
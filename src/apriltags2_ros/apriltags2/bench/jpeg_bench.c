@@ -0,0 +1,214 @@
+// Benchmark of the JPEG decoder: times decoding the given files in
+// full, luma only and at 1/8 scale, serially and with the restart
+// intervals in parallel (for files that have them), and checks the SIMD IDCT the
+// library was built with against the plain C one on random blocks,
+// counting the pixels on which they disagree.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/getopt.h"
+#include "common/image_u8.h"
+#include "common/pjpeg.h"
+#include "common/time_util.h"
+#include "common/workerpool.h"
+
+void pjpeg_idct_2D_nanojpeg(int32_t in[64], uint8_t *out, uint32_t outstride);
+void pjpeg_idct_2D_nanojpeg_scalar(int32_t in[64], uint8_t *out, uint32_t outstride);
+
+typedef void (*idct_t)(int32_t*, uint8_t*, uint32_t);
+
+static const char *simd_name()
+{
+#if defined(__SSE4_1__)
+    return "sse4.1";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "none";
+#endif
+}
+
+static uint32_t xorshift(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+// nblocks random blocks of dequantized coefficients: mostly sparse, as
+// in real images, some dense and some with values far beyond what a
+// valid JPEG can produce (where only the overflow behaviour matters).
+static int32_t *random_blocks(int nblocks, uint32_t seed)
+{
+    int32_t *blocks = calloc(nblocks, 64 * sizeof(int32_t));
+
+    for (int i = 0; i < nblocks; i++) {
+        int32_t *b = &blocks[64*i];
+        int kind = i % 4;
+
+        int range = (kind == 3) ? (1 << 24) : 1024;
+        int ncoeffs = (kind == 0) ? 1 : (kind == 1) ? 6 : 64;
+
+        for (int j = 0; j < ncoeffs; j++) {
+            int k = (ncoeffs == 64) ? j : xorshift(&seed) % 64;
+            if (j == 0)
+                k = 0;
+            b[k] = (int32_t) (xorshift(&seed) % (2 * range)) - range;
+        }
+    }
+
+    return blocks;
+}
+
+static void run_idct(idct_t idct, const int32_t *blocks, int nblocks, uint8_t *out)
+{
+    int32_t tmp[64];
+
+    for (int i = 0; i < nblocks; i++) {
+        memcpy(tmp, &blocks[64*i], sizeof(tmp));
+        idct(tmp, &out[64*i], 8);
+    }
+}
+
+static double time_idct(idct_t idct, const int32_t *blocks, int nblocks, int iters)
+{
+    uint8_t *out = malloc(64 * nblocks);
+
+    int64_t utime0 = utime_now();
+    for (int i = 0; i < iters; i++)
+        run_idct(idct, blocks, nblocks, out);
+    int64_t usecs = utime_now() - utime0;
+
+    free(out);
+    return usecs * 1000.0 / iters / nblocks;
+}
+
+static uint8_t *read_file(const char *path, int *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *buf = malloc(*len);
+    if (fread(buf, 1, *len, f) != (size_t) *len) {
+        free(buf);
+        buf = NULL;
+    }
+
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_int(getopt, 'i', "iters", "50", "Repetitions per measurement");
+    getopt_add_int(getopt, 'n', "nblocks", "100000", "Random blocks for the IDCT check");
+    getopt_add_int(getopt, 't', "threads", "4", "Threads for parallel decoding");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options] [file.jpg ...]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int iters = getopt_get_int(getopt, "iters");
+    int nblocks = getopt_get_int(getopt, "nblocks");
+    if (nblocks < 1)
+        nblocks = 1;
+
+    workerpool_t *wp = workerpool_create(getopt_get_int(getopt, "threads"));
+
+    printf("simd: %s\n", simd_name());
+
+    int32_t *blocks = random_blocks(nblocks, 1);
+    uint8_t *outa = malloc(64 * nblocks);
+    uint8_t *outb = malloc(64 * nblocks);
+
+    run_idct(pjpeg_idct_2D_nanojpeg_scalar, blocks, nblocks, outa);
+    run_idct(pjpeg_idct_2D_nanojpeg, blocks, nblocks, outb);
+
+    int mismatch = 0;
+    for (int i = 0; i < 64 * nblocks; i++)
+        mismatch += outa[i] != outb[i];
+
+    double tscalar = time_idct(pjpeg_idct_2D_nanojpeg_scalar, blocks, nblocks, 10);
+    double tsimd = time_idct(pjpeg_idct_2D_nanojpeg, blocks, nblocks, 10);
+
+    printf("idct: scalar %.1f ns/block, simd %.1f ns/block, %.2fx, %d mismatched pixels\n\n",
+           tscalar, tsimd, tscalar / tsimd, mismatch);
+
+    free(outa);
+    free(outb);
+    free(blocks);
+
+    struct {
+        const char *name;
+        uint32_t flags;
+    } modes[] = {
+        { "full", 0 },
+        { "luma", PJPEG_LUMA_ONLY },
+        { "luma 1/8", PJPEG_LUMA_ONLY | PJPEG_SCALE_8 },
+    };
+
+    const zarray_t *paths = getopt_get_extra_args(getopt);
+
+    for (int i = 0; i < zarray_size(paths); i++) {
+        char *path;
+        zarray_get(paths, i, &path);
+
+        int len;
+        uint8_t *buf = read_file(path, &len);
+        if (buf == NULL) {
+            printf("%s: can't read\n", path);
+            continue;
+        }
+
+        printf("%s (%d bytes)\n", path, len);
+        printf("  %-10s %11s %12s %12s %9s\n", "", "", "serial (ms)",
+               "parallel", "speedup");
+
+        for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            int err = 0;
+            pjpeg_t *pj = pjpeg_create_from_buffer(buf, len, modes[m].flags, &err);
+            if (pj == NULL) {
+                printf("  %-10s error %d\n", modes[m].name, err);
+                continue;
+            }
+
+            int width = pj->width, height = pj->height;
+            pjpeg_destroy(pj);
+
+            int64_t utime0 = utime_now();
+            for (int it = 0; it < iters; it++)
+                pjpeg_destroy(pjpeg_create_from_buffer(buf, len, modes[m].flags, &err));
+            double serial = (utime_now() - utime0) / 1000.0 / iters;
+
+            utime0 = utime_now();
+            for (int it = 0; it < iters; it++)
+                pjpeg_destroy(pjpeg_create_from_buffer_parallel(buf, len, modes[m].flags, wp, &err));
+            double parallel = (utime_now() - utime0) / 1000.0 / iters;
+
+            printf("  %-10s %5dx%-5d %12.3f %12.3f %8.2fx\n", modes[m].name, width, height,
+                   serial, parallel, serial / parallel);
+        }
+
+        free(buf);
+    }
+
+    workerpool_destroy(wp);
+    getopt_destroy(getopt);
+
+    return 0;
+}
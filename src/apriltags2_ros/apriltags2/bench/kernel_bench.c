@@ -0,0 +1,647 @@
+// Microbenchmarks of the detector's hot kernels, each run in isolation
+// on inputs captured from one real frame: the frame is pushed through
+// the pipeline once, keeping the input of every stage (the decimated
+// image, the threshold image, the clusters, the line fit statistics,
+// the quads and the codes), and each kernel is then timed on its own
+// input many times over.
+//
+// Many of the kernels are static, so this file includes the detector's
+// sources directly, and is linked with the object files of the rest of
+// the library rather than with the library itself (see CMakeLists.txt).
+//
+// Every sample times one frame's worth of calls of a kernel (e.g.
+// fit_quad's line fits on every cluster of the frame). The report gives
+// the median, minimum and 90th percentile of the samples, and their
+// spread ((p90 - p10) / median) as a measure of how stable they are;
+// pin the benchmark to a core (--cpu) on a quiet machine when the
+// spread is more than a few percent.
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "../src/apriltag.c"
+#include "../src/apriltag_quad_thresh.c"
+
+#include "tag36h11.h"
+#include "common/getopt.h"
+
+#include "scene.h"
+
+// the inputs of all kernels, captured from one frame.
+struct capture
+{
+    apriltag_detector_t *td;
+    apriltag_detect_ctx_t *ctx;
+    apriltag_family_t *fam;
+
+    image_u8_t *im_orig;
+    image_u8_t *quad_im;
+    image_u8_t *threshim;
+    unionfind_t *uf;
+
+    // the clusters as gradient_clusters makes them, with the theta of
+    // each point computed (the input of ptsort).
+    zarray_t *clusters;
+
+    // the clusters that fit_quad sorted, and their line fit
+    // statistics.
+    zarray_t *sorted;
+    zarray_t *lfps;
+
+    // quads as fit_quad finds them (the input of refine_edges), and
+    // refined with their homographies (the input of quad_decode).
+    zarray_t *quads;
+    zarray_t *refined;
+
+    // codes read from the refined quads: those of the tags, and random
+    // ones standing in for the quads that are not tags.
+    zarray_t *rcodes;
+    int ndecoded;
+
+    float decimate;
+    double sigma;
+
+    // scratch space of the kernels that work in place.
+    struct pt *pts;
+    zarray_t *quads_scratch;
+    image_u8_t *blur_im;
+};
+
+struct kernel
+{
+    const char *name;
+
+    // how many calls one run makes.
+    int (*ncalls)(struct capture *cap);
+
+    // untimed preparation (e.g. restoring the input of an in-place
+    // kernel), or NULL.
+    void (*prepare)(struct capture *cap);
+
+    void (*run)(struct capture *cap);
+};
+
+////////////////////////////////////////////////////////
+// the kernels
+
+static int one_call(struct capture *cap)
+{
+    return 1;
+}
+
+static int nclusters(struct capture *cap)
+{
+    return zarray_size(cap->clusters);
+}
+
+static int nsorted(struct capture *cap)
+{
+    return zarray_size(cap->sorted);
+}
+
+static int nquads(struct capture *cap)
+{
+    return zarray_size(cap->quads);
+}
+
+static int nrefined(struct capture *cap)
+{
+    return zarray_size(cap->refined);
+}
+
+static int nrcodes(struct capture *cap)
+{
+    return zarray_size(cap->rcodes);
+}
+
+static void run_decimate(struct capture *cap)
+{
+    image_u8_destroy(image_u8_decimate(cap->im_orig, cap->decimate));
+}
+
+static void prepare_blur(struct capture *cap)
+{
+    for (int y = 0; y < cap->quad_im->height; y++)
+        memcpy(&cap->blur_im->buf[y*cap->blur_im->stride], &cap->quad_im->buf[y*cap->quad_im->stride],
+               cap->quad_im->width);
+}
+
+static void run_blur(struct capture *cap)
+{
+    int ksz = 4 * cap->sigma;
+    if ((ksz & 1) == 0)
+        ksz++;
+
+    image_u8_gaussian_blur(cap->blur_im, cap->sigma, ksz);
+}
+
+static void run_threshold(struct capture *cap)
+{
+    image_u8_destroy(threshold(cap->td, cap->quad_im));
+}
+
+static void prepare_unionfind(struct capture *cap)
+{
+    unionfind_destroy(cap->uf);
+    cap->uf = unionfind_create(cap->threshim->width * cap->threshim->height);
+}
+
+static void run_unionfind(struct capture *cap)
+{
+    image_u8_t *im = cap->threshim;
+
+    for (int y = 0; y < im->height - 1; y++)
+        do_unionfind_line(cap->uf, im, im->height, im->width, im->stride, y);
+}
+
+static void run_clusters(struct capture *cap)
+{
+    zarray_t *clusters = gradient_clusters(cap->ctx, cap->threshim, cap->uf,
+                                           cap->threshim->width, cap->threshim->height);
+
+    for (int i = 0; i < zarray_size(clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(clusters, i, &cluster);
+        zarray_destroy(cluster);
+    }
+    zarray_destroy(clusters);
+}
+
+static void prepare_ptsort(struct capture *cap)
+{
+    struct pt *pts = cap->pts;
+
+    for (int i = 0; i < zarray_size(cap->clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->clusters, i, &cluster);
+
+        memcpy(pts, cluster->data, zarray_size(cluster) * sizeof(struct pt));
+        pts += zarray_size(cluster);
+    }
+}
+
+static void run_ptsort(struct capture *cap)
+{
+    struct pt *pts = cap->pts;
+
+    for (int i = 0; i < zarray_size(cap->clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->clusters, i, &cluster);
+
+        ptsort(pts, zarray_size(cluster));
+        pts += zarray_size(cluster);
+    }
+}
+
+static void run_compute_lfps(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->sorted); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->sorted, i, &cluster);
+
+        free(compute_lfps(zarray_size(cluster), cluster, cap->quad_im));
+    }
+}
+
+// the line fits of quad_segment_maxima's inner loop: the four sides
+// between four points spread evenly around each cluster.
+static int nfit_lines(struct capture *cap)
+{
+    return 4 * zarray_size(cap->sorted);
+}
+
+static volatile double fit_line_sink;
+
+static void run_fit_line(struct capture *cap)
+{
+    double sum = 0;
+
+    for (int i = 0; i < zarray_size(cap->sorted); i++) {
+        zarray_t *cluster;
+        struct line_fit_pt *lfps;
+        zarray_get(cap->sorted, i, &cluster);
+        zarray_get(cap->lfps, i, &lfps);
+
+        int sz = zarray_size(cluster);
+        for (int j = 0; j < 4; j++) {
+            double lineparm[4], err, mse;
+            fit_line(lfps, sz, j*sz/4, ((j+1)*sz/4) % sz, lineparm, &err, &mse);
+            sum += err;
+        }
+    }
+
+    fit_line_sink = sum;
+}
+
+static void run_segment_maxima(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->sorted); i++) {
+        zarray_t *cluster;
+        struct line_fit_pt *lfps;
+        zarray_get(cap->sorted, i, &cluster);
+        zarray_get(cap->lfps, i, &lfps);
+
+        int indices[4];
+        quad_segment_maxima(cap->td, cluster, lfps, indices);
+    }
+}
+
+static void prepare_refine_edges(struct capture *cap)
+{
+    zarray_clear(cap->quads_scratch);
+    zarray_add_all(cap->quads_scratch, cap->quads);
+}
+
+static void run_refine_edges(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->quads_scratch); i++) {
+        struct quad *quad;
+        zarray_get_volatile(cap->quads_scratch, i, &quad);
+
+        refine_edges(cap->decimate, cap->im_orig, quad);
+    }
+}
+
+static void run_homography(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->refined); i++) {
+        struct quad *quad;
+        zarray_get_volatile(cap->refined, i, &quad);
+
+        // the same correspondences as quad_update_homographies.
+        zarray_t *correspondences = zarray_create(sizeof(float[4]));
+        for (int j = 0; j < 4; j++) {
+            float corr[4] = { (j==0 || j==3) ? -1 : 1, (j==0 || j==1) ? -1 : 1,
+                              quad->p[j][0], quad->p[j][1] };
+            zarray_add(correspondences, &corr);
+        }
+
+        matd_destroy(homography_compute(correspondences, HOMOGRAPHY_COMPUTE_FLAG_SVD));
+        zarray_destroy(correspondences);
+    }
+}
+
+static void run_quad_decode(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->refined); i++) {
+        struct quad *quad;
+        zarray_get_volatile(cap->refined, i, &quad);
+
+        struct quick_decode_entry entry;
+        quad_decode(cap->fam, cap->im_orig, quad, &entry, NULL);
+    }
+}
+
+static void run_quick_decode(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->rcodes); i++) {
+        uint64_t rcode;
+        zarray_get(cap->rcodes, i, &rcode);
+
+        struct quick_decode_entry entry;
+        quick_decode_codeword(cap->fam, rcode, &entry);
+    }
+}
+
+static const struct kernel kernels[] = {
+    { "image_u8_decimate", one_call, NULL, run_decimate },
+    { "image_u8_gaussian_blur", one_call, prepare_blur, run_blur },
+    { "threshold", one_call, NULL, run_threshold },
+    { "do_unionfind_line", one_call, prepare_unionfind, run_unionfind },
+    { "gradient_clusters", one_call, NULL, run_clusters },
+    { "ptsort", nclusters, prepare_ptsort, run_ptsort },
+    { "compute_lfps", nsorted, NULL, run_compute_lfps },
+    { "fit_line", nfit_lines, NULL, run_fit_line },
+    { "quad_segment_maxima", nsorted, NULL, run_segment_maxima },
+    { "refine_edges", nquads, prepare_refine_edges, run_refine_edges },
+    { "homography_compute", nrefined, NULL, run_homography },
+    { "quad_decode", nrefined, NULL, run_quad_decode },
+    { "quick_decode_codeword", nrcodes, NULL, run_quick_decode },
+};
+
+////////////////////////////////////////////////////////
+// capturing the inputs
+
+static void capture_frame(struct capture *cap, image_u8_t *im_orig, uint32_t seed)
+{
+    const apriltag_detector_t *td = cap->td;
+
+    cap->im_orig = im_orig;
+    cap->quad_im = cap->decimate > 1 ? image_u8_decimate(im_orig, cap->decimate) : image_u8_copy(im_orig);
+    cap->blur_im = image_u8_copy(cap->quad_im);
+
+    image_u8_t *quad_im = cap->quad_im;
+    int w = quad_im->width, h = quad_im->height;
+
+    cap->threshim = threshold(td, quad_im);
+
+    cap->uf = unionfind_create(w * h);
+    run_unionfind(cap);
+
+    cap->clusters = gradient_clusters(cap->ctx, cap->threshim, cap->uf, w, h);
+    cap->sorted = zarray_create(sizeof(zarray_t*));
+    cap->lfps = zarray_create(sizeof(struct line_fit_pt*));
+    cap->quads = zarray_create(sizeof(struct quad));
+
+    int npts = 0;
+
+    for (int i = 0; i < zarray_size(cap->clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->clusters, i, &cluster);
+
+        // the same checks as do_quad_task.
+        int sz = zarray_size(cluster);
+        if (sz < td->qtp.min_cluster_pixels || sz > 3*(2*w+2*h)) {
+            zarray_remove_index(cap->clusters, i--, 0);
+            zarray_destroy(cluster);
+            continue;
+        }
+        npts += sz;
+
+        zarray_t *sorted = zarray_copy(cluster);
+        struct quad quad;
+        memset(&quad, 0, sizeof(struct quad));
+
+        if (fit_quad(td, quad_im, sorted, &quad)) {
+            // in the coordinates of the original image, as frame_quads
+            // leaves them.
+            for (int j = 0; j < 4 && cap->decimate > 1; j++) {
+                quad.p[j][0] *= cap->decimate;
+                quad.p[j][1] *= cap->decimate;
+            }
+            zarray_add(cap->quads, &quad);
+        }
+
+        // fit_quad sorts the cluster by theta (and removes the
+        // duplicate points) unless it rejects it before.
+        struct pt *p0 = (struct pt*) sorted->data;
+        int is_sorted = 1;
+        for (int j = 1; j < zarray_size(sorted); j++)
+            is_sorted &= p0[j-1].theta <= p0[j].theta;
+
+        if (is_sorted && zarray_size(sorted) >= 4) {
+            struct line_fit_pt *lfps = compute_lfps(zarray_size(sorted), sorted, quad_im);
+            zarray_add(cap->sorted, &sorted);
+            zarray_add(cap->lfps, &lfps);
+        } else {
+            zarray_destroy(sorted);
+        }
+    }
+
+    // theta of the points of the original clusters, computed as in
+    // fit_quad, for ptsort.
+    for (int i = 0; i < zarray_size(cap->clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->clusters, i, &cluster);
+
+        int32_t xmax = 0, xmin = INT32_MAX, ymax = 0, ymin = INT32_MAX;
+        for (int j = 0; j < zarray_size(cluster); j++) {
+            struct pt *p;
+            zarray_get_volatile(cluster, j, &p);
+            xmax = imax(xmax, p->x);
+            xmin = imin(xmin, p->x);
+            ymax = imax(ymax, p->y);
+            ymin = imin(ymin, p->y);
+        }
+
+        double cx = (xmin + xmax) * 0.5 + 0.05118;
+        double cy = (ymin + ymax) * 0.5 + -0.028581;
+
+        for (int j = 0; j < zarray_size(cluster); j++) {
+            struct pt *p;
+            zarray_get_volatile(cluster, j, &p);
+            p->theta = atan2f(p->y - cy, p->x - cx);
+        }
+    }
+
+    cap->pts = malloc((npts + 1) * sizeof(struct pt));
+    cap->quads_scratch = zarray_create(sizeof(struct quad));
+
+    // refine the quads and compute their homographies, as
+    // quad_decode_task does, and read their codes.
+    cap->refined = zarray_create(sizeof(struct quad));
+    cap->rcodes = zarray_create(sizeof(uint64_t));
+
+    uint64_t rng = seed;
+    uint64_t mask = cap->fam->d * cap->fam->d >= 64 ? UINT64_MAX :
+        (((uint64_t) 1) << (cap->fam->d * cap->fam->d)) - 1;
+
+    for (int i = 0; i < zarray_size(cap->quads); i++) {
+        struct quad quad;
+        zarray_get(cap->quads, i, &quad);
+
+        if (td->refine_edges)
+            refine_edges(cap->decimate, im_orig, &quad);
+
+        if (quad_update_homographies(&quad))
+            continue;
+
+        zarray_add(cap->refined, &quad);
+
+        struct quick_decode_entry entry;
+        quad_decode(cap->fam, im_orig, &quad, &entry, NULL);
+
+        if (entry.hamming < 255) {
+            zarray_add(cap->rcodes, &entry.rcode);
+            cap->ndecoded++;
+        } else {
+            // xorshift64
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            uint64_t rcode = rng & mask;
+            zarray_add(cap->rcodes, &rcode);
+        }
+    }
+}
+
+static void capture_destroy(struct capture *cap)
+{
+    for (int i = 0; i < zarray_size(cap->clusters); i++) {
+        zarray_t *cluster;
+        zarray_get(cap->clusters, i, &cluster);
+        zarray_destroy(cluster);
+    }
+    zarray_destroy(cap->clusters);
+
+    for (int i = 0; i < zarray_size(cap->sorted); i++) {
+        zarray_t *cluster;
+        struct line_fit_pt *lfps;
+        zarray_get(cap->sorted, i, &cluster);
+        zarray_get(cap->lfps, i, &lfps);
+        zarray_destroy(cluster);
+        free(lfps);
+    }
+    zarray_destroy(cap->sorted);
+    zarray_destroy(cap->lfps);
+
+    for (int i = 0; i < zarray_size(cap->refined); i++) {
+        struct quad *quad;
+        zarray_get_volatile(cap->refined, i, &quad);
+        matd_destroy(quad->H);
+        matd_destroy(quad->Hinv);
+    }
+    zarray_destroy(cap->refined);
+    zarray_destroy(cap->quads);
+    zarray_destroy(cap->quads_scratch);
+    zarray_destroy(cap->rcodes);
+
+    unionfind_destroy(cap->uf);
+    image_u8_destroy(cap->threshim);
+    image_u8_destroy(cap->blur_im);
+    image_u8_destroy(cap->quad_im);
+    free(cap->pts);
+}
+
+////////////////////////////////////////////////////////
+
+static int compare_int64(const void *_a, const void *_b)
+{
+    int64_t a = *(int64_t*) _a, b = *(int64_t*) _b;
+    return (a > b) - (a < b);
+}
+
+static void time_kernel(struct capture *cap, const struct kernel *k, int nsamples, int64_t min_ns)
+{
+    int ncalls = k->ncalls(cap);
+    if (ncalls == 0) {
+        printf("%-24s %10s\n", k->name, "no input");
+        return;
+    }
+
+    // warm up, and find how many runs make up a sample of at least
+    // min_ns, so that the timer's resolution does not matter.
+    int runs = 1;
+    for (int warm = 0; warm < 3; warm++) {
+        int64_t ns = 0;
+        for (int r = 0; r < runs; r++) {
+            if (k->prepare)
+                k->prepare(cap);
+            int64_t t0 = ntime_now();
+            k->run(cap);
+            ns += ntime_now() - t0;
+        }
+        while (ns < min_ns && runs < (1 << 20)) {
+            runs *= 2;
+            ns *= 2;
+        }
+    }
+
+    int64_t *samples = malloc(nsamples * sizeof(int64_t));
+
+    for (int s = 0; s < nsamples; s++) {
+        int64_t ns = 0;
+        for (int r = 0; r < runs; r++) {
+            if (k->prepare)
+                k->prepare(cap);
+            int64_t t0 = ntime_now();
+            k->run(cap);
+            ns += ntime_now() - t0;
+        }
+        samples[s] = ns / runs;
+    }
+
+    qsort(samples, nsamples, sizeof(int64_t), compare_int64);
+
+    double p10 = samples[nsamples / 10];
+    double med = samples[nsamples / 2];
+    double p90 = samples[nsamples * 9 / 10];
+
+    printf("%-24s %7d %12.2f %12.2f %12.2f %12.1f %7.1f%%\n", k->name, ncalls,
+           samples[0] / 1000.0, med / 1000.0, p90 / 1000.0, med / ncalls, 100 * (p90 - p10) / med);
+
+    free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(getopt, '\0', "image", "", "PNM image to capture the inputs from (default: a synthetic scene)");
+    getopt_add_int(getopt, 'W', "width", "1280", "Width of the synthetic scene");
+    getopt_add_int(getopt, 'H', "height", "720", "Height of the synthetic scene");
+    getopt_add_int(getopt, 'n', "tags", "10", "Tags in the synthetic scene");
+    getopt_add_int(getopt, '\0', "seed", "0", "Seed of the synthetic scene");
+    getopt_add_int(getopt, 's', "samples", "100", "Samples per kernel");
+    getopt_add_int(getopt, '\0', "min-us", "200", "Shortest sample (microseconds)");
+    getopt_add_int(getopt, '\0', "cpu", "-1", "Pin to this CPU");
+    getopt_add_string(getopt, 'k', "kernel", "", "Only run the kernels whose name contains this");
+    getopt_add_spacer(getopt, "");
+    getopt_add_double(getopt, 'x', "decimate", "2.0", "Decimate input image by this factor");
+    getopt_add_double(getopt, '\0', "sigma", "0.8", "Blur (sigma) of the image_u8_gaussian_blur kernel");
+    getopt_add_bool(getopt, '\0', "refine-edges", 1, "Refine the quads before decoding them");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    if (getopt_get_int(getopt, "cpu") >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(getopt_get_int(getopt, "cpu"), &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            perror("sched_setaffinity");
+    }
+
+    struct capture cap;
+    memset(&cap, 0, sizeof(cap));
+
+    cap.fam = tag36h11_create();
+    cap.td = apriltag_detector_create();
+    apriltag_detector_add_family(cap.td, cap.fam);
+    cap.td->quad_decimate = getopt_get_double(getopt, "decimate");
+    cap.td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    cap.ctx = apriltag_detect_ctx_create();
+    cap.decimate = cap.td->quad_decimate;
+    cap.sigma = getopt_get_double(getopt, "sigma");
+
+    image_u8_t *im;
+    const char *path = getopt_get_string(getopt, "image");
+    scene_t *scene = NULL;
+
+    if (strlen(path) > 0) {
+        im = image_u8_create_from_pnm(path);
+        if (im == NULL) {
+            printf("Couldn't load %s\n", path);
+            exit(-1);
+        }
+    } else {
+        struct scene_params params;
+        scene_params_init(&params, getopt_get_int(getopt, "width"), getopt_get_int(getopt, "height"));
+        params.ntags = getopt_get_int(getopt, "tags");
+        scene = scene_create(cap.fam, &params, getopt_get_int(getopt, "seed"));
+        im = scene->im;
+    }
+
+    capture_frame(&cap, im, getopt_get_int(getopt, "seed"));
+
+    printf("%dx%d, decimate %.1f: %d clusters, %d sorted, %d quads, %d tags\n\n",
+           im->width, im->height, cap.decimate, zarray_size(cap.clusters), zarray_size(cap.sorted),
+           zarray_size(cap.quads), cap.ndecoded);
+    printf("%-24s %7s %12s %12s %12s %12s %8s\n", "kernel", "calls", "min (us)", "median (us)",
+           "p90 (us)", "ns/call", "spread");
+
+    const char *only = getopt_get_string(getopt, "kernel");
+    int nsamples = imax(getopt_get_int(getopt, "samples"), 1);
+    int64_t min_ns = getopt_get_int(getopt, "min-us") * (int64_t) 1000;
+
+    for (int i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strstr(kernels[i].name, only))
+            time_kernel(&cap, &kernels[i], nsamples, min_ns);
+    }
+
+    capture_destroy(&cap);
+    if (scene)
+        scene_destroy(scene);
+    else
+        image_u8_destroy(im);
+    apriltag_detect_ctx_destroy(cap.ctx);
+    apriltag_detector_destroy(cap.td);
+    tag36h11_destroy(cap.fam);
+    getopt_destroy(getopt);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+// Throughput of the detector on recorded video: replays a raw Y8 or
+// MJPEG stream, or a directory of PGM files, through frame_source as
+// fast as the detector takes the frames, and reports frames per second
+// and the latency of each frame, from when it had been read and
+// decoded to when its detections were out. With --log, the detections
+// and stage timings of every frame are written to a detection log.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag.h"
+#include "tag36h11.h"
+#include "tag36h10.h"
+#include "tag25h9.h"
+#include "tag25h7.h"
+#include "tag16h5.h"
+#include "common/detection_log.h"
+#include "common/frame_source.h"
+#include "common/getopt.h"
+#include "common/time_util.h"
+#include "common/zarray.h"
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t*) a, y = *(const int64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// sorted samples: the value below which a fraction p lies, in ms.
+static double percentile_ms(const int64_t *sorted, int n, double p)
+{
+    int i = p * n;
+    return sorted[i < n ? i : n - 1] / 1.0e6;
+}
+
+static void print_percentiles(const char *name, int64_t *v, int n)
+{
+    qsort(v, n, sizeof(int64_t), compare_int64);
+    printf("%-10s p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n", name,
+           percentile_ms(v, n, 0.5), percentile_ms(v, n, 0.9),
+           percentile_ms(v, n, 0.99), v[n - 1] / 1.0e6);
+}
+
+static apriltag_family_t *family_create(const char *name)
+{
+    if (!strcmp(name, "tag36h11"))
+        return tag36h11_create();
+    if (!strcmp(name, "tag36h10"))
+        return tag36h10_create();
+    if (!strcmp(name, "tag25h9"))
+        return tag25h9_create();
+    if (!strcmp(name, "tag25h7"))
+        return tag25h7_create();
+    if (!strcmp(name, "tag16h5"))
+        return tag16h5_create();
+    return NULL;
+}
+
+static void family_destroy(apriltag_family_t *tf)
+{
+    if (!strcmp(tf->name, "tag36h11"))
+        tag36h11_destroy(tf);
+    else if (!strcmp(tf->name, "tag36h10"))
+        tag36h10_destroy(tf);
+    else if (!strcmp(tf->name, "tag25h9"))
+        tag25h9_destroy(tf);
+    else if (!strcmp(tf->name, "tag25h7"))
+        tag25h7_destroy(tf);
+    else if (!strcmp(tf->name, "tag16h5"))
+        tag16h5_destroy(tf);
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(getopt, '\0', "y8", "", "Raw Y8 stream (needs --width and --height)");
+    getopt_add_int(getopt, 'W', "width", "0", "Width of the Y8 frames");
+    getopt_add_int(getopt, 'H', "height", "0", "Height of the Y8 frames");
+    getopt_add_string(getopt, '\0', "mjpeg", "", "MJPEG stream (concatenated JPEGs)");
+    getopt_add_string(getopt, '\0', "pgm", "", "PGM file or directory of them");
+    getopt_add_int(getopt, 'n', "buffers", "4", "Frames read ahead");
+    getopt_add_int(getopt, 'l', "loop", "1", "Replay the stream this many times");
+    getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag family");
+    getopt_add_int(getopt, '\0', "hamming", "2", "Detect tags with up to this many bit errors");
+    getopt_add_double(getopt, 'd', "decimate", "2.0", "Decimate input image by this factor");
+    getopt_add_int(getopt, 't', "threads", "1", "Use this many CPU threads");
+    getopt_add_string(getopt, 'o', "log", "", "Write a detection log to this file");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options] --y8 <file> -W <w> -H <h> | --mjpeg <file> | --pgm <dir>\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int nbuffers = getopt_get_int(getopt, "buffers");
+    int loop = getopt_get_int(getopt, "loop");
+
+    frame_source_t *fs = NULL;
+    const char *path;
+    if ((path = getopt_get_string(getopt, "y8"))[0])
+        fs = frame_source_create_y8(path, getopt_get_int(getopt, "width"),
+                                    getopt_get_int(getopt, "height"), nbuffers, loop);
+    else if ((path = getopt_get_string(getopt, "mjpeg"))[0])
+        fs = frame_source_create_mjpeg(path, nbuffers, loop);
+    else if ((path = getopt_get_string(getopt, "pgm"))[0])
+        fs = frame_source_create_pgm(path, nbuffers, loop);
+    else {
+        printf("No stream given\n");
+        exit(-1);
+    }
+
+    if (fs == NULL) {
+        printf("Can't open %s\n", path);
+        exit(-1);
+    }
+
+    apriltag_family_t *tf = family_create(getopt_get_string(getopt, "family"));
+    if (tf == NULL) {
+        printf("Unrecognized tag family %s\n", getopt_get_string(getopt, "family"));
+        exit(-1);
+    }
+
+    apriltag_detector_t *td = apriltag_detector_create();
+    apriltag_detector_add_family_bits(td, tf, getopt_get_int(getopt, "hamming"));
+    td->quad_decimate = getopt_get_double(getopt, "decimate");
+    td->nthreads = getopt_get_int(getopt, "threads");
+
+    detection_log_t *log = NULL;
+    if ((path = getopt_get_string(getopt, "log"))[0]) {
+        const char *stages[APRILTAG_STAGE_COUNT];
+        for (int s = 0; s < APRILTAG_STAGE_COUNT; s++)
+            stages[s] = apriltag_stage_name(s);
+
+        log = detection_log_create(path, APRILTAG_STAGE_COUNT, stages);
+        if (log == NULL) {
+            printf("Can't create %s\n", path);
+            exit(-1);
+        }
+    }
+
+    int cap = 1024, n = 0;
+    int64_t *latency = malloc(cap * sizeof(int64_t));
+    int64_t *detect = malloc(cap * sizeof(int64_t));
+    uint64_t npixels = 0;
+    int64_t ndetections = 0;
+
+    int64_t t0 = ntime_now();
+
+    frame_source_frame_t frame;
+    while (frame_source_next(fs, &frame)) {
+        int64_t t1 = ntime_now();
+        zarray_t *detections = apriltag_detector_detect(td, frame.im);
+        int64_t t2 = ntime_now();
+
+        if (log != NULL) {
+            for (int i = 0; i < zarray_size(detections); i++) {
+                apriltag_detection_t *det;
+                zarray_get(detections, i, &det);
+                detection_log_add_detection(log, det, NULL, NULL);
+            }
+            detection_log_add_frame(log, 0, frame.ready_ns, td->ctx->stage_ns);
+        }
+
+        ndetections += zarray_size(detections);
+        npixels += (uint64_t) frame.im->width * frame.im->height;
+        apriltag_detections_destroy(detections);
+        frame_source_release(fs, &frame);
+
+        if (n == cap) {
+            cap *= 2;
+            latency = realloc(latency, cap * sizeof(int64_t));
+            detect = realloc(detect, cap * sizeof(int64_t));
+        }
+        latency[n] = t2 - frame.ready_ns;
+        detect[n] = t2 - t1;
+        n++;
+    }
+
+    double secs = (ntime_now() - t0) / 1.0e9;
+
+    frame_source_stats_t stats;
+    frame_source_get_stats(fs, &stats);
+
+    printf("%d frames, %d errors, %.1f detections/frame\n", n, (int) stats.nerrors,
+           n ? (double) ndetections / n : 0.0);
+
+    if (n > 0) {
+        printf("%.1f frames/s, %.1f Mpix/s, %.1f MB/s of input\n", n / secs,
+               npixels / secs / 1.0e6, stats.nbytes / secs / 1.0e6);
+        print_percentiles("latency", latency, n);
+        print_percentiles("detect", detect, n);
+        printf("source: %.3f ms/frame reading, %.3f ms/frame waited for\n",
+               stats.read_ns / 1.0e6 / n, stats.wait_ns / 1.0e6 / n);
+    }
+
+    free(latency);
+    free(detect);
+
+    if (detection_log_destroy(log))
+        printf("Error writing %s\n", getopt_get_string(getopt, "log"));
+
+    frame_source_destroy(fs);
+    apriltag_detector_destroy(td);
+    family_destroy(tf);
+    getopt_destroy(getopt);
+
+    return 0;
+}
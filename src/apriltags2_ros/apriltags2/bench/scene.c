@@ -0,0 +1,296 @@
+// Synthetic tag scenes for the benchmarks; see scene.h.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+#include "common/homography.h"
+#include "common/matd.h"
+#include "common/math_util.h"
+
+#ifndef M_PI
+# define M_PI 3.141592653589793238462643383279502884196
+#endif
+
+// subsamples per pixel (in each direction) when rendering tags.
+#define SCENE_SUPERSAMPLE 3
+
+// splitmix64, so that a seed gives the same scene everywhere.
+static uint64_t rng_next(uint64_t *s)
+{
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double rng_uniform(uint64_t *s, double a, double b)
+{
+    return a + (b - a) * ((rng_next(s) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+static double rng_gaussian(uint64_t *s)
+{
+    double u = rng_uniform(s, 1e-12, 1);
+    double v = rng_uniform(s, 0, 1);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+void scene_params_init(struct scene_params *params, int width, int height)
+{
+    memset(params, 0, sizeof(struct scene_params));
+    params->width = width;
+    params->height = height;
+    params->ntags = 10;
+    params->min_size = 0.04 * height;
+    params->max_size = 0.20 * height;
+    params->perspective = 0.1;
+    params->blur = 0.8;
+    params->noise = 4;
+    params->clutter = 20;
+}
+
+static void draw_background(image_u8_t *im, const struct scene_params *params, uint64_t *rng)
+{
+    // a smooth variation of brightness, as from uneven lighting.
+    double fx = rng_uniform(rng, 1, 3) * 2 * M_PI / im->width;
+    double fy = rng_uniform(rng, 1, 3) * 2 * M_PI / im->height;
+    double base = rng_uniform(rng, 90, 150);
+
+    for (int y = 0; y < im->height; y++)
+        for (int x = 0; x < im->width; x++)
+            im->buf[y*im->stride + x] = base + 50 * sin(x * fx) * cos(y * fy);
+
+    for (int i = 0; i < params->clutter; i++) {
+        int w = rng_uniform(rng, params->min_size / 4, params->max_size);
+        int h = rng_uniform(rng, params->min_size / 4, params->max_size);
+        int x0 = rng_uniform(rng, -w / 2, im->width - w / 2);
+        int y0 = rng_uniform(rng, -h / 2, im->height - h / 2);
+        uint8_t v = rng_uniform(rng, 0, 256);
+
+        for (int y = y0 < 0 ? 0 : y0; y < y0 + h && y < im->height; y++)
+            for (int x = x0 < 0 ? 0 : x0; x < x0 + w && x < im->width; x++)
+                im->buf[y*im->stride + x] = v;
+    }
+}
+
+// draw the tag image timg so that its corners (0,0), (dim,0), (dim,dim)
+// and (0,dim) land on q[0..3]; its black and white pixels are drawn
+// with gray levels black and white.
+static void draw_tag(image_u8_t *im, const image_u8_t *timg, double q[4][2],
+                     double black, double white)
+{
+    int dim = timg->width;
+    double tc[4][2] = { { 0, 0 }, { dim, 0 }, { dim, dim }, { 0, dim } };
+
+    zarray_t *correspondences = zarray_create(sizeof(float[4]));
+    for (int i = 0; i < 4; i++) {
+        float corr[4] = { q[i][0], q[i][1], tc[i][0], tc[i][1] };
+        zarray_add(correspondences, &corr);
+    }
+    matd_t *H = homography_compute(correspondences, HOMOGRAPHY_COMPUTE_FLAG_SVD);
+    zarray_destroy(correspondences);
+
+    double x0 = q[0][0], x1 = q[0][0], y0 = q[0][1], y1 = q[0][1];
+    for (int i = 1; i < 4; i++) {
+        x0 = fmin(x0, q[i][0]);
+        x1 = fmax(x1, q[i][0]);
+        y0 = fmin(y0, q[i][1]);
+        y1 = fmax(y1, q[i][1]);
+    }
+
+    int ss = SCENE_SUPERSAMPLE;
+
+    for (int y = imax(0, floor(y0)); y < imin(im->height, ceil(y1)); y++) {
+        for (int x = imax(0, floor(x0)); x < imin(im->width, ceil(x1)); x++) {
+            double acc = 0;
+            int nin = 0;
+
+            // pixel (x, y) covers [x, x+1) x [y, y+1), as in the
+            // detector's coordinates.
+            for (int sy = 0; sy < ss; sy++) {
+                for (int sx = 0; sx < ss; sx++) {
+                    double u, v;
+                    homography_project(H, x + (sx + 0.5) / ss, y + (sy + 0.5) / ss, &u, &v);
+                    if (u < 0 || v < 0 || u >= dim || v >= dim)
+                        continue;
+
+                    int t = timg->buf[(int) v * timg->stride + (int) u];
+                    acc += t ? white : black;
+                    nin++;
+                }
+            }
+
+            if (nin > 0) {
+                acc += (ss*ss - nin) * im->buf[y*im->stride + x];
+                im->buf[y*im->stride + x] = acc / (ss*ss) + 0.5;
+            }
+        }
+    }
+
+    matd_destroy(H);
+}
+
+// the point (u, v) of the tag square q[] (u, v in [0, 1]), following
+// the same projective warp as draw_tag.
+static void warp_point(double q[4][2], double u, double v, double p[2])
+{
+    zarray_t *correspondences = zarray_create(sizeof(float[4]));
+    double tc[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+    for (int i = 0; i < 4; i++) {
+        float corr[4] = { tc[i][0], tc[i][1], q[i][0], q[i][1] };
+        zarray_add(correspondences, &corr);
+    }
+    matd_t *H = homography_compute(correspondences, HOMOGRAPHY_COMPUTE_FLAG_SVD);
+    zarray_destroy(correspondences);
+
+    homography_project(H, u, v, &p[0], &p[1]);
+    matd_destroy(H);
+}
+
+scene_t *scene_create(apriltag_family_t *fam, const struct scene_params *params, uint32_t seed)
+{
+    uint64_t rng = seed;
+
+    scene_t *scene = calloc(1, sizeof(scene_t));
+    scene->im = image_u8_create(params->width, params->height);
+    scene->tags = calloc(params->ntags, sizeof(struct scene_tag));
+
+    image_u8_t *im = scene->im;
+    draw_background(im, params, &rng);
+
+    double perspective = fmin(fmax(params->perspective, 0), 0.25);
+
+    int ntags = imin(params->ntags, fam->ncodes);
+
+    for (int attempt = 0; attempt < 200 * ntags && scene->ntags < ntags; attempt++) {
+        double size = rng_uniform(&rng, params->min_size, params->max_size);
+
+        // radius of a circle that contains the warped tag.
+        double r = size * (M_SQRT1_2 + M_SQRT2 * perspective);
+        if (2 * r >= im->width || 2 * r >= im->height)
+            continue;
+
+        double cx = rng_uniform(&rng, r, im->width - r);
+        double cy = rng_uniform(&rng, r, im->height - r);
+
+        int overlap = 0;
+        for (int i = 0; i < scene->ntags; i++) {
+            struct scene_tag *t = &scene->tags[i];
+            double rt = t->size * (M_SQRT1_2 + M_SQRT2 * perspective);
+            if (hypot(cx - t->c[0], cy - t->c[1]) < r + rt)
+                overlap = 1;
+        }
+        if (overlap)
+            continue;
+
+        // tag ids are distinct within a scene.
+        int id;
+        int unique;
+        do {
+            id = rng_next(&rng) % fam->ncodes;
+            unique = 1;
+            for (int i = 0; i < scene->ntags; i++)
+                unique &= scene->tags[i].id != id;
+        } while (!unique);
+
+        double theta = rng_uniform(&rng, 0, 2 * M_PI);
+        double c = cos(theta), s = sin(theta);
+
+        double q[4][2];
+        double sq[4][2] = { { -0.5, -0.5 }, { 0.5, -0.5 }, { 0.5, 0.5 }, { -0.5, 0.5 } };
+        for (int i = 0; i < 4; i++) {
+            q[i][0] = cx + size * (c * sq[i][0] - s * sq[i][1]) + rng_uniform(&rng, -perspective, perspective) * size;
+            q[i][1] = cy + size * (s * sq[i][0] + c * sq[i][1]) + rng_uniform(&rng, -perspective, perspective) * size;
+        }
+
+        image_u8_t *timg = apriltag_to_image(fam, id);
+        draw_tag(im, timg, q, rng_uniform(&rng, 10, 60), rng_uniform(&rng, 180, 245));
+
+        struct scene_tag *t = &scene->tags[scene->ntags++];
+        t->id = id;
+        t->size = size;
+
+        // the black border spans [1, dim-1] of the tag image.
+        double dim = timg->width;
+        double b0 = 1 / dim, b1 = (dim - 1) / dim;
+        double bc[4][2] = { { b0, b0 }, { b1, b0 }, { b1, b1 }, { b0, b1 } };
+        for (int i = 0; i < 4; i++)
+            warp_point(q, bc[i][0], bc[i][1], t->p[i]);
+        warp_point(q, 0.5, 0.5, t->c);
+
+        image_u8_destroy(timg);
+    }
+
+    if (params->blur > 0) {
+        int ksz = 4 * params->blur;
+        if ((ksz & 1) == 0)
+            ksz++;
+        if (ksz > 1)
+            image_u8_gaussian_blur(im, params->blur, ksz);
+    }
+
+    if (params->noise > 0) {
+        for (int y = 0; y < im->height; y++) {
+            for (int x = 0; x < im->width; x++) {
+                double v = im->buf[y*im->stride + x] + params->noise * rng_gaussian(&rng);
+                im->buf[y*im->stride + x] = v < 0 ? 0 : v > 255 ? 255 : v + 0.5;
+            }
+        }
+    }
+
+    return scene;
+}
+
+void scene_destroy(scene_t *scene)
+{
+    if (scene == NULL)
+        return;
+
+    image_u8_destroy(scene->im);
+    free(scene->tags);
+    free(scene);
+}
+
+// mean distance between the corners of det and t, in the best of the
+// possible correspondences (either winding, any starting corner).
+static double corner_err(const apriltag_detection_t *det, const struct scene_tag *t)
+{
+    double best = HUGE_VAL;
+
+    for (int dir = -1; dir <= 1; dir += 2) {
+        for (int k = 0; k < 4; k++) {
+            double err = 0;
+            for (int i = 0; i < 4; i++) {
+                int j = (k + dir * i + 4) % 4;
+                err += hypot(det->p[j][0] - t->p[i][0], det->p[j][1] - t->p[i][1]);
+            }
+            best = fmin(best, err / 4);
+        }
+    }
+
+    return best;
+}
+
+void scene_score(const scene_t *scene, const zarray_t *detections, struct scene_score *score)
+{
+    memset(score, 0, sizeof(struct scene_score));
+    score->ntags = scene->ntags;
+    score->ndetections = zarray_size(detections);
+
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get((zarray_t*) detections, i, &det);
+
+        for (int j = 0; j < scene->ntags; j++) {
+            const struct scene_tag *t = &scene->tags[j];
+            if (t->id != det->id || hypot(det->c[0] - t->c[0], det->c[1] - t->c[1]) > t->size / 4)
+                continue;
+
+            score->ntrue++;
+            score->corner_err_sum += corner_err(det, t);
+            break;
+        }
+    }
+}
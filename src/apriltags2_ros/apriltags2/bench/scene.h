@@ -0,0 +1,78 @@
+// Synthetic tag scenes for the benchmarks: tags rendered with
+// apriltag_to_image, warped onto a cluttered background, blurred and
+// noised, with the ground truth of where each tag is.
+
+#ifndef _BENCH_SCENE_H
+#define _BENCH_SCENE_H
+
+#include "apriltag.h"
+#include "common/image_u8.h"
+#include "common/zarray.h"
+
+struct scene_params
+{
+    int width, height;
+
+    // How many tags, and the range of their size: the side (in
+    // pixels) of the tag including its white border.
+    int ntags;
+    double min_size, max_size;
+
+    // How far (as a fraction of the size) each corner of a tag may be
+    // moved at random, giving an arbitrary perspective warp. At most
+    // 0.25.
+    double perspective;
+
+    // Standard deviation (pixels) of the Gaussian blur, and (gray
+    // levels) of the noise added afterwards. 0 for none.
+    double blur;
+    double noise;
+
+    // How many random dark and light boxes to draw on the background.
+    int clutter;
+};
+
+struct scene_tag
+{
+    int id;
+
+    // corners of the black border and center, in pixels (pixel
+    // (x, y) covering [x, x+1) x [y, y+1)).
+    double p[4][2];
+    double c[2];
+
+    double size;
+};
+
+typedef struct scene scene_t;
+struct scene
+{
+    image_u8_t *im;
+
+    int ntags;
+    struct scene_tag *tags;
+};
+
+void scene_params_init(struct scene_params *params, int width, int height);
+
+// Render a scene with tags of family fam. The same seed always gives
+// the same scene. There may be fewer tags than asked for if they do
+// not fit.
+scene_t *scene_create(apriltag_family_t *fam, const struct scene_params *params, uint32_t seed);
+void scene_destroy(scene_t *scene);
+
+// Accuracy of detections against a scene. A detection is a true
+// positive if a tag with its id lies within a quarter of the tag size
+// of its center; corner_err is then the mean distance between its
+// corners and the true ones.
+struct scene_score
+{
+    int ntags;
+    int ndetections;
+    int ntrue;
+    double corner_err_sum;
+};
+
+void scene_score(const scene_t *scene, const zarray_t *detections, struct scene_score *score);
+
+#endif
@@ -0,0 +1,212 @@
+// Throughput and accuracy benchmark of apriltag_detector_detect on
+// synthetic scenes (see scene.h): reports frames per second, the time
+// of each stage, and recall and precision against the ground truth.
+// The same options always give the same scenes, so that runs of two
+// builds can be compared.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apriltag.h"
+#include "tag36h11.h"
+#include "tag36h10.h"
+#include "tag25h9.h"
+#include "tag25h7.h"
+#include "tag16h5.h"
+#include "common/getopt.h"
+#include "common/image_u8.h"
+#include "common/time_util.h"
+
+#include "scene.h"
+
+static int parse_resolution(const char *s, int *width, int *height)
+{
+    struct {
+        const char *name;
+        int width, height;
+    } presets[] = {
+        { "vga", 640, 480 },
+        { "720p", 1280, 720 },
+        { "1080p", 1920, 1080 },
+        { "4k", 3840, 2160 },
+    };
+
+    for (int i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        if (!strcmp(s, presets[i].name)) {
+            *width = presets[i].width;
+            *height = presets[i].height;
+            return 0;
+        }
+    }
+
+    return sscanf(s, "%dx%d", width, height) == 2 && *width > 0 && *height > 0 ? 0 : -1;
+}
+
+static apriltag_family_t *family_create(const char *name)
+{
+    if (!strcmp(name, "tag36h11"))
+        return tag36h11_create();
+    if (!strcmp(name, "tag36h10"))
+        return tag36h10_create();
+    if (!strcmp(name, "tag25h9"))
+        return tag25h9_create();
+    if (!strcmp(name, "tag25h7"))
+        return tag25h7_create();
+    if (!strcmp(name, "tag16h5"))
+        return tag16h5_create();
+    return NULL;
+}
+
+static void family_destroy(const char *name, apriltag_family_t *tf)
+{
+    if (!strcmp(name, "tag36h11"))
+        tag36h11_destroy(tf);
+    else if (!strcmp(name, "tag36h10"))
+        tag36h10_destroy(tf);
+    else if (!strcmp(name, "tag25h9"))
+        tag25h9_destroy(tf);
+    else if (!strcmp(name, "tag25h7"))
+        tag25h7_destroy(tf);
+    else if (!strcmp(name, "tag16h5"))
+        tag16h5_destroy(tf);
+}
+
+int main(int argc, char *argv[])
+{
+    getopt_t *getopt = getopt_create();
+
+    getopt_add_bool(getopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(getopt, 'r', "resolution", "vga", "vga, 720p, 1080p, 4k or WIDTHxHEIGHT");
+    getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag family");
+    getopt_add_int(getopt, 'n', "tags", "10", "Tags per scene");
+    getopt_add_double(getopt, '\0', "min-size", "0.04", "Smallest tag, as a fraction of the image height");
+    getopt_add_double(getopt, '\0', "max-size", "0.2", "Largest tag, as a fraction of the image height");
+    getopt_add_double(getopt, 'p', "perspective", "0.1", "Perspective warp (0 to 0.25)");
+    getopt_add_double(getopt, 'b', "blur", "0.8", "Scene blur (sigma, pixels)");
+    getopt_add_double(getopt, 'N', "noise", "4", "Scene noise (sigma, gray levels)");
+    getopt_add_int(getopt, '\0', "clutter", "20", "Background boxes per scene");
+    getopt_add_int(getopt, 's', "scenes", "8", "Number of different scenes");
+    getopt_add_int(getopt, '\0', "seed", "0", "Seed of the first scene");
+    getopt_add_int(getopt, 'i', "iters", "100", "Frames to detect (cycling through the scenes)");
+    getopt_add_bool(getopt, 'w', "write", 0, "Write the scenes to scene_N.pnm");
+    getopt_add_spacer(getopt, "");
+    getopt_add_double(getopt, 'x', "decimate", "2.0", "Decimate input image by this factor");
+    getopt_add_double(getopt, '\0', "sigma", "0.0", "Apply low-pass blur to input");
+    getopt_add_int(getopt, 't', "threads", "1", "Use this many CPU threads");
+    getopt_add_int(getopt, '\0', "hamming", "2", "Detect tags with up to this many bit errors");
+    getopt_add_bool(getopt, '\0', "refine-edges", 1, "Spend more time trying to align edges of tags");
+    getopt_add_bool(getopt, '\0', "refine-decode", 0, "Spend more time trying to decode tags");
+    getopt_add_bool(getopt, '\0', "refine-pose", 0, "Spend more time trying to precisely localize tags");
+
+    if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(getopt);
+        exit(0);
+    }
+
+    int width, height;
+    if (parse_resolution(getopt_get_string(getopt, "resolution"), &width, &height)) {
+        printf("Unrecognized resolution %s\n", getopt_get_string(getopt, "resolution"));
+        exit(-1);
+    }
+
+    apriltag_family_t *tf = family_create(getopt_get_string(getopt, "family"));
+    if (tf == NULL) {
+        printf("Unrecognized tag family %s\n", getopt_get_string(getopt, "family"));
+        exit(-1);
+    }
+
+    struct scene_params params;
+    scene_params_init(&params, width, height);
+    params.ntags = getopt_get_int(getopt, "tags");
+    params.min_size = getopt_get_double(getopt, "min-size") * height;
+    params.max_size = getopt_get_double(getopt, "max-size") * height;
+    params.perspective = getopt_get_double(getopt, "perspective");
+    params.blur = getopt_get_double(getopt, "blur");
+    params.noise = getopt_get_double(getopt, "noise");
+    params.clutter = getopt_get_int(getopt, "clutter");
+
+    int nscenes = getopt_get_int(getopt, "scenes");
+    int seed = getopt_get_int(getopt, "seed");
+    int iters = getopt_get_int(getopt, "iters");
+    if (nscenes < 1 || iters < 1) {
+        printf("Need at least one scene and one frame\n");
+        exit(-1);
+    }
+
+    scene_t **scenes = calloc(nscenes, sizeof(scene_t*));
+    int ntags = 0;
+    for (int i = 0; i < nscenes; i++) {
+        scenes[i] = scene_create(tf, &params, seed + i);
+        ntags += scenes[i]->ntags;
+
+        if (getopt_get_bool(getopt, "write")) {
+            char path[64];
+            snprintf(path, sizeof(path), "scene_%d.pnm", i);
+            image_u8_write_pnm(scenes[i]->im, path);
+        }
+    }
+
+    apriltag_detector_t *td = apriltag_detector_create();
+    apriltag_detector_add_family_bits(td, tf, getopt_get_int(getopt, "hamming"));
+    td->quad_decimate = getopt_get_double(getopt, "decimate");
+    td->quad_sigma = getopt_get_double(getopt, "sigma");
+    td->nthreads = getopt_get_int(getopt, "threads");
+    td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    td->refine_decode = getopt_get_bool(getopt, "refine-decode");
+    td->refine_pose = getopt_get_bool(getopt, "refine-pose");
+
+    printf("%dx%d, %d scenes of %.1f %s tags, %d frames, %d threads, decimate %.1f\n",
+           width, height, nscenes, (double) ntags / nscenes, getopt_get_string(getopt, "family"),
+           iters, td->nthreads, td->quad_decimate);
+
+    // one untimed pass, so that the worker threads, scratch buffers
+    // and caches are warm.
+    for (int i = 0; i < nscenes; i++)
+        apriltag_detections_destroy(apriltag_detector_detect(td, scenes[i]->im));
+    apriltag_detect_ctx_stage_reset(td->ctx);
+
+    struct scene_score total;
+    memset(&total, 0, sizeof(total));
+    int64_t nsecs = 0;
+
+    for (int iter = 0; iter < iters; iter++) {
+        scene_t *scene = scenes[iter % nscenes];
+
+        int64_t t0 = ntime_now();
+        zarray_t *detections = apriltag_detector_detect(td, scene->im);
+        nsecs += ntime_now() - t0;
+
+        struct scene_score score;
+        scene_score(scene, detections, &score);
+        total.ntags += score.ntags;
+        total.ndetections += score.ndetections;
+        total.ntrue += score.ntrue;
+        total.corner_err_sum += score.corner_err_sum;
+
+        apriltag_detections_destroy(detections);
+    }
+
+    double seconds = nsecs / 1.0e9;
+    printf("\n%10.2f frames/s  %10.3f ms/frame  %10.2f Mpixels/s\n", iters / seconds,
+           seconds * 1000 / iters, (double) width * height * iters / seconds / 1.0e6);
+    printf("%10.4f recall     %10.4f precision  %10.3f px corner error\n\n",
+           total.ntags > 0 ? (double) total.ntrue / total.ntags : 0,
+           total.ndetections > 0 ? (double) total.ntrue / total.ndetections : 1,
+           total.ntrue > 0 ? total.corner_err_sum / total.ntrue : 0);
+
+    apriltag_detect_ctx_stage_display(td->ctx, stdout);
+
+    printf("\n");
+    apriltag_detect_ctx_perf_display(td->ctx, stdout);
+
+    apriltag_detector_destroy(td);
+    for (int i = 0; i < nscenes; i++)
+        scene_destroy(scenes[i]);
+    free(scenes);
+    family_destroy(getopt_get_string(getopt, "family"), tf);
+    getopt_destroy(getopt);
+
+    return 0;
+}
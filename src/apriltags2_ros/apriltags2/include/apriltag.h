@@ -38,16 +38,16 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "common/matd.h"
 #include "common/image_u8.h"
 #include "common/zarray.h"
 #include "common/workerpool.h"
 #include "common/timeprofile.h"
+#include "common/latency_hist.h"
 #include <pthread.h>
 
-#define APRILTAG_TASKS_PER_THREAD_TARGET 10
-
 struct quad
 {
     float p[4][2]; // corners
@@ -124,14 +124,54 @@ struct apriltag_quad_thresh_params
 // are set to reasonable values, but can be overridden by accessing
 // these fields.
 typedef struct apriltag_detector apriltag_detector_t;
+// The stages of a detection, in the order they run, whose durations
+// are measured (see apriltag_stage_stats). Stages that may run
+// several times per frame (e.g. once per region of interest) are
+// measured in total. APRILTAG_STAGE_TOTAL is the whole detection.
+enum apriltag_stage
+{
+    APRILTAG_STAGE_INIT,
+    APRILTAG_STAGE_PREDICT_ROIS,
+    APRILTAG_STAGE_FRONT_END,       // decimate, filter and threshold (frame or ROIs)
+    APRILTAG_STAGE_UNIONFIND,
+    APRILTAG_STAGE_CLUSTERS,
+    APRILTAG_STAGE_FIT_QUADS,
+    APRILTAG_STAGE_ROI_QUADS,
+    APRILTAG_STAGE_QUADS,
+    APRILTAG_STAGE_DECODE,
+    APRILTAG_STAGE_RECONCILE,
+    APRILTAG_STAGE_DEBUG,
+    APRILTAG_STAGE_CLEANUP,
+    APRILTAG_STAGE_TOTAL,
+    APRILTAG_STAGE_COUNT
+};
+
+typedef struct apriltag_detect_ctx apriltag_detect_ctx_t;
+struct apriltag_perf;
 struct apriltag_detector
 {
     ///////////////////////////////////////////////////////////////
     // User-configurable parameters.
 
-    // How many threads should be used?
+    // How many threads should be used? If 0, one per CPU that the
+    // process may run on (its affinity mask), minus those in
+    // cpu_exclude.
     int nthreads;
 
+    // When non-zero, threads are pinned to the CPUs that the process
+    // may run on, minus those in cpu_exclude, in order. The first of
+    // these CPUs is for the thread calling apriltag_detector_detect,
+    // which does its share of the work: it is pinned there for the
+    // duration of each parallel step and then gets its own affinity
+    // mask back, so it may run anywhere between steps.
+    int pin_threads;
+
+    // CPUs to keep detection off of, e.g. those running a camera
+    // driver or control loop: bit i set excludes CPU i. Unless
+    // pin_threads is set, all threads (the calling one too, in the
+    // same way as above) may then run on any of the remaining CPUs.
+    uint64_t cpu_exclude;
+
     // detection of quads can be done on a lower-resolution image,
     // improving speed at a cost of pose accuracy and a slight
     // decrease in detection rate. Decoding the binary payload is
@@ -177,14 +217,63 @@ struct apriltag_detector
 
     struct apriltag_quad_thresh_params qtp;
 
+    // When non-zero, successive calls to apriltag_detector_detect (or
+    // to apriltag_detector_detect_ctx with the same context) are
+    // assumed to be frames of a video stream. Rather than searching
+    // the whole image, quads are only searched for (at full
+    // resolution) inside regions of interest predicted from the
+    // previous frame's detections. A full-frame scan is still
+    // performed every track_full_scan_interval frames, and on the
+    // frame following the loss of any tracked tag.
+    int track_roi;
+
+    // When tracking, how many frames between full-frame scans? (1
+    // makes every frame a full-frame scan.)
+    int track_full_scan_interval;
+
+    // When tracking, how much should the bounding box of a previous
+    // detection be grown in order to form its region of interest?
+    // Expressed as a fraction of the larger side of the bounding box.
+    float track_roi_padding;
+
+    // When non-zero and quad_decimate > 1, quads are searched for
+    // coarse-to-fine: after the decimated image has been searched as
+    // usual, the blocks of it that have strong contrast but contain no
+    // quad--- possibly a tag too small to survive decimation--- are
+    // searched again at full resolution. Edge refinement and decoding
+    // are always done at full resolution.
+    int coarse_to_fine;
+
+    // Minimum difference between the brightest and darkest pixels of
+    // a 4x4 block of the decimated image for it to be searched again
+    // when coarse_to_fine is enabled.
+    int fine_min_contrast;
+
+    // Largest fraction of the frame that coarse_to_fine may search
+    // again. Blocks are taken in decreasing order of contrast until
+    // their regions cover this much; if merging the regions (into
+    // their bounding boxes) makes them cover more, none is searched.
+    float fine_max_fraction;
+
     ///////////////////////////////////////////////////////////////
-    // Statistics relating to last processed frame
+    // Statistics relating to the last frame processed by
+    // apriltag_detector_detect (apriltag_detector_detect_ctx reports
+    // them in its context instead).
     timeprofile_t *tp;
 
     uint32_t nedges;
     uint32_t nsegments;
     uint32_t nquads;
 
+    // How many regions of interest were searched for quads at full
+    // resolution (when tracking or searching coarse-to-fine)?
+    uint32_t nrois;
+
+    // Fraction of the frame covered by the regions that coarse_to_fine
+    // chose to search again, even if it is above fine_max_fraction and
+    // they were not searched. Raise fine_min_contrast if it often is.
+    float fine_fraction;
+
     ///////////////////////////////////////////////////////////////
     // Internal variables below
 
@@ -193,11 +282,148 @@ struct apriltag_detector
     // tag family passed into the constructor.
     zarray_t *tag_families;
 
-    // Used to manage multi-threading.
+    // The detection context used by apriltag_detector_detect.
+    apriltag_detect_ctx_t *ctx;
+};
+
+// The per-call state of a detection: statistics, the worker threads,
+// and (when tracking) the tags seen in the previous frame of a video
+// stream. A detector itself is not modified while detecting, so
+// several threads may run apriltag_detector_detect_ctx concurrently
+// on one detector (and its tag families and decode tables), provided
+// each uses its own context and nobody reconfigures the detector
+// meanwhile.
+struct apriltag_detect_ctx
+{
+    ///////////////////////////////////////////////////////////////
+    // User-configurable parameters.
+
+    // If non-zero, how many threads to use for detections with this
+    // context, instead of the detector's nthreads.
+    int nthreads;
+
+    // If non-zero, detections with this context leave the CPU
+    // affinity of all threads alone, ignoring the detector's
+    // pin_threads and cpu_exclude. For callers that already placed
+    // their threads, like apriltag_detector_detect_batch does.
+    int keep_affinity;
+
+    ///////////////////////////////////////////////////////////////
+    // Statistics relating to last processed frame
+    timeprofile_t *tp;
+
+    uint32_t nedges;
+    uint32_t nsegments;
+    uint32_t nquads;
+    uint32_t nrois;
+    float fine_fraction;
+
+    // Duration (in nanoseconds) of each stage in the last frame, or 0
+    // if the stage did not run.
+    int64_t stage_ns[APRILTAG_STAGE_COUNT];
+
+    // Durations of each stage over recent frames. Frames in which a
+    // stage did not run are not counted for it.
+    latency_hist_t stage_hist[APRILTAG_STAGE_COUNT];
+
+    ///////////////////////////////////////////////////////////////
+    // Internal variables below
+
+    // Start of the current frame and of the current stage (see
+    // ntime_now), and the stages that ran (bit mask).
+    int64_t stage_t0, stage_t;
+    uint32_t stage_mask;
+
+    // Hardware event counts of the stages, when built with
+    // APRILTAG_PERF_COUNTERS (see apriltag_detect_ctx_stage_perf).
+    struct apriltag_perf *perf;
+
+    // Used to manage multi-threading. Created on first use from the
+    // threading parameters of the detector, unless set with
+    // apriltag_detect_ctx_set_workerpool.
     workerpool_t *wp;
 
+    // Whether wp belongs to the caller (and is shared with other
+    // contexts) rather than to this context.
+    int wp_shared;
+
+    // CPUs (bit mask) that the threads of wp are pinned (wp_pin set)
+    // or restricted to, if any.
+    uint64_t wp_pinned;
+    int wp_pin;
+
     // Used for thread safety.
     pthread_mutex_t mutex;
+
+    // Tags detected in the previous frame (struct apriltag_track),
+    // used to predict regions of interest when track_roi is enabled.
+    zarray_t *tracks;
+
+    // Frames processed since the last full-frame scan, and whether a
+    // tracked tag was lost in the previous frame.
+    int track_nframes;
+    int track_lost;
+
+    // Scratch buffers of the quad detector, kept between calls so
+    // that they need not be allocated (and faulted in) for every
+    // frame: the union-find structure and the cluster hash table.
+    struct unionfind *uf;
+    void *clustermap;
+    int clustermap_size;
+};
+
+// Aggregate statistics of apriltag_detector_detect_batch.
+typedef struct apriltag_batch_stats apriltag_batch_stats_t;
+struct apriltag_batch_stats
+{
+    int nimages;
+    uint64_t npixels;
+    uint64_t nquads;
+    uint64_t ndetections;
+
+    // How many images were processed at once, and with how many
+    // threads each.
+    int nparallel;
+    int nthreads_per_image;
+
+    // Wall-clock time of the whole batch, and the resulting
+    // throughput.
+    double seconds;
+    double images_per_second;
+    double megapixels_per_second;
+};
+
+// Timing statistics of one stage, over recent frames. All durations
+// are in nanoseconds; percentiles are accurate to about 6%.
+typedef struct apriltag_stage_stats apriltag_stage_stats_t;
+struct apriltag_stage_stats
+{
+    enum apriltag_stage stage;
+    const char *name;
+
+    // Duration in the last frame (0 if the stage did not run).
+    int64_t last_ns;
+
+    // How many frames the statistics below are taken from.
+    uint32_t nframes;
+
+    int64_t p50_ns;
+    int64_t p90_ns;
+    int64_t p99_ns;
+    int64_t max_ns;
+};
+
+// Hardware event counts of one stage, summed over the frames (in
+// which the stage ran) since the last apriltag_detect_ctx_stage_reset.
+typedef struct apriltag_stage_perf apriltag_stage_perf_t;
+struct apriltag_stage_perf
+{
+    uint32_t nframes;
+
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t cache_misses;
+    uint64_t branch_misses;
 };
 
 // Represents the detection of a tag. These are returned to the user
@@ -273,9 +499,99 @@ void apriltag_detector_destroy(apriltag_detector_t *td);
 // Detect tags from an image and return an array of
 // apriltag_detection_t*. You can use apriltag_detections_destroy to
 // free the array and the detections it contains, or call
-// _detection_destroy and zarray_destroy yourself.
+// _detection_destroy and zarray_destroy yourself. im_orig is only
+// read, so it may be shared with other readers while detecting.
 zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig);
 
+// Create and destroy a detection context (see struct
+// apriltag_detect_ctx). A context may be used with any detector.
+apriltag_detect_ctx_t *apriltag_detect_ctx_create();
+void apriltag_detect_ctx_destroy(apriltag_detect_ctx_t *ctx);
+
+// Same as apriltag_detector_detect, but all per-call state is kept in
+// ctx, so that several threads can detect with the same detector at
+// once (each with its own context). The statistics of the call are
+// left in ctx rather than in td.
+zarray_t *apriltag_detector_detect_ctx(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                                       image_u8_t *im_orig);
+
+// The worker pool that apriltag_detector_detect_ctx(td, ctx, ...) runs
+// on, created (or recreated) from the threading parameters of td if
+// need be; e.g. to decode the next frame with
+// pjpeg_create_u8_from_buffer_parallel. Must not be used while a
+// detection with ctx is running.
+workerpool_t *apriltag_detect_ctx_get_workerpool(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx);
+
+// Run detections with ctx on wp, a pool that the caller owns and may
+// share between contexts (e.g. that of another context, as returned by
+// apriltag_detect_ctx_get_workerpool), instead of on a pool of ctx's
+// own; NULL goes back to the latter. The threading parameters of the
+// detector are then ignored. A pool runs one detection at a time, so
+// the contexts sharing it must not detect concurrently; wp must
+// outlive its use by ctx.
+void apriltag_detect_ctx_set_workerpool(apriltag_detect_ctx_t *ctx, workerpool_t *wp);
+
+// Detect tags in each of n unrelated images (tracking does not carry
+// over from one to the next), storing the detections of images[i] in
+// results[i] as apriltag_detector_detect would. Small images are
+// processed several at a time with one thread each; large ones one
+// after the other with all the detector's threads. Scratch buffers
+// are reused from one image to the next. Like
+// apriltag_detector_detect_ctx, this does not modify td. stats, if
+// not NULL, receives aggregate statistics of the batch.
+void apriltag_detector_detect_batch(const apriltag_detector_t *td, image_u8_t **images, int n,
+                                    zarray_t **results, apriltag_batch_stats_t *stats);
+
+// A short human-readable name of a stage, e.g. "unionfind".
+const char *apriltag_stage_name(enum apriltag_stage stage);
+
+// Timing statistics of one stage of the detections with ctx. This
+// neither allocates nor modifies ctx, but must not run concurrently
+// with a detection using ctx.
+void apriltag_detect_ctx_stage_stats(const apriltag_detect_ctx_t *ctx, enum apriltag_stage stage,
+                                     apriltag_stage_stats_t *stats);
+
+// Timing statistics of all stages, stats[i] being those of stage i.
+void apriltag_detect_ctx_stage_stats_all(const apriltag_detect_ctx_t *ctx,
+                                         apriltag_stage_stats_t stats[APRILTAG_STAGE_COUNT]);
+
+// Forget the timing statistics of the previous frames.
+void apriltag_detect_ctx_stage_reset(apriltag_detect_ctx_t *ctx);
+
+// Print a table of the timing statistics of all stages to f.
+void apriltag_detect_ctx_stage_display(const apriltag_detect_ctx_t *ctx, FILE *f);
+
+// When the library is built with APRILTAG_PERF_COUNTERS defined (CMake
+// option APRILTAGS2_PERF_COUNTERS), each stage of a detection also
+// counts hardware events with perf_event_open (Linux only), per
+// thread: thread 0 is the one detecting, threads 1 and up are the
+// workers. Worker counts include the time they spin waiting for work.
+// Otherwise the counting is compiled out.
+//
+// Fills perf with the counts of one thread, or of all threads if
+// thread < 0, and returns how many threads are counted (0 if the
+// counters are compiled out, none of them could be opened, or no
+// frame was processed yet).
+int apriltag_detect_ctx_stage_perf(const apriltag_detect_ctx_t *ctx, enum apriltag_stage stage,
+                                   int thread, apriltag_stage_perf_t *perf);
+
+// Print a table of the average event counts per frame of each stage
+// to f, or a single line saying why there is none.
+void apriltag_detect_ctx_perf_display(const apriltag_detect_ctx_t *ctx, FILE *f);
+
+// The same, for the frames processed by apriltag_detector_detect.
+static inline void apriltag_detector_stage_stats(const apriltag_detector_t *td, enum apriltag_stage stage,
+                                                 apriltag_stage_stats_t *stats)
+{
+    apriltag_detect_ctx_stage_stats(td->ctx, stage, stats);
+}
+
+static inline void apriltag_detector_stage_stats_all(const apriltag_detector_t *td,
+                                                     apriltag_stage_stats_t stats[APRILTAG_STAGE_COUNT])
+{
+    apriltag_detect_ctx_stage_stats_all(td->ctx, stats);
+}
+
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detection_destroy(apriltag_detection_t *det);
 
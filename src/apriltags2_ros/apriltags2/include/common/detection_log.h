@@ -0,0 +1,173 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _DETECTION_LOG_H
+#define _DETECTION_LOG_H
+
+#include <stdint.h>
+
+#include "apriltag.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A compact log of detections for long runs: two files of fixed-size
+// records, appended to as frames are processed, that analysis tools
+// can map into memory and index directly.
+//
+// - path holds one struct detection_log_record per detection, in the
+//   order they were added.
+// - path.idx holds one struct detection_log_frame per frame: its
+//   timestamp, stage timings and the range of its detections in path.
+//
+// Each file starts with a struct detection_log_header; the records
+// follow, so record i of a file is at
+// DETECTION_LOG_HEADER_SIZE + i*header.record_size. The number of
+// records comes from the size of the file (a partial record at the
+// end, e.g. after a crash, is ignored). All values are in the byte
+// order of the machine that wrote the log.
+
+#define DETECTION_LOG_VERSION 1
+#define DETECTION_LOG_HEADER_SIZE 1024
+#define DETECTION_LOG_MAX_STAGES 24
+#define DETECTION_LOG_STAGE_NAME_LEN 32
+
+#define DETECTION_LOG_MAGIC "ATDETLOG"
+#define DETECTION_LOG_INDEX_MAGIC "ATDETIDX"
+
+struct detection_log_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+
+    // the stages whose durations each frame record holds.
+    uint32_t nstages;
+    uint32_t reserved;
+    char stages[DETECTION_LOG_MAX_STAGES][DETECTION_LOG_STAGE_NAME_LEN];
+};
+
+// DETECTION_LOG_POSE_VALID: pose_t and pose_q hold the pose of the tag
+// in the camera frame.
+#define DETECTION_LOG_POSE_VALID 1
+
+struct detection_log_record
+{
+    // index of the frame in path.idx.
+    uint64_t frame;
+
+    int32_t id;
+    int32_t hamming;
+    char family[16];
+    float decision_margin;
+    uint32_t flags;
+
+    double c[2];
+    double p[4][2];
+    double H[9]; // row-major
+
+    double pose_t[3];
+    double pose_q[4]; // x, y, z, w
+};
+
+struct detection_log_frame
+{
+    // the caller's timestamp of the frame, e.g. of its capture.
+    int64_t timestamp_ns;
+
+    // its detections are records first to first+ndetections-1.
+    uint64_t first;
+    uint32_t ndetections;
+
+    // the caller's id of the camera (or other stream of images) the
+    // frame came from, when frames of several are logged together.
+    uint32_t stream;
+
+    int64_t stage_ns[DETECTION_LOG_MAX_STAGES];
+};
+
+////////////////////////////////////////////////////////////
+// Writing
+
+typedef struct detection_log detection_log_t;
+
+// Creates (or truncates) path and path.idx. stage_names names the
+// nstages durations given with each frame. Returns NULL if either
+// file can't be created or nstages > DETECTION_LOG_MAX_STAGES.
+detection_log_t *detection_log_create(const char *path, int nstages, const char * const *stage_names);
+
+// Add a detection of the current frame. pose is the translation and
+// quaternion (x, y, z, w) of the tag in the camera frame, or NULL if
+// there is none.
+int detection_log_add_detection(detection_log_t *log, const apriltag_detection_t *det,
+                                const double pose_t[3], const double pose_q[4]);
+
+// End the current frame, of stream: the detections added since the
+// last frame belong to it. stage_ns holds the nstages durations.
+int detection_log_add_frame(detection_log_t *log, uint32_t stream, int64_t timestamp_ns,
+                            const int64_t *stage_ns);
+
+// Records are buffered; these write them out. Return 0 on success,
+// -1 on a write error.
+int detection_log_flush(detection_log_t *log);
+int detection_log_destroy(detection_log_t *log);
+
+////////////////////////////////////////////////////////////
+// Reading
+
+typedef struct detection_log_reader detection_log_reader_t;
+
+// Maps path and path.idx. Returns NULL if they can't be mapped or are
+// not detection logs of this version.
+detection_log_reader_t *detection_log_open(const char *path);
+void detection_log_close(detection_log_reader_t *r);
+
+int detection_log_nstages(const detection_log_reader_t *r);
+const char *detection_log_stage_name(const detection_log_reader_t *r, int stage);
+
+uint64_t detection_log_nframes(const detection_log_reader_t *r);
+uint64_t detection_log_ndetections(const detection_log_reader_t *r);
+
+const struct detection_log_frame *detection_log_get_frame(const detection_log_reader_t *r, uint64_t i);
+const struct detection_log_record *detection_log_get_detection(const detection_log_reader_t *r, uint64_t i);
+
+// The detections of frame i, *n of them (fewer than recorded if the
+// log was cut short).
+const struct detection_log_record *detection_log_get_frame_detections(const detection_log_reader_t *r,
+                                                                      uint64_t i, uint32_t *n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
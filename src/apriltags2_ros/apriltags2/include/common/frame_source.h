@@ -0,0 +1,110 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _FRAME_SOURCE_H
+#define _FRAME_SOURCE_H
+
+#include <stdint.h>
+
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Replays recorded video for offline processing at full speed: a
+// background thread reads (and if need be decodes) frames into a ring
+// of nbuffers reusable buffers, ahead of the caller, who takes them
+// with frame_source_next and gives them back with
+// frame_source_release. Sources:
+//
+// - raw Y8 (GRAY8) streams: width*height bytes per frame, back to
+//   back, with no header, e.g. as written by
+//   "ffmpeg -pix_fmt gray -f rawvideo".
+// - MJPEG streams: JPEG files concatenated, e.g. as written by
+//   "ffmpeg -c:v copy -f mjpeg". Only the luma is decoded.
+// - a directory of PGM files (or a single one), mapped with
+//   image_u8_prefetch.
+
+typedef struct frame_source frame_source_t;
+
+typedef struct frame_source_frame frame_source_frame_t;
+struct frame_source_frame
+{
+    // valid until the frame is released. May be written to.
+    image_u8_t *im;
+
+    // position of the frame in the stream, from 0.
+    int64_t index;
+
+    // ntime_now() when the frame had been read and decoded.
+    int64_t ready_ns;
+
+    // internal: the ring buffer slot.
+    int slot;
+};
+
+typedef struct frame_source_stats frame_source_stats_t;
+struct frame_source_stats
+{
+    int64_t nframes;   // frames read and decoded
+    int64_t nerrors;   // frames skipped because they could not be decoded
+    uint64_t nbytes;   // bytes of input read
+
+    // time the background thread spent reading and decoding, and
+    // time the caller spent in frame_source_next waiting for it.
+    int64_t read_ns;
+    int64_t wait_ns;
+};
+
+// Return NULL if the file can't be opened. loop > 1 replays the
+// stream that many times (frame indices keep counting).
+frame_source_t *frame_source_create_y8(const char *path, int width, int height, int nbuffers, int loop);
+frame_source_t *frame_source_create_mjpeg(const char *path, int nbuffers, int loop);
+frame_source_t *frame_source_create_pgm(const char *path, int nbuffers, int loop);
+
+// The next frame, in stream order. Returns 0 at the end of the
+// stream, 1 otherwise. The caller may hold at most nbuffers frames
+// at once; frames may be released in any order.
+int frame_source_next(frame_source_t *fs, frame_source_frame_t *frame);
+void frame_source_release(frame_source_t *fs, frame_source_frame_t *frame);
+
+void frame_source_get_stats(frame_source_t *fs, frame_source_stats_t *stats);
+
+// Stops the background thread. All frames must have been released.
+void frame_source_destroy(frame_source_t *fs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
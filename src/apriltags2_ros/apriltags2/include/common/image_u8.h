@@ -66,6 +66,10 @@ image_u8_t *image_u8_create_from_pnm(const char *path);
     image_u8_t *image_u8_create_from_pnm_alignment(const char *path, int alignment);
 
 image_u8_t *image_u8_copy(const image_u8_t *in);
+
+// Copy the rectangle with upper-left corner (x0, y0) into a new
+// image. The rectangle must lie within the input image.
+image_u8_t *image_u8_copy_region(const image_u8_t *in, int x0, int y0, int width, int height);
 void image_u8_draw_line(image_u8_t *im, float x0, float y0, float x1, float y1, int v, int width);
 void image_u8_draw_circle(image_u8_t *im, float x0, float y0, float r, int v);
 void image_u8_draw_annulus(image_u8_t *im, float x0, float y0, float r0, float r1, int v);
@@ -77,9 +81,42 @@ void image_u8_darken(image_u8_t *im);
 void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz);
 void image_u8_gaussian_blur(image_u8_t *im, double sigma, int k);
 
+// Unsharp mask: im = 2*im - blur(im), clamped to [0, 255], where blur
+// is image_u8_gaussian_blur. Done in a single pass over im.
+void image_u8_gaussian_sharpen(image_u8_t *im, double sigma, int k);
+
+// same as image_u8_gaussian_blur/sharpen, but never use the SIMD
+// kernels. For testing and benchmarking them.
+void image_u8_gaussian_blur_scalar(image_u8_t *im, double sigma, int k);
+void image_u8_gaussian_sharpen_scalar(image_u8_t *im, double sigma, int k);
+
+// Incremental image_u8_convolve_2D / gaussian_blur / gaussian_sharpen,
+// for filtering an image while it is being produced top to bottom.
+// Each call to image_u8_filter_rows tells the filter that rows
+// [0, nrows) of im hold their input values; it filters as much as it
+// can in place and returns the number of leading rows of im that are
+// now final. Once nrows == im->height, all rows are final.
+// image_u8_gaussian_filter_create returns NULL when sigma is 0 (no
+// filtering to do).
+typedef struct image_u8_filter image_u8_filter_t;
+image_u8_filter_t *image_u8_filter_create(image_u8_t *im, const uint8_t *k, int ksz, int sharpen);
+image_u8_filter_t *image_u8_gaussian_filter_create(image_u8_t *im, double sigma, int k, int sharpen);
+int image_u8_filter_rows(image_u8_filter_t *f, int nrows);
+void image_u8_filter_destroy(image_u8_filter_t *f);
+
 // 1.5, 2, 3, 4, ... supported
 image_u8_t *image_u8_decimate(image_u8_t *im, float factor);
 
+// Row-at-a-time image_u8_decimate: image_u8_decimate_create returns
+// an image of the decimated size, and image_u8_decimate_rows computes
+// its rows [y0, y1). For a factor of 1.5, y0 and y1 must be even.
+image_u8_t *image_u8_decimate_create(const image_u8_t *im, float factor);
+void image_u8_decimate_rows(image_u8_t *decim, const image_u8_t *im, float factor, int y0, int y1);
+
+// same as image_u8_decimate, but never uses the SIMD (NEON, SSE2,
+// AVX2) kernels. For testing and benchmarking them.
+image_u8_t *image_u8_decimate_scalar(image_u8_t *im, float factor);
+
 void image_u8_destroy(image_u8_t *im);
 
 // Write a pnm. Returns 0 on success
@@ -0,0 +1,77 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _IMAGE_U8_MMAP_H
+#define _IMAGE_U8_MMAP_H
+
+#include "image_u8.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Map a binary PGM file (P5, maxval 255) into memory and return an
+// image whose buf points at its pixels, so that nothing is read until
+// it is used and nothing is copied. The stride is the width. Pixels
+// may be written; the writes are private to the process and never
+// reach the file. Returns NULL if the file cannot be mapped or is not
+// such a PGM (image_u8_create_from_pnm reads other kinds). Release
+// the image with image_u8_unmap, never image_u8_destroy.
+image_u8_t *image_u8_map_pnm(const char *path);
+void image_u8_unmap(image_u8_t *im);
+
+// Maps the PGM files of a directory (or a single file) one after the
+// other, in name order, with a background thread that keeps up to
+// depth files ahead of the caller mapped and read into memory.
+// Files that image_u8_map_pnm cannot map are skipped, with a message
+// on stderr.
+typedef struct image_u8_prefetch image_u8_prefetch_t;
+image_u8_prefetch_t *image_u8_prefetch_create(const char *path, int depth);
+
+// The next image, or NULL once all files have been returned. If path
+// is not NULL, it receives the path of the image's file, valid until
+// image_u8_prefetch_destroy. Release the image with image_u8_unmap.
+image_u8_t *image_u8_prefetch_next(image_u8_prefetch_t *pf, const char **path);
+
+// how many files there are in all (including any that will be
+// skipped).
+int image_u8_prefetch_count(const image_u8_prefetch_t *pf);
+
+// Stops the background thread and unmaps the images it mapped that
+// were not returned yet.
+void image_u8_prefetch_destroy(image_u8_prefetch_t *pf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _LATENCY_HIST_H
+#define _LATENCY_HIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A rolling histogram of durations (or any non-negative integer
+// samples), from which percentiles can be read. Buckets are
+// logarithmic, with 8 per power of two, so that a percentile is
+// within about 6% of the true value; values below 16 are exact and
+// values beyond 2^42 fall into the last bucket.
+//
+// Only the recent samples are kept: the histogram holds the current
+// window of up to LATENCY_HIST_WINDOW samples and the complete window
+// before it. A latency_hist_t is a plain struct that needs no
+// allocation; zero it (or call latency_hist_clear) before use.
+
+#define LATENCY_HIST_SUBBITS 3
+#define LATENCY_HIST_NBUCKETS (16 + 38 * (1 << LATENCY_HIST_SUBBITS))
+
+// XXX tunable
+#define LATENCY_HIST_WINDOW 512
+
+typedef struct latency_hist latency_hist_t;
+struct latency_hist
+{
+    uint32_t counts[2][LATENCY_HIST_NBUCKETS];
+    uint32_t n[2];
+    int64_t max[2];
+
+    // the window that receives new samples (0 or 1).
+    int cur;
+
+    // the most recent sample.
+    int64_t last;
+};
+
+void latency_hist_clear(latency_hist_t *h);
+void latency_hist_add(latency_hist_t *h, int64_t v);
+
+// How many samples the histogram holds (at most 2*LATENCY_HIST_WINDOW).
+uint32_t latency_hist_count(const latency_hist_t *h);
+
+// The smallest sample no smaller than a fraction p (0 to 1) of the
+// samples, to the resolution of the buckets, or 0 if there are no
+// samples.
+int64_t latency_hist_percentile(const latency_hist_t *h, double p);
+
+// The largest sample held.
+int64_t latency_hist_max(const latency_hist_t *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hardware performance counters of one thread, read with Linux
+// perf_event_open(2). Counting requires a kernel.perf_event_paranoid
+// setting that allows it (or CAP_PERFMON); counters that cannot be
+// opened (e.g. in virtual machines without a PMU) read as zero.
+// Elsewhere than on Linux, perf_counters_open always fails.
+
+enum perf_counter
+{
+    PERF_COUNTER_CYCLES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_COUNTER_CACHE_MISSES,
+    PERF_COUNTER_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+};
+
+typedef struct perf_counters perf_counters_t;
+struct perf_counters
+{
+    // one file descriptor per counter, -1 if not available.
+    int fd[PERF_COUNTER_COUNT];
+};
+
+// Start counting the events of thread tid (a Linux thread id, or 0 for
+// the calling thread), in user space only. Returns 0 on success, -1
+// if no counter at all could be opened.
+int perf_counters_open(perf_counters_t *pc, int tid);
+void perf_counters_close(perf_counters_t *pc);
+
+// The counts since perf_counters_open. Unavailable counters read as 0.
+void perf_counters_read(const perf_counters_t *pc, uint64_t v[PERF_COUNTER_COUNT]);
+
+// A short name of counter c, e.g. "cycles".
+const char *perf_counter_name(enum perf_counter c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
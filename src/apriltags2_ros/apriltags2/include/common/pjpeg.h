@@ -24,6 +24,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 
 #include "image_u8.h"
 #include "image_u8x3.h"
+#include "workerpool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -61,8 +62,10 @@ struct pjpeg
     // status of the decode is put here. Non-zero means error.
     int error;
 
-    uint32_t width, height; // pixel dimensions
+    uint32_t width, height; // pixel dimensions (after any PJPEG_SCALE_*)
 
+    // With PJPEG_LUMA_ONLY, only components[0] has data; the
+    // others have data == NULL.
     int ncomponents;
     pjpeg_component_t *components;
 };
@@ -70,6 +73,12 @@ struct pjpeg
 enum PJPEG_FLAGS {
     PJPEG_STRICT = 1,  // Don't try to recover from errors.
     PJPEG_MJPEG = 2,   // Support JPGs with missing DHT segments.
+    PJPEG_LUMA_ONLY = 4, // Only decode the first (Y) component.
+
+    // Decode at 1/8 of the resolution (rounded up): each pixel is the
+    // DC term of its 8x8 block, which needs no IDCT at all and is
+    // within one gray level of the block's mean in a full decode.
+    PJPEG_SCALE_8 = 32,
 };
 
 enum PJPEG_ERROR {
@@ -93,6 +102,21 @@ void pjpeg_destroy(pjpeg_t *pj);
 image_u8_t *pjpeg_to_u8_baseline(pjpeg_t *pj);
 image_u8x3_t *pjpeg_to_u8x3_baseline(pjpeg_t *pj);
 
+// Decode only the luma of a JPEG (PJPEG_LUMA_ONLY is implied) straight
+// into an image, without copying it out of a pjpeg_t. Returns NULL on
+// error.
+image_u8_t *pjpeg_create_u8_from_buffer(uint8_t *buf, int buflen, uint32_t flags, int *error);
+image_u8_t *pjpeg_create_u8_from_file(const char *path, uint32_t flags, int *error);
+
+// Same as the _from_buffer functions, but the restart intervals of
+// JPEGs that have them (a DRI marker and RST markers in the scan) are
+// decoded in parallel on wp. Others, or if wp is NULL or has a single
+// thread, are decoded serially. The result is the same either way.
+pjpeg_t *pjpeg_create_from_buffer_parallel(uint8_t *buf, int buflen, uint32_t flags,
+                                           workerpool_t *wp, int *error);
+image_u8_t *pjpeg_create_u8_from_buffer_parallel(uint8_t *buf, int buflen, uint32_t flags,
+                                                 workerpool_t *wp, int *error);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,9 @@ struct unionfind
 {
     uint32_t maxid;
     struct ufrec *data;
+
+    // number of records allocated in data (at least maxid + 1).
+    uint32_t capacity;
 };
 
 struct ufrec
@@ -59,6 +62,7 @@ static inline unionfind_t *unionfind_create(uint32_t maxid)
 {
     unionfind_t *uf = (unionfind_t*) calloc(1, sizeof(unionfind_t));
     uf->maxid = maxid;
+    uf->capacity = maxid + 1;
     uf->data = (struct ufrec*) malloc((maxid+1) * sizeof(struct ufrec));
     for (int i = 0; i <= maxid; i++) {
         uf->data[i].size = 1;
@@ -73,6 +77,25 @@ static inline void unionfind_destroy(unionfind_t *uf)
     free(uf);
 }
 
+// Same as destroying uf (which may be NULL) and calling
+// unionfind_create(maxid), but reuses the storage of uf when it is
+// large enough.
+static inline unionfind_t *unionfind_recreate(unionfind_t *uf, uint32_t maxid)
+{
+    if (uf == NULL || uf->capacity < maxid + 1) {
+        if (uf != NULL)
+            unionfind_destroy(uf);
+        return unionfind_create(maxid);
+    }
+
+    uf->maxid = maxid;
+    for (int i = 0; i <= maxid; i++) {
+        uf->data[i].size = 1;
+        uf->data[i].parent = i;
+    }
+    return uf;
+}
+
 /*
 static inline uint32_t unionfind_get_representative(unionfind_t *uf, uint32_t id)
 {
@@ -33,25 +33,68 @@ either expressed or implied, of the Regents of The University of Michigan.
 #ifndef _WORKERPOOL_H
 #define _WORKERPOOL_H
 
+#include <stdint.h>
+
 #include "zarray.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct workerpool workerpool_t;
 
-// as a special case, if nthreads==1, no additional threads are
-// created, and workerpool_run will run synchronously.
+// nthreads-1 additional threads are created; the thread calling
+// workerpool_run does its share of the work. As a special case, if
+// nthreads==1, workerpool_run will run synchronously.
 workerpool_t *workerpool_create(int nthreads);
+
+// same as workerpool_create, but the threads are pinned to CPUs:
+// thread i runs on cpus[i % ncpus]. Thread 0 is whichever thread calls
+// workerpool_run (or workerpool_parallel_for): it is pinned to cpus[0]
+// while it runs tasks, and gets its own affinity mask back before the
+// call returns. If ncpus is 0, no thread is pinned.
+workerpool_t *workerpool_create_pinned(int nthreads, const int *cpus, int ncpus);
+
+// same as workerpool_create_pinned, but every thread may run on any of
+// cpus rather than on one of them.
+workerpool_t *workerpool_create_restricted(int nthreads, const int *cpus, int ncpus);
 void workerpool_destroy(workerpool_t *wp);
 
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p);
 
-// runs all added tasks, waits for them to complete.
+// runs all added tasks, waits for them to complete. Tasks may run in
+// any order. Must not be called from within a task.
 void workerpool_run(workerpool_t *wp);
 
+// calls f(ctx, i0, i1) on disjoint ranges [i0, i1) covering [0, n),
+// in parallel, and waits for them to complete. Threads claim ranges
+// as they become idle; ranges get smaller (but no smaller than grain)
+// as the remaining work decreases. Must not be called while tasks
+// added with workerpool_add_task are pending.
+void workerpool_parallel_for(workerpool_t *wp, int n, int grain,
+                             void (*f)(void *ctx, int i0, int i1), void *ctx);
+
 // same as workerpool_run, except always single threaded. (mostly for debugging).
 void workerpool_run_single(workerpool_t *wp);
 
 int workerpool_get_nthreads(workerpool_t *wp);
 
+// the Linux thread id of thread i (1 <= i < nthreads), waiting for
+// the thread to start if need be. Returns 0 for thread 0 (whichever
+// thread calls workerpool_run), and -1 elsewhere than on Linux.
+int workerpool_get_thread_id(workerpool_t *wp, int i);
+
+// number of online processors.
 int workerpool_get_nprocs();
 
+// writes to cpus (at most maxcpus of) the indices of the CPUs this
+// process may run on according to its scheduling affinity mask, in
+// increasing order, skipping CPU i if bit i of exclude is set. Returns
+// how many were written.
+int workerpool_get_affinity_cpus(uint64_t exclude, int *cpus, int maxcpus);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
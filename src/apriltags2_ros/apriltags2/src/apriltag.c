@@ -47,10 +47,18 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/matd.h"
 #include "common/homography.h"
 #include "common/timeprofile.h"
+#include "common/time_util.h"
+#include "common/unionfind.h"
 #include "common/math_util.h"
 #include "common/g2d.h"
 #include "common/floats.h"
 
+#ifdef APRILTAG_PERF_COUNTERS
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "common/perf_counters.h"
+#endif
+
 #include "apriltag_math.h"
 
 #include "common/postscript_utils.h"
@@ -60,7 +68,9 @@ either expressed or implied, of the Regents of The University of Michigan.
 #endif
 
 extern zarray_t *apriltag_quad_gradient(apriltag_detector_t *td, image_u8_t *im);
-extern zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im);
+extern zarray_t *apriltag_quad_thresh_fused(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                                            image_u8_t *im_orig, image_u8_t *quad_im,
+                                            image_u8_filter_t *filter);
 
 // Regresses a model of the form:
 // intensity(x,y) = C0*x + C1*y + CC2
@@ -345,6 +355,27 @@ void apriltag_detector_clear_families(apriltag_detector_t *td)
     zarray_clear(td->tag_families);
 }
 
+// A tag detected in the previous frame, from which the region of
+// interest for the current frame is predicted.
+struct apriltag_track
+{
+    apriltag_family_t *family;
+    int id;
+
+    // center and axis-aligned bounding box in the previous frame.
+    double c[2];
+    double xmin, ymin, xmax, ymax;
+
+    // center motion between the two previous frames (pixels/frame).
+    double v[2];
+};
+
+// An axis-aligned region of the image: [x0, x1) x [y0, y1).
+struct apriltag_roi
+{
+    int x0, y0, x1, y1;
+};
+
 apriltag_detector_t *apriltag_detector_create()
 {
     apriltag_detector_t *td = (apriltag_detector_t*) calloc(1, sizeof(apriltag_detector_t));
@@ -363,9 +394,8 @@ apriltag_detector_t *apriltag_detector_create()
 
     td->tag_families = zarray_create(sizeof(apriltag_family_t*));
 
-    pthread_mutex_init(&td->mutex, NULL);
-
-    td->tp = timeprofile_create();
+    td->ctx = apriltag_detect_ctx_create();
+    td->tp = td->ctx->tp;
 
     td->refine_edges = 1;
     td->refine_pose = 0;
@@ -373,16 +403,20 @@ apriltag_detector_t *apriltag_detector_create()
 
     td->debug = 0;
 
-    // NB: defer initialization of td->wp so that the user can
-    // override td->nthreads.
+    td->track_roi = 0;
+    td->track_full_scan_interval = 10;
+    td->track_roi_padding = 0.25;
+
+    td->coarse_to_fine = 0;
+    td->fine_min_contrast = 60;
+    td->fine_max_fraction = 0.25;
 
     return td;
 }
 
 void apriltag_detector_destroy(apriltag_detector_t *td)
 {
-    timeprofile_destroy(td->tp);
-    workerpool_destroy(td->wp);
+    apriltag_detect_ctx_destroy(td->ctx);
 
     apriltag_detector_clear_families(td);
 
@@ -390,11 +424,355 @@ void apriltag_detector_destroy(apriltag_detector_t *td)
     free(td);
 }
 
+apriltag_detect_ctx_t *apriltag_detect_ctx_create()
+{
+    apriltag_detect_ctx_t *ctx = (apriltag_detect_ctx_t*) calloc(1, sizeof(apriltag_detect_ctx_t));
+
+    ctx->tp = timeprofile_create();
+
+    pthread_mutex_init(&ctx->mutex, NULL);
+
+    ctx->tracks = zarray_create(sizeof(struct apriltag_track));
+
+    // NB: defer initialization of ctx->wp so that the user can
+    // override td->nthreads.
+
+    return ctx;
+}
+
+static const char *stage_names[APRILTAG_STAGE_COUNT] = {
+    [APRILTAG_STAGE_INIT] = "init",
+    [APRILTAG_STAGE_PREDICT_ROIS] = "predict rois",
+    [APRILTAG_STAGE_FRONT_END] = "decimate/filter/threshold",
+    [APRILTAG_STAGE_UNIONFIND] = "unionfind",
+    [APRILTAG_STAGE_CLUSTERS] = "make clusters",
+    [APRILTAG_STAGE_FIT_QUADS] = "fit quads to clusters",
+    [APRILTAG_STAGE_ROI_QUADS] = "roi quads",
+    [APRILTAG_STAGE_QUADS] = "quads",
+    [APRILTAG_STAGE_DECODE] = "decode+refinement",
+    [APRILTAG_STAGE_RECONCILE] = "reconcile",
+    [APRILTAG_STAGE_DEBUG] = "debug output",
+    [APRILTAG_STAGE_CLEANUP] = "cleanup",
+    [APRILTAG_STAGE_TOTAL] = "total",
+};
+
+const char *apriltag_stage_name(enum apriltag_stage stage)
+{
+    if (stage < 0 || stage >= APRILTAG_STAGE_COUNT)
+        return "unknown";
+    return stage_names[stage];
+}
+
+#ifdef APRILTAG_PERF_COUNTERS
+
+// Hardware event counts of the threads of a detection context, per
+// stage. Thread 0 is the one detecting, the others are the workers
+// of ctx->wp.
+struct apriltag_perf
+{
+    // the thread whose events thread 0 counts.
+    int tid;
+
+    int nthreads;
+    perf_counters_t *pc;
+
+    // whether at least one counter of one thread could be opened.
+    int available;
+
+    // counts at the end of the last stage, for each thread.
+    uint64_t (*last)[PERF_COUNTER_COUNT];
+
+    // counts of each thread in each stage, summed over frames.
+    uint64_t (*counts)[APRILTAG_STAGE_COUNT][PERF_COUNTER_COUNT];
+    uint32_t nframes[APRILTAG_STAGE_COUNT];
+};
+
+static void perf_destroy(struct apriltag_perf *perf)
+{
+    if (perf == NULL)
+        return;
+
+    for (int t = 0; t < perf->nthreads; t++)
+        perf_counters_close(&perf->pc[t]);
+
+    free(perf->pc);
+    free(perf->last);
+    free(perf->counts);
+    free(perf);
+}
+
+// Open the counters of ctx->perf if need be: on first use, after the
+// worker pool was recreated, or when another thread detects with ctx.
+static void perf_update(apriltag_detect_ctx_t *ctx)
+{
+    struct apriltag_perf *perf = ctx->perf;
+    int tid = (int) syscall(SYS_gettid);
+
+    if (perf != NULL && perf->tid == tid)
+        return;
+
+    if (perf == NULL) {
+        perf = calloc(1, sizeof(struct apriltag_perf));
+        perf->nthreads = workerpool_get_nthreads(ctx->wp);
+        perf->pc = calloc(perf->nthreads, sizeof(perf_counters_t));
+        perf->last = calloc(perf->nthreads, sizeof(*perf->last));
+        perf->counts = calloc(perf->nthreads, sizeof(*perf->counts));
+
+        for (int t = 1; t < perf->nthreads; t++)
+            perf_counters_open(&perf->pc[t], workerpool_get_thread_id(ctx->wp, t));
+
+        ctx->perf = perf;
+    } else {
+        perf_counters_close(&perf->pc[0]);
+    }
+
+    perf_counters_open(&perf->pc[0], 0);
+    perf->tid = tid;
+
+    perf->available = 0;
+    for (int t = 0; t < perf->nthreads; t++) {
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+            perf->available |= perf->pc[t].fd[i] >= 0;
+    }
+}
+
+static void perf_begin(apriltag_detect_ctx_t *ctx)
+{
+    perf_update(ctx);
+
+    struct apriltag_perf *perf = ctx->perf;
+    for (int t = 0; t < perf->nthreads; t++)
+        perf_counters_read(&perf->pc[t], perf->last[t]);
+}
+
+static void perf_stamp(apriltag_detect_ctx_t *ctx, enum apriltag_stage stage)
+{
+    struct apriltag_perf *perf = ctx->perf;
+
+    for (int t = 0; t < perf->nthreads; t++) {
+        uint64_t v[PERF_COUNTER_COUNT];
+        perf_counters_read(&perf->pc[t], v);
+
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+            perf->counts[t][stage][i] += v[i] - perf->last[t][i];
+            perf->counts[t][APRILTAG_STAGE_TOTAL][i] += v[i] - perf->last[t][i];
+            perf->last[t][i] = v[i];
+        }
+    }
+}
+
+static void perf_end(apriltag_detect_ctx_t *ctx)
+{
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++) {
+        if (ctx->stage_mask & (1u << i))
+            ctx->perf->nframes[i]++;
+    }
+}
+
+#endif
+
+static void stage_begin(apriltag_detect_ctx_t *ctx)
+{
+    memset(ctx->stage_ns, 0, sizeof(ctx->stage_ns));
+    ctx->stage_mask = 0;
+
+#ifdef APRILTAG_PERF_COUNTERS
+    perf_begin(ctx);
+#endif
+
+    ctx->stage_t0 = ntime_now();
+    ctx->stage_t = ctx->stage_t0;
+}
+
+// Ends the current stage of the detection with ctx: the time since
+// the end of the previous stage is counted for it. Also stamps the
+// time profile, under the name of the stage.
+void apriltag_stage_stamp(apriltag_detect_ctx_t *ctx, enum apriltag_stage stage)
+{
+    int64_t now = ntime_now();
+
+    ctx->stage_ns[stage] += now - ctx->stage_t;
+    ctx->stage_mask |= 1u << stage;
+    ctx->stage_t = now;
+
+#ifdef APRILTAG_PERF_COUNTERS
+    perf_stamp(ctx, stage);
+#endif
+
+    timeprofile_stamp(ctx->tp, stage_names[stage]);
+}
+
+static void stage_end(apriltag_detect_ctx_t *ctx)
+{
+    ctx->stage_ns[APRILTAG_STAGE_TOTAL] = ctx->stage_t - ctx->stage_t0;
+    ctx->stage_mask |= 1u << APRILTAG_STAGE_TOTAL;
+
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++) {
+        if (ctx->stage_mask & (1u << i))
+            latency_hist_add(&ctx->stage_hist[i], ctx->stage_ns[i]);
+    }
+
+#ifdef APRILTAG_PERF_COUNTERS
+    perf_end(ctx);
+#endif
+}
+
+void apriltag_detect_ctx_stage_stats(const apriltag_detect_ctx_t *ctx, enum apriltag_stage stage,
+                                     apriltag_stage_stats_t *stats)
+{
+    const latency_hist_t *h = &ctx->stage_hist[stage];
+
+    stats->stage = stage;
+    stats->name = stage_names[stage];
+    stats->last_ns = ctx->stage_ns[stage];
+    stats->nframes = latency_hist_count(h);
+    stats->p50_ns = latency_hist_percentile(h, 0.50);
+    stats->p90_ns = latency_hist_percentile(h, 0.90);
+    stats->p99_ns = latency_hist_percentile(h, 0.99);
+    stats->max_ns = latency_hist_max(h);
+}
+
+void apriltag_detect_ctx_stage_stats_all(const apriltag_detect_ctx_t *ctx,
+                                         apriltag_stage_stats_t stats[APRILTAG_STAGE_COUNT])
+{
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++)
+        apriltag_detect_ctx_stage_stats(ctx, i, &stats[i]);
+}
+
+void apriltag_detect_ctx_stage_reset(apriltag_detect_ctx_t *ctx)
+{
+    memset(ctx->stage_ns, 0, sizeof(ctx->stage_ns));
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++)
+        latency_hist_clear(&ctx->stage_hist[i]);
+
+#ifdef APRILTAG_PERF_COUNTERS
+    struct apriltag_perf *perf = ctx->perf;
+    if (perf != NULL) {
+        memset(perf->counts, 0, perf->nthreads * sizeof(*perf->counts));
+        memset(perf->nframes, 0, sizeof(perf->nframes));
+    }
+#endif
+}
+
+void apriltag_detect_ctx_stage_display(const apriltag_detect_ctx_t *ctx, FILE *f)
+{
+    fprintf(f, "%32s %6s %10s %10s %10s %10s %10s\n", "stage (ms)", "frames",
+            "last", "p50", "p90", "p99", "max");
+
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++) {
+        apriltag_stage_stats_t st;
+        apriltag_detect_ctx_stage_stats(ctx, i, &st);
+        if (st.nframes == 0)
+            continue;
+
+        fprintf(f, "%32s %6u %10.3f %10.3f %10.3f %10.3f %10.3f\n", st.name, st.nframes,
+                st.last_ns / 1.0e6, st.p50_ns / 1.0e6, st.p90_ns / 1.0e6,
+                st.p99_ns / 1.0e6, st.max_ns / 1.0e6);
+    }
+
+    if (ctx->fine_fraction > 0)
+        fprintf(f, "%32s %.1f%% of the last frame\n", "fine search", 100.0 * ctx->fine_fraction);
+}
+
+int apriltag_detect_ctx_stage_perf(const apriltag_detect_ctx_t *ctx, enum apriltag_stage stage,
+                                   int thread, apriltag_stage_perf_t *perf)
+{
+    memset(perf, 0, sizeof(apriltag_stage_perf_t));
+
+#ifdef APRILTAG_PERF_COUNTERS
+    const struct apriltag_perf *p = ctx->perf;
+    if (p == NULL || !p->available)
+        return 0;
+
+    uint64_t v[PERF_COUNTER_COUNT] = { 0 };
+    for (int t = 0; t < p->nthreads; t++) {
+        if (thread >= 0 && t != thread)
+            continue;
+        for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+            v[i] += p->counts[t][stage][i];
+    }
+
+    perf->nframes = p->nframes[stage];
+    perf->cycles = v[PERF_COUNTER_CYCLES];
+    perf->instructions = v[PERF_COUNTER_INSTRUCTIONS];
+    perf->cache_misses = v[PERF_COUNTER_CACHE_MISSES];
+    perf->branch_misses = v[PERF_COUNTER_BRANCH_MISSES];
+
+    return p->nthreads;
+#else
+    return 0;
+#endif
+}
+
+void apriltag_detect_ctx_perf_display(const apriltag_detect_ctx_t *ctx, FILE *f)
+{
+    apriltag_stage_perf_t perf;
+    int nthreads = apriltag_detect_ctx_stage_perf(ctx, APRILTAG_STAGE_TOTAL, -1, &perf);
+
+    if (nthreads == 0) {
+#ifdef APRILTAG_PERF_COUNTERS
+        // perf_event_open failed for every counter, e.g. because of
+        // kernel.perf_event_paranoid or in a container.
+        if (ctx->perf != NULL && !ctx->perf->available) {
+            fprintf(f, "perf counters unavailable\n");
+            return;
+        }
+#endif
+        fprintf(f, "no performance counters\n");
+        return;
+    }
+
+    fprintf(f, "%32s %6s %6s %12s %12s %6s %12s %12s\n", "stage (per frame)", "frames", "thread",
+            "cycles", "instructions", "IPC", "cache-miss", "branch-miss");
+
+    for (int i = 0; i < APRILTAG_STAGE_COUNT; i++) {
+        // all threads, then each one if there are several.
+        for (int t = -1; t < (nthreads > 1 ? nthreads : 0); t++) {
+            apriltag_detect_ctx_stage_perf(ctx, i, t, &perf);
+            if (perf.nframes == 0)
+                break;
+
+            double n = perf.nframes;
+            char thread[16];
+            if (t < 0)
+                snprintf(thread, sizeof(thread), "all");
+            else
+                snprintf(thread, sizeof(thread), "%d", t);
+
+            fprintf(f, "%32s %6u %6s %12.0f %12.0f %6.2f %12.0f %12.0f\n",
+                    t < 0 ? stage_names[i] : "", perf.nframes, thread,
+                    perf.cycles / n, perf.instructions / n,
+                    perf.cycles > 0 ? (double) perf.instructions / perf.cycles : 0.0,
+                    perf.cache_misses / n, perf.branch_misses / n);
+        }
+    }
+}
+
+void apriltag_detect_ctx_destroy(apriltag_detect_ctx_t *ctx)
+{
+#ifdef APRILTAG_PERF_COUNTERS
+    perf_destroy(ctx->perf);
+#endif
+    timeprofile_destroy(ctx->tp);
+    if (!ctx->wp_shared)
+        workerpool_destroy(ctx->wp);
+    pthread_mutex_destroy(&ctx->mutex);
+    zarray_destroy(ctx->tracks);
+    if (ctx->uf != NULL)
+        unionfind_destroy(ctx->uf);
+    free(ctx->clustermap);
+    free(ctx);
+}
+
 struct quad_decode_task
 {
-    int i0, i1;
     zarray_t *quads;
-    apriltag_detector_t *td;
+    const apriltag_detector_t *td;
+    apriltag_detect_ctx_t *ctx;
+
+    // quads [0, ndecimated) were found in the image decimated by
+    // td->quad_decimate, the others at full resolution.
+    int ndecimated;
 
     image_u8_t *im;
     zarray_t *detections;
@@ -813,7 +1191,7 @@ double optimize_quad_generic(apriltag_family_t *family, image_u8_t *im, struct q
     return best_score;
 }
 
-static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct quad *quad)
+static void refine_edges(float quad_decimate, image_u8_t *im_orig, struct quad *quad)
 {
     double lines[4][4]; // for each line, [Ex Ey nx ny]
 
@@ -857,7 +1235,7 @@ static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct qu
             // search on another pixel in the first place. Likewise,
             // for very small tags, we don't want the range to be too
             // big.
-            double range = td->quad_decimate + 1;
+            double range = quad_decimate + 1;
 
             // XXX tunable step size.
             for (double n = -range; n <= range; n +=  0.25) {
@@ -955,13 +1333,13 @@ static void refine_edges(apriltag_detector_t *td, image_u8_t *im_orig, struct qu
     }
 }
 
-static void quad_decode_task(void *_u)
+static void quad_decode_task(void *_u, int i0, int i1)
 {
     struct quad_decode_task *task = (struct quad_decode_task*) _u;
-    apriltag_detector_t *td = task->td;
+    const apriltag_detector_t *td = task->td;
     image_u8_t *im = task->im;
 
-    for (int quadidx = task->i0; quadidx < task->i1; quadidx++) {
+    for (int quadidx = i0; quadidx < i1; quadidx++) {
         struct quad *quad_original;
         zarray_get_volatile(task->quads, quadidx, &quad_original);
 
@@ -969,7 +1347,7 @@ static void quad_decode_task(void *_u)
         // apply this optimization BEFORE the other work.
         //if (td->quad_decimate > 1 && td->refine_edges) {
         if (td->refine_edges) {
-            refine_edges(td, im, quad_original);
+            refine_edges(quadidx < task->ndecimated ? td->quad_decimate : 1, im, quad_original);
         }
 
         // make sure the homographies are computed...
@@ -1058,9 +1436,9 @@ static void quad_decode_task(void *_u)
                     det->p[i][1] = p[1];
                 }
 
-                pthread_mutex_lock(&td->mutex);
+                pthread_mutex_lock(&task->ctx->mutex);
                 zarray_add(task->detections, &det);
-                pthread_mutex_unlock(&td->mutex);
+                pthread_mutex_unlock(&task->ctx->mutex);
             }
 
             quad_destroy(quad);
@@ -1091,84 +1469,304 @@ int prefer_smaller(int pref, double q0, double q1)
     return 0;
 }
 
-zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+// The kernel size of the blur or sharpening filter requested by the
+// user for the image used for quad detection, or 0 if there is none.
+static int quad_im_filter_ksz(const apriltag_detector_t *td)
 {
-    if (zarray_size(td->tag_families) == 0) {
-        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
-        printf("apriltag.c: No tag families enabled.");
-        return s;
+    if (td->quad_sigma == 0)
+        return 0;
+
+    // compute a reasonable kernel width by figuring that the
+    // kernel should go out 2 std devs.
+    //
+    // max sigma          ksz
+    // 0.499              1  (disabled)
+    // 0.999              3
+    // 1.499              5
+    // 1.999              7
+
+    float sigma = fabsf((float) td->quad_sigma);
+
+    int ksz = 4 * sigma; // 2 std devs in each direction
+    if ((ksz & 1) == 0)
+        ksz++;
+
+    return ksz > 1 ? ksz : 0;
+}
+
+// The blur (quad_sigma > 0) or sharpening (quad_sigma < 0) filter
+// requested by the user for the image used for quad detection, or
+// NULL if there is none. The filter works in place.
+static image_u8_filter_t *quad_im_filter_create(const apriltag_detector_t *td, image_u8_t *quad_im)
+{
+    int ksz = quad_im_filter_ksz(td);
+    if (ksz == 0)
+        return NULL;
+
+    // a negative sigma SHARPENs the image by subtracting the low
+    // frequency components.
+    return image_u8_gaussian_filter_create(quad_im, fabsf((float) td->quad_sigma), ksz, td->quad_sigma < 0);
+}
+
+// Merge overlapping regions into their bounding box until no two
+// regions overlap.
+static void rois_merge(zarray_t *rois)
+{
+    for (int i = 0; i < zarray_size(rois); i++) {
+        struct apriltag_roi *a;
+        zarray_get_volatile(rois, i, &a);
+
+        for (int j = i + 1; j < zarray_size(rois); j++) {
+            struct apriltag_roi *b;
+            zarray_get_volatile(rois, j, &b);
+
+            if (a->x0 >= b->x1 || b->x0 >= a->x1 || a->y0 >= b->y1 || b->y0 >= a->y1)
+                continue;
+
+            a->x0 = imin(a->x0, b->x0);
+            a->y0 = imin(a->y0, b->y0);
+            a->x1 = imax(a->x1, b->x1);
+            a->y1 = imax(a->y1, b->y1);
+
+            zarray_remove_index(rois, j, 1);
+
+            // a has grown; it must be checked against every region again.
+            j = i;
+        }
     }
+}
+
+// Predict where the tags of the previous frame will be in the current
+// one, adding a region of interest for each of them.
+static void track_predict_rois(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                               image_u8_t *im, zarray_t *rois)
+{
+    // smallest region worth searching: a few threshold tiles.
+    const int min_size = 16;
+
+    for (int i = 0; i < zarray_size(ctx->tracks); i++) {
+        struct apriltag_track *track;
+        zarray_get_volatile(ctx->tracks, i, &track);
+
+        double pad = td->track_roi_padding * fmax(track->xmax - track->xmin, track->ymax - track->ymin);
+
+        struct apriltag_roi roi = {
+            .x0 = imax(0, floor(track->xmin + track->v[0] - pad)),
+            .y0 = imax(0, floor(track->ymin + track->v[1] - pad)),
+            .x1 = imin(im->width, ceil(track->xmax + track->v[0] + pad) + 1),
+            .y1 = imin(im->height, ceil(track->ymax + track->v[1] + pad) + 1) };
+
+        if (roi.x1 - roi.x0 < min_size || roi.y1 - roi.y0 < min_size)
+            continue;
 
-    if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp)) {
-        workerpool_destroy(td->wp);
-        td->wp = workerpool_create(td->nthreads);
+        zarray_add(rois, &roi);
     }
 
-    timeprofile_clear(td->tp);
-    timeprofile_stamp(td->tp, "init");
+    rois_merge(rois);
+}
 
-    ///////////////////////////////////////////////////////////
-    // Step 1. Detect quads according to requested image decimation
-    // and blurring parameters.
-    image_u8_t *quad_im = im_orig;
-    if (td->quad_decimate > 1) {
-        quad_im = image_u8_decimate(im_orig, td->quad_decimate);
+// Find quads inside each region of interest, at full resolution. The
+// quads are added to 'quads' in the coordinates of the full image.
+static void roi_quads(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                      image_u8_t *im_orig, zarray_t *rois, zarray_t *quads)
+{
+    for (int i = 0; i < zarray_size(rois); i++) {
+        struct apriltag_roi *roi;
+        zarray_get_volatile(rois, i, &roi);
+
+        // work on a copy: the region is filtered in place.
+        image_u8_t *roi_im = image_u8_copy_region(im_orig, roi->x0, roi->y0,
+                                                  roi->x1 - roi->x0, roi->y1 - roi->y0);
+        image_u8_filter_t *filter = quad_im_filter_create(td, roi_im);
+
+        zarray_t *roi_quads = apriltag_quad_thresh_fused(td, ctx, roi_im, roi_im, filter);
+
+        image_u8_filter_destroy(filter);
+
+        for (int j = 0; j < zarray_size(roi_quads); j++) {
+            struct quad *q;
+            zarray_get_volatile(roi_quads, j, &q);
 
-        timeprofile_stamp(td->tp, "decimate");
+            for (int k = 0; k < 4; k++) {
+                q->p[k][0] += roi->x0;
+                q->p[k][1] += roi->y0;
+            }
+
+            zarray_add(quads, q);
+        }
+
+        zarray_destroy(roi_quads);
+        image_u8_destroy(roi_im);
     }
+}
 
-    if (td->quad_sigma != 0) {
-        // compute a reasonable kernel width by figuring that the
-        // kernel should go out 2 std devs.
-        //
-        // max sigma          ksz
-        // 0.499              1  (disabled)
-        // 0.999              3
-        // 1.499              5
-        // 1.999              7
+// Coarse-to-fine: add a full resolution region of interest for each
+// 4x4 block of the decimated image that has enough contrast to contain
+// a tag, but is not covered by any of the quads found in it. Such a
+// block may hold a tag that was too small to survive decimation. On
+// textured scenes most blocks qualify, and searching them all at full
+// resolution would cost more than not decimating: blocks are taken in
+// decreasing order of contrast until their regions cover
+// td->fine_max_fraction of the frame, and none at all if the merged
+// regions still cover more. Returns the fraction of the frame covered
+// by the merged regions (before dropping them, if they are).
+static float fine_search_rois(const apriltag_detector_t *td, image_u8_t *quad_im, zarray_t *quads,
+                              image_u8_t *im_orig, zarray_t *rois)
+{
+    const int bs = 4;
+    int bw = (quad_im->width + bs - 1) / bs;
+    int bh = (quad_im->height + bs - 1) / bs;
 
-        float sigma = fabsf((float) td->quad_sigma);
+    uint8_t *covered = calloc(bw*bh, sizeof(uint8_t));
 
-        int ksz = 4 * sigma; // 2 std devs in each direction
-        if ((ksz & 1) == 0)
-            ksz++;
+    for (int i = 0; i < zarray_size(quads); i++) {
+        struct quad *q;
+        zarray_get_volatile(quads, i, &q);
+
+        float xmin = q->p[0][0], xmax = q->p[0][0], ymin = q->p[0][1], ymax = q->p[0][1];
+        for (int k = 1; k < 4; k++) {
+            xmin = fmin(xmin, q->p[k][0]);
+            xmax = fmax(xmax, q->p[k][0]);
+            ymin = fmin(ymin, q->p[k][1]);
+            ymax = fmax(ymax, q->p[k][1]);
+        }
+
+        // quads have already been scaled to full resolution. Also
+        // cover the neighbouring blocks: their (grown) regions would
+        // otherwise contain the quad, and find it a second time.
+        int bx0 = iclamp(xmin / td->quad_decimate / bs - 1, 0, bw - 1);
+        int bx1 = iclamp(xmax / td->quad_decimate / bs + 1, 0, bw - 1);
+        int by0 = iclamp(ymin / td->quad_decimate / bs - 1, 0, bh - 1);
+        int by1 = iclamp(ymax / td->quad_decimate / bs + 1, 0, bh - 1);
+
+        for (int by = by0; by <= by1; by++)
+            for (int bx = bx0; bx <= bx1; bx++)
+                covered[by*bw + bx] = 1;
+    }
 
-        if (ksz > 1) {
+    // contrast of each block worth searching again, 0 for the others.
+    uint8_t *contrast = calloc(bw*bh, sizeof(uint8_t));
+    int ncontrast[256] = { 0 };
 
-            if (td->quad_sigma > 0) {
-                // Apply a blur
-                image_u8_gaussian_blur(quad_im, sigma, ksz);
-            } else {
-                // SHARPEN the image by subtracting the low frequency components.
-                image_u8_t *orig = image_u8_copy(quad_im);
-                image_u8_gaussian_blur(quad_im, sigma, ksz);
-
-                for (int y = 0; y < orig->height; y++) {
-                    for (int x = 0; x < orig->width; x++) {
-                        int vorig = orig->buf[y*orig->stride + x];
-                        int vblur = quad_im->buf[y*quad_im->stride + x];
-
-                        int v = 2*vorig - vblur;
-                        if (v < 0)
-                            v = 0;
-                        if (v > 255)
-                            v = 255;
-
-                        quad_im->buf[y*quad_im->stride + x] = (uint8_t) v;
-                    }
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            if (covered[by*bw + bx])
+                continue;
+
+            uint8_t min = 255, max = 0;
+            for (int y = by*bs; y < imin((by + 1)*bs, quad_im->height); y++) {
+                for (int x = bx*bs; x < imin((bx + 1)*bs, quad_im->width); x++) {
+                    uint8_t v = quad_im->buf[y*quad_im->stride + x];
+                    if (v < min)
+                        min = v;
+                    if (v > max)
+                        max = v;
                 }
-                image_u8_destroy(orig);
             }
+
+            if (max - min < imax(1, td->fine_min_contrast))
+                continue;
+
+            contrast[by*bw + bx] = max - min;
+            ncontrast[max - min]++;
         }
     }
 
-    timeprofile_stamp(td->tp, "blur/sharp");
+    // rank the blocks by decreasing contrast (a counting sort).
+    int first[256];
+    int nblocks = 0;
+    for (int c = 255; c >= 0; c--) {
+        first[c] = nblocks;
+        nblocks += ncontrast[c];
+    }
+
+    int *ranked = malloc(imax(1, nblocks) * sizeof(int));
+    for (int i = 0; i < bw*bh; i++) {
+        if (contrast[i])
+            ranked[first[contrast[i]]++] = i;
+    }
+
+    // the blocks covered by the regions so far, to stop at the budget.
+    memset(covered, 0, bw*bh);
+    int ncovered = 0;
+    int budget = td->fine_max_fraction * bw*bh;
+
+    for (int i = 0; i < nblocks; i++) {
+        int bx = ranked[i] % bw, by = ranked[i] / bw;
+
+        // grow the block by one block on each side, so that a tag
+        // straddling block boundaries is entirely contained.
+        int bx0 = imax(0, bx - 1), bx1 = imin(bw - 1, bx + 1);
+        int by0 = imax(0, by - 1), by1 = imin(bh - 1, by + 1);
+
+        int nnew = 0;
+        for (int y = by0; y <= by1; y++)
+            for (int x = bx0; x <= bx1; x++)
+                nnew += !covered[y*bw + x];
+
+        if (ncovered + nnew > budget)
+            break;
+
+        for (int y = by0; y <= by1; y++)
+            for (int x = bx0; x <= bx1; x++)
+                covered[y*bw + x] = 1;
+        ncovered += nnew;
+
+        struct apriltag_roi roi = {
+            .x0 = bx0*bs*td->quad_decimate,
+            .y0 = by0*bs*td->quad_decimate,
+            .x1 = imin(im_orig->width, (bx1 + 1)*bs*td->quad_decimate),
+            .y1 = imin(im_orig->height, (by1 + 1)*bs*td->quad_decimate) };
+
+        zarray_add(rois, &roi);
+    }
+
+    free(ranked);
+    free(contrast);
+    free(covered);
+
+    rois_merge(rois);
+
+    // merging into bounding boxes may have grown the regions beyond
+    // the budget.
+    int64_t area = 0;
+    for (int i = 0; i < zarray_size(rois); i++) {
+        struct apriltag_roi *roi;
+        zarray_get_volatile(rois, i, &roi);
+        area += (int64_t) (roi->x1 - roi->x0) * (roi->y1 - roi->y0);
+    }
+
+    float fraction = (float) area / ((int64_t) im_orig->width * im_orig->height);
+    if (fraction > td->fine_max_fraction)
+        zarray_clear(rois);
+
+    return fraction;
+}
+
+// Find quads in the whole (possibly decimated) frame. The quads are
+// returned in the coordinates of the full resolution image. If
+// fine_rois is not NULL, the regions that should be searched again at
+// full resolution are added to it.
+static zarray_t *frame_quads(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                             image_u8_t *im_orig, zarray_t *fine_rois)
+{
+    // decimation, blur/sharpen and thresholding happen in a single
+    // pass inside apriltag_quad_thresh_fused.
+    image_u8_t *quad_im = im_orig;
+    if (td->quad_decimate > 1)
+        quad_im = image_u8_decimate_create(im_orig, td->quad_decimate);
+    else if (quad_im_filter_ksz(td) != 0)
+        // the filter works in place, and im_orig belongs to the
+        // caller (and is needed unfiltered by refine_edges): filter
+        // a copy of it instead.
+        quad_im = image_u8_create(im_orig->width, im_orig->height);
 
-    if (td->debug)
-        image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+    image_u8_filter_t *filter = quad_im_filter_create(td, quad_im);
 
 //    zarray_t *quads = apriltag_quad_gradient(td, im_orig);
-    zarray_t *quads = apriltag_quad_thresh(td, quad_im);
+    zarray_t *quads = apriltag_quad_thresh_fused(td, ctx, im_orig, quad_im, filter);
+
+    image_u8_filter_destroy(filter);
 
     // adjust centers of pixels so that they correspond to the
     // original full-resolution image.
@@ -1184,14 +1782,206 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         }
     }
 
+    if (fine_rois != NULL && td->quad_decimate > 1)
+        ctx->fine_fraction = fine_search_rois(td, quad_im, quads, im_orig, fine_rois);
+
     if (quad_im != im_orig)
         image_u8_destroy(quad_im);
 
+    return quads;
+}
+
+// Replace the tracks with the detections of the current frame. If the
+// current frame was only searched inside regions of interest, any
+// previously tracked tag that was not found again counts as lost.
+static void track_update(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                         zarray_t *detections, int full_scan)
+{
+    zarray_t *tracks = zarray_create(sizeof(struct apriltag_track));
+
+    ctx->track_lost = 0;
+
+    for (int i = 0; i < zarray_size(ctx->tracks); i++) {
+        struct apriltag_track *old;
+        zarray_get_volatile(ctx->tracks, i, &old);
+
+        int found = 0;
+        for (int j = 0; j < zarray_size(detections); j++) {
+            apriltag_detection_t *det;
+            zarray_get(detections, j, &det);
+
+            if (det->id == old->id && det->family == old->family) {
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found && !full_scan)
+            ctx->track_lost = 1;
+    }
+
+    for (int i = 0; i < zarray_size(detections); i++) {
+        apriltag_detection_t *det;
+        zarray_get(detections, i, &det);
+
+        struct apriltag_track track = { .family = det->family, .id = det->id,
+                                        .c = { det->c[0], det->c[1] },
+                                        .xmin = det->p[0][0], .xmax = det->p[0][0],
+                                        .ymin = det->p[0][1], .ymax = det->p[0][1] };
+
+        for (int k = 1; k < 4; k++) {
+            track.xmin = fmin(track.xmin, det->p[k][0]);
+            track.xmax = fmax(track.xmax, det->p[k][0]);
+            track.ymin = fmin(track.ymin, det->p[k][1]);
+            track.ymax = fmax(track.ymax, det->p[k][1]);
+        }
+
+        for (int j = 0; j < zarray_size(ctx->tracks); j++) {
+            struct apriltag_track *old;
+            zarray_get_volatile(ctx->tracks, j, &old);
+
+            if (old->id == det->id && old->family == det->family) {
+                track.v[0] = det->c[0] - old->c[0];
+                track.v[1] = det->c[1] - old->c[1];
+                break;
+            }
+        }
+
+        zarray_add(tracks, &track);
+    }
+
+    zarray_destroy(ctx->tracks);
+    ctx->tracks = tracks;
+
+    ctx->track_nframes = full_scan ? 1 : ctx->track_nframes + 1;
+}
+
+// (Re)create the worker pool if the threading parameters have changed.
+static void update_workerpool(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx)
+{
+    if (ctx->wp_shared)
+        return;
+
+    int cpus[64];
+    int ncpus = 0;
+
+    int nthreads = ctx->nthreads > 0 ? ctx->nthreads : td->nthreads;
+
+    int pin = td->pin_threads && !ctx->keep_affinity;
+    int restrict_cpus = pin || (td->cpu_exclude && !ctx->keep_affinity);
+
+    if (nthreads <= 0 || restrict_cpus)
+        ncpus = workerpool_get_affinity_cpus(td->cpu_exclude, cpus, 64);
+
+    if (nthreads <= 0)
+        nthreads = imax(1, ncpus);
+
+    // the CPUs that the threads (the calling one included) are pinned
+    // or restricted to.
+    uint64_t pinned = 0;
+    if (restrict_cpus) {
+        for (int i = 0; i < ncpus; i++)
+            pinned |= (uint64_t) 1 << (cpus[i] & 63);
+    } else {
+        ncpus = 0;
+    }
+
+    if (ctx->wp != NULL && nthreads == workerpool_get_nthreads(ctx->wp) &&
+        pinned == ctx->wp_pinned && pin == ctx->wp_pin)
+        return;
+
+#ifdef APRILTAG_PERF_COUNTERS
+    // the counters of the old workers are of no further use.
+    perf_destroy(ctx->perf);
+    ctx->perf = NULL;
+#endif
+
+    workerpool_destroy(ctx->wp);
+    if (pin)
+        ctx->wp = workerpool_create_pinned(nthreads, cpus, ncpus);
+    else
+        ctx->wp = workerpool_create_restricted(nthreads, cpus, ncpus);
+    ctx->wp_pinned = pinned;
+    ctx->wp_pin = pin;
+}
+
+workerpool_t *apriltag_detect_ctx_get_workerpool(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx)
+{
+    update_workerpool(td, ctx);
+    return ctx->wp;
+}
+
+void apriltag_detect_ctx_set_workerpool(apriltag_detect_ctx_t *ctx, workerpool_t *wp)
+{
+#ifdef APRILTAG_PERF_COUNTERS
+    // they count the threads of the old pool.
+    perf_destroy(ctx->perf);
+    ctx->perf = NULL;
+#endif
+
+    if (!ctx->wp_shared)
+        workerpool_destroy(ctx->wp);
+
+    ctx->wp = wp;
+    ctx->wp_shared = wp != NULL;
+    ctx->wp_pinned = 0;
+    ctx->wp_pin = 0;
+}
+
+zarray_t *apriltag_detector_detect_ctx(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                                       image_u8_t *im_orig)
+{
+    if (zarray_size(td->tag_families) == 0) {
+        zarray_t *s = zarray_create(sizeof(apriltag_detection_t*));
+        printf("apriltag.c: No tag families enabled.");
+        return s;
+    }
+
+    update_workerpool(td, ctx);
+
+    timeprofile_clear(ctx->tp);
+    stage_begin(ctx);
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_INIT);
+
+    ///////////////////////////////////////////////////////////
+    // Step 1. Detect quads according to requested image decimation
+    // and blurring parameters. When tracking, only the regions of
+    // interest around the previous detections are searched, at full
+    // resolution, unless a full-frame scan is due. When searching
+    // coarse-to-fine, the full-frame scan is followed by a full
+    // resolution search of promising regions without quads.
+    zarray_t *rois = zarray_create(sizeof(struct apriltag_roi));
+    if (td->track_roi && !ctx->track_lost && ctx->track_nframes < td->track_full_scan_interval) {
+        track_predict_rois(td, ctx, im_orig, rois);
+        apriltag_stage_stamp(ctx, APRILTAG_STAGE_PREDICT_ROIS);
+    }
+
+    int full_scan = zarray_size(rois) == 0;
+    ctx->fine_fraction = 0;
+
+    zarray_t *quads;
+    int ndecimated = 0;
+
+    if (full_scan) {
+        quads = frame_quads(td, ctx, im_orig, td->coarse_to_fine ? rois : NULL);
+        ndecimated = zarray_size(quads);
+    } else {
+        quads = zarray_create(sizeof(struct quad));
+    }
+
+    if (zarray_size(rois) > 0) {
+        roi_quads(td, ctx, im_orig, rois, quads);
+        apriltag_stage_stamp(ctx, APRILTAG_STAGE_ROI_QUADS);
+    }
+
+    ctx->nrois = zarray_size(rois);
+    zarray_destroy(rois);
+
     zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
 
-    td->nquads = zarray_size(quads);
+    ctx->nquads = zarray_size(quads);
 
-    timeprofile_stamp(td->tp, "quads");
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_QUADS);
 
     if (td->debug) {
         image_u8_t *im_quads = image_u8_copy(im_orig);
@@ -1222,26 +2012,11 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     if (1) {
         image_u8_t *im_samples = td->debug ? image_u8_copy(im_orig) : NULL;
 
-        int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        struct quad_decode_task task = { .quads = quads, .td = td, .ctx = ctx, .ndecimated = ndecimated,
+                                         .im = im_orig, .detections = detections,
+                                         .im_samples = im_samples };
 
-        struct quad_decode_task tasks[zarray_size(quads) / chunksize + 1];
-
-        int ntasks = 0;
-        for (int i = 0; i < zarray_size(quads); i+= chunksize) {
-            tasks[ntasks].i0 = i;
-            tasks[ntasks].i1 = imin(zarray_size(quads), i + chunksize);
-            tasks[ntasks].quads = quads;
-            tasks[ntasks].td = td;
-            tasks[ntasks].im = im_orig;
-            tasks[ntasks].detections = detections;
-
-            tasks[ntasks].im_samples = im_samples;
-
-            workerpool_add_task(td->wp, quad_decode_task, &tasks[ntasks]);
-            ntasks++;
-        }
-
-        workerpool_run(td->wp);
+        workerpool_parallel_for(ctx->wp, zarray_size(quads), 1, quad_decode_task, &task);
 
         if (im_samples != NULL) {
             image_u8_write_pnm(im_samples, "debug_samples.pnm");
@@ -1274,7 +2049,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         image_u8_destroy(im_quads);
     }
 
-    timeprofile_stamp(td->tp, "decode+refinement");
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_DECODE);
 
     ////////////////////////////////////////////////////////////////
     // Step 3. Reconcile detections--- don't report the same tag more
@@ -1348,7 +2123,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         zarray_destroy(poly1);
     }
 
-    timeprofile_stamp(td->tp, "reconcile");
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_RECONCILE);
 
     ////////////////////////////////////////////////////////////////
     // Produce final debug output
@@ -1471,7 +2246,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         fclose(f);
     }
 
-    timeprofile_stamp(td->tp, "debug output");
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_DEBUG);
 
     for (int i = 0; i < zarray_size(quads); i++) {
         struct quad *quad;
@@ -1483,11 +2258,160 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     zarray_destroy(quads);
 
     zarray_sort(detections, detection_compare_function);
-    timeprofile_stamp(td->tp, "cleanup");
+
+    if (td->track_roi)
+        track_update(td, ctx, detections, full_scan);
+    else
+        zarray_clear(ctx->tracks);
+
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_CLEANUP);
+    stage_end(ctx);
+
+    return detections;
+}
+
+
+zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
+{
+    zarray_t *detections = apriltag_detector_detect_ctx(td, td->ctx, im_orig);
+
+    td->nedges = td->ctx->nedges;
+    td->nsegments = td->ctx->nsegments;
+    td->nquads = td->ctx->nquads;
+    td->nrois = td->ctx->nrois;
+    td->fine_fraction = td->ctx->fine_fraction;
 
     return detections;
 }
 
+// XXX tunable: largest image (in pixels) that batches process several
+// at a time, one thread each. Beyond this, the working set of one
+// image per thread no longer fits in cache, and it is better to
+// spread the stages of one image over all threads instead.
+#define APRILTAG_BATCH_MAX_PARALLEL_PIXELS (1280*960)
+
+struct batch_task
+{
+    const apriltag_detector_t *td;
+    image_u8_t **images;
+    zarray_t **results;
+
+    // contexts not currently in use.
+    apriltag_detect_ctx_t **ctxs;
+    int nctxs;
+
+    pthread_mutex_t mutex;
+    uint64_t nquads;
+};
+
+static void batch_detect(struct batch_task *task, apriltag_detect_ctx_t *ctx, int i0, int i1)
+{
+    uint64_t nquads = 0;
+
+    for (int i = i0; i < i1; i++) {
+        // the images are unrelated: start each from a full scan.
+        zarray_clear(ctx->tracks);
+        ctx->track_nframes = 0;
+        ctx->track_lost = 0;
+
+        task->results[i] = apriltag_detector_detect_ctx(task->td, ctx, task->images[i]);
+        nquads += ctx->nquads;
+    }
+
+    pthread_mutex_lock(&task->mutex);
+    task->nquads += nquads;
+    pthread_mutex_unlock(&task->mutex);
+}
+
+static void batch_detect_task(void *p, int i0, int i1)
+{
+    struct batch_task *task = (struct batch_task*) p;
+
+    pthread_mutex_lock(&task->mutex);
+    apriltag_detect_ctx_t *ctx = task->ctxs[--task->nctxs];
+    pthread_mutex_unlock(&task->mutex);
+
+    batch_detect(task, ctx, i0, i1);
+
+    pthread_mutex_lock(&task->mutex);
+    task->ctxs[task->nctxs++] = ctx;
+    pthread_mutex_unlock(&task->mutex);
+}
+
+void apriltag_detector_detect_batch(const apriltag_detector_t *td, image_u8_t **images, int n,
+                                    zarray_t **results, apriltag_batch_stats_t *stats)
+{
+    int64_t utime0 = utime_now();
+
+    // the context whose worker pool runs the batch, sized and pinned
+    // according to the detector's threading parameters.
+    apriltag_detect_ctx_t *ctx = apriltag_detect_ctx_create();
+    update_workerpool(td, ctx);
+
+    int nthreads = workerpool_get_nthreads(ctx->wp);
+
+    uint64_t npixels = 0;
+    int maxpixels = 0;
+    for (int i = 0; i < n; i++) {
+        int pixels = images[i]->width * images[i]->height;
+        npixels += pixels;
+        maxpixels = imax(maxpixels, pixels);
+    }
+
+    struct batch_task task = { .td = td, .images = images, .results = results };
+    pthread_mutex_init(&task.mutex, NULL);
+
+    int nparallel = 1;
+
+    if (nthreads > 1 && n >= nthreads && maxpixels <= APRILTAG_BATCH_MAX_PARALLEL_PIXELS) {
+        // image-level parallelism: each thread of ctx->wp detects
+        // whole images with a single-threaded context of its own.
+        // The thread stays on the CPUs ctx->wp placed it on: pinning
+        // it again for each image would put all of them on the first
+        // CPU of the detector.
+        nparallel = nthreads;
+
+        task.ctxs = calloc(nparallel, sizeof(apriltag_detect_ctx_t*));
+        for (int i = 0; i < nparallel; i++) {
+            task.ctxs[i] = apriltag_detect_ctx_create();
+            task.ctxs[i]->nthreads = 1;
+            task.ctxs[i]->keep_affinity = 1;
+        }
+        task.nctxs = nparallel;
+
+        workerpool_parallel_for(ctx->wp, n, 1, batch_detect_task, &task);
+
+        for (int i = 0; i < nparallel; i++)
+            apriltag_detect_ctx_destroy(task.ctxs[i]);
+        free(task.ctxs);
+    } else {
+        // stage-level parallelism: one image after the other, each
+        // with all threads.
+        batch_detect(&task, ctx, 0, n);
+    }
+
+    pthread_mutex_destroy(&task.mutex);
+    apriltag_detect_ctx_destroy(ctx);
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(apriltag_batch_stats_t));
+
+        stats->nimages = n;
+        stats->npixels = npixels;
+        stats->nquads = task.nquads;
+        for (int i = 0; i < n; i++)
+            stats->ndetections += zarray_size(results[i]);
+
+        stats->nparallel = nparallel;
+        stats->nthreads_per_image = nparallel > 1 ? 1 : nthreads;
+
+        stats->seconds = (utime_now() - utime0) / 1.0E6;
+        if (stats->seconds > 0) {
+            stats->images_per_second = n / stats->seconds;
+            stats->megapixels_per_second = npixels / 1.0E6 / stats->seconds;
+        }
+    }
+}
 
 // Call this method on each of the tags returned by apriltag_detector_detect
 void apriltag_detections_destroy(zarray_t *detections)
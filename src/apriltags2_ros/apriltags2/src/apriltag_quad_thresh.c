@@ -39,6 +39,10 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdio.h>
 #include <stdint.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "apriltag.h"
 #include "common/image_u8x3.h"
 #include "common/zarray.h"
@@ -49,6 +53,8 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/postscript_utils.h"
 #include "common/math_util.h"
 
+extern void apriltag_stage_stamp(apriltag_detect_ctx_t *ctx, enum apriltag_stage stage);
+
 static inline uint32_t u64hash_2(uint64_t x) {
     return (2654435761 * x) >> 32;
     return (uint32_t) x;
@@ -76,18 +82,21 @@ struct pt
 
 struct unionfind_task
 {
-    int y0, y1;
     int w, h, s;
     unionfind_t *uf;
     image_u8_t *im;
+
+    // rows that must be processed again to stitch together the
+    // ranges processed in parallel.
+    uint8_t *stitch;
 };
 
 struct quad_task
 {
     zarray_t *clusters;
-    int cidx0, cidx1; // [cidx0, cidx1)
     zarray_t *quads;
-    apriltag_detector_t *td;
+    const apriltag_detector_t *td;
+    apriltag_detect_ctx_t *ctx;
     int w, h;
 
     image_u8_t *im;
@@ -387,7 +396,7 @@ int err_compare_descending(const void *_a, const void *_b)
   rather than pairs of clusters.) Critically, this helps keep nearby
   edges from becoming connected.
 */
-int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_maxima(const apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
 {
     int sz = zarray_size(cluster);
 
@@ -563,7 +572,7 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 }
 
 // returns 0 if the cluster looks bad.
-int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_agg(const apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
 {
     int sz = zarray_size(cluster);
 
@@ -673,8 +682,92 @@ int quad_segment_agg(apriltag_detector_t *td, zarray_t *cluster, struct line_fit
     return 1;
 }
 
+// Step 2 of fit_quad: cumulative statistics of the sorted cluster,
+// which allow line fit queries to be efficiently computed for any
+// contiguous range of indices. Free the result with free().
+static struct line_fit_pt *compute_lfps(int sz, zarray_t *cluster, image_u8_t *im)
+{
+    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
+
+    for (int i = 0; i < sz; i++) {
+        struct pt *p;
+        zarray_get_volatile(cluster, i, &p);
+
+        if (i > 0) {
+            memcpy(&lfps[i], &lfps[i-1], sizeof(struct line_fit_pt));
+        }
+
+        if (0) {
+            // we now undo our fixed-point arithmetic.
+            double delta = 0.5;
+            double x = p->x * .5 + delta;
+            double y = p->y * .5 + delta;
+            double W;
+
+            for (int dy = -1; dy <= 1; dy++) {
+                int iy = y + dy;
+
+                if (iy < 0 || iy + 1 >= im->height)
+                    continue;
+
+                for (int dx = -1; dx <= 1; dx++) {
+                    int ix = x + dx;
+
+                    if (ix < 0 || ix + 1 >= im->width)
+                        continue;
+
+                    int grad_x = im->buf[iy * im->stride + ix + 1] -
+                        im->buf[iy * im->stride + ix - 1];
+
+                    int grad_y = im->buf[(iy+1) * im->stride + ix] -
+                        im->buf[(iy-1) * im->stride + ix];
+
+                    W = sqrtf(grad_x*grad_x + grad_y*grad_y) + 1;
+
+//                    double fx = x + dx, fy = y + dy;
+                    double fx = ix + .5, fy = iy + .5;
+                    lfps[i].Mx  += W * fx;
+                    lfps[i].My  += W * fy;
+                    lfps[i].Mxx += W * fx * fx;
+                    lfps[i].Mxy += W * fx * fy;
+                    lfps[i].Myy += W * fy * fy;
+                    lfps[i].W   += W;
+                }
+            }
+        } else {
+            // we now undo our fixed-point arithmetic.
+            double delta = 0.5; // adjust for pixel center bias
+            double x = p->x * .5 + delta;
+            double y = p->y * .5 + delta;
+            int ix = x, iy = y;
+            double W = 1;
+
+            if (ix > 0 && ix+1 < im->width && iy > 0 && iy+1 < im->height) {
+                int grad_x = im->buf[iy * im->stride + ix + 1] -
+                    im->buf[iy * im->stride + ix - 1];
+
+                int grad_y = im->buf[(iy+1) * im->stride + ix] -
+                    im->buf[(iy-1) * im->stride + ix];
+
+                // XXX Tunable. How to shape the gradient magnitude?
+                W = sqrt(grad_x*grad_x + grad_y*grad_y) + 1;
+            }
+
+            double fx = x, fy = y;
+            lfps[i].Mx  += W * fx;
+            lfps[i].My  += W * fy;
+            lfps[i].Mxx += W * fx * fx;
+            lfps[i].Mxy += W * fx * fy;
+            lfps[i].Myy += W * fy * fy;
+            lfps[i].W   += W;
+        }
+    }
+
+    return lfps;
+}
+
 // return 1 if the quad looks okay, 0 if it should be discarded
-int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct quad *quad)
+int fit_quad(const apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct quad *quad)
 {
     int res = 0;
 
@@ -818,84 +911,9 @@ int fit_quad(apriltag_detector_t *td, image_u8_t *im, zarray_t *cluster, struct
         return 0;
 
     /////////////////////////////////////////////////////////////
-    // Step 2. Precompute statistics that allow line fit queries to be
-    // efficiently computed for any contiguous range of indices.
+    // Step 2. Precompute statistics for the line fits.
 
-    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
-
-    for (int i = 0; i < sz; i++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, i, &p);
-
-        if (i > 0) {
-            memcpy(&lfps[i], &lfps[i-1], sizeof(struct line_fit_pt));
-        }
-
-        if (0) {
-            // we now undo our fixed-point arithmetic.
-            double delta = 0.5;
-            double x = p->x * .5 + delta;
-            double y = p->y * .5 + delta;
-            double W;
-
-            for (int dy = -1; dy <= 1; dy++) {
-                int iy = y + dy;
-
-                if (iy < 0 || iy + 1 >= im->height)
-                    continue;
-
-                for (int dx = -1; dx <= 1; dx++) {
-                    int ix = x + dx;
-
-                    if (ix < 0 || ix + 1 >= im->width)
-                        continue;
-
-                    int grad_x = im->buf[iy * im->stride + ix + 1] -
-                        im->buf[iy * im->stride + ix - 1];
-
-                    int grad_y = im->buf[(iy+1) * im->stride + ix] -
-                        im->buf[(iy-1) * im->stride + ix];
-
-                    W = sqrtf(grad_x*grad_x + grad_y*grad_y) + 1;
-
-//                    double fx = x + dx, fy = y + dy;
-                    double fx = ix + .5, fy = iy + .5;
-                    lfps[i].Mx  += W * fx;
-                    lfps[i].My  += W * fy;
-                    lfps[i].Mxx += W * fx * fx;
-                    lfps[i].Mxy += W * fx * fy;
-                    lfps[i].Myy += W * fy * fy;
-                    lfps[i].W   += W;
-                }
-            }
-        } else {
-            // we now undo our fixed-point arithmetic.
-            double delta = 0.5; // adjust for pixel center bias
-            double x = p->x * .5 + delta;
-            double y = p->y * .5 + delta;
-            int ix = x, iy = y;
-            double W = 1;
-
-            if (ix > 0 && ix+1 < im->width && iy > 0 && iy+1 < im->height) {
-                int grad_x = im->buf[iy * im->stride + ix + 1] -
-                    im->buf[iy * im->stride + ix - 1];
-
-                int grad_y = im->buf[(iy+1) * im->stride + ix] -
-                    im->buf[(iy-1) * im->stride + ix];
-
-                // XXX Tunable. How to shape the gradient magnitude?
-                W = sqrt(grad_x*grad_x + grad_y*grad_y) + 1;
-            }
-
-            double fx = x, fy = y;
-            lfps[i].Mx  += W * fx;
-            lfps[i].My  += W * fy;
-            lfps[i].Mxx += W * fx * fx;
-            lfps[i].Mxy += W * fx * fy;
-            lfps[i].Myy += W * fy * fy;
-            lfps[i].W   += W;
-        }
-    }
+    struct line_fit_pt *lfps = compute_lfps(sz, cluster, im);
 
     int indices[4];
     if (1) {
@@ -1116,25 +1134,34 @@ static void do_unionfind_line(unionfind_t *uf, image_u8_t *im, int h, int w, int
 }
 #undef DO_UNIONFIND
 
-static void do_unionfind_task(void *p)
+// processes rows [y0, y1). Note that this attaches each cell to the
+// right and down, so row y1 is potentially modified. For
+// parallelization, the last row of the range is left out (and
+// stitched later) so that no two ranges touch the same row.
+static void do_unionfind_task(void *p, int y0, int y1)
 {
     struct unionfind_task *task = (struct unionfind_task*) p;
 
-    for (int y = task->y0; y < task->y1; y++) {
+    if (y1 < task->h - 1) {
+        y1--;
+        task->stitch[y1] = 1;
+    }
+
+    for (int y = y0; y < y1; y++) {
         do_unionfind_line(task->uf, task->im, task->h, task->w, task->s, y);
     }
 }
 
-static void do_quad_task(void *p)
+static void do_quad_task(void *p, int cidx0, int cidx1)
 {
     struct quad_task *task = (struct quad_task*) p;
 
     zarray_t *clusters = task->clusters;
     zarray_t *quads = task->quads;
-    apriltag_detector_t *td = task->td;
+    const apriltag_detector_t *td = task->td;
     int w = task->w, h = task->h;
 
-    for (int cidx = task->cidx0; cidx < task->cidx1; cidx++) {
+    for (int cidx = cidx0; cidx < cidx1; cidx++) {
 
         zarray_t *cluster;
         zarray_get(clusters, cidx, &cluster);
@@ -1156,59 +1183,110 @@ static void do_quad_task(void *p)
         memset(&quad, 0, sizeof(struct quad));
 
         if (fit_quad(td, task->im, cluster, &quad)) {
-            pthread_mutex_lock(&td->mutex);
+            pthread_mutex_lock(&task->ctx->mutex);
 
             zarray_add(quads, &quad);
-            pthread_mutex_unlock(&td->mutex);
+            pthread_mutex_unlock(&task->ctx->mutex);
         }
     }
 }
 
-image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+// XXX Tunable. Generally, small tile sizes--- so long as they're
+// large enough to span a single tag edge--- seem to be a winner.
+#define THRESHOLD_TILESZ 4
+
+// The state of threshold() between tile rows, so that an image can
+// also be thresholded band by band while it is being produced (see
+// apriltag_quad_thresh_fused).
+struct threshold_state
+{
+    const apriltag_detector_t *td;
+    image_u8_t *im, *threshim;
+
+    // the last (possibly partial) tiles along each row and column will
+    // just use the min/max value from the last full tile.
+    int tw, th;
+
+    // min/max of each tile, and over the 3x3 surrounding tiles.
+    uint8_t *tile_max, *tile_min;
+    uint8_t *im_max, *im_min;
+};
+
+static void threshold_init(struct threshold_state *st, const apriltag_detector_t *td, image_u8_t *im)
 {
     int w = im->width, h = im->height, s = im->stride;
     assert(w < 32768);
     assert(h < 32768);
 
-    image_u8_t *threshim = image_u8_create_alignment(w, h, s);
-    assert(threshim->stride == s);
+    st->td = td;
+    st->im = im;
+    st->threshim = image_u8_create_alignment(w, h, s);
+    assert(st->threshim->stride == s);
 
-    // The idea is to find the maximum and minimum values in a
-    // window around each pixel. If it's a contrast-free region
-    // (max-min is small), don't try to binarize. Otherwise,
-    // threshold according to (max+min)/2.
-    //
-    // Mark low-contrast regions with value 127 so that we can skip
-    // future work on these areas too.
+    st->tw = w / THRESHOLD_TILESZ;
+    st->th = h / THRESHOLD_TILESZ;
 
-    // however, computing max/min around every pixel is needlessly
-    // expensive. We compute max/min for tiles. To avoid artifacts
-    // that arise when high-contrast features appear near a tile
-    // edge (and thus moving from one tile to another results in a
-    // large change in max/min value), the max/min values used for
-    // any pixel are computed from all 3x3 surrounding tiles. Thus,
-    // the max/min sampling area for nearby pixels overlap by at least
-    // one tile.
-    //
-    // The important thing is that the windows be large enough to
-    // capture edge transitions; the tag does not need to fit into
-    // a tile.
+    int ntiles = st->tw * st->th;
+    st->tile_max = calloc(ntiles, sizeof(uint8_t));
+    st->tile_min = calloc(ntiles, sizeof(uint8_t));
+    st->im_max = calloc(ntiles, sizeof(uint8_t));
+    st->im_min = calloc(ntiles, sizeof(uint8_t));
+}
 
-    // XXX Tunable. Generally, small tile sizes--- so long as they're
-    // large enough to span a single tag edge--- seem to be a winner.
-    const int tilesz = 4;
+static void threshold_cleanup(struct threshold_state *st)
+{
+    free(st->tile_max);
+    free(st->tile_min);
+    free(st->im_max);
+    free(st->im_min);
+}
 
-    // the last (possibly partial) tiles along each row and column will
-    // just use the min/max value from the last full tile.
-    int tw = w / tilesz;
-    int th = h / tilesz;
+// collect min/max statistics for each tile in tile rows [ty0, ty1).
+static void threshold_tiles(struct threshold_state *st, int ty0, int ty1)
+{
+    const int tilesz = THRESHOLD_TILESZ;
+    image_u8_t *im = st->im;
+    int s = im->stride, tw = st->tw;
 
-    uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
-    uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
+    for (int ty = ty0; ty < ty1; ty++) {
+        int tx0 = 0;
 
-    // first, collect min/max statistics for each tile
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
+#ifdef __SSE2__
+        // 16 tiles at a time: min/max down the 4 rows, then across
+        // each group of 4 bytes.
+        const __m128i lomask = _mm_set1_epi32(0xff);
+        for (; tx0 + 16 <= tw; tx0 += 16) {
+            __m128i max[4], min[4];
+
+            for (int i = 0; i < 4; i++) {
+                const uint8_t *p = &im->buf[ty*tilesz*s + (tx0 + 4*i)*tilesz];
+                __m128i mx = _mm_loadu_si128((const __m128i*) p), mn = mx;
+
+                for (int dy = 1; dy < tilesz; dy++) {
+                    __m128i v = _mm_loadu_si128((const __m128i*) (p + dy*s));
+                    mx = _mm_max_epu8(mx, v);
+                    mn = _mm_min_epu8(mn, v);
+                }
+
+                mx = _mm_max_epu8(mx, _mm_srli_epi32(mx, 8));
+                mx = _mm_max_epu8(mx, _mm_srli_epi32(mx, 16));
+                mn = _mm_min_epu8(mn, _mm_srli_epi32(mn, 8));
+                mn = _mm_min_epu8(mn, _mm_srli_epi32(mn, 16));
+
+                max[i] = _mm_and_si128(mx, lomask);
+                min[i] = _mm_and_si128(mn, lomask);
+            }
+
+            _mm_storeu_si128((__m128i*) &st->tile_max[ty*tw + tx0],
+                             _mm_packus_epi16(_mm_packs_epi32(max[0], max[1]),
+                                              _mm_packs_epi32(max[2], max[3])));
+            _mm_storeu_si128((__m128i*) &st->tile_min[ty*tw + tx0],
+                             _mm_packus_epi16(_mm_packs_epi32(min[0], min[1]),
+                                              _mm_packs_epi32(min[2], min[3])));
+        }
+#endif
+
+        for (int tx = tx0; tx < tw; tx++) {
             uint8_t max = 0, min = 255;
 
             for (int dy = 0; dy < tilesz; dy++) {
@@ -1223,56 +1301,108 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
                 }
             }
 
-            im_max[ty*tw+tx] = max;
-            im_min[ty*tw+tx] = min;
+            st->tile_max[ty*tw+tx] = max;
+            st->tile_min[ty*tw+tx] = min;
         }
     }
+}
 
-    // second, apply 3x3 max/min convolution to "blur" these values
-    // over larger areas. This reduces artifacts due to abrupt changes
-    // in the threshold value.
-    if (1) {
-        uint8_t *im_max_tmp = calloc(tw*th, sizeof(uint8_t));
-        uint8_t *im_min_tmp = calloc(tw*th, sizeof(uint8_t));
+// apply 3x3 max/min convolution to "blur" the tile statistics over
+// larger areas, for tile rows [ty0, ty1). This reduces artifacts due
+// to abrupt changes in the threshold value. Needs the statistics of
+// tile rows ty0-1 through ty1.
+static void threshold_dilate(struct threshold_state *st, int ty0, int ty1)
+{
+    int tw = st->tw, th = st->th;
 
-        for (int ty = 0; ty < th; ty++) {
-            for (int tx = 0; tx < tw; tx++) {
-                uint8_t max = 0, min = 255;
+    for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = 0; tx < tw; tx++) {
+            uint8_t max = 0, min = 255;
 
-                for (int dy = -1; dy <= 1; dy++) {
-                    if (ty+dy < 0 || ty+dy >= th)
+            for (int dy = -1; dy <= 1; dy++) {
+                if (ty+dy < 0 || ty+dy >= th)
+                    continue;
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (tx+dx < 0 || tx+dx >= tw)
                         continue;
-                    for (int dx = -1; dx <= 1; dx++) {
-                        if (tx+dx < 0 || tx+dx >= tw)
-                            continue;
-
-                        uint8_t m = im_max[(ty+dy)*tw+tx+dx];
-                        if (m > max)
-                            max = m;
-                        m = im_min[(ty+dy)*tw+tx+dx];
-                        if (m < min)
-                            min = m;
-                    }
-                }
 
-                im_max_tmp[ty*tw + tx] = max;
-                im_min_tmp[ty*tw + tx] = min;
+                    uint8_t m = st->tile_max[(ty+dy)*tw+tx+dx];
+                    if (m > max)
+                        max = m;
+                    m = st->tile_min[(ty+dy)*tw+tx+dx];
+                    if (m < min)
+                        min = m;
+                }
             }
+
+            st->im_max[ty*tw + tx] = max;
+            st->im_min[ty*tw + tx] = min;
         }
-        free(im_max);
-        free(im_min);
-        im_max = im_max_tmp;
-        im_min = im_min_tmp;
     }
+}
 
-    for (int ty = 0; ty < th; ty++) {
-        for (int tx = 0; tx < tw; tx++) {
+// threshold the pixels of tile rows [ty0, ty1), including the partial
+// tiles at the end of each row. When ty1 is the last tile row, the
+// rows below it are done too.
+static void threshold_binarize(struct threshold_state *st, int ty0, int ty1)
+{
+    const int tilesz = THRESHOLD_TILESZ;
+    image_u8_t *im = st->im, *threshim = st->threshim;
+    int w = im->width, h = im->height, s = im->stride;
+    int tw = st->tw, th = st->th;
+    uint8_t *im_max = st->im_max, *im_min = st->im_min;
+
+    for (int ty = ty0; ty < ty1; ty++) {
+        int tx0 = 0;
+
+#ifdef __SSE2__
+        // 16 tiles (4 vectors of pixels) at a time.
+        if (st->td->qtp.min_white_black_diff <= 255) {
+            const __m128i mwbd = _mm_set1_epi8(imax(0, st->td->qtp.min_white_black_diff));
+            const __m128i gray = _mm_set1_epi8(127), zero = _mm_setzero_si128();
+
+            for (; tx0 + 16 <= tw; tx0 += 16) {
+                __m128i max = _mm_loadu_si128((const __m128i*) &im_max[ty*tw + tx0]);
+                __m128i min = _mm_loadu_si128((const __m128i*) &im_min[ty*tw + tx0]);
+
+                __m128i diff = _mm_subs_epu8(max, min);
+                __m128i thresh = _mm_add_epi8(min, _mm_and_si128(_mm_srli_epi16(diff, 1),
+                                                                 _mm_set1_epi8(0x7f)));
+                // low contrast region? (no edges)
+                __m128i low = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(mwbd, diff), zero),
+                                            _mm_set1_epi8(-1));
+
+                // replicate each tile's values over its 4 pixels.
+                __m128i t8[2] = { _mm_unpacklo_epi8(thresh, thresh), _mm_unpackhi_epi8(thresh, thresh) };
+                __m128i l8[2] = { _mm_unpacklo_epi8(low, low), _mm_unpackhi_epi8(low, low) };
+
+                for (int i = 0; i < 4; i++) {
+                    __m128i t = (i & 1) ? _mm_unpackhi_epi16(t8[i/2], t8[i/2]) : _mm_unpacklo_epi16(t8[i/2], t8[i/2]);
+                    __m128i l = (i & 1) ? _mm_unpackhi_epi16(l8[i/2], l8[i/2]) : _mm_unpacklo_epi16(l8[i/2], l8[i/2]);
+
+                    for (int dy = 0; dy < tilesz; dy++) {
+                        int idx = (ty*tilesz + dy)*s + (tx0 + 4*i)*tilesz;
+                        __m128i v = _mm_loadu_si128((const __m128i*) &im->buf[idx]);
+
+                        // v > thresh ? 255 : 0
+                        __m128i bin = _mm_xor_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, t), zero),
+                                                    _mm_set1_epi8(-1));
+
+                        _mm_storeu_si128((__m128i*) &threshim->buf[idx],
+                                         _mm_or_si128(_mm_and_si128(l, gray), _mm_andnot_si128(l, bin)));
+                    }
+                }
+            }
+        }
+#endif
+
+        for (int tx = tx0; tx < tw; tx++) {
 
             int min = im_min[ty*tw + tx];
             int max = im_max[ty*tw + tx];
 
             // low contrast region? (no edges)
-            if (max - min < td->qtp.min_white_black_diff) {
+            if (max - min < st->td->qtp.min_white_black_diff) {
                 for (int dy = 0; dy < tilesz; dy++) {
                     int y = ty*tilesz + dy;
 
@@ -1308,90 +1438,123 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
     }
 
     // we skipped over the non-full-sized tiles above. Fix those now.
-    if (1) {
-        for (int y = 0; y < h; y++) {
+    int y1 = ty1 == th ? h : ty1*tilesz;
 
-            // what is the first x coordinate we need to process in this row?
+    for (int y = ty0*tilesz; y < y1; y++) {
 
-            int x0;
+        // what is the first x coordinate we need to process in this row?
 
-            if (y >= th*tilesz) {
-                x0 = 0; // we're at the bottom; do the whole row.
-            } else {
-                x0 = tw*tilesz; // we only need to do the right most part.
-            }
+        int x0;
 
-            // compute tile coordinates and clamp.
-            int ty = y / tilesz;
-            if (ty >= th)
-                ty = th - 1;
-
-            for (int x = x0; x < w; x++) {
-                int tx = x / tilesz;
-                if (tx >= tw)
-                    tx = tw - 1;
-
-                int max = im_max[ty*tw + tx];
-                int min = im_min[ty*tw + tx];
-                int thresh = min + (max - min) / 2;
-
-                uint8_t v = im->buf[y*s+x];
-                if (v > thresh)
-                    threshim->buf[y*s+x] = 255;
-                else
-                    threshim->buf[y*s+x] = 0;
-            }
+        if (y >= th*tilesz) {
+            x0 = 0; // we're at the bottom; do the whole row.
+        } else {
+            x0 = tw*tilesz; // we only need to do the right most part.
+        }
+
+        // compute tile coordinates and clamp.
+        int ty = y / tilesz;
+        if (ty >= th)
+            ty = th - 1;
+
+        for (int x = x0; x < w; x++) {
+            int tx = x / tilesz;
+            if (tx >= tw)
+                tx = tw - 1;
+
+            int max = im_max[ty*tw + tx];
+            int min = im_min[ty*tw + tx];
+            int thresh = min + (max - min) / 2;
+
+            uint8_t v = im->buf[y*s+x];
+            if (v > thresh)
+                threshim->buf[y*s+x] = 255;
+            else
+                threshim->buf[y*s+x] = 0;
         }
     }
+}
 
-    free(im_min);
-    free(im_max);
-
-    // this is a dilate/erode deglitching scheme that does not improve
-    // anything as far as I can tell.
-    if (0 || td->qtp.deglitch) {
-        image_u8_t *tmp = image_u8_create(w, h);
-
-        for (int y = 1; y + 1 < h; y++) {
-            for (int x = 1; x + 1 < w; x++) {
-                uint8_t max = 0;
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dx = -1; dx <= 1; dx++) {
-                        uint8_t v = threshim->buf[(y+dy)*s + x + dx];
-                        if (v > max)
-                            max = v;
-                    }
+// this is a dilate/erode deglitching scheme that does not improve
+// anything as far as I can tell.
+static void threshold_deglitch(image_u8_t *threshim)
+{
+    int w = threshim->width, h = threshim->height, s = threshim->stride;
+
+    image_u8_t *tmp = image_u8_create(w, h);
+
+    for (int y = 1; y + 1 < h; y++) {
+        for (int x = 1; x + 1 < w; x++) {
+            uint8_t max = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    uint8_t v = threshim->buf[(y+dy)*s + x + dx];
+                    if (v > max)
+                        max = v;
                 }
-                tmp->buf[y*s+x] = max;
             }
+            tmp->buf[y*s+x] = max;
         }
+    }
 
-        for (int y = 1; y + 1 < h; y++) {
-            for (int x = 1; x + 1 < w; x++) {
-                uint8_t min = 255;
-                for (int dy = -1; dy <= 1; dy++) {
-                    for (int dx = -1; dx <= 1; dx++) {
-                        uint8_t v = tmp->buf[(y+dy)*s + x + dx];
-                        if (v < min)
-                            min = v;
-                    }
+    for (int y = 1; y + 1 < h; y++) {
+        for (int x = 1; x + 1 < w; x++) {
+            uint8_t min = 255;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    uint8_t v = tmp->buf[(y+dy)*s + x + dx];
+                    if (v < min)
+                        min = v;
                 }
-                threshim->buf[y*s+x] = min;
             }
+            threshim->buf[y*s+x] = min;
         }
-
-        image_u8_destroy(tmp);
     }
 
-    timeprofile_stamp(td->tp, "threshold");
+    image_u8_destroy(tmp);
+}
 
-    return threshim;
+image_u8_t *threshold(const apriltag_detector_t *td, image_u8_t *im)
+{
+    // The idea is to find the maximum and minimum values in a
+    // window around each pixel. If it's a contrast-free region
+    // (max-min is small), don't try to binarize. Otherwise,
+    // threshold according to (max+min)/2.
+    //
+    // Mark low-contrast regions with value 127 so that we can skip
+    // future work on these areas too.
+
+    // however, computing max/min around every pixel is needlessly
+    // expensive. We compute max/min for tiles. To avoid artifacts
+    // that arise when high-contrast features appear near a tile
+    // edge (and thus moving from one tile to another results in a
+    // large change in max/min value), the max/min values used for
+    // any pixel are computed from all 3x3 surrounding tiles. Thus,
+    // the max/min sampling area for nearby pixels overlap by at least
+    // one tile.
+    //
+    // The important thing is that the windows be large enough to
+    // capture edge transitions; the tag does not need to fit into
+    // a tile.
+    struct threshold_state st;
+    threshold_init(&st, td, im);
+
+    threshold_tiles(&st, 0, st.th);
+    threshold_dilate(&st, 0, st.th);
+    threshold_binarize(&st, 0, st.th);
+
+    threshold_cleanup(&st);
+
+    if (0 || td->qtp.deglitch)
+        threshold_deglitch(st.threshim);
+
+    return st.threshim;
 }
 
 // basically the same as threshold(), but assumes the input image is a
 // bayer image. It collects statistics separately for each 2x2 block
 // of pixels. NOT WELL TESTED.
-image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
+image_u8_t *threshold_bayer(const apriltag_detector_t *td, image_u8_t *im)
 {
     int w = im->width, h = im->height, s = im->stride;
 
@@ -1502,72 +1665,29 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
         free(im_max[i]);
     }
 
-    timeprofile_stamp(td->tp, "threshold");
-
     return threshim;
 }
 
-zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
+// Groups the boundary points between each pair of adjacent black and
+// white components of threshim into clusters (zarrays of struct pt),
+// which the caller destroys.
+static zarray_t *gradient_clusters(apriltag_detect_ctx_t *ctx, image_u8_t *threshim,
+                                   unionfind_t *uf, int w, int h)
 {
-    ////////////////////////////////////////////////////////
-    // step 1. threshold the image, creating the edge image.
-
-    int w = im->width, h = im->height;
-
-    image_u8_t *threshim = threshold(td, im);
     int ts = threshim->stride;
 
-    if (td->debug)
-        image_u8_write_pnm(threshim, "debug_threshold.pnm");
-
-    ////////////////////////////////////////////////////////
-    // step 2. find connected components.
-
-    unionfind_t *uf = unionfind_create(w * h);
-
-    if (td->nthreads <= 1) {
-        for (int y = 0; y < h - 1; y++) {
-            do_unionfind_line(uf, threshim, h, w, ts, y);
-        }
-    } else {
-        int sz = h - 1;
-        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-        struct unionfind_task tasks[sz / chunksize + 1];
-
-        int ntasks = 0;
-
-        for (int i = 0; i < sz; i += chunksize) {
-            // each task will process [y0, y1). Note that this attaches
-            // each cell to the right and down, so row y1 *is* potentially modified.
-            //
-            // for parallelization, make sure that each task doesn't touch rows
-            // used by another thread.
-            tasks[ntasks].y0 = i;
-            tasks[ntasks].y1 = imin(sz, i + chunksize - 1);
-            tasks[ntasks].h = h;
-            tasks[ntasks].w = w;
-            tasks[ntasks].s = ts;
-            tasks[ntasks].uf = uf;
-            tasks[ntasks].im = threshim;
-
-            workerpool_add_task(td->wp, do_unionfind_task, &tasks[ntasks]);
-            ntasks++;
-        }
-
-        workerpool_run(td->wp);
-
-        // XXX stitch together the different chunks.
-        for (int i = 0; i + 1 < ntasks; i++) {
-            do_unionfind_line(uf, threshim, h, w, ts, tasks[i].y1);
-        }
-    }
-
-    timeprofile_stamp(td->tp, "unionfind");
-
     // XXX sizing??
     int nclustermap = 2*w*h - 1;
 
-    struct uint64_zarray_entry **clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
+    // The table is kept in ctx for the next call, and is all NULL
+    // again once the entries have been freed below.
+    if (ctx->clustermap_size < nclustermap) {
+        free(ctx->clustermap);
+        ctx->clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
+        ctx->clustermap_size = nclustermap;
+    }
+
+    struct uint64_zarray_entry **clustermap = ctx->clustermap;
 
     for (int y = 1; y < h-1; y++) {
         for (int x = 1; x < w-1; x++) {
@@ -1642,6 +1762,70 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     }
 #undef DO_CONN
 
+    // collect the clusters, and leave the table empty.
+    zarray_t *clusters = zarray_create(sizeof(zarray_t*)); //, uint64_zarray_hash_size(clustermap));
+    if (1) {
+        for (int i = 0; i < nclustermap; i++) {
+
+            for (struct uint64_zarray_entry *entry = clustermap[i]; entry; entry = entry->next) {
+                // XXX reject clusters here?
+                zarray_add(clusters, &entry->cluster);
+            }
+        }
+    }
+
+    if (1) {
+      for (int i = 0; i < nclustermap; i++) {
+        struct uint64_zarray_entry *entry = clustermap[i];
+        while (entry) {
+          struct uint64_zarray_entry *tmp = entry->next;
+          free(entry);
+          entry = tmp;
+        }
+        clustermap[i] = NULL;
+      }
+    }
+
+    return clusters;
+}
+
+// steps 2 onwards of apriltag_quad_thresh_fused, given the
+// thresholded image (which is destroyed).
+static zarray_t *quads_from_threshim(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                                     image_u8_t *im, image_u8_t *threshim)
+{
+    int w = im->width, h = im->height;
+    int ts = threshim->stride;
+
+    if (td->debug)
+        image_u8_write_pnm(threshim, "debug_threshold.pnm");
+
+    ////////////////////////////////////////////////////////
+    // step 2. find connected components.
+
+    // kept in ctx for the next call.
+    unionfind_t *uf = ctx->uf = unionfind_recreate(ctx->uf, w * h);
+
+    if (1) {
+        struct unionfind_task task = { .w = w, .h = h, .s = ts, .uf = uf, .im = threshim,
+                                       .stitch = calloc(h, sizeof(uint8_t)) };
+
+        // XXX tunable: minimum number of rows per range.
+        workerpool_parallel_for(ctx->wp, h - 1, 16, do_unionfind_task, &task);
+
+        // stitch together the different ranges.
+        for (int y = 0; y < h - 1; y++) {
+            if (task.stitch[y])
+                do_unionfind_line(uf, threshim, h, w, ts, y);
+        }
+
+        free(task.stitch);
+    }
+
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_UNIONFIND);
+
+    zarray_t *clusters = gradient_clusters(ctx, threshim, uf, w, h);
+
     image_u8_destroy(threshim);
 
     // make segmentation image.
@@ -1682,21 +1866,7 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         image_u8x3_destroy(d);
     }
 
-    timeprofile_stamp(td->tp, "make clusters");
-
-    ////////////////////////////////////////////////////////
-    // step 3. process each connected component.
-    zarray_t *clusters = zarray_create(sizeof(zarray_t*)); //, uint64_zarray_hash_size(clustermap));
-    if (1) {
-        for (int i = 0; i < nclustermap; i++) {
-
-            for (struct uint64_zarray_entry *entry = clustermap[i]; entry; entry = entry->next) {
-                // XXX reject clusters here?
-                zarray_add(clusters, &entry->cluster);
-            }
-        }
-    }
-
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_CLUSTERS);
 
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
@@ -1730,42 +1900,16 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
         image_u8x3_destroy(d);
     }
 
-    if (1) {
-      for (int i = 0; i < nclustermap; i++) {
-        struct uint64_zarray_entry *entry = clustermap[i];
-        while (entry) {
-          struct uint64_zarray_entry *tmp = entry->next;
-          free(entry);
-          entry = tmp;
-        }
-      }
-      free(clustermap);
-    }
-
+    ////////////////////////////////////////////////////////
+    // step 3. process each connected component.
     zarray_t *quads = zarray_create(sizeof(struct quad));
 
-    int sz = zarray_size(clusters);
-    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task tasks[sz / chunksize + 1];
-
-    int ntasks = 0;
-    for (int i = 0; i < sz; i += chunksize) {
-        tasks[ntasks].td = td;
-        tasks[ntasks].cidx0 = i;
-        tasks[ntasks].cidx1 = imin(sz, i + chunksize);
-        tasks[ntasks].h = h;
-        tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
-        tasks[ntasks].clusters = clusters;
-        tasks[ntasks].im = im;
-
-        workerpool_add_task(td->wp, do_quad_task, &tasks[ntasks]);
-        ntasks++;
-    }
+    struct quad_task task = { .clusters = clusters, .quads = quads, .td = td, .ctx = ctx,
+                              .w = w, .h = h, .im = im };
 
-    workerpool_run(td->wp);
+    workerpool_parallel_for(ctx->wp, zarray_size(clusters), 1, do_quad_task, &task);
 
-    timeprofile_stamp(td->tp, "fit quads to clusters");
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_FIT_QUADS);
 
     if (td->debug) {
         FILE *f = fopen("debug_lines.ps", "w");
@@ -1807,8 +1951,6 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     //        printf("  %d %d %d %d\n", indices[0], indices[1], indices[2], indices[3]);
 
-    unionfind_destroy(uf);
-
     for (int i = 0; i < zarray_size(clusters); i++) {
         zarray_t *cluster;
         zarray_get(clusters, i, &cluster);
@@ -1820,3 +1962,68 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     return quads;
 }
+
+// Find the quads of im_orig: decimate it into quad_im, filter quad_im,
+// threshold it (as threshold() does), then segment the thresholded
+// image and fit quads to its clusters. The first three steps run
+// together band by band: each band of rows is decimated, filtered and
+// thresholded while it is still in cache, instead of streaming the
+// whole image through memory three times.
+//
+// quad_im is either im_orig itself (no decimation, no filter), an
+// image of the same size as im_orig (no decimation) or an image
+// created by image_u8_decimate_create(im_orig, td->quad_decimate).
+// Unless it is im_orig, its rows are computed here from those of
+// im_orig. filter, if not NULL, filters quad_im in place.
+zarray_t *apriltag_quad_thresh_fused(const apriltag_detector_t *td, apriltag_detect_ctx_t *ctx,
+                                     image_u8_t *im_orig, image_u8_t *quad_im,
+                                     image_u8_filter_t *filter)
+{
+    // XXX tunable: rows of quad_im per band. Must be even (for
+    // decimation by 1.5).
+    const int band = 16;
+
+    int h = quad_im->height;
+
+    struct threshold_state st;
+    threshold_init(&st, td, quad_im);
+
+    // tile rows with statistics; tile rows thresholded.
+    int ntiles = 0, nbinarized = 0;
+
+    for (int y0 = 0; y0 < h; y0 += band) {
+        int y1 = imin(y0 + band, h);
+
+        if (quad_im != im_orig && td->quad_decimate > 1) {
+            image_u8_decimate_rows(quad_im, im_orig, td->quad_decimate, y0, y1);
+        } else if (quad_im != im_orig) {
+            for (int y = y0; y < y1; y++)
+                memcpy(&quad_im->buf[y*quad_im->stride], &im_orig->buf[y*im_orig->stride], quad_im->width);
+        }
+
+        // rows of quad_im that will not change anymore.
+        int nfinal = filter ? image_u8_filter_rows(filter, y1) : y1;
+
+        int ntiles1 = nfinal == h ? st.th : nfinal / THRESHOLD_TILESZ;
+        threshold_tiles(&st, ntiles, ntiles1);
+        ntiles = ntiles1;
+
+        // the 3x3 neighbourhood of a tile row includes the next one.
+        int nbinarized1 = ntiles == st.th ? st.th : imax(0, ntiles - 1);
+        threshold_dilate(&st, nbinarized, nbinarized1);
+        threshold_binarize(&st, nbinarized, nbinarized1);
+        nbinarized = nbinarized1;
+    }
+
+    threshold_cleanup(&st);
+
+    if (0 || td->qtp.deglitch)
+        threshold_deglitch(st.threshim);
+
+    apriltag_stage_stamp(ctx, APRILTAG_STAGE_FRONT_END);
+
+    if (td->debug)
+        image_u8_write_pnm(quad_im, "debug_preprocess.pnm");
+
+    return quads_from_threshim(td, ctx, quad_im, st.threshim);
+}
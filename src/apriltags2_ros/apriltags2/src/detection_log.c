@@ -0,0 +1,347 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detection_log.h"
+#include "matd.h"
+#include "string_util.h"
+
+// XXX tunable: stdio buffer of each file.
+#define DETECTION_LOG_BUFFER_SIZE (64*1024)
+
+struct detection_log
+{
+    FILE *f, *fidx;
+    char *fbuf, *fidxbuf;
+
+    int nstages;
+
+    uint64_t nframes;
+    uint64_t ndetections;
+
+    // the first detection of the current frame.
+    uint64_t frame_first;
+
+    // set on the first write error.
+    int err;
+};
+
+struct mapped_file
+{
+    uint8_t *base;
+    size_t len;
+
+    const struct detection_log_header *header;
+    uint64_t nrecords;
+};
+
+struct detection_log_reader
+{
+    struct mapped_file log, idx;
+};
+
+static FILE *create_file(const char *path, const char *magic, uint32_t record_size,
+                         int nstages, const char * const *stage_names, char **buf)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return NULL;
+
+    *buf = malloc(DETECTION_LOG_BUFFER_SIZE);
+    setvbuf(f, *buf, _IOFBF, DETECTION_LOG_BUFFER_SIZE);
+
+    uint8_t data[DETECTION_LOG_HEADER_SIZE] = { 0 };
+    struct detection_log_header *header = (struct detection_log_header*) data;
+
+    memcpy(header->magic, magic, sizeof(header->magic));
+    header->version = DETECTION_LOG_VERSION;
+    header->record_size = record_size;
+    header->nstages = nstages;
+    for (int i = 0; i < nstages; i++)
+        strncpy(header->stages[i], stage_names[i], DETECTION_LOG_STAGE_NAME_LEN - 1);
+
+    if (fwrite(data, 1, sizeof(data), f) != sizeof(data)) {
+        fclose(f);
+        free(*buf);
+        return NULL;
+    }
+
+    return f;
+}
+
+detection_log_t *detection_log_create(const char *path, int nstages, const char * const *stage_names)
+{
+    if (nstages < 0 || nstages > DETECTION_LOG_MAX_STAGES)
+        return NULL;
+
+    detection_log_t *log = calloc(1, sizeof(detection_log_t));
+    log->nstages = nstages;
+
+    char *idxpath = str_concat(path, ".idx");
+
+    log->f = create_file(path, DETECTION_LOG_MAGIC, sizeof(struct detection_log_record),
+                         nstages, stage_names, &log->fbuf);
+    if (log->f != NULL)
+        log->fidx = create_file(idxpath, DETECTION_LOG_INDEX_MAGIC, sizeof(struct detection_log_frame),
+                                nstages, stage_names, &log->fidxbuf);
+
+    free(idxpath);
+
+    if (log->fidx == NULL) {
+        if (log->f != NULL)
+            fclose(log->f);
+        free(log->fbuf);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+int detection_log_add_detection(detection_log_t *log, const apriltag_detection_t *det,
+                                const double pose_t[3], const double pose_q[4])
+{
+    struct detection_log_record rec;
+    memset(&rec, 0, sizeof(rec));
+
+    rec.frame = log->nframes;
+    rec.id = det->id;
+    rec.hamming = det->hamming;
+    strncpy(rec.family, det->family->name, sizeof(rec.family) - 1);
+    rec.decision_margin = det->decision_margin;
+
+    memcpy(rec.c, det->c, sizeof(rec.c));
+    memcpy(rec.p, det->p, sizeof(rec.p));
+    if (det->H != NULL && det->H->nrows == 3 && det->H->ncols == 3)
+        memcpy(rec.H, det->H->data, sizeof(rec.H));
+
+    if (pose_t != NULL && pose_q != NULL) {
+        rec.flags |= DETECTION_LOG_POSE_VALID;
+        memcpy(rec.pose_t, pose_t, sizeof(rec.pose_t));
+        memcpy(rec.pose_q, pose_q, sizeof(rec.pose_q));
+    }
+
+    if (fwrite(&rec, sizeof(rec), 1, log->f) != 1) {
+        log->err = 1;
+        return -1;
+    }
+
+    log->ndetections++;
+    return 0;
+}
+
+int detection_log_add_frame(detection_log_t *log, uint32_t stream, int64_t timestamp_ns,
+                            const int64_t *stage_ns)
+{
+    struct detection_log_frame frame;
+    memset(&frame, 0, sizeof(frame));
+
+    frame.timestamp_ns = timestamp_ns;
+    frame.first = log->frame_first;
+    frame.ndetections = log->ndetections - log->frame_first;
+    frame.stream = stream;
+    if (stage_ns != NULL)
+        memcpy(frame.stage_ns, stage_ns, log->nstages * sizeof(int64_t));
+
+    if (fwrite(&frame, sizeof(frame), 1, log->fidx) != 1) {
+        log->err = 1;
+        return -1;
+    }
+
+    log->nframes++;
+    log->frame_first = log->ndetections;
+    return 0;
+}
+
+int detection_log_flush(detection_log_t *log)
+{
+    // the detections first, so that the index never points past them.
+    if (fflush(log->f) || fflush(log->fidx))
+        log->err = 1;
+
+    return log->err ? -1 : 0;
+}
+
+int detection_log_destroy(detection_log_t *log)
+{
+    if (log == NULL)
+        return 0;
+
+    int res = detection_log_flush(log);
+
+    if (fclose(log->f) || fclose(log->fidx))
+        res = -1;
+
+    free(log->fbuf);
+    free(log->fidxbuf);
+    free(log);
+
+    return res;
+}
+
+////////////////////////////////////////////////////////////
+
+static int map_file(struct mapped_file *m, const char *path, const char *magic, uint32_t record_size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < DETECTION_LOG_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+
+    m->len = st.st_size;
+    m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (m->base == MAP_FAILED) {
+        m->base = NULL;
+        return -1;
+    }
+
+    m->header = (const struct detection_log_header*) m->base;
+    if (memcmp(m->header->magic, magic, sizeof(m->header->magic)) ||
+        m->header->version != DETECTION_LOG_VERSION ||
+        m->header->record_size != record_size ||
+        m->header->nstages > DETECTION_LOG_MAX_STAGES) {
+        munmap(m->base, m->len);
+        m->base = NULL;
+        return -1;
+    }
+
+    m->nrecords = (m->len - DETECTION_LOG_HEADER_SIZE) / record_size;
+
+    // we'll be scanning through it.
+    madvise(m->base, m->len, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+detection_log_reader_t *detection_log_open(const char *path)
+{
+    detection_log_reader_t *r = calloc(1, sizeof(detection_log_reader_t));
+    char *idxpath = str_concat(path, ".idx");
+
+    int res = map_file(&r->log, path, DETECTION_LOG_MAGIC, sizeof(struct detection_log_record));
+    if (res == 0)
+        res = map_file(&r->idx, idxpath, DETECTION_LOG_INDEX_MAGIC, sizeof(struct detection_log_frame));
+
+    free(idxpath);
+
+    if (res == 0 && r->log.header->nstages != r->idx.header->nstages)
+        res = -1;
+
+    if (res) {
+        detection_log_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void detection_log_close(detection_log_reader_t *r)
+{
+    if (r == NULL)
+        return;
+
+    if (r->log.base != NULL)
+        munmap(r->log.base, r->log.len);
+    if (r->idx.base != NULL)
+        munmap(r->idx.base, r->idx.len);
+    free(r);
+}
+
+int detection_log_nstages(const detection_log_reader_t *r)
+{
+    return r->idx.header->nstages;
+}
+
+const char *detection_log_stage_name(const detection_log_reader_t *r, int stage)
+{
+    if (stage < 0 || stage >= (int) r->idx.header->nstages)
+        return NULL;
+
+    return r->idx.header->stages[stage];
+}
+
+uint64_t detection_log_nframes(const detection_log_reader_t *r)
+{
+    return r->idx.nrecords;
+}
+
+uint64_t detection_log_ndetections(const detection_log_reader_t *r)
+{
+    return r->log.nrecords;
+}
+
+const struct detection_log_frame *detection_log_get_frame(const detection_log_reader_t *r, uint64_t i)
+{
+    if (i >= r->idx.nrecords)
+        return NULL;
+
+    return (const struct detection_log_frame*) &r->idx.base[DETECTION_LOG_HEADER_SIZE +
+                                                            i * sizeof(struct detection_log_frame)];
+}
+
+const struct detection_log_record *detection_log_get_detection(const detection_log_reader_t *r, uint64_t i)
+{
+    if (i >= r->log.nrecords)
+        return NULL;
+
+    return (const struct detection_log_record*) &r->log.base[DETECTION_LOG_HEADER_SIZE +
+                                                             i * sizeof(struct detection_log_record)];
+}
+
+const struct detection_log_record *detection_log_get_frame_detections(const detection_log_reader_t *r,
+                                                                      uint64_t i, uint32_t *n)
+{
+    *n = 0;
+
+    const struct detection_log_frame *frame = detection_log_get_frame(r, i);
+    if (frame == NULL || frame->first >= r->log.nrecords)
+        return NULL;
+
+    uint64_t avail = r->log.nrecords - frame->first;
+    *n = frame->ndetections < avail ? frame->ndetections : avail;
+
+    return detection_log_get_detection(r, frame->first);
+}
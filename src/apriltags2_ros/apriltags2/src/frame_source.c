@@ -0,0 +1,453 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_source.h"
+#include "image_u8_mmap.h"
+#include "pjpeg.h"
+#include "time_util.h"
+
+// XXX tunable: how much MJPEG input is read at a time.
+#define FRAME_SOURCE_READ_SIZE (256*1024)
+
+enum { SLOT_FREE, SLOT_READY, SLOT_TAKEN };
+
+struct frame_slot
+{
+    int state;
+
+    // Y8: a buffer reused from frame to frame. MJPEG: the last frame
+    // decoded into this slot (pjpeg allocates each one). PGM: the
+    // mapped file, unmapped on release.
+    image_u8_t *im;
+
+    int64_t index;
+    int64_t ready_ns;
+};
+
+struct frame_source
+{
+    // read the next frame into slot. Returns 1 on success, 0 at the
+    // end of the stream, -1 if a frame had to be skipped.
+    int (*read)(frame_source_t *fs, struct frame_slot *slot);
+
+    // back to the beginning of the stream. Returns 0 on failure.
+    int (*rewind)(frame_source_t *fs);
+
+    void (*release)(frame_source_t *fs, struct frame_slot *slot);
+    void (*destroy_im)(image_u8_t *im);
+
+    // Y8 and MJPEG
+    FILE *f;
+    int width, height;
+
+    // MJPEG: input read but not consumed yet is buf[bufpos, buflen).
+    uint8_t *buf;
+    size_t bufpos, buflen, bufcap;
+
+    // PGM
+    char *path;
+    image_u8_prefetch_t *pf;
+
+    int nbuffers;
+    struct frame_slot *slots;
+
+    // passes over the stream still to make after the current one,
+    // and frames produced by the current pass.
+    int loops_left;
+    int64_t pass_nframes;
+
+    // bytes read since the reader thread last held the mutex, added
+    // to stats.nbytes when it next does. Touched by that thread only.
+    uint64_t read_nbytes;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // the index of the next frame to be read, and of the next to be
+    // returned by frame_source_next. Frame i goes in slots[i % nbuffers].
+    int64_t next_read;
+    int64_t next_take;
+
+    int eof;
+    int stop;
+
+    frame_source_stats_t stats;
+};
+
+////////////////////////////////////////////////////////////
+// raw Y8
+
+static int y8_read(frame_source_t *fs, struct frame_slot *slot)
+{
+    if (slot->im == NULL)
+        slot->im = image_u8_create_stride(fs->width, fs->height, fs->width);
+
+    size_t len = (size_t) fs->width * fs->height;
+    if (fread(slot->im->buf, 1, len, fs->f) != len)
+        return 0; // a partial frame at the end is dropped.
+
+    fs->read_nbytes += len;
+    return 1;
+}
+
+static int file_rewind(frame_source_t *fs)
+{
+    fs->bufpos = fs->buflen = 0;
+    return fseek(fs->f, 0, SEEK_SET) == 0;
+}
+
+////////////////////////////////////////////////////////////
+// MJPEG
+
+// read more input into buf, keeping buf[bufpos, buflen). Returns the
+// number of bytes read.
+static size_t mjpeg_fill(frame_source_t *fs)
+{
+    if (fs->bufpos > 0) {
+        memmove(fs->buf, &fs->buf[fs->bufpos], fs->buflen - fs->bufpos);
+        fs->buflen -= fs->bufpos;
+        fs->bufpos = 0;
+    }
+
+    if (fs->bufcap - fs->buflen < FRAME_SOURCE_READ_SIZE) {
+        fs->bufcap = fs->buflen + 2*FRAME_SOURCE_READ_SIZE;
+        fs->buf = realloc(fs->buf, fs->bufcap);
+    }
+
+    size_t n = fread(&fs->buf[fs->buflen], 1, FRAME_SOURCE_READ_SIZE, fs->f);
+    fs->buflen += n;
+    fs->read_nbytes += n;
+    return n;
+}
+
+// find the next JPEG: from an SOI marker (ff d8) to the next EOI
+// marker (ff d9). Neither can occur inside the entropy-coded data,
+// where an ff is always followed by 00 or a RST marker.
+static int mjpeg_next(frame_source_t *fs, size_t *start, size_t *end)
+{
+    // look for the SOI, dropping anything before it.
+    while (1) {
+        size_t i = fs->bufpos;
+        while (i + 1 < fs->buflen && !(fs->buf[i] == 0xff && fs->buf[i+1] == 0xd8))
+            i++;
+        fs->bufpos = i;
+
+        if (i + 1 < fs->buflen)
+            break;
+        if (mjpeg_fill(fs) == 0)
+            return 0;
+    }
+
+    // then for the EOI, from where we left off when we need more input.
+    size_t i = fs->bufpos + 2;
+    while (1) {
+        while (i + 1 < fs->buflen && !(fs->buf[i] == 0xff && fs->buf[i+1] == 0xd9))
+            i++;
+
+        if (i + 1 < fs->buflen)
+            break;
+
+        size_t off = i - fs->bufpos;
+        if (mjpeg_fill(fs) == 0)
+            return 0; // a truncated JPEG at the end is dropped.
+        i = fs->bufpos + off;
+    }
+
+    *start = fs->bufpos;
+    *end = i + 2;
+    return 1;
+}
+
+static int mjpeg_read(frame_source_t *fs, struct frame_slot *slot)
+{
+    size_t start, end;
+    if (!mjpeg_next(fs, &start, &end))
+        return 0;
+
+    fs->bufpos = end;
+
+    // the frames of most cameras have no Huffman tables (DHT) and rely
+    // on the standard ones; a frame's own tables still take precedence.
+    int err = 0;
+    image_u8_t *im = pjpeg_create_u8_from_buffer(&fs->buf[start], end - start, PJPEG_MJPEG, &err);
+    if (im == NULL)
+        return -1;
+
+    image_u8_destroy(slot->im);
+    slot->im = im;
+    return 1;
+}
+
+////////////////////////////////////////////////////////////
+// PGM files
+
+static int pgm_read(frame_source_t *fs, struct frame_slot *slot)
+{
+    slot->im = image_u8_prefetch_next(fs->pf, NULL);
+    if (slot->im == NULL)
+        return 0;
+
+    fs->read_nbytes += (uint64_t) slot->im->width * slot->im->height;
+    return 1;
+}
+
+static int pgm_rewind(frame_source_t *fs)
+{
+    int depth = fs->nbuffers;
+    image_u8_prefetch_destroy(fs->pf);
+    fs->pf = image_u8_prefetch_create(fs->path, depth);
+    return 1;
+}
+
+static void pgm_release(frame_source_t *fs, struct frame_slot *slot)
+{
+    image_u8_unmap(slot->im);
+    slot->im = NULL;
+}
+
+////////////////////////////////////////////////////////////
+
+static void *frame_source_thread(void *p)
+{
+    frame_source_t *fs = p;
+
+    pthread_mutex_lock(&fs->mutex);
+
+    while (!fs->stop) {
+        struct frame_slot *slot = &fs->slots[fs->next_read % fs->nbuffers];
+        if (slot->state != SLOT_FREE) {
+            pthread_cond_wait(&fs->cond, &fs->mutex);
+            continue;
+        }
+
+        // the slot is ours until we mark it ready.
+        pthread_mutex_unlock(&fs->mutex);
+
+        int64_t t0 = ntime_now();
+        int res = fs->read(fs, slot);
+
+        // start the next pass, unless this one was empty.
+        if (res == 0 && fs->loops_left > 0 && fs->pass_nframes > 0 && fs->rewind(fs)) {
+            fs->loops_left--;
+            fs->pass_nframes = 0;
+            res = fs->read(fs, slot);
+        }
+
+        int64_t t1 = ntime_now();
+
+        pthread_mutex_lock(&fs->mutex);
+
+        fs->stats.read_ns += t1 - t0;
+        fs->stats.nbytes += fs->read_nbytes;
+        fs->read_nbytes = 0;
+
+        if (res == 0) {
+            fs->eof = 1;
+            pthread_cond_broadcast(&fs->cond);
+            break;
+        }
+
+        if (res < 0) {
+            fs->stats.nerrors++;
+            continue;
+        }
+
+        slot->index = fs->next_read++;
+        slot->ready_ns = t1;
+        slot->state = SLOT_READY;
+        fs->pass_nframes++;
+        fs->stats.nframes++;
+        pthread_cond_broadcast(&fs->cond);
+    }
+
+    pthread_mutex_unlock(&fs->mutex);
+    return NULL;
+}
+
+static frame_source_t *frame_source_create(int nbuffers, int loop)
+{
+    frame_source_t *fs = calloc(1, sizeof(frame_source_t));
+    fs->nbuffers = nbuffers > 0 ? nbuffers : 1;
+    fs->slots = calloc(fs->nbuffers, sizeof(struct frame_slot));
+    fs->loops_left = loop > 1 ? loop - 1 : 0;
+    fs->destroy_im = image_u8_destroy;
+
+    return fs;
+}
+
+static void frame_source_start(frame_source_t *fs)
+{
+    pthread_mutex_init(&fs->mutex, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+    pthread_create(&fs->thread, NULL, frame_source_thread, fs);
+}
+
+frame_source_t *frame_source_create_y8(const char *path, int width, int height, int nbuffers, int loop)
+{
+    if (width <= 0 || height <= 0)
+        return NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    frame_source_t *fs = frame_source_create(nbuffers, loop);
+    fs->f = f;
+    fs->width = width;
+    fs->height = height;
+    fs->read = y8_read;
+    fs->rewind = file_rewind;
+
+    frame_source_start(fs);
+    return fs;
+}
+
+frame_source_t *frame_source_create_mjpeg(const char *path, int nbuffers, int loop)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    frame_source_t *fs = frame_source_create(nbuffers, loop);
+    fs->f = f;
+    fs->read = mjpeg_read;
+    fs->rewind = file_rewind;
+
+    frame_source_start(fs);
+    return fs;
+}
+
+frame_source_t *frame_source_create_pgm(const char *path, int nbuffers, int loop)
+{
+    frame_source_t *fs = frame_source_create(nbuffers, loop);
+    fs->path = strdup(path);
+    fs->pf = image_u8_prefetch_create(path, fs->nbuffers);
+    fs->read = pgm_read;
+    fs->rewind = pgm_rewind;
+    fs->release = pgm_release;
+    fs->destroy_im = image_u8_unmap;
+
+    frame_source_start(fs);
+    return fs;
+}
+
+int frame_source_next(frame_source_t *fs, frame_source_frame_t *frame)
+{
+    int64_t t0 = ntime_now();
+    int res = 0;
+
+    pthread_mutex_lock(&fs->mutex);
+
+    while (1) {
+        struct frame_slot *slot = &fs->slots[fs->next_take % fs->nbuffers];
+
+        if (slot->state == SLOT_READY && slot->index == fs->next_take) {
+            slot->state = SLOT_TAKEN;
+
+            frame->im = slot->im;
+            frame->index = slot->index;
+            frame->ready_ns = slot->ready_ns;
+            frame->slot = fs->next_take % fs->nbuffers;
+
+            fs->next_take++;
+            res = 1;
+            break;
+        }
+
+        if (fs->eof && fs->next_take >= fs->next_read)
+            break;
+
+        pthread_cond_wait(&fs->cond, &fs->mutex);
+    }
+
+    fs->stats.wait_ns += ntime_now() - t0;
+
+    pthread_mutex_unlock(&fs->mutex);
+
+    return res;
+}
+
+void frame_source_release(frame_source_t *fs, frame_source_frame_t *frame)
+{
+    pthread_mutex_lock(&fs->mutex);
+
+    struct frame_slot *slot = &fs->slots[frame->slot];
+    if (fs->release)
+        fs->release(fs, slot);
+    slot->state = SLOT_FREE;
+
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->mutex);
+
+    frame->im = NULL;
+}
+
+void frame_source_get_stats(frame_source_t *fs, frame_source_stats_t *stats)
+{
+    pthread_mutex_lock(&fs->mutex);
+    memcpy(stats, &fs->stats, sizeof(frame_source_stats_t));
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+void frame_source_destroy(frame_source_t *fs)
+{
+    if (fs == NULL)
+        return;
+
+    pthread_mutex_lock(&fs->mutex);
+    fs->stop = 1;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->mutex);
+
+    pthread_join(fs->thread, NULL);
+
+    for (int i = 0; i < fs->nbuffers; i++)
+        fs->destroy_im(fs->slots[i].im);
+
+    pthread_mutex_destroy(&fs->mutex);
+    pthread_cond_destroy(&fs->cond);
+
+    if (fs->f != NULL)
+        fclose(fs->f);
+    image_u8_prefetch_destroy(fs->pf);
+
+    free(fs->path);
+    free(fs->buf);
+    free(fs->slots);
+    free(fs);
+}
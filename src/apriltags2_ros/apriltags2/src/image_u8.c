@@ -36,6 +36,13 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <string.h>
 #include <math.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include "common/image_u8.h"
 #include "common/pnm.h"
 #include "common/math_util.h"
@@ -84,6 +91,18 @@ image_u8_t *image_u8_copy(const image_u8_t *in)
     return copy;
 }
 
+image_u8_t *image_u8_copy_region(const image_u8_t *in, int x0, int y0, int width, int height)
+{
+    assert(x0 >= 0 && y0 >= 0 && x0 + width <= in->width && y0 + height <= in->height);
+
+    image_u8_t *copy = image_u8_create(width, height);
+
+    for (int y = 0; y < height; y++)
+        memcpy(&copy->buf[y*copy->stride], &in->buf[(y0 + y)*in->stride + x0], width);
+
+    return copy;
+}
+
 void image_u8_destroy(image_u8_t *im)
 {
     if (!im)
@@ -299,57 +318,231 @@ void image_u8_darken(image_u8_t *im)
     }
 }
 
-static void convolve(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz)
+// dst[x] = (k[0]*src[0][x] + ... + k[ksz-1]*src[ksz-1][x]) >> 8, for
+// 0 <= x < n. The same code serves the row pass (src[j] = row + j)
+// and the column pass (src[j] = row j of the window). When simd is
+// set, the sums are accumulated 16 bits wide, which is exact as long
+// as the taps add up to at most 257.
+static void convolve_taps(uint8_t *dst, const uint8_t **src, int n,
+                          const uint8_t *k, int ksz, int simd)
 {
-    assert((ksz&1)==1);
+    int x = 0;
+
+#ifdef __AVX2__
+    if (simd) {
+        __m256i kv[ksz];
+        for (int j = 0; j < ksz; j++)
+            kv[j] = _mm256_set1_epi16(k[j]);
+
+        for (; x + 16 <= n; x += 16) {
+            __m256i acc = _mm256_setzero_si256();
+
+            for (int j = 0; j < ksz; j++) {
+                __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) &src[j][x]));
+                acc = _mm256_add_epi16(acc, _mm256_mullo_epi16(v, kv[j]));
+            }
+
+            acc = _mm256_srli_epi16(acc, 8);
+            _mm_storeu_si128((__m128i*) &dst[x],
+                             _mm_packus_epi16(_mm256_castsi256_si128(acc),
+                                              _mm256_extracti128_si256(acc, 1)));
+        }
+    }
+#elif defined(__SSE2__)
+    if (simd) {
+        __m128i kv[ksz];
+        for (int j = 0; j < ksz; j++)
+            kv[j] = _mm_set1_epi16(k[j]);
 
-    for (int i = 0; i < ksz/2 && i < sz; i++)
-        y[i] = x[i];
+        __m128i zero = _mm_setzero_si128();
 
-    for (int i = 0; i < sz - ksz; i++) {
+        for (; x + 16 <= n; x += 16) {
+            __m128i lo = zero, hi = zero;
+
+            for (int j = 0; j < ksz; j++) {
+                __m128i v = _mm_loadu_si128((const __m128i*) &src[j][x]);
+                lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), kv[j]));
+                hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), kv[j]));
+            }
+
+            _mm_storeu_si128((__m128i*) &dst[x],
+                             _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+        }
+    }
+#endif
+
+    for (; x < n; x++) {
         uint32_t acc = 0;
 
         for (int j = 0; j < ksz; j++)
-            acc += k[j]*x[i+j];
+            acc += k[j]*src[j][x];
+
+        dst[x] = acc >> 8;
+    }
+}
+
+// y[x] = clamp(2*y[x] - blur[x], 0, 255)
+static void sharpen_row(uint8_t *y, const uint8_t *blur, int n, int simd)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    if (simd) {
+        __m128i zero = _mm_setzero_si128();
+
+        for (; x + 16 <= n; x += 16) {
+            __m128i o = _mm_loadu_si128((const __m128i*) &y[x]);
+            __m128i b = _mm_loadu_si128((const __m128i*) &blur[x]);
 
-        y[ksz/2 + i] = acc >> 8;
+            __m128i lo = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(o, zero), 1),
+                                       _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_sub_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(o, zero), 1),
+                                       _mm_unpackhi_epi8(b, zero));
+
+            // packus saturates to [0, 255]
+            _mm_storeu_si128((__m128i*) &y[x], _mm_packus_epi16(lo, hi));
+        }
     }
+#endif
 
-    for (int i = sz - ksz + ksz/2; i < sz; i++)
-        y[i] = x[i];
+    for (; x < n; x++) {
+        int v = 2*y[x] - blur[x];
+        if (v < 0)
+            v = 0;
+        if (v > 255)
+            v = 255;
+        y[x] = v;
+    }
 }
 
-void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz)
+// Separable convolution with the 8-bit kernel k (taps summing to
+// about 256), first along rows, then along columns. As in the
+// original implementation, the first ksz/2 and the last ksz/2+1
+// pixels of each row (column) are left unfiltered.
+//
+// The image is processed top to bottom in one pass: each row is
+// filtered horizontally into a ring of the last ksz rows, and output
+// row y is written as soon as row y + ksz/2 is in the ring. No
+// transposed copy of the image is needed, and the column pass runs
+// along rows too. When sharpen is set, the result is the unsharp mask
+// 2*im - blur(im) instead; row y of im still holds its original
+// values when output row y is computed, so no copy of the image is
+// needed either.
+struct image_u8_filter
+{
+    image_u8_t *im;
+    int ksz;
+    uint8_t *k;
+    int sharpen, simd;
+
+    uint8_t *ring; // ksz horizontally filtered rows
+    uint8_t *blur; // one output row, when sharpening
+
+    int nin;  // rows of im consumed so far
+    int nout; // rows of im that are final
+};
+
+static image_u8_filter_t *filter_create(image_u8_t *im, const uint8_t *k, int ksz, int sharpen, int simd)
 {
     assert((ksz & 1) == 1); // ksz must be odd.
 
-    for (int y = 0; y < im->height; y++) {
+    image_u8_filter_t *f = calloc(1, sizeof(image_u8_filter_t));
+    f->im = im;
+    f->ksz = ksz;
+    f->k = malloc(ksz);
+    memcpy(f->k, k, ksz);
+    f->sharpen = sharpen;
+
+    // 16 bit accumulators overflow for larger kernels.
+    int ksum = 0;
+    for (int j = 0; j < ksz; j++)
+        ksum += k[j];
+    f->simd = simd && ksum <= 257;
+
+    f->ring = malloc((size_t) ksz * im->width + im->width);
+    f->blur = &f->ring[ksz * im->width];
+
+    return f;
+}
 
-        uint8_t x[im->stride];
-        memcpy(x, &im->buf[y*im->stride], im->stride);
+static void filter_output_row(image_u8_filter_t *f, int oy)
+{
+    image_u8_t *im = f->im;
+    int width = im->width, height = im->height;
+    int ksz = f->ksz, r = ksz / 2;
 
-        convolve(x, &im->buf[y*im->stride], im->width, k, ksz);
+    uint8_t *out = &im->buf[oy*im->stride];
+    uint8_t *dst = f->sharpen ? f->blur : out;
+
+    if (oy - r >= 0 && oy - r < height - ksz) {
+        const uint8_t *taps[ksz];
+        for (int j = 0; j < ksz; j++)
+            taps[j] = &f->ring[((oy - r + j) % ksz) * width];
+        convolve_taps(dst, taps, width, f->k, ksz, f->simd);
+    } else {
+        memcpy(dst, &f->ring[(oy % ksz) * width], width);
     }
 
-    for (int x = 0; x < im->width; x++) {
-        uint8_t xb[im->height];
-        uint8_t yb[im->height];
+    if (f->sharpen)
+        sharpen_row(out, f->blur, width, f->simd);
+}
+
+int image_u8_filter_rows(image_u8_filter_t *f, int nrows)
+{
+    image_u8_t *im = f->im;
+    int width = im->width, height = im->height;
+    int ksz = f->ksz, r = ksz / 2;
+
+    for (; f->nin < nrows; f->nin++) {
+        int y = f->nin;
+        const uint8_t *in = &im->buf[y*im->stride];
+        uint8_t *row = &f->ring[(y % ksz) * width];
 
-        for (int y = 0; y < im->height; y++)
-            xb[y] = im->buf[y*im->stride + x];
+        memcpy(row, in, width);
 
-        convolve(xb, yb, im->height, k, ksz);
+        const uint8_t *taps[ksz];
+        for (int j = 0; j < ksz; j++)
+            taps[j] = &in[j];
+        convolve_taps(&row[r], taps, width - ksz, f->k, ksz, f->simd);
+
+        if (y - r >= 0)
+            filter_output_row(f, f->nout++);
+    }
 
-        for (int y = 0; y < im->height; y++)
-            im->buf[y*im->stride + x] = yb[y];
+    // the bottom rows depend on no rows below the image.
+    if (f->nin == height) {
+        while (f->nout < height)
+            filter_output_row(f, f->nout++);
     }
+
+    return f->nout;
 }
 
-void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+void image_u8_filter_destroy(image_u8_filter_t *f)
 {
-    if (sigma == 0)
+    if (f == NULL)
         return;
 
+    free(f->k);
+    free(f->ring);
+    free(f);
+}
+
+image_u8_filter_t *image_u8_filter_create(image_u8_t *im, const uint8_t *k, int ksz, int sharpen)
+{
+    return filter_create(im, k, ksz, sharpen, 1);
+}
+
+void image_u8_convolve_2D(image_u8_t *im, const uint8_t *k, int ksz)
+{
+    image_u8_filter_t *f = filter_create(im, k, ksz, 0, 1);
+    image_u8_filter_rows(f, im->height);
+    image_u8_filter_destroy(f);
+}
+
+// 8-bit Gaussian kernel of size ksz: taps sum to at most 255.
+static void gaussian_kernel(double sigma, int ksz, uint8_t *k)
+{
     assert((ksz & 1) == 1); // ksz must be odd.
 
     // build the kernel.
@@ -371,7 +564,6 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
     for (int i = 0; i < ksz; i++)
         dk[i] /= acc;
 
-    uint8_t k[ksz];
     for (int i = 0; i < ksz; i++)
         k[i] = dk[i]*255;
 
@@ -379,8 +571,50 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
         for (int i = 0; i < ksz; i++)
             printf("%d %15f %5d\n", i, dk[i], k[i]);
     }
+}
+
+static void gaussian_filter(image_u8_t *im, double sigma, int ksz, int sharpen, int simd)
+{
+    if (sigma == 0)
+        return;
+
+    uint8_t k[ksz];
+    gaussian_kernel(sigma, ksz, k);
+
+    image_u8_filter_t *f = filter_create(im, k, ksz, sharpen, simd);
+    image_u8_filter_rows(f, im->height);
+    image_u8_filter_destroy(f);
+}
+
+image_u8_filter_t *image_u8_gaussian_filter_create(image_u8_t *im, double sigma, int ksz, int sharpen)
+{
+    if (sigma == 0)
+        return NULL;
+
+    uint8_t k[ksz];
+    gaussian_kernel(sigma, ksz, k);
+
+    return filter_create(im, k, ksz, sharpen, 1);
+}
 
-    image_u8_convolve_2D(im, k, ksz);
+void image_u8_gaussian_blur(image_u8_t *im, double sigma, int ksz)
+{
+    gaussian_filter(im, sigma, ksz, 0, 1);
+}
+
+void image_u8_gaussian_blur_scalar(image_u8_t *im, double sigma, int ksz)
+{
+    gaussian_filter(im, sigma, ksz, 0, 0);
+}
+
+void image_u8_gaussian_sharpen(image_u8_t *im, double sigma, int ksz)
+{
+    gaussian_filter(im, sigma, ksz, 1, 1);
+}
+
+void image_u8_gaussian_sharpen_scalar(image_u8_t *im, double sigma, int ksz)
+{
+    gaussian_filter(im, sigma, ksz, 1, 0);
 }
 
 image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
@@ -520,18 +754,494 @@ void neon_decimate4(uint8_t * __restrict dest, int destwidth, int destheight, in
 
 #endif
 
-image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
+#ifdef __SSE2__
+
+// The x86 kernels below produce exactly the same output as the plain
+// C code in image_u8_decimate. Each processes as many whole blocks of
+// output pixels per row as fit, starting at output column x0, and
+// returns the column at which the plain C code must take over.
+
+// Gather every third byte of 96 bytes: on return, v[0..1] hold bytes
+// 0, 3, 6, ..., v[2..3] bytes 1, 4, 7, ... and v[4..5] bytes 2, 5, 8,
+// ... Five rounds of the same byte interleave do this.
+static inline void sse2_deinterleave3(__m128i *v)
 {
-    int width = im->width, height = im->height;
+    __m128i a0 = v[0], a1 = v[1], a2 = v[2], a3 = v[3], a4 = v[4], a5 = v[5];
+
+    for (int r = 0; r < 5; r++) {
+        __m128i t0 = _mm_unpacklo_epi8(a0, a3), t1 = _mm_unpackhi_epi8(a0, a3);
+        __m128i t2 = _mm_unpacklo_epi8(a1, a4), t3 = _mm_unpackhi_epi8(a1, a4);
+        __m128i t4 = _mm_unpacklo_epi8(a2, a5), t5 = _mm_unpackhi_epi8(a2, a5);
+        a0 = t0; a1 = t1; a2 = t2; a3 = t3; a4 = t4; a5 = t5;
+    }
+
+    v[0] = a0; v[1] = a1; v[2] = a2; v[3] = a3; v[4] = a4; v[5] = a5;
+}
+
+// Gather every fourth byte of 64 bytes into v[0], ..., v[3]: four
+// rounds of the same byte interleave.
+static inline void sse2_deinterleave4(__m128i *v)
+{
+    __m128i a0 = v[0], a1 = v[1], a2 = v[2], a3 = v[3];
+
+    for (int r = 0; r < 4; r++) {
+        __m128i t0 = _mm_unpacklo_epi8(a0, a2), t1 = _mm_unpackhi_epi8(a0, a2);
+        __m128i t2 = _mm_unpacklo_epi8(a1, a3), t3 = _mm_unpackhi_epi8(a1, a3);
+        a0 = t0; a1 = t1; a2 = t2; a3 = t3;
+    }
+
+    v[0] = a0; v[1] = a1; v[2] = a2; v[3] = a3;
+}
+
+// blocks of 16 output pixels.
+static int sse2_decimate2(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    const __m128i lomask = _mm_set1_epi16(0x00ff);
+    int x1 = x0 + (destwidth - x0) / 16 * 16;
+
+    for (int y = 0; y < destheight; y++) {
+        const uint8_t *row0 = src + 2*y*srcstride, *row1 = row0 + srcstride;
+
+        for (int x = x0; x < x1; x += 16) {
+            __m128i sum[2];
+            for (int k = 0; k < 2; k++) {
+                __m128i a = _mm_loadu_si128((const __m128i*) (row0 + 2*x + 16*k));
+                __m128i b = _mm_loadu_si128((const __m128i*) (row1 + 2*x + 16*k));
+
+                __m128i s = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, lomask), _mm_srli_epi16(a, 8)),
+                                          _mm_add_epi16(_mm_and_si128(b, lomask), _mm_srli_epi16(b, 8)));
+                sum[k] = _mm_srli_epi16(s, 2);
+            }
+
+            _mm_storeu_si128((__m128i*) (dest + y*deststride + x), _mm_packus_epi16(sum[0], sum[1]));
+        }
+    }
+
+    return x1;
+}
+
+// blocks of 32 output pixels.
+static int sse2_decimate3(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x1 = x0 + (destwidth - x0) / 32 * 32;
+
+    for (int y = 0; y < destheight; y++) {
+        for (int x = x0; x < x1; x += 32) {
+            __m128i sum[4] = { zero, zero, zero, zero };
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (3*y + dy)*srcstride + 3*x;
+
+                __m128i v[6];
+                for (int i = 0; i < 6; i++)
+                    v[i] = _mm_loadu_si128((const __m128i*) (p + 16*i));
+                sse2_deinterleave3(v);
+
+                // the lower right sample is omitted.
+                int ncols = dy < 2 ? 3 : 2;
+                for (int c = 0; c < ncols; c++) {
+                    for (int h = 0; h < 2; h++) {
+                        sum[2*h+0] = _mm_add_epi16(sum[2*h+0], _mm_unpacklo_epi8(v[2*c+h], zero));
+                        sum[2*h+1] = _mm_add_epi16(sum[2*h+1], _mm_unpackhi_epi8(v[2*c+h], zero));
+                    }
+                }
+            }
+
+            for (int h = 0; h < 2; h++)
+                _mm_storeu_si128((__m128i*) (dest + y*deststride + x + 16*h),
+                                 _mm_packus_epi16(_mm_srli_epi16(sum[2*h+0], 3), _mm_srli_epi16(sum[2*h+1], 3)));
+        }
+    }
+
+    return x1;
+}
+
+// blocks of 16 output pixels.
+static int sse2_decimate4(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    // weight of each of the 4x3 samples (the scalar code counts
+    // the second sample of the second row twice, and skips the fourth.)
+    static const int weights[3][4] = { { 1, 1, 1, 1 }, { 1, 2, 1, 0 }, { 1, 1, 1, 1 } };
+
+    const __m128i zero = _mm_setzero_si128();
+    int x1 = x0 + (destwidth - x0) / 16 * 16;
+
+    for (int y = 0; y < destheight; y++) {
+        for (int x = x0; x < x1; x += 16) {
+            __m128i sum[2] = { zero, zero };
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (4*y + dy)*srcstride + 4*x;
+
+                __m128i v[4];
+                for (int i = 0; i < 4; i++)
+                    v[i] = _mm_loadu_si128((const __m128i*) (p + 16*i));
+                sse2_deinterleave4(v);
+
+                for (int c = 0; c < 4; c++) {
+                    __m128i lo = _mm_unpacklo_epi8(v[c], zero), hi = _mm_unpackhi_epi8(v[c], zero);
+                    for (int w = 0; w < weights[dy][c]; w++) {
+                        sum[0] = _mm_add_epi16(sum[0], lo);
+                        sum[1] = _mm_add_epi16(sum[1], hi);
+                    }
+                }
+            }
+
+            _mm_storeu_si128((__m128i*) (dest + y*deststride + x),
+                             _mm_packus_epi16(_mm_srli_epi16(sum[0], 4), _mm_srli_epi16(sum[1], 4)));
+        }
+    }
+
+    return x1;
+}
+
+// v / 9 for 0 <= v <= 9*255: (v * 7282) >> 16 is exact over that range.
+static inline __m128i sse2_div9(__m128i v)
+{
+    return _mm_mulhi_epu16(v, _mm_set1_epi16(7282));
+}
+
+// blocks of 64 output pixels (32 groups of 3x3 input pixels) on each of
+// the two output rows.
+static int sse2_decimate1_5(uint8_t *dest, int destwidth, int destheight, int deststride,
+                            const uint8_t *src, int srcstride, int x0)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int x1 = x0 + (destwidth - x0) / 64 * 64;
+
+    for (int y = 0; y + 1 < destheight; y += 2) {
+        for (int x = x0; x < x1; x += 64) {
+            // for each input row, and each group of 3 pixels (a b c):
+            // L = 2a + b and R = 2c + b, as 16 bit values.
+            __m128i L[3][4], R[3][4];
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (3*y/2 + dy)*srcstride + 3*x/2;
+
+                __m128i v[6];
+                for (int i = 0; i < 6; i++)
+                    v[i] = _mm_loadu_si128((const __m128i*) (p + 16*i));
+                sse2_deinterleave3(v);
+
+                for (int h = 0; h < 2; h++) {
+                    __m128i a[2] = { _mm_unpacklo_epi8(v[h], zero), _mm_unpackhi_epi8(v[h], zero) };
+                    __m128i b[2] = { _mm_unpacklo_epi8(v[2+h], zero), _mm_unpackhi_epi8(v[2+h], zero) };
+                    __m128i c[2] = { _mm_unpacklo_epi8(v[4+h], zero), _mm_unpackhi_epi8(v[4+h], zero) };
+
+                    for (int k = 0; k < 2; k++) {
+                        L[dy][2*h+k] = _mm_add_epi16(_mm_slli_epi16(a[k], 1), b[k]);
+                        R[dy][2*h+k] = _mm_add_epi16(_mm_slli_epi16(c[k], 1), b[k]);
+                    }
+                }
+            }
+
+            // top row: (4a + 2b + 2d + e) / 9 = (2 L0 + L1) / 9, and
+            // likewise for the right pixel and the bottom row.
+            for (int row = 0; row < 2; row++) {
+                int outer = row == 0 ? 0 : 2;
+                __m128i left[4], right[4];
+                for (int i = 0; i < 4; i++) {
+                    left[i] = sse2_div9(_mm_add_epi16(_mm_slli_epi16(L[outer][i], 1), L[1][i]));
+                    right[i] = sse2_div9(_mm_add_epi16(_mm_slli_epi16(R[outer][i], 1), R[1][i]));
+                }
+
+                uint8_t *out = dest + (y + row)*deststride + x;
+                for (int h = 0; h < 2; h++) {
+                    __m128i l = _mm_packus_epi16(left[2*h], left[2*h+1]);
+                    __m128i r = _mm_packus_epi16(right[2*h], right[2*h+1]);
+                    _mm_storeu_si128((__m128i*) (out + 32*h), _mm_unpacklo_epi8(l, r));
+                    _mm_storeu_si128((__m128i*) (out + 32*h + 16), _mm_unpackhi_epi8(l, r));
+                }
+            }
+        }
+    }
+
+    return x1;
+}
+
+#ifdef __AVX2__
+
+// The AVX2 kernels do the work of the SSE2 kernels on two consecutive
+// blocks at once, one in each 128 bit lane: lane 0 of register i is
+// loaded from p0 + 16 i and lane 1 from p1 + 16 i.
+static inline __m256i avx2_load2(const uint8_t *p0, const uint8_t *p1)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) p0)),
+                                   _mm_loadu_si128((const __m128i*) p1), 1);
+}
+
+static inline void avx2_store2(uint8_t *p0, uint8_t *p1, __m256i v)
+{
+    _mm_storeu_si128((__m128i*) p0, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i*) p1, _mm256_extracti128_si256(v, 1));
+}
+
+static inline void avx2_deinterleave3(__m256i *v)
+{
+    __m256i a0 = v[0], a1 = v[1], a2 = v[2], a3 = v[3], a4 = v[4], a5 = v[5];
+
+    for (int r = 0; r < 5; r++) {
+        __m256i t0 = _mm256_unpacklo_epi8(a0, a3), t1 = _mm256_unpackhi_epi8(a0, a3);
+        __m256i t2 = _mm256_unpacklo_epi8(a1, a4), t3 = _mm256_unpackhi_epi8(a1, a4);
+        __m256i t4 = _mm256_unpacklo_epi8(a2, a5), t5 = _mm256_unpackhi_epi8(a2, a5);
+        a0 = t0; a1 = t1; a2 = t2; a3 = t3; a4 = t4; a5 = t5;
+    }
+
+    v[0] = a0; v[1] = a1; v[2] = a2; v[3] = a3; v[4] = a4; v[5] = a5;
+}
+
+static inline void avx2_deinterleave4(__m256i *v)
+{
+    __m256i a0 = v[0], a1 = v[1], a2 = v[2], a3 = v[3];
+
+    for (int r = 0; r < 4; r++) {
+        __m256i t0 = _mm256_unpacklo_epi8(a0, a2), t1 = _mm256_unpackhi_epi8(a0, a2);
+        __m256i t2 = _mm256_unpacklo_epi8(a1, a3), t3 = _mm256_unpackhi_epi8(a1, a3);
+        a0 = t0; a1 = t1; a2 = t2; a3 = t3;
+    }
+
+    v[0] = a0; v[1] = a1; v[2] = a2; v[3] = a3;
+}
+
+static int avx2_decimate2(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    const __m256i lomask = _mm256_set1_epi16(0x00ff);
+    int x1 = x0 + (destwidth - x0) / 32 * 32;
+
+    for (int y = 0; y < destheight; y++) {
+        const uint8_t *row0 = src + 2*y*srcstride, *row1 = row0 + srcstride;
+
+        for (int x = x0; x < x1; x += 32) {
+            __m256i sum[2];
+            for (int k = 0; k < 2; k++) {
+                __m256i a = avx2_load2(row0 + 2*x + 16*k, row0 + 2*x + 32 + 16*k);
+                __m256i b = avx2_load2(row1 + 2*x + 16*k, row1 + 2*x + 32 + 16*k);
+
+                __m256i s = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, lomask), _mm256_srli_epi16(a, 8)),
+                                             _mm256_add_epi16(_mm256_and_si256(b, lomask), _mm256_srli_epi16(b, 8)));
+                sum[k] = _mm256_srli_epi16(s, 2);
+            }
+
+            uint8_t *out = dest + y*deststride + x;
+            avx2_store2(out, out + 16, _mm256_packus_epi16(sum[0], sum[1]));
+        }
+    }
+
+    return x1;
+}
+
+static int avx2_decimate3(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int x1 = x0 + (destwidth - x0) / 64 * 64;
+
+    for (int y = 0; y < destheight; y++) {
+        for (int x = x0; x < x1; x += 64) {
+            __m256i sum[4] = { zero, zero, zero, zero };
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (3*y + dy)*srcstride + 3*x;
+
+                __m256i v[6];
+                for (int i = 0; i < 6; i++)
+                    v[i] = avx2_load2(p + 16*i, p + 96 + 16*i);
+                avx2_deinterleave3(v);
+
+                int ncols = dy < 2 ? 3 : 2;
+                for (int c = 0; c < ncols; c++) {
+                    for (int h = 0; h < 2; h++) {
+                        sum[2*h+0] = _mm256_add_epi16(sum[2*h+0], _mm256_unpacklo_epi8(v[2*c+h], zero));
+                        sum[2*h+1] = _mm256_add_epi16(sum[2*h+1], _mm256_unpackhi_epi8(v[2*c+h], zero));
+                    }
+                }
+            }
+
+            uint8_t *out = dest + y*deststride + x;
+            for (int h = 0; h < 2; h++)
+                avx2_store2(out + 16*h, out + 32 + 16*h,
+                            _mm256_packus_epi16(_mm256_srli_epi16(sum[2*h+0], 3), _mm256_srli_epi16(sum[2*h+1], 3)));
+        }
+    }
+
+    return x1;
+}
+
+static int avx2_decimate4(uint8_t *dest, int destwidth, int destheight, int deststride,
+                          const uint8_t *src, int srcstride, int x0)
+{
+    static const int weights[3][4] = { { 1, 1, 1, 1 }, { 1, 2, 1, 0 }, { 1, 1, 1, 1 } };
+
+    const __m256i zero = _mm256_setzero_si256();
+    int x1 = x0 + (destwidth - x0) / 32 * 32;
+
+    for (int y = 0; y < destheight; y++) {
+        for (int x = x0; x < x1; x += 32) {
+            __m256i sum[2] = { zero, zero };
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (4*y + dy)*srcstride + 4*x;
+
+                __m256i v[4];
+                for (int i = 0; i < 4; i++)
+                    v[i] = avx2_load2(p + 16*i, p + 64 + 16*i);
+                avx2_deinterleave4(v);
+
+                for (int c = 0; c < 4; c++) {
+                    __m256i lo = _mm256_unpacklo_epi8(v[c], zero), hi = _mm256_unpackhi_epi8(v[c], zero);
+                    for (int w = 0; w < weights[dy][c]; w++) {
+                        sum[0] = _mm256_add_epi16(sum[0], lo);
+                        sum[1] = _mm256_add_epi16(sum[1], hi);
+                    }
+                }
+            }
+
+            uint8_t *out = dest + y*deststride + x;
+            avx2_store2(out, out + 16,
+                        _mm256_packus_epi16(_mm256_srli_epi16(sum[0], 4), _mm256_srli_epi16(sum[1], 4)));
+        }
+    }
+
+    return x1;
+}
+
+static int avx2_decimate1_5(uint8_t *dest, int destwidth, int destheight, int deststride,
+                            const uint8_t *src, int srcstride, int x0)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i div9 = _mm256_set1_epi16(7282);
+    int x1 = x0 + (destwidth - x0) / 128 * 128;
+
+    for (int y = 0; y + 1 < destheight; y += 2) {
+        for (int x = x0; x < x1; x += 128) {
+            __m256i L[3][4], R[3][4];
+
+            for (int dy = 0; dy < 3; dy++) {
+                const uint8_t *p = src + (3*y/2 + dy)*srcstride + 3*x/2;
+
+                __m256i v[6];
+                for (int i = 0; i < 6; i++)
+                    v[i] = avx2_load2(p + 16*i, p + 96 + 16*i);
+                avx2_deinterleave3(v);
+
+                for (int h = 0; h < 2; h++) {
+                    __m256i a[2] = { _mm256_unpacklo_epi8(v[h], zero), _mm256_unpackhi_epi8(v[h], zero) };
+                    __m256i b[2] = { _mm256_unpacklo_epi8(v[2+h], zero), _mm256_unpackhi_epi8(v[2+h], zero) };
+                    __m256i c[2] = { _mm256_unpacklo_epi8(v[4+h], zero), _mm256_unpackhi_epi8(v[4+h], zero) };
+
+                    for (int k = 0; k < 2; k++) {
+                        L[dy][2*h+k] = _mm256_add_epi16(_mm256_slli_epi16(a[k], 1), b[k]);
+                        R[dy][2*h+k] = _mm256_add_epi16(_mm256_slli_epi16(c[k], 1), b[k]);
+                    }
+                }
+            }
+
+            for (int row = 0; row < 2; row++) {
+                int outer = row == 0 ? 0 : 2;
+                __m256i left[4], right[4];
+                for (int i = 0; i < 4; i++) {
+                    left[i] = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_slli_epi16(L[outer][i], 1), L[1][i]), div9);
+                    right[i] = _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_slli_epi16(R[outer][i], 1), R[1][i]), div9);
+                }
+
+                uint8_t *out = dest + (y + row)*deststride + x;
+                for (int h = 0; h < 2; h++) {
+                    __m256i l = _mm256_packus_epi16(left[2*h], left[2*h+1]);
+                    __m256i r = _mm256_packus_epi16(right[2*h], right[2*h+1]);
+                    avx2_store2(out + 32*h, out + 64 + 32*h, _mm256_unpacklo_epi8(l, r));
+                    avx2_store2(out + 32*h + 16, out + 64 + 32*h + 16, _mm256_unpackhi_epi8(l, r));
+                }
+            }
+        }
+    }
+
+    return x1;
+}
+#endif
+
+// Computes the leading output columns of rows [sy0, sy1) of
+// image_u8_decimate with the widest available x86 kernels; returns
+// the column at which the plain C code must take over (0 if there is
+// no kernel for this factor).
+static int x86_decimate(image_u8_t *decim, const image_u8_t *im, float ffactor, int sy0, int sy1)
+{
+    int dw = decim->width, dh = sy1 - sy0, ds = decim->stride;
+    uint8_t *d = &decim->buf[sy0*ds];
+    int x0 = 0;
+
+    if (ffactor == 1.5) {
+        const uint8_t *src = &im->buf[sy0 / 2 * 3 * im->stride];
+#ifdef __AVX2__
+        x0 = avx2_decimate1_5(d, dw, dh, ds, src, im->stride, x0);
+#endif
+        x0 = sse2_decimate1_5(d, dw, dh, ds, src, im->stride, x0);
+        return x0;
+    }
+
+    int factor = (int) ffactor;
+    const uint8_t *src = &im->buf[sy0 * factor * im->stride];
+
+    switch (factor) {
+        case 2:
+#ifdef __AVX2__
+            x0 = avx2_decimate2(d, dw, dh, ds, src, im->stride, x0);
+#endif
+            x0 = sse2_decimate2(d, dw, dh, ds, src, im->stride, x0);
+            break;
+        case 3:
+#ifdef __AVX2__
+            x0 = avx2_decimate3(d, dw, dh, ds, src, im->stride, x0);
+#endif
+            x0 = sse2_decimate3(d, dw, dh, ds, src, im->stride, x0);
+            break;
+        case 4:
+#ifdef __AVX2__
+            x0 = avx2_decimate4(d, dw, dh, ds, src, im->stride, x0);
+#endif
+            x0 = sse2_decimate4(d, dw, dh, ds, src, im->stride, x0);
+            break;
+    }
+
+    return x0;
+}
+
+#endif
+
+image_u8_t *image_u8_decimate_create(const image_u8_t *im, float ffactor)
+{
+    if (ffactor == 1.5)
+        return image_u8_create(im->width / 3 * 2, im->height / 3 * 2);
+
+    int factor = (int) ffactor;
+    return image_u8_create(im->width / factor, im->height / factor);
+}
+
+// Computes rows [sy0, sy1) of decim. When simd is zero, only the
+// plain C code is used.
+static void decimate_rows(image_u8_t *decim, const image_u8_t *im, float ffactor,
+                          int sy0, int sy1, int simd)
+{
+    int swidth = decim->width;
+
+    // leading columns of each output row computed by SIMD kernels.
+    int sx0 = 0;
 
     if (ffactor == 1.5) {
-        int swidth = width / 3 * 2, sheight = height / 3 * 2;
+        assert((sy0 & 1) == 0 && (sy1 & 1) == 0);
 
-        image_u8_t *decim = image_u8_create(swidth, sheight);
+#ifdef __SSE2__
+        if (simd)
+            sx0 = x86_decimate(decim, im, ffactor, sy0, sy1);
+#endif
 
-        int y = 0, sy = 0;
-        while (sy < sheight) {
-            int x = 0, sx = 0;
+        int y = sy0 / 2 * 3, sy = sy0;
+        while (sy < sy1) {
+            int x = sx0 / 2 * 3, sx = sx0;
             while (sx < swidth) {
 
                 // a b c
@@ -567,37 +1277,40 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
             sy += 2;
         }
 
-        return decim;
+        return;
     }
 
     int factor = (int) ffactor;
 
-    int swidth = width / factor, sheight = height / factor;
-
-    image_u8_t *decim = image_u8_create(swidth, sheight);
-
 #ifdef __ARM_NEON__
-    if (factor == 2) {
-        neon_decimate2(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
-    } else if (factor == 3) {
-        neon_decimate3(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
-    } else if (factor == 4) {
-        neon_decimate4(decim->buf, decim->width, decim->height, decim->stride,
-                       im->buf, im->width, im->height, im->stride);
-        return decim;
+    if (simd && factor >= 2 && factor <= 4) {
+        uint8_t *dest = &decim->buf[sy0*decim->stride];
+        uint8_t *src = &im->buf[sy0*factor*im->stride];
+
+        if (factor == 2)
+            neon_decimate2(dest, decim->width, sy1 - sy0, decim->stride,
+                           src, im->width, im->height, im->stride);
+        else if (factor == 3)
+            neon_decimate3(dest, decim->width, sy1 - sy0, decim->stride,
+                           src, im->width, im->height, im->stride);
+        else
+            neon_decimate4(dest, decim->width, sy1 - sy0, decim->stride,
+                           src, im->width, im->height, im->stride);
+        return;
     }
 #endif
 
+#ifdef __SSE2__
+    if (simd)
+        sx0 = x86_decimate(decim, im, ffactor, sy0, sy1);
+#endif
+
     if (factor == 2) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*2)*im->stride;
+        for (int sy = sy0; sy < sy1; sy++) {
+            int sidx = sy * decim->stride + sx0;
+            int idx = (sy*2)*im->stride + 2*sx0;
 
-            for (int sx = 0; sx < swidth; sx++) {
+            for (int sx = sx0; sx < swidth; sx++) {
                 uint32_t v = im->buf[idx] + im->buf[idx+1] +
                     im->buf[idx+im->stride] + im->buf[idx+im->stride + 1];
                 decim->buf[sidx] = (v>>2);
@@ -606,11 +1319,11 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
             }
         }
     } else if (factor == 3) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*3)*im->stride;
+        for (int sy = sy0; sy < sy1; sy++) {
+            int sidx = sy * decim->stride + sx0;
+            int idx = (sy*3)*im->stride + 3*sx0;
 
-            for (int sx = 0; sx < swidth; sx++) {
+            for (int sx = sx0; sx < swidth; sx++) {
                 uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] +
                     im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
                     im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1];
@@ -622,11 +1335,11 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
             }
         }
     } else if (factor == 4) {
-        for (int sy = 0; sy < sheight; sy++) {
-            int sidx = sy * decim->stride;
-            int idx = (sy*4)*im->stride;
+        for (int sy = sy0; sy < sy1; sy++) {
+            int sidx = sy * decim->stride + sx0;
+            int idx = (sy*4)*im->stride + 4*sx0;
 
-            for (int sx = 0; sx < swidth; sx++) {
+            for (int sx = sx0; sx < swidth; sx++) {
                 uint32_t v = im->buf[idx] + im->buf[idx+1] + im->buf[idx+2] + im->buf[idx+3] +
                     im->buf[idx+im->stride] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 1] + im->buf[idx+im->stride + 2] +
                     im->buf[idx+2*im->stride] + im->buf[idx+2*im->stride + 1] + im->buf[idx+2*im->stride + 2] + im->buf[idx+2*im->stride + 3];
@@ -640,21 +1353,38 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
         // XXX this isn't a very good decimation code.
         uint32_t row[swidth];
 
-        for (int y = 0; y < height; y+= factor) {
+        // only whole factor x factor blocks contribute.
+        for (int sy = sy0; sy < sy1; sy++) {
             memset(row, 0, sizeof(row));
 
             for (int dy = 0; dy < factor; dy++) {
-                for (int x = 0; x < width; x++) {
-                    row[x/factor] += im->buf[(y+dy)*im->stride + x];
+                for (int x = 0; x < swidth*factor; x++) {
+                    row[x/factor] += im->buf[(sy*factor+dy)*im->stride + x];
                 }
             }
 
             for (int x = 0; x < swidth; x++)
-                decim->buf[(y/factor)*decim->stride + x] = row[x] / sq(factor);
-
+                decim->buf[sy*decim->stride + x] = row[x] / sq(factor);
         }
     }
+}
 
+void image_u8_decimate_rows(image_u8_t *decim, const image_u8_t *im, float ffactor, int y0, int y1)
+{
+    decimate_rows(decim, im, ffactor, y0, y1, 1);
+}
+
+image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
+{
+    image_u8_t *decim = image_u8_decimate_create(im, ffactor);
+    decimate_rows(decim, im, ffactor, 0, decim->height, 1);
+    return decim;
+}
+
+image_u8_t *image_u8_decimate_scalar(image_u8_t *im, float ffactor)
+{
+    image_u8_t *decim = image_u8_decimate_create(im, ffactor);
+    decimate_rows(decim, im, ffactor, 0, decim->height, 0);
     return decim;
 }
 
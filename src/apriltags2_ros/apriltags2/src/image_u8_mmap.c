@@ -0,0 +1,327 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_u8_mmap.h"
+#include "string_util.h"
+#include "zarray.h"
+
+// largest width or height accepted. (So that width*height cannot
+// overflow.)
+#define MAP_PNM_MAX_DIM (1 << 20)
+
+struct image_u8_mapped
+{
+    // first, so that the image_u8_t* we hand out points at the whole.
+    image_u8_t im;
+
+    void *base;
+    size_t len;
+};
+
+// The offset of the pixels if data is a binary PGM with maxval 255 of
+// at least width*height pixels, otherwise 0.
+static size_t parse_pgm_header(const uint8_t *data, size_t len, int *width, int *height)
+{
+    if (len < 2 || data[0] != 'P' || data[1] != '5')
+        return 0;
+
+    size_t pos = 2;
+    int params[3];
+
+    for (int i = 0; i < 3; i++) {
+        // skip white space and comments
+        while (pos < len) {
+            if (data[pos] == '#') {
+                while (pos < len && data[pos] != '\n')
+                    pos++;
+            } else if (isspace(data[pos])) {
+                pos++;
+            } else {
+                break;
+            }
+        }
+
+        if (pos >= len || !isdigit(data[pos]))
+            return 0;
+
+        int acc = 0;
+        while (pos < len && isdigit(data[pos])) {
+            acc = acc*10 + data[pos] - '0';
+            if (acc > MAP_PNM_MAX_DIM)
+                return 0;
+            pos++;
+        }
+
+        params[i] = acc;
+    }
+
+    // a single white space character ends the header.
+    if (pos >= len || !isspace(data[pos]))
+        return 0;
+    pos++;
+
+    if (params[0] <= 0 || params[1] <= 0 || params[2] != 255)
+        return 0;
+
+    if (len - pos < (size_t) params[0] * params[1])
+        return 0;
+
+    *width = params[0];
+    *height = params[1];
+    return pos;
+}
+
+image_u8_t *image_u8_map_pnm(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = st.st_size;
+
+    // private and writable: the detector may scribble on its input,
+    // which then only costs a copy of the pages it touches.
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    int width, height;
+    size_t offset = parse_pgm_header(base, len, &width, &height);
+    if (offset == 0) {
+        munmap(base, len);
+        return NULL;
+    }
+
+    struct image_u8_mapped *m = calloc(1, sizeof(struct image_u8_mapped));
+
+    image_u8_t tmp = { .width = width, .height = height, .stride = width,
+                       .buf = (uint8_t*) base + offset };
+    memcpy(&m->im, &tmp, sizeof(image_u8_t));
+    m->base = base;
+    m->len = len;
+
+    return &m->im;
+}
+
+void image_u8_unmap(image_u8_t *im)
+{
+    if (im == NULL)
+        return;
+
+    struct image_u8_mapped *m = (struct image_u8_mapped*) im;
+    munmap(m->base, m->len);
+    free(m);
+}
+
+// read the pages of a mapped image into memory, so that whoever uses
+// it does not wait on the disk.
+static void map_touch(image_u8_t *im)
+{
+    struct image_u8_mapped *m = (struct image_u8_mapped*) im;
+
+    madvise(m->base, m->len, MADV_WILLNEED);
+
+    long pagesize = sysconf(_SC_PAGESIZE);
+    volatile uint8_t sink = 0;
+    for (size_t off = 0; off < m->len; off += pagesize)
+        sink ^= ((const uint8_t*) m->base)[off];
+    (void) sink;
+}
+
+////////////////////////////////////////////////////////////
+// prefetching
+
+struct image_u8_prefetch
+{
+    zarray_t *paths; // char*
+    int depth;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // files [0, nloaded) have been mapped (or skipped), and [0,
+    // nreturned) returned to the caller. Image i (NULL if skipped) is
+    // in slots[i % depth] while nreturned <= i < nloaded.
+    int nloaded;
+    int nreturned;
+    image_u8_t **slots;
+
+    int stop;
+};
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+static void *prefetch_thread(void *p)
+{
+    image_u8_prefetch_t *pf = p;
+
+    pthread_mutex_lock(&pf->mutex);
+
+    while (!pf->stop && pf->nloaded < zarray_size(pf->paths)) {
+        if (pf->nloaded - pf->nreturned >= pf->depth) {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+            continue;
+        }
+
+        int i = pf->nloaded;
+        char *path;
+        zarray_get(pf->paths, i, &path);
+
+        pthread_mutex_unlock(&pf->mutex);
+
+        image_u8_t *im = image_u8_map_pnm(path);
+        if (im == NULL)
+            fprintf(stderr, "image_u8_prefetch: can't map %s\n", path);
+        else
+            map_touch(im);
+
+        pthread_mutex_lock(&pf->mutex);
+
+        pf->slots[i % pf->depth] = im;
+        pf->nloaded++;
+        pthread_cond_broadcast(&pf->cond);
+    }
+
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+image_u8_prefetch_t *image_u8_prefetch_create(const char *path, int depth)
+{
+    image_u8_prefetch_t *pf = calloc(1, sizeof(image_u8_prefetch_t));
+    pf->paths = zarray_create(sizeof(char*));
+    pf->depth = depth > 0 ? depth : 1;
+    pf->slots = calloc(pf->depth, sizeof(image_u8_t*));
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        struct dirent *ent;
+        while (dir != NULL && (ent = readdir(dir)) != NULL) {
+            if (str_ends_with(ent->d_name, ".pgm") || str_ends_with(ent->d_name, ".pnm")) {
+                char *p = str_concat(path, "/", ent->d_name);
+                zarray_add(pf->paths, &p);
+            }
+        }
+        if (dir != NULL)
+            closedir(dir);
+        zarray_sort(pf->paths, compare_strings);
+    } else {
+        char *p = strdup(path);
+        zarray_add(pf->paths, &p);
+    }
+
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    pthread_create(&pf->thread, NULL, prefetch_thread, pf);
+
+    return pf;
+}
+
+image_u8_t *image_u8_prefetch_next(image_u8_prefetch_t *pf, const char **path)
+{
+    image_u8_t *im = NULL;
+
+    pthread_mutex_lock(&pf->mutex);
+
+    while (im == NULL && pf->nreturned < zarray_size(pf->paths)) {
+        if (pf->nreturned == pf->nloaded) {
+            pthread_cond_wait(&pf->cond, &pf->mutex);
+            continue;
+        }
+
+        int i = pf->nreturned++;
+        im = pf->slots[i % pf->depth];
+        pf->slots[i % pf->depth] = NULL;
+
+        if (im != NULL && path != NULL)
+            zarray_get(pf->paths, i, path);
+
+        pthread_cond_broadcast(&pf->cond);
+    }
+
+    pthread_mutex_unlock(&pf->mutex);
+
+    return im;
+}
+
+int image_u8_prefetch_count(const image_u8_prefetch_t *pf)
+{
+    return zarray_size(pf->paths);
+}
+
+void image_u8_prefetch_destroy(image_u8_prefetch_t *pf)
+{
+    if (pf == NULL)
+        return;
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+
+    pthread_join(pf->thread, NULL);
+
+    for (int i = pf->nreturned; i < pf->nloaded; i++)
+        image_u8_unmap(pf->slots[i % pf->depth]);
+
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->cond);
+
+    zarray_vmap(pf->paths, free);
+    zarray_destroy(pf->paths);
+    free(pf->slots);
+    free(pf);
+}
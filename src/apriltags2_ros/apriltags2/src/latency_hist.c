@@ -0,0 +1,120 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#include <string.h>
+#include <math.h>
+
+#include "latency_hist.h"
+
+static int bucket_index(int64_t v)
+{
+    if (v < 16)
+        return v < 0 ? 0 : (int) v;
+
+    int o = 63 - __builtin_clzll((uint64_t) v);
+    int sub = (int) (v >> (o - LATENCY_HIST_SUBBITS)) & ((1 << LATENCY_HIST_SUBBITS) - 1);
+    int idx = 16 + ((o - 4) << LATENCY_HIST_SUBBITS) + sub;
+
+    return idx < LATENCY_HIST_NBUCKETS ? idx : LATENCY_HIST_NBUCKETS - 1;
+}
+
+// the middle of the range of values that fall into bucket idx.
+static int64_t bucket_value(int idx)
+{
+    if (idx < 16)
+        return idx;
+
+    int o = ((idx - 16) >> LATENCY_HIST_SUBBITS) + 4;
+    int sub = (idx - 16) & ((1 << LATENCY_HIST_SUBBITS) - 1);
+    int64_t width = (int64_t) 1 << (o - LATENCY_HIST_SUBBITS);
+
+    return (((1 << LATENCY_HIST_SUBBITS) + sub) * width) + width / 2;
+}
+
+void latency_hist_clear(latency_hist_t *h)
+{
+    memset(h, 0, sizeof(latency_hist_t));
+}
+
+void latency_hist_add(latency_hist_t *h, int64_t v)
+{
+    if (h->n[h->cur] == LATENCY_HIST_WINDOW) {
+        // the current window is full: the older one is forgotten
+        // and starts over.
+        h->cur ^= 1;
+        memset(h->counts[h->cur], 0, sizeof(h->counts[h->cur]));
+        h->n[h->cur] = 0;
+        h->max[h->cur] = 0;
+    }
+
+    h->counts[h->cur][bucket_index(v)]++;
+    h->n[h->cur]++;
+    if (v > h->max[h->cur])
+        h->max[h->cur] = v;
+    h->last = v;
+}
+
+uint32_t latency_hist_count(const latency_hist_t *h)
+{
+    return h->n[0] + h->n[1];
+}
+
+int64_t latency_hist_max(const latency_hist_t *h)
+{
+    return h->max[0] > h->max[1] ? h->max[0] : h->max[1];
+}
+
+int64_t latency_hist_percentile(const latency_hist_t *h, double p)
+{
+    uint32_t n = latency_hist_count(h);
+    if (n == 0)
+        return 0;
+
+    // rank of the requested sample, 1..n
+    uint32_t rank = (uint32_t) ceil(p * n);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+
+    uint32_t acc = 0;
+    for (int i = 0; i < LATENCY_HIST_NBUCKETS; i++) {
+        acc += h->counts[0][i] + h->counts[1][i];
+        if (acc >= rank) {
+            int64_t v = bucket_value(i);
+            int64_t max = latency_hist_max(h);
+            return v < max ? v : max;
+        }
+    }
+
+    return latency_hist_max(h);
+}
@@ -0,0 +1,123 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf_counters.h"
+
+const char *perf_counter_name(enum perf_counter c)
+{
+    switch (c) {
+        case PERF_COUNTER_CYCLES: return "cycles";
+        case PERF_COUNTER_INSTRUCTIONS: return "instructions";
+        case PERF_COUNTER_CACHE_MISSES: return "cache-misses";
+        case PERF_COUNTER_BRANCH_MISSES: return "branch-misses";
+        default: return "unknown";
+    }
+}
+
+#ifdef __linux__
+
+static const uint64_t perf_config[PERF_COUNTER_COUNT] = {
+    [PERF_COUNTER_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF_COUNTER_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF_COUNTER_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [PERF_COUNTER_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+int perf_counters_open(perf_counters_t *pc, int tid)
+{
+    int nopen = 0;
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_config[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // The counters are opened separately rather than as a group,
+        // so that one the PMU lacks does not disable the others.
+        pc->fd[i] = syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (pc->fd[i] >= 0)
+            nopen++;
+    }
+
+    return nopen > 0 ? 0 : -1;
+}
+
+void perf_counters_close(perf_counters_t *pc)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fd[i] >= 0)
+            close(pc->fd[i]);
+        pc->fd[i] = -1;
+    }
+}
+
+void perf_counters_read(const perf_counters_t *pc, uint64_t v[PERF_COUNTER_COUNT])
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        v[i] = 0;
+        if (pc->fd[i] >= 0 && read(pc->fd[i], &v[i], sizeof(uint64_t)) != sizeof(uint64_t))
+            v[i] = 0;
+    }
+}
+
+#else
+
+int perf_counters_open(perf_counters_t *pc, int tid)
+{
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+        pc->fd[i] = -1;
+    return -1;
+}
+
+void perf_counters_close(perf_counters_t *pc)
+{
+}
+
+void perf_counters_read(const perf_counters_t *pc, uint64_t v[PERF_COUNTER_COUNT])
+{
+    memset(v, 0, PERF_COUNTER_COUNT * sizeof(uint64_t));
+}
+
+#endif
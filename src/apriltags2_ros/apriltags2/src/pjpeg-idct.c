@@ -22,6 +22,16 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 #include <math.h>
 #include <stdint.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
 #ifndef M_PI
 # define M_PI 3.141592653589793238462643383279502884196
 #endif
@@ -371,7 +381,7 @@ static inline void njColIDCT(const int* blk, unsigned char *out, int stride) {
     *out = njClip(((x7 - x1) >> 14) + 128);
 }
 
-void pjpeg_idct_2D_nanojpeg(int32_t in[64], uint8_t *out, uint32_t outstride)
+void pjpeg_idct_2D_nanojpeg_scalar(int32_t in[64], uint8_t *out, uint32_t outstride)
 {
     int coef;
 
@@ -380,3 +390,225 @@ void pjpeg_idct_2D_nanojpeg(int32_t in[64], uint8_t *out, uint32_t outstride)
     for (coef = 0;  coef < 8;  ++coef)
         njColIDCT(&in[coef], &out[coef], outstride);
 }
+
+//////////////////////////////////////////////
+// The same IDCT on four rows (or columns) at once, in 32 bit lanes, so
+// that it gives exactly the same results as the scalar code, overflow
+// included. The scalar code's shortcuts for rows and columns whose AC
+// coefficients are all zero give the same results as the full
+// computation, so they are not needed.
+#if defined(__SSE2__) || defined(__ARM_NEON__)
+
+#ifdef __SSE2__
+typedef __m128i v4i;
+
+#define v_add(a, b) _mm_add_epi32(a, b)
+#define v_sub(a, b) _mm_sub_epi32(a, b)
+#define v_shl(a, n) _mm_slli_epi32(a, n)
+#define v_shr(a, n) _mm_srai_epi32(a, n)
+#define v_set1(c) _mm_set1_epi32(c)
+
+static inline v4i v_mulc(v4i a, int32_t c)
+{
+#ifdef __SSE4_1__
+    return _mm_mullo_epi32(a, _mm_set1_epi32(c));
+#else
+    // the low 32 bits of the products are the same signed or unsigned.
+    v4i b = _mm_set1_epi32(c);
+    v4i p02 = _mm_mul_epu32(a, b);
+    v4i p13 = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(p02, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(p13, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+
+static inline void v_transpose(v4i *r0, v4i *r1, v4i *r2, v4i *r3)
+{
+    v4i t0 = _mm_unpacklo_epi32(*r0, *r1);
+    v4i t1 = _mm_unpacklo_epi32(*r2, *r3);
+    v4i t2 = _mm_unpackhi_epi32(*r0, *r1);
+    v4i t3 = _mm_unpackhi_epi32(*r2, *r3);
+    *r0 = _mm_unpacklo_epi64(t0, t1);
+    *r1 = _mm_unpackhi_epi64(t0, t1);
+    *r2 = _mm_unpacklo_epi64(t2, t3);
+    *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+#define v_load(p) _mm_loadu_si128((const __m128i*) (p))
+
+// clamp the 8 values of lo and hi to [0, 255] and store them.
+static inline void v_store_u8(uint8_t *out, v4i lo, v4i hi)
+{
+    v4i s16 = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i*) out, _mm_packus_epi16(s16, s16));
+}
+#else
+typedef int32x4_t v4i;
+
+#define v_add(a, b) vaddq_s32(a, b)
+#define v_sub(a, b) vsubq_s32(a, b)
+#define v_shl(a, n) vshlq_n_s32(a, n)
+#define v_shr(a, n) vshrq_n_s32(a, n)
+#define v_set1(c) vdupq_n_s32(c)
+#define v_mulc(a, c) vmulq_n_s32(a, c)
+
+static inline void v_transpose(v4i *r0, v4i *r1, v4i *r2, v4i *r3)
+{
+    int32x4x2_t t01 = vtrnq_s32(*r0, *r1);
+    int32x4x2_t t23 = vtrnq_s32(*r2, *r3);
+    *r0 = vcombine_s32(vget_low_s32(t01.val[0]), vget_low_s32(t23.val[0]));
+    *r1 = vcombine_s32(vget_low_s32(t01.val[1]), vget_low_s32(t23.val[1]));
+    *r2 = vcombine_s32(vget_high_s32(t01.val[0]), vget_high_s32(t23.val[0]));
+    *r3 = vcombine_s32(vget_high_s32(t01.val[1]), vget_high_s32(t23.val[1]));
+}
+
+#define v_load(p) vld1q_s32(p)
+
+static inline void v_store_u8(uint8_t *out, v4i lo, v4i hi)
+{
+    vst1_u8(out, vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi))));
+}
+#endif
+
+// njRowIDCT on the four rows in the lanes of b[0..7].
+static inline void v_row_idct(v4i b[8])
+{
+    v4i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = v_shl(b[4], 11);
+    x2 = b[6];
+    x3 = b[2];
+    x4 = b[1];
+    x5 = b[7];
+    x6 = b[5];
+    x7 = b[3];
+    x0 = v_add(v_shl(b[0], 11), v_set1(128));
+    x8 = v_mulc(v_add(x4, x5), W7);
+    x4 = v_add(x8, v_mulc(x4, W1 - W7));
+    x5 = v_sub(x8, v_mulc(x5, W1 + W7));
+    x8 = v_mulc(v_add(x6, x7), W3);
+    x6 = v_sub(x8, v_mulc(x6, W3 - W5));
+    x7 = v_sub(x8, v_mulc(x7, W3 + W5));
+    x8 = v_add(x0, x1);
+    x0 = v_sub(x0, x1);
+    x1 = v_mulc(v_add(x3, x2), W6);
+    x2 = v_sub(x1, v_mulc(x2, W2 + W6));
+    x3 = v_add(x1, v_mulc(x3, W2 - W6));
+    x1 = v_add(x4, x6);
+    x4 = v_sub(x4, x6);
+    x6 = v_add(x5, x7);
+    x5 = v_sub(x5, x7);
+    x7 = v_add(x8, x3);
+    x8 = v_sub(x8, x3);
+    x3 = v_add(x0, x2);
+    x0 = v_sub(x0, x2);
+    x2 = v_shr(v_add(v_mulc(v_add(x4, x5), 181), v_set1(128)), 8);
+    x4 = v_shr(v_add(v_mulc(v_sub(x4, x5), 181), v_set1(128)), 8);
+    b[0] = v_shr(v_add(x7, x1), 8);
+    b[1] = v_shr(v_add(x3, x2), 8);
+    b[2] = v_shr(v_add(x0, x4), 8);
+    b[3] = v_shr(v_add(x8, x6), 8);
+    b[4] = v_shr(v_sub(x8, x6), 8);
+    b[5] = v_shr(v_sub(x0, x4), 8);
+    b[6] = v_shr(v_sub(x3, x2), 8);
+    b[7] = v_shr(v_sub(x7, x1), 8);
+}
+
+// njColIDCT on the four columns in the lanes of b[0..7], leaving
+// the pixels before clamping (with the +128 bias) in b.
+static inline void v_col_idct(v4i b[8])
+{
+    v4i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = v_shl(b[4], 8);
+    x2 = b[6];
+    x3 = b[2];
+    x4 = b[1];
+    x5 = b[7];
+    x6 = b[5];
+    x7 = b[3];
+    x0 = v_add(v_shl(b[0], 8), v_set1(8192));
+    x8 = v_add(v_mulc(v_add(x4, x5), W7), v_set1(4));
+    x4 = v_shr(v_add(x8, v_mulc(x4, W1 - W7)), 3);
+    x5 = v_shr(v_sub(x8, v_mulc(x5, W1 + W7)), 3);
+    x8 = v_add(v_mulc(v_add(x6, x7), W3), v_set1(4));
+    x6 = v_shr(v_sub(x8, v_mulc(x6, W3 - W5)), 3);
+    x7 = v_shr(v_sub(x8, v_mulc(x7, W3 + W5)), 3);
+    x8 = v_add(x0, x1);
+    x0 = v_sub(x0, x1);
+    x1 = v_add(v_mulc(v_add(x3, x2), W6), v_set1(4));
+    x2 = v_shr(v_sub(x1, v_mulc(x2, W2 + W6)), 3);
+    x3 = v_shr(v_add(x1, v_mulc(x3, W2 - W6)), 3);
+    x1 = v_add(x4, x6);
+    x4 = v_sub(x4, x6);
+    x6 = v_add(x5, x7);
+    x5 = v_sub(x5, x7);
+    x7 = v_add(x8, x3);
+    x8 = v_sub(x8, x3);
+    x3 = v_add(x0, x2);
+    x0 = v_sub(x0, x2);
+    x2 = v_shr(v_add(v_mulc(v_add(x4, x5), 181), v_set1(128)), 8);
+    x4 = v_shr(v_add(v_mulc(v_sub(x4, x5), 181), v_set1(128)), 8);
+
+    v4i bias = v_set1(128);
+    b[0] = v_add(v_shr(v_add(x7, x1), 14), bias);
+    b[1] = v_add(v_shr(v_add(x3, x2), 14), bias);
+    b[2] = v_add(v_shr(v_add(x0, x4), 14), bias);
+    b[3] = v_add(v_shr(v_add(x8, x6), 14), bias);
+    b[4] = v_add(v_shr(v_sub(x8, x6), 14), bias);
+    b[5] = v_add(v_shr(v_sub(x0, x4), 14), bias);
+    b[6] = v_add(v_shr(v_sub(x3, x2), 14), bias);
+    b[7] = v_add(v_shr(v_sub(x7, x1), 14), bias);
+}
+
+static void pjpeg_idct_2D_nanojpeg_simd(int32_t in[64], uint8_t *out, uint32_t outstride)
+{
+    // v[g][k]: coefficient k of rows 4g..4g+3 (after transposing).
+    v4i v[2][8];
+
+    for (int g = 0; g < 2; g++) {
+        for (int h = 0; h < 2; h++) {
+            v4i r0 = v_load(&in[(4*g + 0)*8 + 4*h]);
+            v4i r1 = v_load(&in[(4*g + 1)*8 + 4*h]);
+            v4i r2 = v_load(&in[(4*g + 2)*8 + 4*h]);
+            v4i r3 = v_load(&in[(4*g + 3)*8 + 4*h]);
+            v_transpose(&r0, &r1, &r2, &r3);
+            v[g][4*h + 0] = r0;
+            v[g][4*h + 1] = r1;
+            v[g][4*h + 2] = r2;
+            v[g][4*h + 3] = r3;
+        }
+
+        v_row_idct(v[g]);
+    }
+
+    // c[h][y]: row y, columns 4h..4h+3.
+    v4i c[2][8];
+
+    for (int g = 0; g < 2; g++) {
+        for (int h = 0; h < 2; h++) {
+            v4i r0 = v[g][4*h + 0], r1 = v[g][4*h + 1], r2 = v[g][4*h + 2], r3 = v[g][4*h + 3];
+            v_transpose(&r0, &r1, &r2, &r3);
+            c[h][4*g + 0] = r0;
+            c[h][4*g + 1] = r1;
+            c[h][4*g + 2] = r2;
+            c[h][4*g + 3] = r3;
+        }
+    }
+
+    v_col_idct(c[0]);
+    v_col_idct(c[1]);
+
+    for (int y = 0; y < 8; y++)
+        v_store_u8(&out[y*outstride], c[0][y], c[1][y]);
+}
+#endif
+
+void pjpeg_idct_2D_nanojpeg(int32_t in[64], uint8_t *out, uint32_t outstride)
+{
+#if defined(__SSE2__) || defined(__ARM_NEON__)
+    pjpeg_idct_2D_nanojpeg_simd(in, out, outstride);
+#else
+    pjpeg_idct_2D_nanojpeg_scalar(in, out, outstride);
+#endif
+}
@@ -29,6 +29,7 @@ License along with this library; if not, see <http://www.gnu.org/licenses/>.
 
 #include "image_u8.h"
 #include "image_u8x3.h"
+#include "workerpool.h"
 
 // https://www.w3.org/Graphics/JPEG/itu-t81.pdf
 
@@ -36,10 +37,30 @@ void pjpeg_idct_2D_double(int32_t in[64], uint8_t *out, uint32_t outstride);
 void pjpeg_idct_2D_u32(int32_t in[64], uint8_t *out, uint32_t outstride);
 void pjpeg_idct_2D_nanojpeg(int32_t in[64], uint8_t *out, uint32_t outstride);
 
-struct pjpeg_huffman_code
+// codes of up to this many bits are decoded with a single table
+// lookup. XXX tunable
+#define HUFF_FAST_BITS 9
+
+struct pjpeg_huffman_table
 {
-    uint8_t nbits;  // how many bits should we actually consume?
-    uint8_t code;   // what is the symbol that was encoded? (not actually a DCT coefficient; see encoding)
+    // indexed by the next HUFF_FAST_BITS bits of input: (nbits << 8) |
+    // symbol for codes of up to HUFF_FAST_BITS bits, 0 for longer
+    // codes. (The symbol is not actually a DCT coefficient; see
+    // encoding.)
+    uint16_t fast[1 << HUFF_FAST_BITS];
+
+    // AC tables only: when the code and the additional bits that
+    // follow it both fit in HUFF_FAST_BITS, the whole coefficient:
+    // (value << 8) | (run of zeros << 4) | total nbits. Otherwise (and
+    // for EOB) 0.
+    int32_t fast_ac[1 << HUFF_FAST_BITS];
+
+    // longer codes, decoded canonically from the next 16 bits of
+    // input: a code has nbits bits if those bits are less than
+    // maxcode[nbits], and its symbol is values[valptr[nbits] + code].
+    uint32_t maxcode[17];
+    int32_t valptr[17];
+    uint8_t values[256];
 };
 
 struct pjpeg_decode_state
@@ -52,15 +73,20 @@ struct pjpeg_decode_state
 
     uint32_t flags;
 
-    // to decode, we load the next 16 bits of input (generally more
-    // than we need). We then look up in our code book how many bits
-    // we have actually consumed. For example, if there was a code
-    // whose bit sequence was "0", the first 32768 entries would all
-    // be copies of {.bits=1, .value=XX}; no matter what the following
-    // 15 bits are, we would get the correct decode.
+    // the image is decoded at 1/scale resolution (scale 1 or 8), from
+    // blocks of 8/scale x 8/scale pixels.
+    int scale;
+
+    // to decode, we look at the next HUFF_FAST_BITS bits of input
+    // (generally more than we need), and look up in the fast table
+    // which code they begin with and how many bits it has. For
+    // example, if there was a code whose bit sequence was "0", the
+    // first half of the entries would all be copies of {nbits=1,
+    // XX}; no matter what the following bits are, we would get the
+    // correct decode. Only the rare longer codes need more work.
     //
     // Can be up to 8 tables; computed as (ACDC * 2 + htidx)
-    struct pjpeg_huffman_code huff_codes[4][65536];
+    struct pjpeg_huffman_table huff_tables[4];
     int huff_codes_present[4];
 
     uint8_t  qtab[4][64];
@@ -72,6 +98,10 @@ struct pjpeg_decode_state
     int reset_count;
     int reset_next; // What reset marker do we expect next? (add 0xd0)
 
+    // if not NULL, the restart intervals of a scan are decoded in
+    // parallel.
+    workerpool_t *wp;
+
     int debug;
 };
 
@@ -236,6 +266,367 @@ static inline uint32_t bd_get_offset(struct bit_decoder *bd)
     return bd->inpos - bd->nbits_avail / 8;
 }
 
+// Reads the entropy-coded data of a scan. Unlike the bit_decoder, it
+// keeps up to 64 bits at hand, and never reads past a marker (it
+// supplies zeros instead), so that where the data ends is known
+// exactly.
+struct scan_decoder
+{
+    uint8_t *in;
+    uint32_t inpos;
+    uint32_t inlen;
+
+    uint64_t bits; // the high order nbits_avail bits are valid.
+    int nbits_avail;
+};
+
+// continue reading where bd left off.
+static inline void sd_init(struct scan_decoder *sd, struct bit_decoder *bd)
+{
+    sd->in = bd->in;
+    sd->inpos = bd_get_offset(bd);
+    sd->inlen = bd->inlen;
+    sd->bits = 0;
+    sd->nbits_avail = 0;
+}
+
+// hand the input back to bd, after the last byte of data the scan
+// decoder read. The bits left are padding.
+static inline void sd_finish(struct scan_decoder *sd, struct bit_decoder *bd)
+{
+    bd->inpos = sd->inpos;
+    bd->bits = 0;
+    bd->nbits_avail = 0;
+}
+
+// ensure that at least 57 bits are available.
+static inline void sd_fill(struct scan_decoder *sd)
+{
+    while (sd->nbits_avail <= 56) {
+        uint32_t nextbyte = 0;
+
+        if (sd->inpos >= sd->inlen) {
+            // we hit end of stream: hallucinate an infinite stream
+            // of 1s
+            nextbyte = 0xff;
+        } else if (sd->in[sd->inpos] != 0xff) {
+            nextbyte = sd->in[sd->inpos++];
+        } else if (sd->inpos + 1 < sd->inlen && sd->in[sd->inpos + 1] == 0x00) {
+            // a stuffed byte
+            nextbyte = 0xff;
+            sd->inpos += 2;
+        }
+        // else a marker: stay in front of it and supply zeros.
+
+        sd->bits |= ((uint64_t) nextbyte) << (56 - sd->nbits_avail);
+        sd->nbits_avail += 8;
+    }
+}
+
+static inline uint32_t sd_peek_bits(struct scan_decoder *sd, int nbits)
+{
+    return sd->bits >> (64 - nbits);
+}
+
+static inline void sd_skip_bits(struct scan_decoder *sd, int nbits)
+{
+    sd->bits <<= nbits;
+    sd->nbits_avail -= nbits;
+}
+
+// read nbits (at most 16) additional bits, and sign-extend them as
+// in F.2.2.1: if high bit is clear, it's negative.
+static inline int32_t sd_receive_extend(struct scan_decoder *sd, int nbits)
+{
+    if (nbits == 0)
+        return 0;
+
+    int32_t value = sd_peek_bits(sd, nbits);
+    sd_skip_bits(sd, nbits);
+
+    if (value < (1 << (nbits-1)))
+        value -= (1 << nbits) - 1;
+
+    return value;
+}
+
+// decode one huffman code; needs 16 bits available. Bits that are no
+// code decode to symbol 0 without being consumed.
+static inline int sd_decode_symbol(struct scan_decoder *sd, const struct pjpeg_huffman_table *ht)
+{
+    uint32_t next16 = sd_peek_bits(sd, 16);
+
+    uint16_t fast = ht->fast[next16 >> (16 - HUFF_FAST_BITS)];
+    if (fast) {
+        sd_skip_bits(sd, fast >> 8);
+        return fast & 0xff;
+    }
+
+    for (int nbits = HUFF_FAST_BITS + 1; nbits <= 16; nbits++) {
+        if (next16 < ht->maxcode[nbits]) {
+            sd_skip_bits(sd, nbits);
+            return ht->values[ht->valptr[nbits] + (next16 >> (16 - nbits))];
+        }
+    }
+
+    return 0;
+}
+
+// fill a blocksz x blocksz block with the IDCT of a block with only a
+// DC coefficient. The same as pjpeg_idct_2D_nanojpeg, which rounds
+// such blocks the same way. When decoding at 1/8 scale (blocksz 1),
+// this is the mean of any block.
+static inline void idct_dc_only(int32_t dc, int blocksz, uint8_t *out, uint32_t outstride)
+{
+    int32_t v = ((dc + 4) >> 3) + 128;
+    uint8_t pixel = v < 0 ? 0 : (v > 255 ? 255 : v);
+
+    for (int y = 0; y < blocksz; y++)
+        memset(&out[y*outstride], pixel, blocksz);
+}
+
+// the parameters of a scan needed to decode its MCUs.
+struct pjpeg_scan
+{
+    struct pjpeg_decode_state *pjd;
+
+    // the components in the scan (indices into pjd->components[]),
+    // and whether each is output.
+    int ns;
+    const uint8_t *comp_idx;
+    const uint8_t *comp_decode;
+
+    int mcus_x;
+    int blocksz;
+};
+
+// decode the MCU at (mcu_x, mcu_y), updating the DC predictions.
+static void decode_mcu(const struct pjpeg_scan *scan, struct scan_decoder *sd, int32_t *dcpred,
+                       int mcu_x, int mcu_y)
+{
+    struct pjpeg_decode_state *pjd = scan->pjd;
+
+    for (int nsidx = 0; nsidx < scan->ns; nsidx++) {
+
+        struct pjpeg_component *comp = &pjd->components[scan->comp_idx[nsidx]];
+        int decode = scan->comp_decode[nsidx];
+
+        int32_t block[64];
+
+        int qtabidx = comp->tq; // which quant table?
+        const uint8_t *qtab = pjd->qtab[qtabidx];
+
+        for (int sby = 0; sby < comp->scaley; sby++) {
+            for (int sbx = 0; sbx < comp->scalex; sbx++) {
+                // decode block for component nsidx
+                if (decode)
+                    memset(block, 0, sizeof(block));
+
+                int dc_huff_table_idx = comp->tda >> 4;
+                int ac_huff_table_idx = 2 + (comp->tda & 0x0f);
+
+                const struct pjpeg_huffman_table *dc_table = &pjd->huff_tables[dc_huff_table_idx];
+                const struct pjpeg_huffman_table *ac_table = &pjd->huff_tables[ac_huff_table_idx];
+
+                // did we see any AC coefficient?
+                int has_ac = 0;
+
+                if (1) {
+                    // do DC coefficient
+                    sd_fill(sd);
+
+                    int ssss = sd_decode_symbol(sd, dc_table) & 0x0f; // ssss == number of additional bits to read
+                    int32_t value = sd_receive_extend(sd, ssss);
+
+                    dcpred[nsidx] += value;
+                    block[0] = dcpred[nsidx] * qtab[0];
+                }
+
+                if (1) {
+                    // do AC coefficients
+                    for (int coeff = 1; coeff < 64; coeff++) {
+
+                        // enough for a code and its additional bits.
+                        if (sd->nbits_avail < 32)
+                            sd_fill(sd);
+
+                        int32_t value;
+
+                        int32_t fast_ac = ac_table->fast_ac[sd_peek_bits(sd, HUFF_FAST_BITS)];
+                        if (fast_ac) {
+                            sd_skip_bits(sd, fast_ac & 0x0f);
+                            coeff += (fast_ac >> 4) & 0x0f;
+                            value = fast_ac >> 8;
+                        } else {
+                            int code = sd_decode_symbol(sd, ac_table);
+
+                            if (code == 0) {
+                                break; // EOB
+                            }
+
+                            int rrrr = code >> 4; // run length of zeros
+                            int ssss = code & 0x0f;
+
+                            value = sd_receive_extend(sd, ssss);
+
+                            coeff += rrrr;
+                        }
+
+                        if (coeff > 63)
+                            break; // corrupt
+
+                        if (decode)
+                            block[(int) ZZ[coeff]] = value * qtab[coeff];
+                        has_ac = 1;
+                    }
+                }
+
+                if (!decode)
+                    continue;
+
+                // do IDCT
+
+                // output block's upper-left
+                // coordinate (in pixels) is
+                // (comp_x, comp_y).
+                uint32_t comp_x = (mcu_x * comp->scalex + sbx) * scan->blocksz;
+                uint32_t comp_y = (mcu_y * comp->scaley + sby) * scan->blocksz;
+                uint32_t dataidx = comp_y * comp->stride + comp_x;
+
+//                pjpeg_idct_2D_u32(block, &comp->data[dataidx], comp->stride);
+                if (!has_ac || scan->blocksz == 1)
+                    idct_dc_only(block[0], scan->blocksz, &comp->data[dataidx], comp->stride);
+                else
+                    pjpeg_idct_2D_nanojpeg(block, &comp->data[dataidx], comp->stride);
+            }
+        }
+    }
+}
+
+// a restart interval of a scan, decoded on its own.
+struct restart_interval
+{
+    // the entropy-coded data begins at offset start. For all but the
+    // last interval, end is the offset of the RST marker that follows.
+    uint32_t start, end;
+    int mcu0, mcu1;
+
+    int error;
+    uint32_t inpos; // where decoding stopped
+};
+
+struct restart_task
+{
+    const struct pjpeg_scan *scan;
+    struct restart_interval *intervals;
+    int nintervals;
+};
+
+static void restart_task(void *p, int i0, int i1)
+{
+    struct restart_task *task = p;
+    const struct pjpeg_scan *scan = task->scan;
+    struct pjpeg_decode_state *pjd = scan->pjd;
+
+    for (int i = i0; i < i1; i++) {
+        struct restart_interval *ri = &task->intervals[i];
+
+        struct scan_decoder sd = { .in = pjd->in, .inpos = ri->start, .inlen = pjd->inlen };
+
+        int32_t dcpred[scan->ns];
+        memset(dcpred, 0, sizeof(dcpred));
+
+        for (int mcu = ri->mcu0; mcu < ri->mcu1; mcu++)
+            decode_mcu(scan, &sd, dcpred, mcu % scan->mcus_x, mcu / scan->mcus_x);
+
+        ri->inpos = sd.inpos;
+
+        // as in the serial decoder, the next 0xff must be that of the
+        // RST marker; anything else means the interval is corrupt.
+        if (i + 1 < task->nintervals) {
+            for (uint32_t pos = sd.inpos; pos < ri->end; pos++) {
+                if (pjd->in[pos] == 0xff) {
+                    ri->error = PJPEG_ERR_RESET;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// decode the MCUs of a scan that begins where bd is, splitting it at
+// its restart markers and decoding the intervals on pjd->wp. Returns
+// 0 (having done nothing) if the scan has no restart intervals or
+// they are not all where they should be; the serial decoder then
+// takes over, and reports any error in the same way as always.
+static int pjpeg_decode_scan_parallel(const struct pjpeg_scan *scan, struct bit_decoder *bd, int nmcus)
+{
+    struct pjpeg_decode_state *pjd = scan->pjd;
+
+    if (pjd->reset_interval <= 0 || nmcus <= pjd->reset_interval)
+        return 0;
+
+    int nintervals = (nmcus + pjd->reset_interval - 1) / pjd->reset_interval;
+    struct restart_interval *intervals = calloc(nintervals, sizeof(struct restart_interval));
+
+    // find the RST markers: they are the only 0xff bytes in the
+    // entropy-coded data not followed by 0x00.
+    uint32_t pos = bd_get_offset(bd);
+    int reset_next = pjd->reset_next;
+    int n = 0;
+
+    intervals[0].start = pos;
+
+    while (n + 1 < nintervals && pos + 1 < pjd->inlen) {
+        if (pjd->in[pos] != 0xff || pjd->in[pos + 1] == 0x00) {
+            pos += 1 + (pjd->in[pos] == 0xff);
+            continue;
+        }
+
+        if (pjd->in[pos + 1] != 0xd0 + reset_next)
+            break; // the end of the scan, or not the marker we expect.
+
+        intervals[n].end = pos;
+        intervals[n + 1].start = pos + 2;
+        reset_next = (reset_next + 1) & 0x7;
+        n++;
+        pos += 2;
+    }
+
+    if (n + 1 < nintervals) {
+        free(intervals);
+        return 0;
+    }
+
+    for (int i = 0; i < nintervals; i++) {
+        intervals[i].mcu0 = i * pjd->reset_interval;
+        intervals[i].mcu1 = (i + 1 < nintervals) ? intervals[i].mcu0 + pjd->reset_interval : nmcus;
+    }
+    intervals[nintervals - 1].end = pjd->inlen;
+
+    struct restart_task task = { .scan = scan, .intervals = intervals, .nintervals = nintervals };
+    workerpool_parallel_for(pjd->wp, nintervals, 1, restart_task, &task);
+
+    // an interval that the serial decoder would have rejected: let
+    // it do so, from the beginning of the scan.
+    for (int i = 0; i < nintervals; i++) {
+        if (intervals[i].error) {
+            free(intervals);
+            return 0;
+        }
+    }
+
+    // continue after the scan, as the serial decoder would.
+    struct scan_decoder sd = { .inpos = intervals[nintervals - 1].inpos };
+    sd_finish(&sd, bd);
+
+    pjd->reset_count = intervals[nintervals - 1].mcu1 - intervals[nintervals - 1].mcu0;
+    pjd->reset_next = reset_next;
+
+    free(intervals);
+    return 1;
+}
+
 static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
 {
     // XXX TODO Include sanity check that this is actually a JPG
@@ -391,6 +782,8 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                         return PJPEG_ERR_DHT;
 
                     int htidx = Tc*2 + Th;
+                    struct pjpeg_huffman_table *ht = &pjd->huff_tables[htidx];
+                    memset(ht, 0, sizeof(struct pjpeg_huffman_table));
 
                     uint8_t L[17]; // how many symbols of each bit length?
                     L[0] = 0;      // no 0 bit codes :)
@@ -400,29 +793,64 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                     }
                     length -= 16;
 
+                    // codes are assigned in order (canonically);
+                    // code_pos is the next one, left-aligned in 16
+                    // bits.
                     uint32_t code_pos = 0;
+                    int nsymbols = 0;
 
                     for (int nbits = 1; nbits <= 16; nbits++) {
                         int nvalues = L[nbits];
 
-                        // how many entries will we fill?
-                        // (a 1 bit code will fill 32768, a 2 bit code 16384, ...)
+                        // how many 16 bit sequences begin with each code?
+                        // (a 1 bit code will cover 32768, a 2 bit code 16384, ...)
                         uint32_t ncodes = (1 << (16 - nbits));
 
+                        ht->valptr[nbits] = nsymbols - (code_pos >> (16 - nbits));
+
                         // consume the values...
                         for (int vi = 0; vi < nvalues; vi++) {
                             uint8_t code = bd_consume_bits(&bd, 8);
 
-                            if (code_pos + ncodes > 0xffff)
+                            if (code_pos + ncodes > 0xffff || nsymbols >= 256)
                                 return PJPEG_ERR_DHT;
 
-                            for (int ci = 0; ci < ncodes; ci++) {
-                                pjd->huff_codes[htidx][code_pos].nbits = nbits;
-                                pjd->huff_codes[htidx][code_pos].code = code;
-                                code_pos++;
+                            ht->values[nsymbols++] = code;
+
+                            if (nbits <= HUFF_FAST_BITS) {
+                                int shift = 16 - HUFF_FAST_BITS;
+                                for (int ci = code_pos >> shift; ci < (code_pos + ncodes) >> shift; ci++)
+                                    ht->fast[ci] = (nbits << 8) | code;
                             }
+
+                            code_pos += ncodes;
+                        }
+
+                        ht->maxcode[nbits] = code_pos;
+                    }
+
+                    if (Tc == 1) {
+                        // decode the coefficient along with the code
+                        // where both fit.
+                        for (int i = 0; i < (1 << HUFF_FAST_BITS); i++) {
+                            int nbits = ht->fast[i] >> 8;
+                            int rrrr = (ht->fast[i] >> 4) & 0x0f;
+                            int ssss = ht->fast[i] & 0x0f;
+
+                            if (nbits == 0 || (ht->fast[i] & 0xff) == 0 || nbits + ssss > HUFF_FAST_BITS)
+                                continue; // long code or EOB
+
+                            int32_t value = 0;
+                            if (ssss > 0) {
+                                value = (i >> (HUFF_FAST_BITS - nbits - ssss)) & ((1 << ssss) - 1);
+                                if (value < (1 << (ssss-1)))
+                                    value -= (1 << ssss) - 1;
+                            }
+
+                            ht->fast_ac[i] = value * 256 + (rrrr << 4) + nbits + ssss;
                         }
                     }
+
                     pjd->huff_codes_present[htidx] = 1;
                 }
                 break;
@@ -496,11 +924,24 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                     printf("Image has %d x %d MCU blocks, each %d x %d pixels\n",
                            mcus_x, mcus_y, maxmcux, maxmcuy);
 
+                // size of each decoded block in pixels
+                int blocksz = 8 / pjd->scale;
+
+                // which components do we output? With PJPEG_LUMA_ONLY,
+                // the others are still entropy-decoded (to get past
+                // them) but not dequantized or transformed.
+                uint8_t comp_decode[ns];
+                for (int i = 0; i < ns; i++)
+                    comp_decode[i] = !(pjd->flags & PJPEG_LUMA_ONLY) || comp_idx[i] == 0;
+
                 // allocate output storage
                 for (int i = 0; i < ns; i++) {
+                    if (!comp_decode[i])
+                        continue;
+
                     struct pjpeg_component *comp = &pjd->components[comp_idx[i]];
-                    comp->width = mcus_x * comp->scalex * 8;
-                    comp->height = mcus_y * comp->scaley * 8;
+                    comp->width = mcus_x * comp->scalex * blocksz;
+                    comp->height = mcus_y * comp->scaley * blocksz;
                     comp->stride = comp->width;
 
                     int alignment = 32;
@@ -511,12 +952,35 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                 }
 
 
+                struct pjpeg_scan scan = { .pjd = pjd, .ns = ns, .comp_idx = comp_idx,
+                                           .comp_decode = comp_decode, .mcus_x = mcus_x,
+                                           .blocksz = blocksz };
+
+                for (int i = 0; i < ns; i++) {
+                    struct pjpeg_component *comp = &pjd->components[comp_idx[i]];
+
+                    // check the table indices of corrupt files.
+                    if ((comp->tda >> 4) > 1 || (comp->tda & 0x0f) > 1 || comp->tq >= 4)
+                        return PJPEG_ERR_SOS;
+
+                    if (!pjd->huff_codes_present[comp->tda >> 4] ||
+                        !pjd->huff_codes_present[2 + (comp->tda & 0x0f)])
+                        return PJPEG_ERR_MISSING_DHT; // probably an MJPEG.
+                }
+
+                if (pjd->wp != NULL && workerpool_get_nthreads(pjd->wp) > 1 &&
+                    pjpeg_decode_scan_parallel(&scan, &bd, mcus_x * mcus_y))
+                    break;
+
                 // each component has its own DC prediction
                 int32_t dcpred[ns];
                 memset(dcpred, 0, sizeof(dcpred));
 
                 pjd->reset_count = 0;
 
+                struct scan_decoder sd;
+                sd_init(&sd, &bd);
+
                 for (int mcu_y = 0; mcu_y < mcus_y; mcu_y++) {
                     for (int mcu_x = 0; mcu_x < mcus_x; mcu_x++) {
 
@@ -531,6 +995,8 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                         // discard any fractional bits left.
                         if (pjd->reset_interval > 0 && pjd->reset_count == pjd->reset_interval) {
 
+                            sd_finish(&sd, &bd);
+
                             // RST markers are byte-aligned, so force
                             // the bit-decoder to the next byte
                             // boundary.
@@ -555,95 +1021,20 @@ static int pjpeg_decode_buffer(struct pjpeg_decode_state *pjd)
                             pjd->reset_next = (pjd->reset_next + 1) & 0x7;
 
                             memset(dcpred, 0, sizeof(dcpred));
-                        }
-
-                        for (int nsidx = 0; nsidx < ns; nsidx++) {
-
-                            struct pjpeg_component *comp = &pjd->components[comp_idx[nsidx]];
-
-                            int32_t block[64];
-
-                            int qtabidx = comp->tq; // which quant table?
-
-                            for (int sby = 0; sby < comp->scaley; sby++) {
-                                for (int sbx = 0; sbx < comp->scalex; sbx++) {
-                                    // decode block for component nsidx
-                                    memset(block, 0, sizeof(block));
-
-                                    int dc_huff_table_idx = comp->tda >> 4;
-                                    int ac_huff_table_idx = 2 + (comp->tda & 0x0f);
-
-                                    if (!pjd->huff_codes_present[dc_huff_table_idx] ||
-                                        !pjd->huff_codes_present[ac_huff_table_idx])
-                                        return PJPEG_ERR_MISSING_DHT; // probably an MJPEG.
-
-
-                                    if (1) {
-                                        // do DC coefficient
-                                        uint32_t next16 = bd_peek_bits(&bd, 16);
-                                        struct pjpeg_huffman_code *huff_code = &pjd->huff_codes[dc_huff_table_idx][next16];
-                                        bd_consume_bits(&bd, huff_code->nbits);
-
-                                        int ssss = huff_code->code & 0x0f; // ssss == number of additional bits to read
-                                        int32_t value = bd_consume_bits(&bd, ssss);
-
-                                        // if high bit is clear, it's negative
-                                        if ((value & (1 << (ssss-1))) == 0)
-                                            value += ((-1) << ssss) + 1;
-
-                                        dcpred[nsidx] += value;
-                                        block[0] = dcpred[nsidx] * pjd->qtab[qtabidx][0];
-                                    }
-
-                                    if (1) {
-                                        // do AC coefficients
-                                        for (int coeff = 1; coeff < 64; coeff++) {
 
-                                            uint32_t next16 = bd_peek_bits(&bd, 16);
-
-                                            struct pjpeg_huffman_code *huff_code = &pjd->huff_codes[ac_huff_table_idx][next16];
-                                            bd_consume_bits(&bd, huff_code->nbits);
-
-                                            if (huff_code->code == 0) {
-                                                break; // EOB
-                                            }
-
-                                            int rrrr = huff_code->code >> 4; // run length of zeros
-                                            int ssss = huff_code->code & 0x0f;
-
-                                            int32_t value = bd_consume_bits(&bd, ssss);
-
-                                            // if high bit is clear, it's negative
-                                            if ((value & (1 << (ssss-1))) == 0)
-                                                value += ((-1) << ssss) + 1;
-
-                                            coeff += rrrr;
-
-                                            block[(int) ZZ[coeff]] = value * pjd->qtab[qtabidx][coeff];
-                                        }
-                                    }
-
-                                    // do IDCT
-
-                                    // output block's upper-left
-                                    // coordinate (in pixels) is
-                                    // (comp_x, comp_y).
-                                    uint32_t comp_x = (mcu_x * comp->scalex + sbx) * 8;
-                                    uint32_t comp_y = (mcu_y * comp->scaley + sby) * 8;
-                                    uint32_t dataidx = comp_y * comp->stride + comp_x;
-
-//                                    pjpeg_idct_2D_u32(block, &comp->data[dataidx], comp->stride);
-                                    pjpeg_idct_2D_nanojpeg(block, &comp->data[dataidx], comp->stride);
-                                }
-                            }
+                            sd_init(&sd, &bd);
                         }
 
+                        decode_mcu(&scan, &sd, dcpred, mcu_x, mcu_y);
+
                         pjd->reset_count++;
 //                        printf("%04x: reset count %d / %d\n", pjd->inpos, pjd->reset_count, pjd->reset_interval);
 
                     }
                 }
 
+                sd_finish(&sd, &bd);
+
                 break;
             }
 
@@ -694,7 +1085,7 @@ void pjpeg_destroy(pjpeg_t *pj)
 // just grab the first component.
 image_u8_t *pjpeg_to_u8_baseline(pjpeg_t *pj)
 {
-    assert(pj->ncomponents > 0);
+    assert(pj->ncomponents > 0 && pj->components[0].data != NULL);
 
     pjpeg_component_t *comp = &pj->components[0];
 
@@ -735,6 +1126,8 @@ image_u8x3_t *pjpeg_to_u8x3_baseline(pjpeg_t *pj)
     pjpeg_component_t *Cb = &pj->components[1];
     pjpeg_component_t *Cr = &pj->components[2];
 
+    assert(Y->data != NULL && Cb->data != NULL && Cr->data != NULL);
+
     int Cb_factor_y = Y->height / Cb->height;
     int Cb_factor_x = Y->width / Cb->width;
 
@@ -841,9 +1234,16 @@ pjpeg_t *pjpeg_create_from_file(const char *path, uint32_t flags, int *error)
 }
 
 pjpeg_t *pjpeg_create_from_buffer(uint8_t *buf, int buflen, uint32_t flags, int *error)
+{
+    return pjpeg_create_from_buffer_parallel(buf, buflen, flags, NULL, error);
+}
+
+pjpeg_t *pjpeg_create_from_buffer_parallel(uint8_t *buf, int buflen, uint32_t flags,
+                                           workerpool_t *wp, int *error)
 {
     struct pjpeg_decode_state pjd;
     memset(&pjd, 0, sizeof(pjd));
+    pjd.scale = 1;
 
     if (flags & PJPEG_MJPEG) {
         pjd.in = mjpeg_dht;
@@ -855,6 +1255,10 @@ pjpeg_t *pjpeg_create_from_buffer(uint8_t *buf, int buflen, uint32_t flags, int
     pjd.in = buf;
     pjd.inlen = buflen;
     pjd.flags = flags;
+    pjd.wp = wp;
+
+    if (flags & PJPEG_SCALE_8)
+        pjd.scale = 8;
 
     int result = pjpeg_decode_buffer(&pjd);
     if (error)
@@ -870,10 +1274,70 @@ pjpeg_t *pjpeg_create_from_buffer(uint8_t *buf, int buflen, uint32_t flags, int
 
     pjpeg_t *pj = calloc(1, sizeof(pjpeg_t));
 
-    pj->width = pjd.width;
-    pj->height = pjd.height;
+    pj->width = (pjd.width + pjd.scale - 1) / pjd.scale;
+    pj->height = (pjd.height + pjd.scale - 1) / pjd.scale;
     pj->ncomponents = pjd.ncomponents;
     pj->components = pjd.components;
 
     return pj;
 }
+
+image_u8_t *pjpeg_create_u8_from_buffer(uint8_t *buf, int buflen, uint32_t flags, int *error)
+{
+    return pjpeg_create_u8_from_buffer_parallel(buf, buflen, flags, NULL, error);
+}
+
+image_u8_t *pjpeg_create_u8_from_buffer_parallel(uint8_t *buf, int buflen, uint32_t flags,
+                                                 workerpool_t *wp, int *error)
+{
+    pjpeg_t *pj = pjpeg_create_from_buffer_parallel(buf, buflen, flags | PJPEG_LUMA_ONLY, wp, error);
+    if (pj == NULL)
+        return NULL;
+
+    // a corrupt file may end before the luma was decoded.
+    if (pj->ncomponents == 0 || pj->components[0].data == NULL ||
+        pj->components[0].width < pj->width || pj->components[0].height < pj->height) {
+        pjpeg_destroy(pj);
+        if (error)
+            *error = PJPEG_ERR_EOF;
+        return NULL;
+    }
+
+    // hand the luma plane over to the image instead of copying it.
+    pjpeg_component_t *comp = &pj->components[0];
+
+    image_u8_t tmp = { .width = pj->width, .height = pj->height, .stride = comp->stride, .buf = comp->data };
+    image_u8_t *im = calloc(1, sizeof(image_u8_t));
+    memcpy(im, &tmp, sizeof(image_u8_t));
+
+    comp->data = NULL;
+    pjpeg_destroy(pj);
+
+    return im;
+}
+
+image_u8_t *pjpeg_create_u8_from_file(const char *path, uint32_t flags, int *error)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long buflen = ftell(f);
+
+    uint8_t *buf = malloc(buflen);
+    fseek(f, 0, SEEK_SET);
+    int res = fread(buf, 1, buflen, f);
+    fclose(f);
+    if (res != buflen) {
+        free(buf);
+        if (error)
+            *error = PJPEG_ERR_FILE;
+        return NULL;
+    }
+
+    image_u8_t *im = pjpeg_create_u8_from_buffer(buf, buflen, flags, error);
+
+    free(buf);
+    return im;
+}
@@ -58,6 +58,13 @@ int64_t utime_now() // blacklist-ignore
     return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+int64_t ntime_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 int64_t utime_get_seconds(int64_t v)
 {
     return v/1000000;
@@ -30,32 +30,84 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the Regents of The University of Michigan.
 */
 
-#define __USE_GNU
+#define _GNU_SOURCE
 #include <pthread.h>
 #include <sched.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <inttypes.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #include "workerpool.h"
 #include "timeprofile.h"
 #include "math_util.h"
-#include "string_util.h"
+
+// Tasks are distributed over one deque per thread when workerpool_run
+// is called; the calling thread acts as worker 0. Each thread takes
+// tasks from the front of its own deque, and when that is empty,
+// steals from the back of the others'. A deque is a range [head,
+// tail) of the task array, packed together with the generation (run
+// count) it belongs to into a single word so that both ends can be
+// claimed with one compare-and-swap. Idle threads spin briefly
+// waiting for the next generation before parking on a condition
+// variable, so that back-to-back calls to workerpool_run (several per
+// frame) do not pay for a wake-up. When the pool is pinned or
+// restricted to some CPUs, so is the calling thread for as long as it
+// runs tasks: its own affinity mask is restored afterwards.
+
+// How long do idle threads spin before parking?
+#define WORKERPOOL_SPIN_COUNT 4000
+
+#define DEQUE_BITS 20
+#define DEQUE_MASK ((1 << DEQUE_BITS) - 1)
+#define DEQUE_GEN_MASK 0xffffff
+
+struct deque
+{
+    uint64_t v; // generation:24 | head:20 | tail:20
+} __attribute__ ((aligned (64)));
+
+struct worker
+{
+    workerpool_t *wp;
+    int idx;
+
+    // Linux thread id, set once the thread has started (see
+    // workerpool_get_thread_id).
+    int tid;
+};
 
 struct workerpool {
     int nthreads;
     zarray_t *tasks;
-    int taskspos;
 
     pthread_t *threads;
-    int *status;
+    struct worker *workers;
+    struct deque *deques;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t startcond;   // used to signal the availability of work
-    pthread_cond_t endcond;     // used to signal completion of all work
+    uint32_t generation; // incremented by each workerpool_run
+    int exiting;
+
+    // how long to spin before parking or yielding. Zero on a single
+    // CPU, where spinning only delays the thread we are waiting for.
+    int spin_count;
 
-    int end_count; // how many threads are done?
+    // CPUs that the thread calling workerpool_run is confined to while
+    // it runs tasks, or NULL.
+    cpu_set_t *caller_cpus;
+
+    int pending __attribute__ ((aligned (64))); // tasks not yet completed
+
+    // used to park idle threads.
+    pthread_mutex_t mutex;
+    pthread_cond_t wakecond;
+    int nparked;
 };
 
 struct task
@@ -64,43 +116,135 @@ struct task
     void *p;
 };
 
-void *worker_thread(void *p)
+static inline void cpu_relax()
 {
-    workerpool_t *wp = (workerpool_t*) p;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+    __asm__ __volatile__ ("yield");
+#endif
+}
 
-    int cnt = 0;
+static inline uint64_t deque_pack(uint32_t gen, uint32_t head, uint32_t tail)
+{
+    return ((uint64_t) (gen & DEQUE_GEN_MASK) << (2*DEQUE_BITS)) | ((uint64_t) head << DEQUE_BITS) | tail;
+}
+
+// claim a task from the front (steal == 0) or back (steal != 0) of
+// the deque. Returns the task index, or -1 if the deque is empty or
+// belongs to another generation.
+static int deque_take(struct deque *dq, uint32_t gen, int steal)
+{
+    uint64_t v = __atomic_load_n(&dq->v, __ATOMIC_ACQUIRE);
 
     while (1) {
+        uint32_t head = (v >> DEQUE_BITS) & DEQUE_MASK;
+        uint32_t tail = v & DEQUE_MASK;
+
+        if ((v >> (2*DEQUE_BITS)) != (gen & DEQUE_GEN_MASK) || head == tail)
+            return -1;
+
+        uint64_t nv = steal ? deque_pack(gen, head, tail - 1) : deque_pack(gen, head + 1, tail);
+
+        // on failure, v is updated to the current value.
+        if (__atomic_compare_exchange_n(&dq->v, &v, nv, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return steal ? tail - 1 : head;
+    }
+}
+
+// run tasks of generation 'gen' until every deque is empty.
+static void run_tasks(workerpool_t *wp, int self, uint32_t gen)
+{
+    while (1) {
+        int idx = deque_take(&wp->deques[self], gen, 0);
+
+        for (int i = 1; idx < 0 && i < wp->nthreads; i++)
+            idx = deque_take(&wp->deques[(self + i) % wp->nthreads], gen, 1);
+
+        if (idx < 0)
+            return;
+
         struct task *task;
+        zarray_get_volatile(wp->tasks, idx, &task);
+        task->f(task->p);
 
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->taskspos == zarray_size(wp->tasks)) {
-            wp->end_count++;
-//          printf("%"PRId64" thread %d did %d\n", utime_now(), pthread_self(), cnt);
-            pthread_cond_broadcast(&wp->endcond);
-            pthread_cond_wait(&wp->startcond, &wp->mutex);
-            cnt = 0;
-//            printf("%"PRId64" thread %d awake\n", utime_now(), pthread_self());
-        }
+        __atomic_sub_fetch(&wp->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// wait for a generation other than 'seen' to start; returns it.
+static uint32_t wait_for_work(workerpool_t *wp, uint32_t seen)
+{
+    uint32_t gen;
+
+    for (int i = 0; i < wp->spin_count; i++) {
+        gen = __atomic_load_n(&wp->generation, __ATOMIC_ACQUIRE);
+        if (gen != seen)
+            return gen;
+        cpu_relax();
+    }
 
-        zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-        wp->taskspos++;
-        cnt++;
+    pthread_mutex_lock(&wp->mutex);
+    __atomic_add_fetch(&wp->nparked, 1, __ATOMIC_SEQ_CST);
+    while ((gen = __atomic_load_n(&wp->generation, __ATOMIC_SEQ_CST)) == seen)
+        pthread_cond_wait(&wp->wakecond, &wp->mutex);
+    __atomic_sub_fetch(&wp->nparked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&wp->mutex);
+
+    return gen;
+}
+
+// start a new generation, waking up any parked thread.
+static void start_generation(workerpool_t *wp)
+{
+    __atomic_add_fetch(&wp->generation, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&wp->nparked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&wp->mutex);
+        pthread_cond_broadcast(&wp->wakecond);
         pthread_mutex_unlock(&wp->mutex);
-//        pthread_yield();
-        sched_yield();
+    }
+}
+
+void *worker_thread(void *p)
+{
+    struct worker *worker = (struct worker*) p;
+    workerpool_t *wp = worker->wp;
+
+#ifdef __linux__
+    __atomic_store_n(&worker->tid, (int) syscall(SYS_gettid), __ATOMIC_RELEASE);
+#endif
+
+    uint32_t gen = 0;
+
+    while (1) {
+        gen = wait_for_work(wp, gen);
 
         // we've been asked to exit.
-        if (task->f == NULL)
+        if (__atomic_load_n(&wp->exiting, __ATOMIC_ACQUIRE))
             return NULL;
 
-        task->f(task->p);
+        run_tasks(wp, worker->idx, gen);
     }
 
     return NULL;
 }
 
-workerpool_t *workerpool_create(int nthreads)
+// the CPUs that thread i may run on: cpus[i % ncpus] if pin is set,
+// any of cpus otherwise.
+static void thread_cpuset(cpu_set_t *cpuset, int i, const int *cpus, int ncpus, int pin)
+{
+    CPU_ZERO(cpuset);
+
+    if (pin) {
+        CPU_SET(cpus[i % ncpus], cpuset);
+    } else {
+        for (int j = 0; j < ncpus; j++)
+            CPU_SET(cpus[j], cpuset);
+    }
+}
+
+static workerpool_t *workerpool_create_affinity(int nthreads, const int *cpus, int ncpus, int pin)
 {
     assert(nthreads > 0);
 
@@ -108,15 +252,43 @@ workerpool_t *workerpool_create(int nthreads)
     wp->nthreads = nthreads;
     wp->tasks = zarray_create(sizeof(struct task));
 
+    if (ncpus > 0) {
+        wp->caller_cpus = malloc(sizeof(cpu_set_t));
+        thread_cpuset(wp->caller_cpus, 0, cpus, ncpus, pin);
+    }
+
     if (nthreads > 1) {
+        // thread 0 is the one calling workerpool_run.
         wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
+        wp->workers = calloc(wp->nthreads, sizeof(struct worker));
+
+        int res = posix_memalign((void**) &wp->deques, 64, wp->nthreads * sizeof(struct deque));
+        if (res != 0) {
+            perror("posix_memalign");
+            exit(-1);
+        }
+        memset(wp->deques, 0, wp->nthreads * sizeof(struct deque));
 
         pthread_mutex_init(&wp->mutex, NULL);
-        pthread_cond_init(&wp->startcond, NULL);
-        pthread_cond_init(&wp->endcond, NULL);
+        pthread_cond_init(&wp->wakecond, NULL);
 
-        for (int i = 0; i < nthreads; i++) {
-            int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
+        wp->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WORKERPOOL_SPIN_COUNT : 0;
+
+        for (int i = 1; i < nthreads; i++) {
+            wp->workers[i].wp = wp;
+            wp->workers[i].idx = i;
+
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+
+            if (ncpus > 0) {
+                cpu_set_t cpuset;
+                thread_cpuset(&cpuset, i, cpus, ncpus, pin);
+                pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+            }
+
+            res = pthread_create(&wp->threads[i], &attr, worker_thread, &wp->workers[i]);
+            pthread_attr_destroy(&attr);
             if (res != 0) {
                 perror("pthread_create");
                 exit(-1);
@@ -127,6 +299,21 @@ workerpool_t *workerpool_create(int nthreads)
     return wp;
 }
 
+workerpool_t *workerpool_create(int nthreads)
+{
+    return workerpool_create_affinity(nthreads, NULL, 0, 0);
+}
+
+workerpool_t *workerpool_create_pinned(int nthreads, const int *cpus, int ncpus)
+{
+    return workerpool_create_affinity(nthreads, cpus, ncpus, 1);
+}
+
+workerpool_t *workerpool_create_restricted(int nthreads, const int *cpus, int ncpus)
+{
+    return workerpool_create_affinity(nthreads, cpus, ncpus, 0);
+}
+
 void workerpool_destroy(workerpool_t *wp)
 {
     if (wp == NULL)
@@ -134,23 +321,21 @@ void workerpool_destroy(workerpool_t *wp)
 
     // force all worker threads to exit.
     if (wp->nthreads > 1) {
-        for (int i = 0; i < wp->nthreads; i++)
-            workerpool_add_task(wp, NULL, NULL);
-
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
-        pthread_mutex_unlock(&wp->mutex);
+        __atomic_store_n(&wp->exiting, 1, __ATOMIC_RELEASE);
+        start_generation(wp);
 
-        for (int i = 0; i < wp->nthreads; i++)
+        for (int i = 1; i < wp->nthreads; i++)
             pthread_join(wp->threads[i], NULL);
 
         pthread_mutex_destroy(&wp->mutex);
-        pthread_cond_destroy(&wp->startcond);
-        pthread_cond_destroy(&wp->endcond);
+        pthread_cond_destroy(&wp->wakecond);
         free(wp->threads);
+        free(wp->workers);
+        free(wp->deques);
     }
 
     zarray_destroy(wp->tasks);
+    free(wp->caller_cpus);
     free(wp);
 }
 
@@ -159,6 +344,22 @@ int workerpool_get_nthreads(workerpool_t *wp)
     return wp->nthreads;
 }
 
+int workerpool_get_thread_id(workerpool_t *wp, int i)
+{
+#ifdef __linux__
+    if (i <= 0 || i >= wp->nthreads)
+        return 0;
+
+    int tid;
+    while ((tid = __atomic_load_n(&wp->workers[i].tid, __ATOMIC_ACQUIRE)) == 0)
+        sched_yield();
+
+    return tid;
+#else
+    return -1;
+#endif
+}
+
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
 {
     struct task t;
@@ -179,52 +380,160 @@ void workerpool_run_single(workerpool_t *wp)
     zarray_clear(wp->tasks);
 }
 
+// confine the calling thread to wp->caller_cpus, saving its affinity
+// mask in old. Returns whether it has to be restored with
+// unpin_caller.
+static int pin_caller(workerpool_t *wp, cpu_set_t *old)
+{
+    if (wp->caller_cpus == NULL)
+        return 0;
+
+    pthread_t self = pthread_self();
+    if (pthread_getaffinity_np(self, sizeof(cpu_set_t), old) != 0)
+        return 0;
+
+    if (CPU_EQUAL(old, wp->caller_cpus))
+        return 0;
+
+    return pthread_setaffinity_np(self, sizeof(cpu_set_t), wp->caller_cpus) == 0;
+}
+
+static void unpin_caller(int pinned, const cpu_set_t *old)
+{
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), old);
+}
+
 // runs all added tasks, waits for them to complete.
 void workerpool_run(workerpool_t *wp)
 {
-    if (wp->nthreads > 1) {
-        wp->end_count = 0;
+    cpu_set_t old_cpus;
+    int pinned = pin_caller(wp, &old_cpus);
 
-        pthread_mutex_lock(&wp->mutex);
-        pthread_cond_broadcast(&wp->startcond);
+    int ntasks = zarray_size(wp->tasks);
 
-        while (wp->end_count < wp->nthreads) {
-//            printf("caught %d\n", wp->end_count);
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
+    if (wp->nthreads > 1 && ntasks > 1) {
+        assert(ntasks <= DEQUE_MASK);
+
+        uint32_t gen = wp->generation + 1;
+
+        // give each thread a contiguous share of the tasks. Threads
+        // still working through a previous generation cannot claim
+        // any of these: all of its deques are empty.
+        wp->pending = ntasks;
+        for (int i = 0; i < wp->nthreads; i++) {
+            uint32_t head = (int64_t) ntasks * i / wp->nthreads;
+            uint32_t tail = (int64_t) ntasks * (i + 1) / wp->nthreads;
+            __atomic_store_n(&wp->deques[i].v, deque_pack(gen, head, tail), __ATOMIC_RELAXED);
         }
 
-        pthread_mutex_unlock(&wp->mutex);
+        start_generation(wp);
 
-        wp->taskspos = 0;
+        run_tasks(wp, 0, gen);
+
+        // once our own deque and all the others are empty, the
+        // remaining tasks are being run by other threads.
+        for (int i = 0; __atomic_load_n(&wp->pending, __ATOMIC_ACQUIRE) > 0; i++) {
+            if (i < wp->spin_count)
+                cpu_relax();
+            else
+                sched_yield();
+        }
 
         zarray_clear(wp->tasks);
 
     } else {
         workerpool_run_single(wp);
     }
+
+    unpin_caller(pinned, &old_cpus);
 }
 
-int workerpool_get_nprocs()
+struct parallel_for
 {
-    FILE * f = fopen("/proc/cpuinfo", "r");
-    size_t n = 0;
-    char * buf = NULL;
+    void (*f)(void *ctx, int i0, int i1);
+    void *ctx;
+
+    int n, grain, nthreads;
+    int next __attribute__ ((aligned (64))); // first unclaimed index
+};
 
-    int nproc = 0;
+static void parallel_for_task(void *p)
+{
+    struct parallel_for *pf = (struct parallel_for*) p;
+
+    int i0 = __atomic_load_n(&pf->next, __ATOMIC_RELAXED);
+
+    while (1) {
+        // claim a range proportional to the remaining work, so that
+        // ranges shrink (down to grain) as the loop nears its end
+        // and the threads finish at about the same time.
+        int remaining = pf->n - i0;
+        if (remaining <= 0)
+            return;
 
-    while(getline(&buf, &n, f) != -1)
-    {
-        if(!str_starts_with(buf, "processor"))
+        int chunk = imin(remaining, imax(pf->grain, remaining / (2 * pf->nthreads)));
+
+        // on failure, i0 is updated to the current value.
+        if (!__atomic_compare_exchange_n(&pf->next, &i0, i0 + chunk, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
             continue;
 
-       int colon = str_indexof(buf, ":");
+        pf->f(pf->ctx, i0, i0 + chunk);
+
+        i0 = __atomic_load_n(&pf->next, __ATOMIC_RELAXED);
+    }
+}
+
+void workerpool_parallel_for(workerpool_t *wp, int n, int grain,
+                             void (*f)(void *ctx, int i0, int i1), void *ctx)
+{
+    if (n <= 0)
+        return;
+
+    if (grain < 1)
+        grain = 1;
 
-       int v = atoi(&buf[colon+1]);
-       if (v > nproc)
-	 nproc = v;
+    if (wp->nthreads <= 1 || n <= grain) {
+        cpu_set_t old_cpus;
+        int pinned = pin_caller(wp, &old_cpus);
+        f(ctx, 0, n);
+        unpin_caller(pinned, &old_cpus);
+        return;
     }
 
-    free(buf);
+    struct parallel_for pf = { .f = f, .ctx = ctx, .n = n, .grain = grain,
+                               .nthreads = wp->nthreads, .next = 0 };
+
+    for (int i = 0; i < wp->nthreads; i++)
+        workerpool_add_task(wp, parallel_for_task, &pf);
+
+    workerpool_run(wp);
+}
+
+int workerpool_get_nprocs()
+{
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return nprocs > 0 ? nprocs : 1;
+}
+
+int workerpool_get_affinity_cpus(uint64_t exclude, int *cpus, int maxcpus)
+{
+    cpu_set_t cpuset;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) {
+        perror("sched_getaffinity");
+        return 0;
+    }
+
+    int ncpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && ncpus < maxcpus; cpu++) {
+        if (!CPU_ISSET(cpu, &cpuset))
+            continue;
+        if (cpu < 64 && (exclude & ((uint64_t) 1 << cpu)))
+            continue;
+
+        cpus[ncpus++] = cpu;
+    }
 
-    return nproc;
+    return ncpus;
 }
@@ -0,0 +1,121 @@
+// apriltag_detector_detect_batch with pin_threads set: each thread of
+// the batch detects whole images, and must do so on the CPU it was
+// pinned to, rather than being moved onto the detector's first CPU
+// for every stage of every image.
+//
+// The library's calls to pthread_setaffinity_np are interposed below:
+// inside each call, sched_getaffinity tells where the calling thread
+// runs before being moved.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "apriltag.h"
+#include "tag36h11.h"
+#include "common/workerpool.h"
+
+namespace
+{
+
+typedef int (*setaffinity_fn)(pthread_t, size_t, const cpu_set_t*);
+
+int moves_between_cpus = 0;
+
+// A thread that runs on exactly one CPU.
+bool single_cpu(const cpu_set_t *cpus)
+{
+  return CPU_COUNT(cpus) == 1;
+}
+
+image_u8_t *tag_image(apriltag_family_t *tf, int id)
+{
+  // the tag, scaled up 8x, in the middle of a white image.
+  image_u8_t *tag = apriltag_to_image(tf, id);
+  image_u8_t *im = image_u8_create(20 * tag->width, 20 * tag->height);
+  memset(im->buf, 255, im->height * im->stride);
+
+  int x0 = (im->width - 8 * tag->width) / 2, y0 = (im->height - 8 * tag->height) / 2;
+  for (int y = 0; y < 8 * tag->height; y++)
+    for (int x = 0; x < 8 * tag->width; x++)
+      im->buf[(y0 + y) * im->stride + x0 + x] = tag->buf[(y / 8) * tag->stride + x / 8];
+
+  image_u8_destroy(tag);
+  return im;
+}
+
+} // namespace
+
+extern "C" int pthread_setaffinity_np(pthread_t thread, size_t size, const cpu_set_t *cpus)
+{
+  static setaffinity_fn next = (setaffinity_fn) dlsym(RTLD_NEXT, "pthread_setaffinity_np");
+
+  cpu_set_t current;
+  if (pthread_equal(thread, pthread_self()) &&
+      sched_getaffinity(0, sizeof(cpu_set_t), &current) == 0 &&
+      single_cpu(&current) && single_cpu(cpus) && !CPU_EQUAL(&current, cpus))
+    __atomic_add_fetch(&moves_between_cpus, 1, __ATOMIC_RELAXED);
+
+  return next(thread, size, cpus);
+}
+
+TEST(BatchAffinity, ThreadsStayOnTheirCpus)
+{
+  int cpus[64];
+  int ncpus = workerpool_get_affinity_cpus(0, cpus, 64);
+  if (ncpus < 2) {
+    std::cout << "only one CPU available, nothing to check" << std::endl;
+    return;
+  }
+
+  apriltag_family_t *tf = tag36h11_create();
+  apriltag_detector_t *td = apriltag_detector_create();
+  apriltag_detector_add_family(td, tf);
+  td->nthreads = ncpus;
+  td->pin_threads = 1;
+
+  int n = 4 * ncpus;
+  std::vector<image_u8_t*> images(n);
+  std::vector<zarray_t*> results(n);
+  for (int i = 0; i < n; i++)
+    images[i] = tag_image(tf, i);
+
+  cpu_set_t before, after;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpu_set_t), &before));
+
+  apriltag_batch_stats_t stats;
+  apriltag_detector_detect_batch(td, images.data(), n, results.data(), &stats);
+
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(cpu_set_t), &after));
+
+  // images were detected several at a time, one thread each...
+  EXPECT_EQ(ncpus, stats.nparallel);
+  EXPECT_EQ(n, stats.ndetections);
+
+  // ...without moving any of the pinned threads to another CPU, and
+  // the calling thread got its own affinity mask back.
+  EXPECT_EQ(0, moves_between_cpus);
+  EXPECT_TRUE(CPU_EQUAL(&before, &after));
+
+  for (int i = 0; i < n; i++) {
+    apriltag_detections_destroy(results[i]);
+    image_u8_destroy(images[i]);
+  }
+  apriltag_detector_destroy(td);
+  tag36h11_destroy(tf);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,123 @@
+// Replaying an MJPEG stream with frame_source: frames with and without
+// their own Huffman tables (DHT), as most cameras send them, must all
+// decode to the same image as the JPEG they were made from.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "common/frame_source.h"
+#include "common/image_u8.h"
+#include "common/pjpeg.h"
+
+namespace
+{
+
+std::vector<uint8_t> read_file(const char *path)
+{
+  std::vector<uint8_t> buf;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return buf;
+
+  uint8_t tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+    buf.insert(buf.end(), tmp, tmp + n);
+
+  fclose(f);
+  return buf;
+}
+
+// jpeg without its DHT segments. Everything from the start of scan
+// (SOS) on is kept as is.
+std::vector<uint8_t> strip_dht(const std::vector<uint8_t>& jpeg)
+{
+  std::vector<uint8_t> out(jpeg.begin(), jpeg.begin() + 2); // SOI
+
+  size_t pos = 2;
+  while (pos + 4 <= jpeg.size() && jpeg[pos] == 0xff && jpeg[pos + 1] != 0xda) {
+    size_t len = 2 + (jpeg[pos + 2] << 8 | jpeg[pos + 3]);
+    if (jpeg[pos + 1] != 0xc4)
+      out.insert(out.end(), jpeg.begin() + pos, jpeg.begin() + pos + len);
+    pos += len;
+  }
+
+  out.insert(out.end(), jpeg.begin() + pos, jpeg.end());
+  return out;
+}
+
+bool same_image(const image_u8_t *a, const image_u8_t *b)
+{
+  if (a->width != b->width || a->height != b->height)
+    return false;
+
+  for (int y = 0; y < a->height; y++) {
+    if (memcmp(&a->buf[y*a->stride], &b->buf[y*b->stride], a->width))
+      return false;
+  }
+
+  return true;
+}
+
+} // namespace
+
+TEST(FrameSource, MjpegWithAndWithoutHuffmanTables)
+{
+  std::vector<uint8_t> jpeg = read_file("data/tags_q50.jpg");
+  ASSERT_FALSE(jpeg.empty());
+
+  std::vector<uint8_t> bare = strip_dht(jpeg);
+  ASSERT_LT(bare.size(), jpeg.size());
+
+  int error;
+  image_u8_t *expected = pjpeg_create_u8_from_buffer(jpeg.data(), jpeg.size(), 0, &error);
+  ASSERT_TRUE(expected != NULL);
+
+  // without tables, only PJPEG_MJPEG can decode the frame.
+  EXPECT_TRUE(pjpeg_create_u8_from_buffer(bare.data(), bare.size(), 0, &error) == NULL);
+  EXPECT_EQ(PJPEG_ERR_MISSING_DHT, error);
+
+  char path[] = "/tmp/frame_source_test_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+
+  const std::vector<uint8_t> *frames[] = { &jpeg, &bare, &jpeg, &bare };
+  for (int i = 0; i < 4; i++)
+    ASSERT_EQ((ssize_t) frames[i]->size(), write(fd, frames[i]->data(), frames[i]->size()));
+  close(fd);
+
+  frame_source_t *fs = frame_source_create_mjpeg(path, 2, 1);
+  ASSERT_TRUE(fs != NULL);
+
+  int nframes = 0;
+  frame_source_frame_t frame;
+  while (frame_source_next(fs, &frame)) {
+    EXPECT_EQ(nframes, frame.index);
+    EXPECT_TRUE(same_image(expected, frame.im)) << "frame " << nframes;
+    frame_source_release(fs, &frame);
+    nframes++;
+  }
+
+  frame_source_stats_t stats;
+  frame_source_get_stats(fs, &stats);
+  frame_source_destroy(fs);
+  unlink(path);
+
+  EXPECT_EQ(4, nframes);
+  EXPECT_EQ(4, stats.nframes);
+  EXPECT_EQ(0, stats.nerrors);
+
+  image_u8_destroy(expected);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
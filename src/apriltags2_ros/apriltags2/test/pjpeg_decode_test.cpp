@@ -0,0 +1,105 @@
+// Full decodes of the test JPEGs against the planes the decoder gave
+// before its Huffman fast path and SIMD IDCT (data/<name>.{y,cb,cr}.pgm):
+// a q50 4:2:0 image and an odd-sized q90 4:4:4 one, whose longer codes
+// miss the 9-bit lookup tables more often. They must match exactly.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/image_u8.h"
+#include "common/pjpeg.h"
+
+namespace
+{
+
+std::vector<uint8_t> read_file(const char *path)
+{
+  std::vector<uint8_t> buf;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return buf;
+
+  uint8_t tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+    buf.insert(buf.end(), tmp, tmp + n);
+
+  fclose(f);
+  return buf;
+}
+
+// number of pixels in the width x height top left corner of data that
+// differ from ref.
+int count_diffs(const uint8_t *data, int stride, const image_u8_t *ref, int width, int height)
+{
+  int ndiffs = 0;
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      if (data[y*stride + x] != ref->buf[y*ref->stride + x])
+        ndiffs++;
+    }
+  }
+
+  return ndiffs;
+}
+
+void check_decode(const std::string& name)
+{
+  std::vector<uint8_t> jpeg = read_file(("data/" + name + ".jpg").c_str());
+  ASSERT_FALSE(jpeg.empty());
+
+  int error;
+  pjpeg_t *pj = pjpeg_create_from_buffer(jpeg.data(), jpeg.size(), 0, &error);
+  ASSERT_TRUE(pj != NULL);
+  ASSERT_EQ(3, pj->ncomponents);
+
+  const char *planes[] = { "y", "cb", "cr" };
+  image_u8_t *refs[3];
+
+  for (int i = 0; i < 3; i++) {
+    refs[i] = image_u8_create_from_pnm(("data/" + name + "." + planes[i] + ".pgm").c_str());
+    ASSERT_TRUE(refs[i] != NULL);
+
+    pjpeg_component_t *comp = &pj->components[i];
+    ASSERT_EQ(refs[i]->width, (int) comp->width);
+    ASSERT_EQ(refs[i]->height, (int) comp->height);
+
+    EXPECT_EQ(0, count_diffs(comp->data, comp->stride, refs[i], comp->width, comp->height))
+      << name << " " << planes[i];
+  }
+
+  // the luma-only decode straight into an image.
+  image_u8_t *im = pjpeg_create_u8_from_buffer(jpeg.data(), jpeg.size(), 0, &error);
+  ASSERT_TRUE(im != NULL);
+  ASSERT_EQ((int) pj->width, im->width);
+  ASSERT_EQ((int) pj->height, im->height);
+  EXPECT_EQ(0, count_diffs(im->buf, im->stride, refs[0], im->width, im->height)) << name;
+
+  image_u8_destroy(im);
+  for (int i = 0; i < 3; i++)
+    image_u8_destroy(refs[i]);
+  pjpeg_destroy(pj);
+}
+
+} // namespace
+
+TEST(PjpegDecode, Subsampled420)
+{
+  check_decode("tags_q50");
+}
+
+TEST(PjpegDecode, OddSized444)
+{
+  check_decode("tags_q90_444");
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
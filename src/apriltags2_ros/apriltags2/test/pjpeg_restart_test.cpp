@@ -0,0 +1,160 @@
+// Parallel decoding of restart intervals (pjpeg_create_from_buffer_parallel)
+// on data/tags_rst.jpg, a 160x120 4:2:0 JPEG with a restart marker after
+// every row of MCUs: it must give exactly the serial decode, and leave
+// JPEGs whose markers are corrupt to the serial decoder.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/image_u8.h"
+#include "common/pjpeg.h"
+#include "common/workerpool.h"
+
+namespace
+{
+
+std::vector<uint8_t> read_file(const char *path)
+{
+  std::vector<uint8_t> buf;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return buf;
+
+  uint8_t tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+    buf.insert(buf.end(), tmp, tmp + n);
+
+  fclose(f);
+  return buf;
+}
+
+// offsets of the RST markers of jpeg.
+std::vector<size_t> find_rst(const std::vector<uint8_t>& jpeg)
+{
+  std::vector<size_t> rst;
+
+  for (size_t i = 0; i + 1 < jpeg.size(); i++) {
+    if (jpeg[i] == 0xff && jpeg[i + 1] >= 0xd0 && jpeg[i + 1] <= 0xd7)
+      rst.push_back(i);
+  }
+
+  return rst;
+}
+
+bool same_planes(const pjpeg_t *a, const pjpeg_t *b)
+{
+  if (a->width != b->width || a->height != b->height || a->ncomponents != b->ncomponents)
+    return false;
+
+  for (int i = 0; i < a->ncomponents; i++) {
+    const pjpeg_component_t *ca = &a->components[i], *cb = &b->components[i];
+    if (ca->width != cb->width || ca->height != cb->height)
+      return false;
+
+    for (uint32_t y = 0; y < ca->height; y++) {
+      if (memcmp(&ca->data[y*ca->stride], &cb->data[y*cb->stride], ca->width))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+class PjpegRestart : public testing::Test
+{
+protected:
+  void SetUp()
+  {
+    jpeg = read_file("data/tags_rst.jpg");
+    ASSERT_FALSE(jpeg.empty());
+
+    rst = find_rst(jpeg);
+    ASSERT_EQ(7u, rst.size());
+
+    wp = workerpool_create(4);
+  }
+
+  void TearDown()
+  {
+    if (wp)
+      workerpool_destroy(wp);
+  }
+
+  // decodes buf serially and in parallel, expecting the same result.
+  void check_same(std::vector<uint8_t> buf, int expected_error)
+  {
+    int serial_error, parallel_error;
+    pjpeg_t *serial = pjpeg_create_from_buffer(buf.data(), buf.size(), 0, &serial_error);
+    pjpeg_t *parallel = pjpeg_create_from_buffer_parallel(buf.data(), buf.size(), 0, wp,
+                                                          &parallel_error);
+
+    EXPECT_EQ(expected_error, serial_error);
+    EXPECT_EQ(serial_error, parallel_error);
+    EXPECT_EQ(serial == NULL, parallel == NULL);
+
+    if (serial && parallel)
+      EXPECT_TRUE(same_planes(serial, parallel));
+
+    if (serial)
+      pjpeg_destroy(serial);
+    if (parallel)
+      pjpeg_destroy(parallel);
+  }
+
+  std::vector<uint8_t> jpeg;
+  std::vector<size_t> rst;
+  workerpool_t *wp = NULL;
+};
+
+} // namespace
+
+TEST_F(PjpegRestart, SameAsSerial)
+{
+  check_same(jpeg, PJPEG_OKAY);
+
+  int error;
+  image_u8_t *serial = pjpeg_create_u8_from_buffer(jpeg.data(), jpeg.size(), 0, &error);
+  ASSERT_TRUE(serial != NULL);
+  image_u8_t *parallel = pjpeg_create_u8_from_buffer_parallel(jpeg.data(), jpeg.size(), 0,
+                                                              wp, &error);
+  ASSERT_TRUE(parallel != NULL);
+
+  ASSERT_EQ(serial->width, parallel->width);
+  ASSERT_EQ(serial->height, parallel->height);
+  for (int y = 0; y < serial->height; y++)
+    EXPECT_EQ(0, memcmp(&serial->buf[y*serial->stride], &parallel->buf[y*parallel->stride],
+                        serial->width)) << "row " << y;
+
+  image_u8_destroy(parallel);
+  image_u8_destroy(serial);
+}
+
+// RST3 where RST2 should be: the markers can't be matched up with the
+// intervals.
+TEST_F(PjpegRestart, MarkerOutOfOrder)
+{
+  std::vector<uint8_t> buf = jpeg;
+  buf[rst[2] + 1] = 0xd3;
+
+  check_same(buf, PJPEG_ERR_RESET);
+}
+
+// RST4 missing: the intervals on either side of it run together.
+TEST_F(PjpegRestart, MissingMarker)
+{
+  std::vector<uint8_t> buf = jpeg;
+  buf.erase(buf.begin() + rst[4], buf.begin() + rst[4] + 2);
+
+  check_same(buf, PJPEG_ERR_RESET);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
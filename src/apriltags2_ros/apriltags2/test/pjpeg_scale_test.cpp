@@ -0,0 +1,89 @@
+// Scaled JPEG decoding (PJPEG_SCALE_8) against a box-filtered full
+// decode, on a q50 JPEG of tags (data/tags_q50.jpg, 4:2:0), as
+// documented in pjpeg.h.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/image_u8.h"
+#include "common/pjpeg.h"
+
+namespace
+{
+
+std::vector<uint8_t> read_file(const char *path)
+{
+  std::vector<uint8_t> buf;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL)
+    return buf;
+
+  uint8_t tmp[4096];
+  size_t n;
+  while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+    buf.insert(buf.end(), tmp, tmp + n);
+
+  fclose(f);
+  return buf;
+}
+
+void check_scale(uint32_t flag, int scale, double max_err, double max_mean_err)
+{
+  std::vector<uint8_t> jpeg = read_file("data/tags_q50.jpg");
+  ASSERT_FALSE(jpeg.empty());
+
+  int error;
+  image_u8_t *full = pjpeg_create_u8_from_buffer(jpeg.data(), jpeg.size(), 0, &error);
+  ASSERT_TRUE(full != NULL);
+  image_u8_t *im = pjpeg_create_u8_from_buffer(jpeg.data(), jpeg.size(), flag, &error);
+  ASSERT_TRUE(im != NULL);
+
+  ASSERT_EQ((full->width + scale - 1) / scale, im->width);
+  ASSERT_EQ((full->height + scale - 1) / scale, im->height);
+
+  double err_sum = 0, err_max = 0;
+  int n = 0;
+
+  // pixels whose box lies entirely inside the image.
+  for (int y = 0; y < full->height / scale; y++) {
+    for (int x = 0; x < full->width / scale; x++) {
+      int acc = 0;
+      for (int j = 0; j < scale; j++)
+        for (int i = 0; i < scale; i++)
+          acc += full->buf[(y*scale + j)*full->stride + x*scale + i];
+
+      double err = std::fabs(im->buf[y*im->stride + x] - (double) acc / (scale * scale));
+      err_sum += err;
+      err_max = std::max(err_max, err);
+      n++;
+    }
+  }
+
+  std::printf("1/%d: mean error %.3f, max %.3f gray levels\n", scale, err_sum / n, err_max);
+
+  EXPECT_LE(err_max, max_err);
+  EXPECT_LE(err_sum / n, max_mean_err);
+
+  image_u8_destroy(im);
+  image_u8_destroy(full);
+}
+
+} // namespace
+
+// the DC term, which the clipping of a full decode may move the box
+// mean away from.
+TEST(PjpegScale, Eighth)
+{
+  check_scale(PJPEG_SCALE_8, 8, 1.0, 0.35);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -50,6 +50,9 @@
 #include <map>
 #include <typeinfo>
 
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include <ros/ros.h>
 #include <ros/console.h>
 #include <XmlRpcException.h>
@@ -65,9 +68,10 @@
 
 #include "apriltags2_ros/AprilTagDetection.h"
 #include "apriltags2_ros/AprilTagDetectionArray.h"
+#include "apriltags2_ros/StageTimings.h"
 #include "apriltag.h"
-
-#include "std_msgs/String.h"
+#include "common/detection_log.h"
+#include "common/latency_hist.h"
 namespace apriltags2_ros
 {
 
@@ -153,6 +157,43 @@ class TagBundleDescription
   std::vector<TagBundleMember > tags_;
 };
 
+// The state of TagDetector::detectTags that belongs to one camera: the
+// detection context (tracking and stage statistics of the detector), the
+// durations of the pose estimation, the name and the tf frame of the
+// camera. One
+// TagDetector (its detector, tag family, decode tables and worker pool) can
+// serve several cameras by giving each its own stream; see
+// TagDetector::createStream
+class DetectionStream : private boost::noncopyable
+{
+ public:
+  DetectionStream(apriltag_detect_ctx_t *ctx, bool own_ctx,
+                  const std::string& name, const std::string& camera_frame,
+                  uint32_t id);
+  ~DetectionStream();
+
+  apriltag_detect_ctx_t *ctx() { return ctx_; }
+  // The name of the camera, empty for the default stream. When set, the
+  // tf frames of the tags it sees are prefixed with <name>/, so that
+  // cameras seeing the same tag do not publish the same frame, and its
+  // detections are given the tf frame of the camera
+  const std::string& name() const { return name_; }
+  // The tf frame of the camera; empty to use the frame_id of the images
+  const std::string& camera_frame() const { return camera_frame_; }
+  // Identifies the stream in the detection log
+  uint32_t id() const { return id_; }
+
+  latency_hist_t pose_hist_;
+  latency_hist_t total_hist_;
+
+ private:
+  apriltag_detect_ctx_t *ctx_;
+  bool own_ctx_;
+  std::string name_;
+  std::string camera_frame_;
+  uint32_t id_;
+};
+
 class TagDetector
 {
  private:
@@ -166,20 +207,32 @@ class TagDetector
   std::string family_;
   int border_;
   int threads_;
+  int pin_threads_;
+  std::vector<int> cpu_exclude_;
   double decimate_;
   double blur_;
   int refine_edges_;
   int refine_decode_;
   int refine_pose_;
   int debug_;
+  int track_roi_;
+  int track_full_scan_interval_;
+  double track_roi_padding_;
+  int coarse_to_fine_;
+  int fine_min_contrast_;
+  double fine_max_fraction_;
 public:
-  std_msgs::String timings_;
+  // Stage timings of the last call to detectTags
+  StageTimings timings_;
 private:
   // AprilTags 2 objects
   apriltag_family_t *tf_;
   apriltag_detector_t *td_;
   zarray_t *detections_;
 
+  // Gray version of the last color image
+  cv::Mat gray_image_;
+
   // Other members
   std::map<int, StandaloneTagDescription> standalone_tag_descriptions_;
   std::vector<TagBundleDescription > tag_bundle_descriptions_;
@@ -188,6 +241,20 @@ private:
   tf::TransformBroadcaster tf_pub_;
   std::string camera_tf_frame_;
 
+  // The stream of the camera_frame camera, on the detector's own context,
+  // and the number of streams created so far
+  boost::shared_ptr<DetectionStream> default_stream_;
+  uint32_t nstreams_;
+
+  // If the detection_log parameter names a file, every detection and
+  // the stage timings of every image are logged to it
+  detection_log_t *detection_log_;
+
+  // Set timings_ from the stream's stage statistics and the duration of
+  // the pose estimation that followed the detection
+  void fillTimings(const std_msgs::Header& header, int64_t pose_ns,
+                   DetectionStream& stream);
+
  public:
 
   TagDetector(ros::NodeHandle pnh);
@@ -213,10 +280,24 @@ private:
       const Eigen::Quaternion<double> rot_quaternion,
       const std_msgs::Header& header);
 
-  // Detect tags in an image
+  // Detect tags in an image. Mono8 images are used as they are, without
+  // a copy; color images are converted to gray
   AprilTagDetectionArray detectTags(
-      const cv_bridge::CvImagePtr& image,
+      const cv_bridge::CvImageConstPtr& image,
       const sensor_msgs::CameraInfoConstPtr& camera_info);
+  // The same, for a camera of its own: the image is the next of the stream
+  AprilTagDetectionArray detectTags(
+      const cv_bridge::CvImageConstPtr& image,
+      const sensor_msgs::CameraInfoConstPtr& camera_info,
+      DetectionStream& stream);
+
+  // A stream for camera name, with tf frame camera_frame (empty: that of
+  // its images). It runs on the same worker pool as the default stream,
+  // so detections of different streams must not run at the same time
+  boost::shared_ptr<DetectionStream> createStream(
+      const std::string& name, const std::string& camera_frame);
+  // The stream of detectTags without one (camera camera_frame)
+  boost::shared_ptr<DetectionStream> defaultStream() { return default_stream_; }
 
   // Get the pose of the tag in the camera frame
   // Returns homogeneous transformation matrix [R,t;[0 0 0 1]] which
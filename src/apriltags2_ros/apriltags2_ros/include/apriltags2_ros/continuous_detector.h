@@ -31,7 +31,8 @@
  ** continuous_detector.h ******************************************************
  *
  * Wrapper class of TagDetector class which calls TagDetector::detectTags on
- * each newly arrived image published by a camera.
+ * each newly arrived image published by a camera (or by each of several
+ * cameras).
  *
  * $Revision: 1.0 $
  * $Date: 2017/12/17 13:25:52 $
@@ -45,8 +46,9 @@
 
 
 #include "apriltags2_ros/common_functions.h"
+#include "apriltags2_ros/FrameLatency.h"
+#include <boost/thread.hpp>
 #include <duckietown_msgs/BoolStamped.h>
-#include <std_msgs/String.h>
 
 namespace apriltags2_ros
 {
@@ -55,24 +57,76 @@ class ContinuousDetector
 {
  public:
   ContinuousDetector(ros::NodeHandle& nh, ros::NodeHandle& pnh);
+  ~ContinuousDetector();
+
+ private:
+  // A camera: its topics, its detection stream and its mailbox. With the
+  // cameras parameter, one detector serves several cameras: they share its
+  // tag family, decode tables and worker pool, and their images are
+  // processed one at a time, taking the cameras in turn
+  struct Camera
+  {
+    // Namespace of the camera's topics (empty for the single camera)
+    std::string name;
+    boost::shared_ptr<DetectionStream> stream;
+
+    image_transport::CameraSubscriber camera_image_subscriber;
+    image_transport::Publisher tag_detections_image_publisher;
+    ros::Publisher tag_detections_publisher;
+    ros::Publisher subprocess_timings_publisher;
+    ros::Publisher frame_latency_publisher;
+
+    // The latest image not processed yet (under mailbox_mutex_)
+    sensor_msgs::ImageConstPtr pending_image;
+    sensor_msgs::CameraInfoConstPtr pending_camera_info;
+    ros::WallTime pending_received;
+
+    // Image counts (under mailbox_mutex_) and latencies, for FrameLatency
+    uint64_t received;
+    uint64_t processed;
+    uint64_t dropped;
+    latency_hist_t latency_hist;
+  };
 
   void imageCallback(const sensor_msgs::ImageConstPtr& image_rect,
-                     const sensor_msgs::CameraInfoConstPtr& camera_info);
+                     const sensor_msgs::CameraInfoConstPtr& camera_info,
+                     Camera* camera);
 
- private:
   void switchCB(const duckietown_msgs::BoolStamped::ConstPtr& switch_msg);
   ros::Subscriber switch_sub_;
 
+  // Detect tags in an image of camera that arrived at time received, and
+  // publish the detections, timings, latency and detections image
+  void processImage(Camera& camera,
+                    const sensor_msgs::ImageConstPtr& image_rect,
+                    const sensor_msgs::CameraInfoConstPtr& camera_info,
+                    const ros::WallTime& received);
+
+  // Runs processImage on the images imageCallback leaves in the mailboxes
+  void processingThread();
+
+  // The next camera, in turn after the last one served, with an image in
+  // its mailbox, or NULL if none has one. Called under mailbox_mutex_
+  Camera* nextPendingCamera();
+
+  // With async_processing (the default), imageCallback only puts the image
+  // in its camera's mailbox of one slot, and a thread of its own processes
+  // it, so that a slow image neither holds up the ROS callbacks nor makes
+  // the next image processed a stale one: an image that arrives while the
+  // slot is full replaces the one in it, which is dropped
+  bool async_processing_;
+  boost::mutex mailbox_mutex_;
+  boost::condition_variable mailbox_cond_;
+  bool stop_;
+  boost::thread processing_thread_;
+
   TagDetector tag_detector_;
   bool draw_tag_detections_image_;
   cv_bridge::CvImagePtr cv_image_;
 
   image_transport::ImageTransport it_;
-  image_transport::CameraSubscriber camera_image_subscriber_;
-  image_transport::Publisher tag_detections_image_publisher_;
-  ros::Publisher tag_detections_publisher_;
-  ros::Publisher subprocess_timings_publisher_;
-
+  std::vector<boost::shared_ptr<Camera> > cameras_;
+  size_t next_camera_;
 
   bool on_switch;
 };
@@ -0,0 +1,96 @@
+"""Reader of the detection logs written by the detector (see
+apriltags2/include/common/detection_log.h): maps the record and index
+files into memory as numpy record arrays, so that long runs can be
+scanned without loading them.
+
+    log = DetectionLog('run.log')
+    total = log.stage_ms('total')               # per frame
+    dets = log.frame_detections(100)            # records of frame 100
+    tag3 = log.detections[log.detections['id'] == 3]
+    cam1 = log.frames[log.frames['stream'] == 1]  # frames of one camera
+"""
+
+import struct
+
+import numpy as np
+
+VERSION = 1
+HEADER_SIZE = 1024
+MAX_STAGES = 24
+STAGE_NAME_LEN = 32
+
+MAGIC = b'ATDETLOG'
+INDEX_MAGIC = b'ATDETIDX'
+
+POSE_VALID = 1
+
+# struct detection_log_record
+RECORD_DTYPE = np.dtype([
+    ('frame', 'u8'),
+    ('id', 'i4'),
+    ('hamming', 'i4'),
+    ('family', 'S16'),
+    ('decision_margin', 'f4'),
+    ('flags', 'u4'),
+    ('c', 'f8', (2,)),
+    ('p', 'f8', (4, 2)),
+    ('H', 'f8', (3, 3)),
+    ('pose_t', 'f8', (3,)),
+    ('pose_q', 'f8', (4,)),
+])
+
+# struct detection_log_frame
+FRAME_DTYPE = np.dtype([
+    ('timestamp_ns', 'i8'),
+    ('first', 'u8'),
+    ('ndetections', 'u4'),
+    ('stream', 'u4'),
+    ('stage_ns', 'i8', (MAX_STAGES,)),
+])
+
+_HEADER = struct.Struct('=8sIIII' + '%ds' % STAGE_NAME_LEN * MAX_STAGES)
+
+
+def _read_header(path, magic, dtype):
+    with open(path, 'rb') as f:
+        data = f.read(_HEADER.size)
+    if len(data) < _HEADER.size:
+        raise ValueError('%s: not a detection log' % path)
+
+    fields = _HEADER.unpack(data)
+    if fields[0] != magic or fields[1] != VERSION or fields[2] != dtype.itemsize:
+        raise ValueError('%s: not a detection log of version %d' % (path, VERSION))
+
+    nstages = fields[3]
+    return [s.split(b'\0', 1)[0].decode() for s in fields[5:5 + nstages]]
+
+
+def _map(path, dtype):
+    """The complete records of a file; a partial one at the end is
+    ignored."""
+    size = np.memmap(path, dtype='u1', mode='r').size
+    n = (size - HEADER_SIZE) // dtype.itemsize
+    if n == 0:
+        return np.zeros(0, dtype=dtype)
+    return np.memmap(path, dtype=dtype, mode='r', offset=HEADER_SIZE, shape=(n,))
+
+
+class DetectionLog(object):
+    def __init__(self, path):
+        self.stages = _read_header(path + '.idx', INDEX_MAGIC, FRAME_DTYPE)
+        if _read_header(path, MAGIC, RECORD_DTYPE) != self.stages:
+            raise ValueError('%s: record and index files do not match' % path)
+
+        self.frames = _map(path + '.idx', FRAME_DTYPE)
+        self.detections = _map(path, RECORD_DTYPE)
+
+    def __len__(self):
+        return len(self.frames)
+
+    def stage_ms(self, name):
+        """The duration of a stage in each frame, in milliseconds."""
+        return self.frames['stage_ns'][:, self.stages.index(name)] / 1e6
+
+    def frame_detections(self, i):
+        first = int(self.frames['first'][i])
+        return self.detections[first:first + int(self.frames['ndetections'][i])]
@@ -32,6 +32,7 @@
 #include "apriltags2_ros/common_functions.h"
 
 #include "common/homography.h"
+#include "common/time_util.h"
 #include "tag36h11.h"
 #include "tag36h10.h"
 #include "tag25h9.h"
@@ -41,16 +42,47 @@
 namespace apriltags2_ros
 {
 
+DetectionStream::DetectionStream(apriltag_detect_ctx_t *ctx, bool own_ctx,
+                                 const std::string& name,
+                                 const std::string& camera_frame,
+                                 uint32_t id) :
+    ctx_(ctx),
+    own_ctx_(own_ctx),
+    name_(name),
+    camera_frame_(camera_frame),
+    id_(id)
+{
+  latency_hist_clear(&pose_hist_);
+  latency_hist_clear(&total_hist_);
+}
+
+DetectionStream::~DetectionStream()
+{
+  if (own_ctx_)
+  {
+    apriltag_detect_ctx_destroy(ctx_);
+  }
+}
+
 TagDetector::TagDetector(ros::NodeHandle pnh) :
     family_(getAprilTagOption<std::string>(pnh, "tag_family", "tag36h11")),
     border_(getAprilTagOption<int>(pnh, "tag_border", 1)),
     threads_(getAprilTagOption<int>(pnh, "tag_threads", 4)),
+    pin_threads_(getAprilTagOption<int>(pnh, "tag_pin_threads", 0)),
+    cpu_exclude_(getAprilTagOption<std::vector<int> >(pnh, "tag_cpu_exclude",
+                                                       std::vector<int>())),
     decimate_(getAprilTagOption<double>(pnh, "tag_decimate", 1.0)),
     blur_(getAprilTagOption<double>(pnh, "tag_blur", 0.0)),
     refine_edges_(getAprilTagOption<int>(pnh, "tag_refine_edges", 1)),
     refine_decode_(getAprilTagOption<int>(pnh, "tag_refine_decode", 0)),
     refine_pose_(getAprilTagOption<int>(pnh, "tag_refine_pose", 0)),
     debug_(getAprilTagOption<int>(pnh, "tag_debug", 0)),
+    track_roi_(getAprilTagOption<int>(pnh, "tag_track_roi", 0)),
+    track_full_scan_interval_(getAprilTagOption<int>(pnh, "tag_track_full_scan_interval", 10)),
+    track_roi_padding_(getAprilTagOption<double>(pnh, "tag_track_roi_padding", 0.25)),
+    coarse_to_fine_(getAprilTagOption<int>(pnh, "tag_coarse_to_fine", 0)),
+    fine_min_contrast_(getAprilTagOption<int>(pnh, "tag_fine_min_contrast", 60)),
+    fine_max_fraction_(getAprilTagOption<double>(pnh, "tag_fine_max_fraction", 0.25)),
     publish_tf_(getAprilTagOption<bool>(pnh, "publish_tf", false))
 {
   // Parse standalone tag descriptions specified by user (stored on ROS
@@ -139,10 +171,28 @@ TagDetector::TagDetector(ros::NodeHandle pnh) :
       printf("decimate using %f",td_->quad_decimate);
   td_->quad_sigma = (float)blur_;
   td_->nthreads = threads_;
+  td_->pin_threads = pin_threads_;
+  td_->cpu_exclude = 0;
+  for (unsigned int i=0; i<cpu_exclude_.size(); i++)
+  {
+    if (cpu_exclude_[i] < 0 || cpu_exclude_[i] >= 64)
+    {
+      ROS_WARN_STREAM("Ignoring tag_cpu_exclude entry " << cpu_exclude_[i]
+                      << ": only CPUs 0-63 can be excluded");
+      continue;
+    }
+    td_->cpu_exclude |= (uint64_t)1 << cpu_exclude_[i];
+  }
   td_->debug = debug_;
   td_->refine_edges = refine_edges_;
   td_->refine_decode = refine_decode_;
   td_->refine_pose = refine_pose_;
+  td_->track_roi = track_roi_;
+  td_->track_full_scan_interval = track_full_scan_interval_;
+  td_->track_roi_padding = (float)track_roi_padding_;
+  td_->coarse_to_fine = coarse_to_fine_;
+  td_->fine_min_contrast = fine_min_contrast_;
+  td_->fine_max_fraction = (float)fine_max_fraction_;
 
   // Get tf frame name to use for the camera
   if (!pnh.getParam("camera_frame", camera_tf_frame_))
@@ -150,13 +200,46 @@ TagDetector::TagDetector(ros::NodeHandle pnh) :
     ROS_WARN_STREAM("Camera frame not specified, using 'camera'");
     camera_tf_frame_ = "camera";
   }
+
+  default_stream_.reset(
+      new DetectionStream(td_->ctx, false, "", camera_tf_frame_, 0));
+  nstreams_ = 1;
+
+  detection_log_ = NULL;
+  std::string detection_log_path;
+  if (pnh.getParam("detection_log", detection_log_path) &&
+      !detection_log_path.empty())
+  {
+    // The stages of StageTimings: the detector's, the pose estimation and
+    // the total of both
+    const char* stages[APRILTAG_STAGE_TOTAL + 2];
+    for (int i = 0; i < APRILTAG_STAGE_TOTAL; i++)
+    {
+      stages[i] = apriltag_stage_name((enum apriltag_stage)i);
+    }
+    stages[APRILTAG_STAGE_TOTAL] = "relative pose estimation";
+    stages[APRILTAG_STAGE_TOTAL + 1] = "total";
+    detection_log_ = detection_log_create(detection_log_path.c_str(),
+                                          APRILTAG_STAGE_TOTAL + 2, stages);
+    if (detection_log_ == NULL)
+    {
+      ROS_WARN_STREAM("Can't create detection log " << detection_log_path);
+    }
+  }
 }
 
 // destructor
 TagDetector::~TagDetector() {
-  // free memory associated with tag detector
+  // free memory associated with tag detector (after the default stream,
+  // which uses its context)
+  default_stream_.reset();
   apriltag_detector_destroy(td_);
 
+  if (detection_log_destroy(detection_log_))
+  {
+    ROS_WARN("Error writing the detection log");
+  }
+
   // Free memory associated with the array of tag detections
   zarray_destroy(detections_);
 
@@ -183,15 +266,65 @@ TagDetector::~TagDetector() {
   }
 }
 
+boost::shared_ptr<DetectionStream> TagDetector::createStream (
+    const std::string& name, const std::string& camera_frame) {
+  // Share the pool of the detector's own context (created now if need be)
+  apriltag_detect_ctx_t *ctx = apriltag_detect_ctx_create();
+  apriltag_detect_ctx_set_workerpool(
+      ctx, apriltag_detect_ctx_get_workerpool(td_, td_->ctx));
+  return boost::shared_ptr<DetectionStream>(
+      new DetectionStream(ctx, true, name, camera_frame, nstreams_++));
+}
+
 AprilTagDetectionArray TagDetector::detectTags (
-    const cv_bridge::CvImagePtr& image,
+    const cv_bridge::CvImageConstPtr& image,
     const sensor_msgs::CameraInfoConstPtr& camera_info) {
-  // Convert image to AprilTag code's format
+  return detectTags(image, camera_info, *default_stream_);
+}
+
+AprilTagDetectionArray TagDetector::detectTags (
+    const cv_bridge::CvImageConstPtr& image,
+    const sensor_msgs::CameraInfoConstPtr& camera_info,
+    DetectionStream& stream) {
+  // Convert image to AprilTag code's format. Mono images are used in
+  // place (rows may be padded, hence the stride): they belong to the
+  // message, which other subscribers share, but the detector only reads
+  // them. Others are converted into gray_image_, which keeps its buffer
+  // from one image to the next
+  namespace enc = sensor_msgs::image_encodings;
   cv::Mat gray_image;
-  cv::cvtColor(image->image, gray_image, CV_BGR2GRAY);
+  if (image->encoding == enc::MONO8 || image->encoding == enc::TYPE_8UC1)
+  {
+    gray_image = image->image;
+  }
+  else if (image->encoding == enc::BGR8)
+  {
+    cv::cvtColor(image->image, gray_image_, CV_BGR2GRAY);
+    gray_image = gray_image_;
+  }
+  else if (image->encoding == enc::RGB8)
+  {
+    cv::cvtColor(image->image, gray_image_, CV_RGB2GRAY);
+    gray_image = gray_image_;
+  }
+  else if (image->encoding == enc::BGRA8)
+  {
+    cv::cvtColor(image->image, gray_image_, CV_BGRA2GRAY);
+    gray_image = gray_image_;
+  }
+  else if (image->encoding == enc::RGBA8)
+  {
+    cv::cvtColor(image->image, gray_image_, CV_RGBA2GRAY);
+    gray_image = gray_image_;
+  }
+  else
+  {
+    // Anything else cv_bridge can convert (16-bit, Bayer, ...)
+    gray_image = cv_bridge::cvtColor(image, enc::MONO8)->image;
+  }
   image_u8_t apriltags2_image = { .width = gray_image.cols,
                                   .height = gray_image.rows,
-                                  .stride = gray_image.cols,
+                                  .stride = (int32_t)gray_image.step,
                                   .buf = gray_image.data
   };
 
@@ -202,7 +335,8 @@ AprilTagDetectionArray TagDetector::detectTags (
   double cy = camera_info->K[5]; // optical center y-coordinate [px]
 
   // Run AprilTags 2 algorithm on the image
-  detections_ = apriltag_detector_detect(td_, &apriltags2_image);
+  detections_ = apriltag_detector_detect_ctx(td_, stream.ctx(),
+                                             &apriltags2_image);
 
 
   // Restriction: any tag ID can appear at most once in the scene. Thus, get all
@@ -212,15 +346,20 @@ AprilTagDetectionArray TagDetector::detectTags (
 
   // Compute the estimated translation and rotation individually for each
   // detected tag
+  const std::string& camera_frame = stream.camera_frame().empty() ?
+      image->header.frame_id : stream.camera_frame();
+  std_msgs::Header pose_header = image->header;
+  if (!stream.name().empty())
+  {
+    pose_header.frame_id = camera_frame;
+  }
+
   AprilTagDetectionArray tag_detection_array;
   std::vector<std::string > detection_names;
-  tag_detection_array.header = image->header;
+  tag_detection_array.header = pose_header;
   std::map<std::string, std::vector<cv::Point3d > > bundleObjectPoints;
   std::map<std::string, std::vector<cv::Point2d > > bundleImagePoints;
-  clock_t begin, end;
-  double cost;
-  //start recording
-  begin = clock();
+  int64_t pose_begin = ntime_now();
   for (int i=0; i < zarray_size(detections_); i++)
   {
     // Get the i-th detected tag
@@ -265,6 +404,10 @@ AprilTagDetectionArray TagDetector::detectTags (
     if (!findStandaloneTagDescription(tagID, standaloneDescription,
                                       !is_part_of_bundle))
     {
+      if (detection_log_)
+      {
+        detection_log_add_detection(detection_log_, detection, NULL, NULL);
+      }
       continue;
     }
 
@@ -302,7 +445,16 @@ AprilTagDetectionArray TagDetector::detectTags (
     Eigen::Quaternion<double> rot_quaternion(rot);
 
     geometry_msgs::PoseWithCovarianceStamped tag_pose =
-        makeTagPose(transform, rot_quaternion, image->header);
+        makeTagPose(transform, rot_quaternion, pose_header);
+
+    if (detection_log_)
+    {
+      const double pose_t[3] = { transform(0, 3), transform(1, 3),
+                                 transform(2, 3) };
+      const double pose_q[4] = { rot_quaternion.x(), rot_quaternion.y(),
+                                 rot_quaternion.z(), rot_quaternion.w() };
+      detection_log_add_detection(detection_log_, detection, pose_t, pose_q);
+    }
 
     // Add the detection to the back of the tag detection array
     AprilTagDetection tag_detection;
@@ -338,7 +490,7 @@ AprilTagDetectionArray TagDetector::detectTags (
       Eigen::Quaternion<double> rot_quaternion(rot);
 
       geometry_msgs::PoseWithCovarianceStamped bundle_pose =
-          makeTagPose(transform, rot_quaternion, image->header);
+          makeTagPose(transform, rot_quaternion, pose_header);
 
       // Add the detection to the back of the tag detection array
       AprilTagDetection tag_detection;
@@ -350,45 +502,12 @@ AprilTagDetectionArray TagDetector::detectTags (
     }
   }
 
-  end = clock();
-  cost = (double)(end - begin)/CLOCKS_PER_SEC; // seconds
-  timeprofile_stamp(td_->tp, "relative pose estimation");
-
-  //output the time cost of each step
-  // timeprofile_display(td_->tp);
-  char processes_output[1500];
-  char *pt_processes_output = processes_output;
-  std::string process_output_string(processes_output);
-
-  timeprofile_get_val(td_->tp, pt_processes_output);
-
-  // Change type of processes_output char -> string
-  std::string str_processes_output;
-  std::stringstream ss;
-  std::string s;
-
-  for (int i = 0; i<8 ; i++)
-  {
-    processes_output[i] = '0';
-  }
-
-  ss << processes_output;
-  str_processes_output = ss.str();
-  //ss >> s;
-
-  //std::string str_processes_output(1, processes_output);
-
-//  std::cout<<"******"<<std::endl<<std::string(processes_output)<<std::endl<<std::endl<<"*****"<<std::endl;
-
-   timings_.data = str_processes_output;
-  //std::cout << "***** [" << str_processes_output << "] *****" << std::endl;
-  //std::cout << "***** [" << typeid(str_processes_output).name()<< "] *****" << std::endl;
-
-  // processes_output needs to be set back to 0, otherwise memory issues.
-  memset(processes_output, 0, sizeof processes_output);
+  fillTimings(image->header, ntime_now() - pose_begin, stream);
 
   // If set, publish the transform /tf topic
   if (publish_tf_) {
+    const std::string tag_frame_prefix =
+        stream.name().empty() ? "" : stream.name() + "/";
     for (unsigned int i=0; i<tag_detection_array.detections.size(); i++) {
       geometry_msgs::PoseStamped pose;
       pose.pose = tag_detection_array.detections[i].pose.pose.pose;
@@ -397,7 +516,8 @@ AprilTagDetectionArray TagDetector::detectTags (
       tf::poseStampedMsgToTF(pose, tag_transform);
       tf_pub_.sendTransform(tf::StampedTransform(tag_transform,
                                                  tag_transform.stamp_,
-                                                 camera_tf_frame_,
+                                                 camera_frame,
+                                                 tag_frame_prefix +
                                                  detection_names[i]));
     }
   }
@@ -487,6 +607,70 @@ void TagDetector::addImagePoints (
   }
 }
 
+void TagDetector::fillTimings(const std_msgs::Header& header, int64_t pose_ns,
+                              DetectionStream& stream)
+{
+  latency_hist_add(&stream.pose_hist_, pose_ns);
+
+  apriltag_stage_stats_t stats[APRILTAG_STAGE_COUNT];
+  apriltag_detect_ctx_stage_stats_all(stream.ctx(), stats);
+  latency_hist_add(&stream.total_hist_,
+                   stats[APRILTAG_STAGE_TOTAL].last_ns + pose_ns);
+
+  // The detector's stages, then the pose estimation, then the total of
+  // both (in place of the detector's total)
+  apriltag_stage_stats_t extra[2];
+  extra[0].name = "relative pose estimation";
+  extra[0].last_ns = pose_ns;
+  extra[1].name = "total";
+  extra[1].last_ns = stats[APRILTAG_STAGE_TOTAL].last_ns + pose_ns;
+  const latency_hist_t* extra_hist[2] = { &stream.pose_hist_,
+                                          &stream.total_hist_ };
+  for (int i = 0; i < 2; i++)
+  {
+    extra[i].nframes = latency_hist_count(extra_hist[i]);
+    extra[i].p50_ns = latency_hist_percentile(extra_hist[i], 0.50);
+    extra[i].p90_ns = latency_hist_percentile(extra_hist[i], 0.90);
+    extra[i].p99_ns = latency_hist_percentile(extra_hist[i], 0.99);
+    extra[i].max_ns = latency_hist_max(extra_hist[i]);
+  }
+
+  const int n = APRILTAG_STAGE_TOTAL + 2;
+  timings_.header = header;
+  timings_.stage.resize(n);
+  timings_.last.resize(n);
+  timings_.p50.resize(n);
+  timings_.p90.resize(n);
+  timings_.p99.resize(n);
+  timings_.max.resize(n);
+  timings_.frames.resize(n);
+  for (int i = 0; i < n; i++)
+  {
+    const apriltag_stage_stats_t& st =
+        i < APRILTAG_STAGE_TOTAL ? stats[i] : extra[i - APRILTAG_STAGE_TOTAL];
+    timings_.stage[i] = st.name;
+    timings_.last[i] = st.last_ns / 1e6;
+    timings_.p50[i] = st.p50_ns / 1e6;
+    timings_.p90[i] = st.p90_ns / 1e6;
+    timings_.p99[i] = st.p99_ns / 1e6;
+    timings_.max[i] = st.max_ns / 1e6;
+    timings_.frames[i] = st.nframes;
+  }
+  timings_.fine_fraction = stream.ctx()->fine_fraction;
+
+  if (detection_log_)
+  {
+    int64_t stage_ns[APRILTAG_STAGE_TOTAL + 2];
+    for (int i = 0; i < n; i++)
+    {
+      stage_ns[i] = i < APRILTAG_STAGE_TOTAL ?
+          stats[i].last_ns : extra[i - APRILTAG_STAGE_TOTAL].last_ns;
+    }
+    detection_log_add_frame(detection_log_, stream.id(), header.stamp.toNSec(),
+                            stage_ns);
+  }
+}
+
 Eigen::Matrix4d TagDetector::getRelativeTransform(
     std::vector<cv::Point3d > objectPoints,
     std::vector<cv::Point2d > imagePoints,
@@ -30,51 +30,208 @@
  */
 
 #include "apriltags2_ros/continuous_detector.h"
-#include <std_msgs/String.h>
+
+#include <algorithm>
 
 namespace apriltags2_ros
 {
 
+// Topic base of camera name (base itself for the single camera)
+static std::string cameraTopic(const std::string& name, const char* base)
+{
+  return name.empty() ? std::string(base) : name + "/" + base;
+}
+
 ContinuousDetector::ContinuousDetector (ros::NodeHandle& nh,
                                         ros::NodeHandle& pnh) :
+    async_processing_(getAprilTagOption<bool>(pnh, "async_processing", true)),
+    stop_(false),
     tag_detector_(pnh),
     draw_tag_detections_image_(
         getAprilTagOption<bool>(pnh, "publish_tag_detections_image", false)),
-    it_(nh)
+    it_(nh),
+    next_camera_(0)
 {
   switch_sub_ = nh.subscribe("apriltag_detector_node/switch",1,&ContinuousDetector::switchCB, this);
-  camera_image_subscriber_ =
-      it_.subscribeCamera("image_rect", 1,
-                          &ContinuousDetector::imageCallback, this);
-  tag_detections_publisher_ =
-      nh.advertise<AprilTagDetectionArray>("tag_detections", 1);
-
-  subprocess_timings_publisher_ =
-      nh.advertise<std_msgs::String>("subprocess_timings", 1);
 
   //on_switch = false;
   on_switch = true;
 
-  if (draw_tag_detections_image_)
+  // The cameras: those named by the cameras parameter (namespaces of their
+  // topics and prefixes of the tf frames of the tags they see, e.g. [cam0,
+  // cam1]), with their tf frames in camera_frames (by default those of
+  // their images), or else the single camera of camera_frame, whose topics
+  // are in the node's namespace
+  std::vector<std::string> names =
+      getAprilTagOption<std::vector<std::string> >(
+          pnh, "cameras", std::vector<std::string>());
+  std::vector<std::string> frames =
+      getAprilTagOption<std::vector<std::string> >(
+          pnh, "camera_frames", std::vector<std::string>());
+  if (!frames.empty() && frames.size() != names.size())
+  {
+    ROS_WARN("camera_frames does not match cameras, using the frames of "
+             "the images");
+    frames.clear();
+  }
+
+  for (unsigned int i = 0; i < std::max<size_t>(names.size(), 1); i++)
+  {
+    boost::shared_ptr<Camera> camera(new Camera());
+    if (names.empty())
+    {
+      camera->stream = tag_detector_.defaultStream();
+    }
+    else
+    {
+      camera->name = names[i];
+      camera->stream =
+          tag_detector_.createStream(names[i],
+                                     frames.empty() ? "" : frames[i]);
+    }
+    camera->received = camera->processed = camera->dropped = 0;
+    latency_hist_clear(&camera->latency_hist);
+
+    camera->tag_detections_publisher = nh.advertise<AprilTagDetectionArray>(
+        cameraTopic(camera->name, "tag_detections"), 1);
+    camera->subprocess_timings_publisher = nh.advertise<StageTimings>(
+        cameraTopic(camera->name, "subprocess_timings"), 1);
+    camera->frame_latency_publisher = nh.advertise<FrameLatency>(
+        cameraTopic(camera->name, "frame_latency"), 1);
+    if (draw_tag_detections_image_)
+    {
+      camera->tag_detections_image_publisher = it_.advertise(
+          cameraTopic(camera->name, "tag_detections_image"), 1);
+    }
+    cameras_.push_back(camera);
+  }
+
+  if (async_processing_)
   {
-    tag_detections_image_publisher_ = it_.advertise("tag_detections_image", 1);
+    processing_thread_ =
+        boost::thread(&ContinuousDetector::processingThread, this);
+  }
+
+  // Subscribe last, when everything the callback uses is ready
+  for (unsigned int i = 0; i < cameras_.size(); i++)
+  {
+    Camera* camera = cameras_[i].get();
+    camera->camera_image_subscriber = it_.subscribeCamera(
+        cameraTopic(camera->name, "image_rect"), 1,
+        boost::bind(&ContinuousDetector::imageCallback, this, _1, _2, camera));
   }
 }
+
+ContinuousDetector::~ContinuousDetector ()
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mailbox_mutex_);
+    stop_ = true;
+  }
+  mailbox_cond_.notify_all();
+  if (processing_thread_.joinable())
+  {
+    processing_thread_.join();
+  }
+}
+
 void ContinuousDetector::switchCB(const duckietown_msgs::BoolStamped::ConstPtr& switch_msg){
      on_switch=switch_msg->data;
    }
 
 void ContinuousDetector::imageCallback (
     const sensor_msgs::ImageConstPtr& image_rect,
-    const sensor_msgs::CameraInfoConstPtr& camera_info)
+    const sensor_msgs::CameraInfoConstPtr& camera_info,
+    Camera* camera)
 {
   if (!on_switch) return;
-  // Convert ROS's sensor_msgs::Image to cv_bridge::CvImagePtr in order to run
-  // AprilTags 2 on the iamge
+
+  ros::WallTime received = ros::WallTime::now();
+  if (!async_processing_)
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(mailbox_mutex_);
+      camera->received++;
+    }
+    processImage(*camera, image_rect, camera_info, received);
+    return;
+  }
+
+  // Leave the image for the processing thread, in place of any image of
+  // this camera it has not got to yet
+  {
+    boost::lock_guard<boost::mutex> lock(mailbox_mutex_);
+    camera->received++;
+    if (camera->pending_image)
+    {
+      camera->dropped++;
+    }
+    camera->pending_image = image_rect;
+    camera->pending_camera_info = camera_info;
+    camera->pending_received = received;
+  }
+  mailbox_cond_.notify_one();
+}
+
+ContinuousDetector::Camera* ContinuousDetector::nextPendingCamera ()
+{
+  // Round robin, so that a camera with a high frame rate can't starve the
+  // others: each gets at most one image processed per turn
+  for (size_t k = 0; k < cameras_.size(); k++)
+  {
+    size_t i = (next_camera_ + k) % cameras_.size();
+    if (cameras_[i]->pending_image)
+    {
+      next_camera_ = i + 1;
+      return cameras_[i].get();
+    }
+  }
+  return NULL;
+}
+
+void ContinuousDetector::processingThread ()
+{
+  while (true)
+  {
+    Camera* camera;
+    sensor_msgs::ImageConstPtr image_rect;
+    sensor_msgs::CameraInfoConstPtr camera_info;
+    ros::WallTime received;
+    {
+      boost::unique_lock<boost::mutex> lock(mailbox_mutex_);
+      while (!stop_ && (camera = nextPendingCamera()) == NULL)
+      {
+        mailbox_cond_.wait(lock);
+      }
+      if (stop_)
+      {
+        return;
+      }
+      image_rect.swap(camera->pending_image);
+      camera_info.swap(camera->pending_camera_info);
+      received = camera->pending_received;
+    }
+
+    processImage(*camera, image_rect, camera_info, received);
+  }
+}
+
+void ContinuousDetector::processImage (
+    Camera& camera,
+    const sensor_msgs::ImageConstPtr& image_rect,
+    const sensor_msgs::CameraInfoConstPtr& camera_info,
+    const ros::WallTime& received)
+{
+  ros::WallTime begin = ros::WallTime::now();
+
+  // Convert ROS's sensor_msgs::Image to cv_bridge::CvImageConstPtr in order
+  // to run AprilTags 2 on the image. The image keeps its encoding and
+  // shares the message's data: detectTags converts it to gray only if it
+  // is not mono already
+  cv_bridge::CvImageConstPtr image;
   try
   {
-    cv_image_ = cv_bridge::toCvCopy(image_rect,
-                                    sensor_msgs::image_encodings::BGR8);
+    image = cv_bridge::toCvShare(image_rect);
   }
   catch (cv_bridge::Exception& e)
   {
@@ -82,18 +239,59 @@ void ContinuousDetector::imageCallback (
     return;
   }
 
-  // Publish detected tags in the image by AprilTags 2
-  tag_detections_publisher_.publish(
-      tag_detector_.detectTags(cv_image_,camera_info));
+  // Publish detected tags in the image by AprilTags 2. Messages are
+  // published as shared pointers, so that subscribers in the same process
+  // (e.g. nodelets) get them without a copy
+  AprilTagDetectionArrayPtr tag_detections(new AprilTagDetectionArray(
+      tag_detector_.detectTags(image, camera_info, *camera.stream)));
+  camera.tag_detections_publisher.publish(tag_detections);
+
+  // Input-to-output latency: from the image's stamp, or from its arrival
+  // if it has no stamp
+  double latency_ms = image_rect->header.stamp.isZero() ?
+      (ros::WallTime::now() - received).toSec() * 1e3 :
+      (ros::Time::now() - image_rect->header.stamp).toSec() * 1e3;
 
-  subprocess_timings_publisher_.publish(tag_detector_.timings_);
+  camera.subprocess_timings_publisher.publish(
+      StageTimingsPtr(new StageTimings(tag_detector_.timings_)));
   // Publish the camera image overlaid by outlines of the detected tags and
-  // their payload values
+  // their payload values. Only this needs a (color) copy of the image
   if (draw_tag_detections_image_)
   {
-    tag_detector_.drawDetections(cv_image_);
-    tag_detections_image_publisher_.publish(cv_image_->toImageMsg());
+    try
+    {
+      cv_image_ = cv_bridge::toCvCopy(image_rect,
+                                      sensor_msgs::image_encodings::BGR8);
+      tag_detector_.drawDetections(cv_image_);
+      camera.tag_detections_image_publisher.publish(cv_image_->toImageMsg());
+    }
+    catch (cv_bridge::Exception& e)
+    {
+      ROS_ERROR("cv_bridge exception: %s", e.what());
+    }
+  }
+
+  // (The stamp may come from a clock slightly ahead of ours)
+  latency_hist_add(&camera.latency_hist,
+                   latency_ms > 0 ? (int64_t)(latency_ms * 1e6) : 0);
+
+  FrameLatencyPtr frame_latency(new FrameLatency);
+  frame_latency->header = image_rect->header;
+  frame_latency->latency = latency_ms;
+  frame_latency->latency_p50 =
+      latency_hist_percentile(&camera.latency_hist, 0.50) / 1e6;
+  frame_latency->latency_p99 =
+      latency_hist_percentile(&camera.latency_hist, 0.99) / 1e6;
+  frame_latency->wait = (begin - received).toSec() * 1e3;
+  frame_latency->processing = (ros::WallTime::now() - begin).toSec() * 1e3;
+  {
+    boost::lock_guard<boost::mutex> lock(mailbox_mutex_);
+    camera.processed++;
+    frame_latency->received = camera.received;
+    frame_latency->processed = camera.processed;
+    frame_latency->dropped = camera.dropped;
   }
+  camera.frame_latency_publisher.publish(frame_latency);
 }
 
 } // namespace apriltags2_ros
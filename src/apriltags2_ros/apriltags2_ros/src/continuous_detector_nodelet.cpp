@@ -0,0 +1,61 @@
+/**
+ * Copyright (c) 2017, California Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the California Institute of
+ * Technology.
+ */
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "apriltags2_ros/continuous_detector.h"
+
+namespace apriltags2_ros
+{
+
+// ContinuousDetector as a nodelet: loaded into the same manager as the
+// camera and rectification nodelets, it receives their images as shared
+// pointers, without serialization, and its detections reach nodelets of
+// that manager the same way
+class ContinuousDetectorNodelet : public nodelet::Nodelet
+{
+ private:
+  virtual void onInit()
+  {
+    // The nodelet's (not multi-threaded) node handles: ContinuousDetector
+    // expects its callbacks to run one at a time
+    continuous_tag_detector_.reset(
+        new ContinuousDetector(getNodeHandle(), getPrivateNodeHandle()));
+  }
+
+  boost::shared_ptr<ContinuousDetector> continuous_tag_detector_;
+};
+
+} // namespace apriltags2_ros
+
+PLUGINLIB_EXPORT_CLASS(apriltags2_ros::ContinuousDetectorNodelet,
+                       nodelet::Nodelet);
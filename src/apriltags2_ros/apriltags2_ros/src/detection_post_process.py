@@ -6,10 +6,10 @@ from ruamel import yaml
 from os import path
 from os import makedirs
 from apriltags2_ros.msg import AprilTagDetectionArray
-from std_msgs.msg import String
 from ros_statistics_msgs.msg import NodeStatistics
 from math import atan2,asin
 from apriltags2_ros.msg import VehiclePoseEuler
+from apriltags2_ros.msg import StageTimings
 from apriltags2_ros_post_process.rotation_utils import *
 
 class WorkSpaceParams(object):
@@ -20,7 +20,7 @@ class WorkSpaceParams(object):
     recieved_pose_local_frame = 0 #topic tag_detections_local_frame
     relative_pose = [] # relative pose of each detection
     relative_pose_local_frame = [] # publisded by tag_detections_local_frame
-    subprocess_time_str = [] # the time of each subprocess of each detection
+    subprocess_timings = [] # the time of each subprocess of each detection (StageTimings)
     det_statistics = [] #topic /node_statistics
     single_result_folder_path = None
     summary_folder_path = None
@@ -75,7 +75,7 @@ def cbVehPoseEuler(msg, ws_params):
 
 def cbSubprocessTime(msg, ws_params):
     if(ws_params.recieved_subprocess_time < ws_params.des_number_of_images):
-        ws_params.subprocess_time_str.append(msg)
+        ws_params.subprocess_timings.append(msg)
         print("[POST-PROCESSNG NODE] recorded subprocess time number {} ".format(str(ws_params.recieved_subprocess_time + 1)))
         #print(msg)
         ws_params.recieved_subprocess_time += 1
@@ -100,7 +100,6 @@ def outputToFile(ws_params):
     orientation_l = [] #euler: robot wrt world
     subprocess_time = []
     subprocess_name = []
-    subprocess_number = 12 # if we add the step of relative pose estimation, it should be 12
 
     #save every single result into .yaml file
     for num in range(0,ws_params.des_number_of_images):
@@ -116,21 +115,15 @@ def outputToFile(ws_params):
         position.append((round(pos_temp.x,5),round(pos_temp.y,5),round(pos_temp.z,5)))
         orientation.append((round(ori_temp.x,5),round(ori_temp.y,5),round(ori_temp.z,5),round(ori_temp.w,5)))
 
-        subprocess_time_str =  ws_params.subprocess_time_str[num].data
-        subprocess_time_str_split = filter(None, subprocess_time_str.split('  '))
+        timings = ws_params.subprocess_timings[num]
         sub_time = {}
         subprocess_time.append([])
-        for i in range(0, subprocess_number):
-                time = round(float(subprocess_time_str_split[3*i+2].split()[0]),5)
+        for i in range(0, len(timings.stage)):
+                time = round(timings.last[i],5)
                 subprocess_time[num].append(time)
                 if(num == 0):
-                    name = subprocess_time_str_split[3*i+1].strip()
-                    subprocess_name.append(name)
+                    subprocess_name.append(timings.stage[i])
                 sub_time[subprocess_name[i]]= time
-        if (num == 0):
-            subprocess_name.append('total time consumption')
-        sub_time[subprocess_name[-1]] = round(float(subprocess_time_str_split[-1].split()[0]),5)
-        subprocess_time[num].append(sub_time[subprocess_name[-1]])
 
         single_result = {
             'image ID': num + 1,
@@ -160,7 +153,7 @@ def outputToFile(ws_params):
 
     subprocess_time_comsumption=zip(*subprocess_time)
     time_consumption = {}
-    for i in range(0, subprocess_number + 1): # subprocesses + total time consumption
+    for i in range(0, len(subprocess_name)): # subprocesses, the last being the total
         time_consumption[subprocess_name[i]] = {
             'mean':float('%0.5f' %np.mean(subprocess_time_comsumption[i])),
             'min':min(subprocess_time_comsumption[i]),
@@ -217,6 +210,6 @@ if __name__ == '__main__':
 
     sub_img = rospy.Subscriber("tag_detections", AprilTagDetectionArray, cbDetection, ws_params)
     veh_pose_euler = rospy.Subscriber("tag_detections_local_frame", VehiclePoseEuler, cbVehPoseEuler, ws_params)
-    sub_time = rospy.Subscriber("subprocess_timings", String, cbSubprocessTime, ws_params)
+    sub_time = rospy.Subscriber("subprocess_timings", StageTimings, cbSubprocessTime, ws_params)
     detection_statistics = rospy.Subscriber("/node_statistics", NodeStatistics, cbDetStatistic, ws_params)
     rospy.spin()